@@ -1,35 +1,65 @@
 // benchmarking:
 // https://docs.gitlab.com/ee/administration/operations/filesystem_benchmarking.html
 
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #define FUSE_USE_VERSION 35
 
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <fuse3/fuse.h>
 #include <fuse3/fuse_lowlevel.h>
 #include <fuse3/fuse_opt.h>
 #include <libgen.h>
+#include <limits.h>
+#include <linux/io_uring.h>
 #include <sqlite3.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <syslog.h>
 #include <unistd.h>
 
 #define MAX_PATH_LEN 1024
 #define OK 0
 #define ROOT_DIR_MODE S_IFDIR | 0755
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define DEFAULT_CHUNK_SIZE (64 * 1024)
+#define DEFAULT_PREALLOC (64 * 1024 * 1024)
+// ms, when background threads write too
+#define DEFAULT_BUSY_TIMEOUT 5000
 
 const char *create_tables_sql = "PRAGMA journal_mode=WAL;\n\
 create table if not exists files(id integer primary key autoincrement, nlink integer default 1 not null, content blob, dev integer, size integer default 0);\n\
 create table if not exists paths(id integer primary key autoincrement, path text not null, parent_id integer, uid integer not null, gid integer not null, mode integer not null, atime integer not null, mtime integer not null, ctime integer not null, file_id integer);\n\
 create unique index if not exists path_idx on paths(path);\n\
 create index if not exists file_id_idx on paths(file_id);\n\
+create index if not exists mtime_idx on paths(mtime);\n\
+create index if not exists uid_idx on paths(uid);\n\
+create index if not exists size_idx on files(size);\n\
+create table if not exists config(key text primary key, value) without rowid;\n\
+create table if not exists tenants(name text primary key, quota_bytes integer not null default 0, quota_inodes integer not null default 0) without rowid;\n\
+create table if not exists changelog(seq integer primary key autoincrement, time integer not null, op integer not null, path text not null, target text, offset integer, length integer);\n\
+create table if not exists heatmap(kind integer not null, id integer not null, chunk integer not null, hits integer not null, primary key(kind, id, chunk)) without rowid;\n\
+create table if not exists chunk_hashes(file_id integer not null, chunk integer not null, length integer not null, hash integer not null, primary key(file_id, chunk)) without rowid;\n\
+create table if not exists tree_hashes(path text primary key, hash integer not null) without rowid;\n\
+create table if not exists dir_usage(path text primary key, rbytes integer not null, rfiles integer not null, rinodes integer not null) without rowid;\n\
+create table if not exists chunk_crcs(file_id integer not null, chunk integer not null, length integer not null, crc integer not null, primary key(file_id, chunk)) without rowid;\n\
 ";
 
 const char *select_file_by_path_sql =
@@ -38,8 +68,8 @@ const char *select_file_by_path_sql =
 const char *select_path_by_name_sql =
     "select p.uid, p.gid, p.mode, p.atime, p.mtime, p.ctime, ifnull(f.size, "
     "0) "
-    "size, f.nlink nlink from paths p left join files f on p.file_id = f.id "
-    "where p.path = ?";
+    "size, f.nlink nlink, p.id from paths p left join files f on p.file_id = "
+    "f.id where p.path = ?";
 const char *select_file_id_by_path_sql =
     "select file_id, mode mode from paths where path = ?";
 const char *select_path_id_by_path_sql = "select id from paths where path = ?";
@@ -72,7 +102,10 @@ const char *select_file_content_by_id_sql =
     "select content from files where id = ?";
 
 const char *update_path_name_by_id_sql =
-    "update paths set path = ? where id = ?";
+    "update paths set path = ?, parent_id = ? where id = ?";
+const char *update_path_prefix_sql =
+    "update paths set path = ?1 || substr(path, length(?2) + 1) "
+    "where path > ?2 || '/' and path < ?2 || '0'";
 const char *update_path_mode_by_id_sql =
     "update paths set mode = ? where id = ?";
 const char *update_path_owner_by_id_sql =
@@ -81,6 +114,34 @@ const char *update_file_size_by_id_sql =
     "update files set size = ? where id = ? and ? < size";
 const char *update_file_content_by_id_sql =
     "update files set content = ?, size = ? where id = ?";
+// keeps the first ?1 bytes, in case a truncate left more, and zeros up to ?2
+const char *grow_file_content_by_id_sql =
+    "update files set content = cast(ifnull(substr(content, 1, ?1), x'') || "
+    "zeroblob(?2 - ?1) as blob), size = ?2 where id = ?3";
+const char *select_mem_entries_sql =
+    "select p.path, p.id, p.uid, p.gid, p.mode, p.atime, p.mtime, p.ctime, "
+    "ifnull(p.file_id, 0), ifnull(f.size, 0), ifnull(f.nlink, 0) from paths p "
+    "left join files f on p.file_id = f.id order by p.path";
+const char *select_mem_entry_by_path_sql =
+    "select p.path, p.id, p.uid, p.gid, p.mode, p.atime, p.mtime, p.ctime, "
+    "ifnull(p.file_id, 0), ifnull(f.size, 0), ifnull(f.nlink, 0) from paths p "
+    "left join files f on p.file_id = f.id where p.path = ?";
+const char *select_paths_by_file_id_sql =
+    "select path from paths where file_id = ?";
+const char *select_small_file_by_path_sql =
+    "select p.file_id, case when f.size <= ? then f.content end, f.size from "
+    "paths p left join files f on p.file_id = f.id where p.path = ?";
+const char *insert_change_sql =
+    "insert into changelog(time, op, path, target, offset, length) "
+    "values(?, ?, ?, ?, ?, ?)";
+// the write lock is taken up front: a savepoint alone would start reading
+// and fail with SQLITE_BUSY_SNAPSHOT, without waiting, when another
+// connection commits before its first write
+const char *begin_change_sql = "begin immediate";
+const char *commit_change_sql = "commit";
+const char *savepoint_change_sql = "savepoint change";
+const char *release_change_sql = "release change";
+const char *rollback_change_sql = "rollback to change";
 
 sqlite3_stmt *select_file_by_path_stmt;
 sqlite3_stmt *select_path_by_name_stmt;
@@ -101,14 +162,65 @@ sqlite3_stmt *count_dir_items_by_id_stmt;
 sqlite3_stmt *update_path_times_by_id_stmt;
 sqlite3_stmt *select_file_content_by_id_stmt;
 sqlite3_stmt *update_path_name_by_id_stmt;
+sqlite3_stmt *update_path_prefix_stmt;
 sqlite3_stmt *update_path_mode_by_id_stmt;
 sqlite3_stmt *update_path_owner_by_id_stmt;
 sqlite3_stmt *update_file_size_by_id_stmt;
 sqlite3_stmt *update_file_content_by_id_stmt;
+sqlite3_stmt *grow_file_content_by_id_stmt;
+sqlite3_stmt *select_mem_entry_by_path_stmt;
+sqlite3_stmt *select_paths_by_file_id_stmt;
+sqlite3_stmt *select_small_file_by_path_stmt;
+sqlite3_stmt *insert_change_stmt;
+sqlite3_stmt *begin_change_stmt;
+sqlite3_stmt *commit_change_stmt;
+sqlite3_stmt *savepoint_change_stmt;
+sqlite3_stmt *release_change_stmt;
+sqlite3_stmt *rollback_change_stmt;
 
 sqlite3 *db;
 char *err_msg;
 
+struct sqlfs_opts {
+    const char *db_path;
+    int show_help;
+    int mem_meta;
+    int warmup;
+    uint64_t cache_size;
+    uint64_t readahead;
+    uint64_t prefetch_small;
+    uint64_t pagecache_arena;
+    int pagecache_huge_pages;
+    uint64_t db_cache_size;
+    uint64_t mmap_size;
+    int mmap_sequential;
+    uint64_t heap_limit;
+    int page_size;
+    const char *temp_store;
+    int wal_autocheckpoint;
+    int busy_timeout;
+    uint32_t chunk_size;
+    int direct_io;
+    int io_uring;
+    int read_only;
+    int shards;
+    uint64_t prealloc;
+    const char *tenants;
+    int changelog;
+    const char *replica;
+    int follower;
+    int coherence;
+    int merkle;
+    int checksums;
+    uint64_t scrub_rate;
+    int scrub_threads;
+    int fts;
+    int dir_usage;
+    const char *stats_file;
+};
+
+struct sqlfs_opts sqlfs_opts;
+
 struct sqlfs_path_info {
     uint64_t id;
     mode_t mode;
@@ -116,902 +228,10750 @@ struct sqlfs_path_info {
     uint64_t size;
 };
 
-void sqlfs_destroy(void *private_data) { sqlite3_close(db); }
+/*
+ * Per-thread buffers.
+ *
+ * sqlfs_buf_get() hands out buffers in power of two size classes and
+ * sqlfs_buf_put() keeps them on a free list of the calling thread, so
+ * steady-state requests reuse the same memory instead of going to the heap.
+ * A thread keeps up to POOL_KEEP_BYTES, a few requests of the largest FUSE
+ * size, and all threads together up to POOL_KEEP_TOTAL_BYTES.
+ *
+ * The request arena is a per-thread bump allocator for short lived strings
+ * such as path components: take a mark with sqlfs_arena_mark() and give
+ * everything after it back with sqlfs_arena_release().
+ */
+#define POOL_MIN_SHIFT 6
+#define POOL_CLASSES 26 // 64 bytes .. 2 GiB
+#define POOL_KEEP_BYTES (4 * 1024 * 1024)
+#define POOL_KEEP_TOTAL_BYTES (32 * 1024 * 1024)
+#define POOL_UNPOOLED UINT32_MAX
 
-bool is_root_dir(const char *path) {
-    if (strcmp(path, "/") == 0) {
-        return true;
-    } else {
-        return false;
+struct sqlfs_buf_header {
+    uint32_t cls;
+    uint32_t pad;
+    struct sqlfs_buf_header *next; // free list link, buffer follows
+};
+
+struct sqlfs_arena_block {
+    struct sqlfs_arena_block *next;
+    size_t cap;
+    size_t used;
+    char data[];
+};
+
+struct sqlfs_arena_mark {
+    struct sqlfs_arena_block *block;
+    size_t used;
+};
+
+struct sqlfs_thread_mem {
+    struct sqlfs_buf_header *free[POOL_CLASSES];
+    uint64_t kept;
+    struct sqlfs_arena_block *arena_head;
+    struct sqlfs_arena_block *arena_cur;
+    bool registered;
+};
+
+__thread struct sqlfs_thread_mem thread_mem;
+pthread_key_t thread_mem_key;
+pthread_once_t thread_mem_once = PTHREAD_ONCE_INIT;
+
+struct sqlfs_alloc_stats {
+    uint64_t heap_allocs;
+    uint64_t pool_hits;
+    // bytes on the free lists of all threads
+    uint64_t kept;
+} alloc_stats;
+
+static void sqlfs_thread_mem_free(void *arg) {
+    struct sqlfs_thread_mem *tm = arg;
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        while (tm->free[i] != NULL) {
+            struct sqlfs_buf_header *h = tm->free[i];
+            tm->free[i] = h->next;
+            free(h);
+        }
     }
+    __atomic_sub_fetch(&alloc_stats.kept, tm->kept, __ATOMIC_RELAXED);
+    while (tm->arena_head != NULL) {
+        struct sqlfs_arena_block *next = tm->arena_head->next;
+        free(tm->arena_head);
+        tm->arena_head = next;
+    }
+    memset(tm, 0, sizeof(struct sqlfs_thread_mem));
 }
 
-int sqlfs_getattr(const char *path, struct stat *stat,
-                  struct fuse_file_info *fi) {
-    if (is_root_dir(path)) {
-        stat->st_mode = ROOT_DIR_MODE;
-        stat->st_nlink = 1;
-        stat->st_uid = getuid();
-        stat->st_gid = getgid();
-        stat->st_atime = time(NULL);
-        stat->st_mtime = time(NULL);
-        return 0;
-    }
-    sqlite3_bind_text(select_path_by_name_stmt, 1, path, -1, NULL);
-    int ret = sqlite3_step(select_path_by_name_stmt);
-    if (ret == SQLITE_ROW) {
-        stat->st_uid = sqlite3_column_int(select_path_by_name_stmt, 0);
-        stat->st_gid = sqlite3_column_int(select_path_by_name_stmt, 1);
-        stat->st_mode = sqlite3_column_int(select_path_by_name_stmt, 2);
-        stat->st_atime = sqlite3_column_int(select_path_by_name_stmt, 3);
-        stat->st_mtime = sqlite3_column_int(select_path_by_name_stmt, 4);
-        stat->st_ctime = sqlite3_column_int(select_path_by_name_stmt, 5);
-        stat->st_size = sqlite3_column_int64(select_path_by_name_stmt, 6);
-        stat->st_nlink = sqlite3_column_int(select_path_by_name_stmt, 7);
-        ret = OK;
-    } else if (ret == SQLITE_DONE) {
-        ret = -ENOENT;
-    } else {
-        printf("sqlfs_getattr(): '%s' sql error %s\n", path,
-               sqlite3_errmsg(db));
-        ret = -EIO;
+static void sqlfs_thread_mem_key_init() {
+    pthread_key_create(&thread_mem_key, sqlfs_thread_mem_free);
+}
+
+static struct sqlfs_thread_mem *sqlfs_thread_mem() {
+    if (!thread_mem.registered) {
+        // the key destructor frees the buffers when the thread exits
+        pthread_once(&thread_mem_once, sqlfs_thread_mem_key_init);
+        pthread_setspecific(thread_mem_key, &thread_mem);
+        thread_mem.registered = true;
     }
-    sqlite3_reset(select_path_by_name_stmt);
-    return ret;
+    return &thread_mem;
 }
+
 /**
- * @brief find file id by path
+ * @brief get a buffer of at least size bytes, release it with sqlfs_buf_put()
  *
- * @param path path to query
- * @param file_id write file id here
- * @return SQLITE_OK on success, SQLITE_DONE on not found
+ * @return NULL when out of memory
  */
-int sqlfs_find_file_id(const char *path, uint64_t *file_id) {
-    if (is_root_dir(path)) {
-        return SQLITE_DONE;
+void *sqlfs_buf_get(size_t size) {
+    uint32_t cls = 0;
+    while (cls < POOL_CLASSES && ((size_t)1 << (cls + POOL_MIN_SHIFT)) < size) {
+        cls++;
     }
-    sqlite3_bind_text(select_file_id_by_path_stmt, 1, path, -1, NULL);
-    int ret = sqlite3_step(select_file_id_by_path_stmt);
-    if (ret == SQLITE_ROW) {
-        *file_id = sqlite3_column_int64(select_file_id_by_path_stmt, 0);
-        ret = SQLITE_OK;
+    struct sqlfs_thread_mem *tm = sqlfs_thread_mem();
+    struct sqlfs_buf_header *h;
+    if (cls < POOL_CLASSES && tm->free[cls] != NULL) {
+        h = tm->free[cls];
+        tm->free[cls] = h->next;
+        tm->kept -= (uint64_t)1 << (cls + POOL_MIN_SHIFT);
+        __atomic_sub_fetch(&alloc_stats.kept,
+                           (uint64_t)1 << (cls + POOL_MIN_SHIFT),
+                           __ATOMIC_RELAXED);
+        __atomic_add_fetch(&alloc_stats.pool_hits, 1, __ATOMIC_RELAXED);
+        return h + 1;
     }
-    sqlite3_reset(select_file_id_by_path_stmt);
-    return ret;
+    size_t cap = cls < POOL_CLASSES ? (size_t)1 << (cls + POOL_MIN_SHIFT) : size;
+    h = malloc(sizeof(struct sqlfs_buf_header) + cap);
+    if (h == NULL) {
+        return NULL;
+    }
+    h->cls = cls < POOL_CLASSES ? cls : POOL_UNPOOLED;
+    __atomic_add_fetch(&alloc_stats.heap_allocs, 1, __ATOMIC_RELAXED);
+    return h + 1;
 }
 
-int sqlfs_open(const char *path, struct fuse_file_info *file_info) {
-    uint64_t file_id;
-    int ret = sqlfs_find_file_id(path, &file_id);
-    if (ret == SQLITE_OK) {
-        file_info->fh = file_id;
-        ret = OK;
-    } else if (ret == SQLITE_DONE) {
-        printf("sqlfs_open(): not found '%s'\n", path);
-        ret = -ENOENT;
-    } else {
-        printf("sqlfs_open(): error %s\n", sqlite3_errmsg(db));
-        ret = -EIO;
+void sqlfs_buf_put(void *buf) {
+    if (buf == NULL) {
+        return;
+    }
+    struct sqlfs_buf_header *h = (struct sqlfs_buf_header *)buf - 1;
+    struct sqlfs_thread_mem *tm = sqlfs_thread_mem();
+    if (h->cls == POOL_UNPOOLED) {
+        free(h);
+        return;
+    }
+    uint64_t cap = (uint64_t)1 << (h->cls + POOL_MIN_SHIFT);
+    if (tm->kept + cap > POOL_KEEP_BYTES) {
+        free(h);
+        return;
+    }
+    if (__atomic_add_fetch(&alloc_stats.kept, cap, __ATOMIC_RELAXED) >
+        POOL_KEEP_TOTAL_BYTES) {
+        __atomic_sub_fetch(&alloc_stats.kept, cap, __ATOMIC_RELAXED);
+        free(h);
+        return;
+    }
+    h->next = tm->free[h->cls];
+    tm->free[h->cls] = h;
+    tm->kept += cap;
+}
+
+struct sqlfs_arena_mark sqlfs_arena_mark() {
+    struct sqlfs_thread_mem *tm = sqlfs_thread_mem();
+    struct sqlfs_arena_mark mark = {tm->arena_cur,
+                                    tm->arena_cur ? tm->arena_cur->used : 0};
+    return mark;
+}
+
+void sqlfs_arena_release(struct sqlfs_arena_mark mark) {
+    struct sqlfs_thread_mem *tm = sqlfs_thread_mem();
+    tm->arena_cur = mark.block != NULL ? mark.block : tm->arena_head;
+    if (tm->arena_cur != NULL) {
+        tm->arena_cur->used = mark.used;
     }
-    return ret;
 }
 
 /**
- * @brief get path id by path name. Root dir '/' id is 0
+ * @brief allocate from the request arena. Blocks are kept after release, so
+ * steady-state requests do not allocate.
  *
- * @param path Path to query
- * @param id write path id here
- * @return SQLITE_OK on success, SQLITE_DONE on not found
+ * @return NULL when out of memory
  */
-int sqlfs_find_path_id(const char *path, uint64_t *id) {
-    if (is_root_dir(path)) {
-        *id = 0;
-        return SQLITE_OK;
+void *sqlfs_arena_alloc(size_t size) {
+    struct sqlfs_thread_mem *tm = sqlfs_thread_mem();
+    size = (size + 15) & ~(size_t)15;
+    struct sqlfs_arena_block *cur = tm->arena_cur;
+    if (cur == NULL || cur->used + size > cur->cap) {
+        struct sqlfs_arena_block *next = cur ? cur->next : tm->arena_head;
+        if (next == NULL || next->cap < size) {
+            size_t cap = MAX(cur ? cur->cap * 2 : 4096, size);
+            struct sqlfs_arena_block *block =
+                malloc(sizeof(struct sqlfs_arena_block) + cap);
+            if (block == NULL) {
+                return NULL;
+            }
+            block->cap = cap;
+            // a too small block after cur is dropped along with its successors
+            while (next != NULL) {
+                struct sqlfs_arena_block *n = next->next;
+                free(next);
+                next = n;
+            }
+            block->next = NULL;
+            if (cur != NULL) {
+                cur->next = block;
+            } else {
+                tm->arena_head = block;
+            }
+            next = block;
+            __atomic_add_fetch(&alloc_stats.heap_allocs, 1, __ATOMIC_RELAXED);
+        }
+        next->used = 0;
+        tm->arena_cur = cur = next;
     }
-    sqlite3_bind_text(select_path_id_by_path_stmt, 1, path, -1, NULL);
-    int ret = sqlite3_step(select_path_id_by_path_stmt);
-    if (ret == SQLITE_ROW) {
-        *id = sqlite3_column_int64(select_path_id_by_path_stmt, 0);
-        ret = SQLITE_OK;
+    void *p = cur->data + cur->used;
+    cur->used += size;
+    return p;
+}
+
+/**
+ * @brief copy the first len bytes of s into the request arena
+ */
+char *sqlfs_arena_strndup(const char *s, size_t len) {
+    char *p = sqlfs_arena_alloc(len + 1);
+    if (p != NULL) {
+        memcpy(p, s, len);
+        p[len] = '\0';
     }
-    sqlite3_reset(select_path_id_by_path_stmt);
-    return ret;
+    return p;
 }
 
+/*
+ * SQLite memory bounds.
+ *
+ * --pagecache-arena gives SQLite one preallocated region for all page cache
+ * lines of the process (SQLITE_CONFIG_PAGECACHE), optionally backed by huge
+ * pages. --db-cache-size and --mmap-size are applied to every connection we
+ * open. --heap-limit is the process-wide hard heap limit, beyond which SQLite
+ * allocations fail, with the soft limit an eighth below it so SQLite first
+ * gives back cache pages. SQLite memory so stays within a configured budget
+ * next to our own caches.
+ */
+struct sqlfs_pagecache {
+    void *arena;
+    size_t arena_size;
+    int line_size;
+    int lines;
+    bool huge_pages;
+} pagecache;
+
 /**
- * @brief get `path info` by path name.
+ * @brief read the page size from the header of an existing database
  *
- * @param path Path to query
- * @param path_info write `path info` here
- * @return SQLITE_OK on success, SQLITE_DONE on not found
+ * @return page size, 4096 for new databases, --page-size if given
  */
-int sqlfs_find_path_info(const char *path, struct sqlfs_path_info *path_info) {
-    if (is_root_dir(path)) {
-        path_info->id = 0;
-        path_info->mode = 0;
-        path_info->file_id = 0;
-        path_info->size = 0;
-        return SQLITE_OK;
+static int sqlfs_db_file_page_size(const char *db_path) {
+    unsigned char header[18];
+    int page_size = 4096;
+    if (sqlfs_opts.page_size > 0) {
+        // sqlfs_init_db() converts the database to this
+        return sqlfs_opts.page_size;
     }
-    sqlite3_bind_text(select_path_info_by_path_stmt, 1, path, -1, NULL);
-    int ret = sqlite3_step(select_path_info_by_path_stmt);
-    if (ret == SQLITE_ROW) {
-        path_info->id = sqlite3_column_int64(select_path_info_by_path_stmt, 0);
-        path_info->mode = sqlite3_column_int(select_path_info_by_path_stmt, 1);
-        path_info->file_id =
-            sqlite3_column_int64(select_path_info_by_path_stmt, 2);
-        path_info->size =
-            sqlite3_column_int64(select_path_info_by_path_stmt, 3);
-        ret = SQLITE_OK;
+    FILE *f = fopen(db_path, "rb");
+    if (f != NULL) {
+        if (fread(header, 1, sizeof(header), f) == sizeof(header) &&
+            memcmp(header, "SQLite format 3", 16) == 0) {
+            page_size = header[16] << 8 | header[17];
+            if (page_size == 1) {
+                page_size = 65536;
+            }
+        }
+        fclose(f);
     }
-    sqlite3_reset(select_path_info_by_path_stmt);
-    return ret;
+    return page_size;
 }
 
-int sqlfs_opendir(const char *path, struct fuse_file_info *file_info) {
-    uint64_t id;
-    int ret = sqlfs_find_path_id(path, &id);
-    if (ret == SQLITE_OK) {
-        file_info->fh = id;
-        return 0;
-    } else if (ret == SQLITE_DONE) {
-        return -ENOENT;
-    } else {
-        return -EIO;
+/**
+ * @brief configure process-wide SQLite memory. Must run before the first
+ * connection is opened.
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_config_memory() {
+    if (sqlfs_opts.pagecache_arena > 0) {
+        int hdr_size = 0;
+        sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &hdr_size);
+        pagecache.line_size =
+            sqlfs_db_file_page_size(sqlfs_opts.db_path) + hdr_size;
+        pagecache.lines = sqlfs_opts.pagecache_arena / pagecache.line_size;
+        pagecache.arena_size = (size_t)pagecache.lines * pagecache.line_size;
+        pagecache.arena = MAP_FAILED;
+        if (sqlfs_opts.pagecache_huge_pages) {
+            size_t huge = 2 * 1024 * 1024;
+            size_t size = (pagecache.arena_size + huge - 1) / huge * huge;
+            pagecache.arena =
+                mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            pagecache.huge_pages = pagecache.arena != MAP_FAILED;
+            if (pagecache.huge_pages) {
+                // the rounding is mapped anyway, let SQLite use it
+                pagecache.arena_size = size;
+                pagecache.lines = size / pagecache.line_size;
+            } else {
+                printf("sqlfs_config_memory(): no huge pages, %s\n",
+                       strerror(errno));
+            }
+        }
+        if (pagecache.arena == MAP_FAILED) {
+            pagecache.arena =
+                mmap(NULL, pagecache.arena_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+        if (pagecache.arena == MAP_FAILED) {
+            return SQLITE_NOMEM;
+        }
+        int ret = sqlite3_config(SQLITE_CONFIG_PAGECACHE, pagecache.arena,
+                                 pagecache.line_size, pagecache.lines);
+        if (ret != SQLITE_OK) {
+            return ret;
+        }
     }
+    if (sqlfs_opts.heap_limit > 0) {
+        sqlite3_hard_heap_limit64(sqlfs_opts.heap_limit);
+        sqlite3_soft_heap_limit64(sqlfs_opts.heap_limit -
+                                  sqlfs_opts.heap_limit / 8);
+    }
+    return SQLITE_OK;
 }
 
-int sqlfs_readdir(const char *path, void *buff, fuse_fill_dir_t filler,
-                  off_t offset, struct fuse_file_info *file_info,
-                  enum fuse_readdir_flags flags) {
-    if (offset == 0) {
-        filler(buff, ".", NULL, 0, FUSE_FILL_DIR_PLUS);
-        filler(buff, "..", NULL, 0, FUSE_FILL_DIR_PLUS);
-    }
-    sqlite3_bind_int64(select_stats_by_parent_id_stmt, 1, file_info->fh);
-    sqlite3_bind_int64(select_stats_by_parent_id_stmt, 2, 0);
-    int ret = sqlite3_step(select_stats_by_parent_id_stmt);
-    char path_copy[MAX_PATH_LEN];
-    while (ret == SQLITE_ROW) {
-        struct stat st;
-        const char *p = (const char *)sqlite3_column_text(
-            select_stats_by_parent_id_stmt, 0);
-        // TODO handle overflow
-        strcpy(path_copy, p);
-        st.st_uid = sqlite3_column_int(select_stats_by_parent_id_stmt, 1);
-        st.st_gid = sqlite3_column_int(select_stats_by_parent_id_stmt, 2);
-        st.st_mode = sqlite3_column_int(select_stats_by_parent_id_stmt, 3);
-        st.st_atime = sqlite3_column_int64(select_stats_by_parent_id_stmt, 4);
-        st.st_mtime = sqlite3_column_int64(select_stats_by_parent_id_stmt, 5);
-        st.st_ctime = sqlite3_column_int64(select_stats_by_parent_id_stmt, 6);
-        st.st_size = sqlite3_column_int64(select_stats_by_parent_id_stmt, 7);
-        st.st_nlink = sqlite3_column_int(select_stats_by_parent_id_stmt, 8);
-        filler(buff, basename(path_copy), &st, 0, FUSE_FILL_DIR_PLUS);
-        ret = sqlite3_step(select_stats_by_parent_id_stmt);
+/**
+ * @brief read an integer pragma
+ *
+ * @return pragma value, -1 on error
+ */
+int sqlfs_pragma_int(sqlite3 *conn, const char *pragma) {
+    char sql[64];
+    sqlite3_stmt *stmt;
+    int value = -1;
+    snprintf(sql, sizeof(sql), "PRAGMA %s", pragma);
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        return -1;
     }
-    if (ret != SQLITE_DONE) {
-        printf("sqlfs_readdir(): '%s' path_id: %ld error %s\n", path,
-               file_info->fh, sqlite3_errmsg(db));
-        ret = -EIO;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        value = sqlite3_column_int(stmt, 0);
     }
-    ret = 0;
-    sqlite3_reset(select_stats_by_parent_id_stmt);
-    return ret;
+    sqlite3_finalize(stmt);
+    return value;
 }
+
 /**
- * @brief Insert a path.
+ * @brief apply per-connection settings
  *
- * @param path path name
- * @param mode
- * @param type, such as S_IFREG, S_IFDIR
- * @param file_id 0 for no file content
- * @return OK if no errors, FUSE negated error otherwise.
+ * @return SQLITE_OK on success
  */
-int sqlfs_insert_path(const char *path, mode_t mode, int type,
-                      uint64_t file_id) {
-    if (is_root_dir(path)) {
-        return OK;
+int sqlfs_config_conn(sqlite3 *conn) {
+    char sql[128];
+    int ret = SQLITE_OK;
+    if (sqlfs_opts.busy_timeout > 0) {
+        ret = sqlite3_busy_timeout(conn, sqlfs_opts.busy_timeout);
     }
-    uint64_t parent_id;
-    char path_copy[MAX_PATH_LEN];
-    // TODO handle overflow
-    stpcpy(path_copy, path);
-    int ret = sqlfs_find_path_id(dirname((char *)path_copy), &parent_id);
-    if (ret == SQLITE_OK) {
-        // do nothing
-    } else if (ret == SQLITE_DONE) {
-        return -ENOENT;
-    } else {
-        return -EIO;
+    if (ret == SQLITE_OK && sqlfs_opts.temp_store != NULL) {
+        snprintf(sql, sizeof(sql), "PRAGMA temp_store = %s",
+                 sqlfs_opts.temp_store);
+        ret = sqlite3_exec(conn, sql, NULL, NULL, NULL);
     }
-    sqlite3_bind_text(insert_path_stmt, 1, path, -1, NULL);
-    sqlite3_bind_int64(insert_path_stmt, 2, parent_id);
-    sqlite3_bind_int64(insert_path_stmt, 3, getuid());
-    sqlite3_bind_int64(insert_path_stmt, 4, getgid());
-    sqlite3_bind_int(insert_path_stmt, 5, mode | type);
-    sqlite3_bind_int64(insert_path_stmt, 6, time(NULL));
-    sqlite3_bind_int64(insert_path_stmt, 7, time(NULL));
-    sqlite3_bind_int64(insert_path_stmt, 8, time(NULL));
-    sqlite3_bind_int64(insert_path_stmt, 9, file_id);
-    ret = sqlite3_step(insert_path_stmt);
-    if (ret == SQLITE_DONE) {
-        ret = OK;
-    } else {
-        printf("sql error in sqlfs_insert_path(): \"%s\" %s\n", path,
-               sqlite3_errmsg(db));
-        ret = -EIO;
+    if (ret == SQLITE_OK && sqlfs_opts.wal_autocheckpoint >= 0) {
+        ret = sqlite3_wal_autocheckpoint(conn, sqlfs_opts.wal_autocheckpoint);
+    }
+    if (ret == SQLITE_OK && sqlfs_opts.db_cache_size > 0) {
+        // negative cache_size is in KiB
+        snprintf(sql, sizeof(sql), "PRAGMA cache_size = -%lu",
+                 sqlfs_opts.db_cache_size / 1024);
+        ret = sqlite3_exec(conn, sql, NULL, NULL, NULL);
+    }
+    if (ret == SQLITE_OK && sqlfs_opts.mmap_size > 0) {
+        snprintf(sql, sizeof(sql), "PRAGMA mmap_size = %lu",
+                 sqlfs_opts.mmap_size);
+        ret = sqlite3_exec(conn, sql, NULL, NULL, NULL);
     }
-    sqlite3_reset(insert_path_stmt);
     return ret;
 }
 
 /**
- * @brief insert an file with content
- *
- * @param content file content
- * @param content_len content length in bytes
- * @param id inserted file id returns here
- * @return int OK if no errors, FUSE negated error otherwise.
+ * @brief a background thread is going to write through a connection of its
+ * own, make the writers wait for each other instead of failing with
+ * SQLITE_BUSY
  */
-int sqlfs_insert_file(const void *content, uint64_t content_len, dev_t dev,
-                      uint64_t *id) {
-    if (content_len == 0) {
-        sqlite3_bind_null(insert_file_stmt, 1);
-    } else {
-        sqlite3_bind_blob64(insert_file_stmt, 1, content, content_len,
-                            SQLITE_STATIC);
+void sqlfs_share_writes() {
+    if (sqlfs_opts.busy_timeout <= 0) {
+        sqlfs_opts.busy_timeout = DEFAULT_BUSY_TIMEOUT;
+        sqlite3_busy_timeout(db, sqlfs_opts.busy_timeout);
     }
+}
 
-    sqlite3_bind_int64(insert_file_stmt, 2, dev);
-    sqlite3_bind_int64(insert_file_stmt, 3, content_len);
-    int ret = sqlite3_step(insert_file_stmt);
-    if (ret == SQLITE_DONE) {
-        ret = OK;
-    } else {
-        printf("sql error in sqlfs_insert_file(): %s\n", sqlite3_errmsg(db));
-        ret = -EIO;
+void sqlfs_print_memory_stats(FILE *out) {
+    sqlite3_int64 used, highwater;
+    sqlite3_int64 pc_used = 0, pc_high = 0, pc_overflow = 0, pc_ohigh = 0;
+    used = sqlite3_memory_used();
+    highwater = sqlite3_memory_highwater(0);
+    sqlite3_status64(SQLITE_STATUS_PAGECACHE_USED, &pc_used, &pc_high, 0);
+    sqlite3_status64(SQLITE_STATUS_PAGECACHE_OVERFLOW, &pc_overflow, &pc_ohigh,
+                     0);
+    int cache_used = 0, cache_high = 0;
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_USED, &cache_used, &cache_high,
+                      0);
+    long rss_pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%*s %ld", &rss_pages) != 1) {
+            rss_pages = 0;
+        }
+        fclose(statm);
     }
-    *id = sqlite3_last_insert_rowid(db);
-    sqlite3_reset(insert_file_stmt);
-    return ret;
+    fprintf(out,
+            "sqlite memory: used %lld highwater %lld soft limit %lld hard "
+            "limit %lld main cache %d\n",
+            used, highwater, sqlite3_soft_heap_limit64(-1),
+            sqlite3_hard_heap_limit64(-1), cache_used);
+    if (pagecache.lines > 0) {
+        fprintf(out,
+                "sqlite pagecache: lines %lld/%d of %d bytes arena %zu%s "
+                "overflow %lld (highwater %lld)\n",
+                pc_used, pagecache.lines, pagecache.line_size,
+                pagecache.arena_size, pagecache.huge_pages ? " huge pages" : "",
+                pc_overflow, pc_ohigh);
+    }
+    fprintf(out, "rss: %ld\n", rss_pages * sysconf(_SC_PAGESIZE));
 }
 
+/*
+ * With --mmap-size SQLite reads pages straight out of a shared mapping of the
+ * database file instead of pread()ing them into its page cache, so cached
+ * metadata lookups cost no syscall. The mappings are owned by SQLite; we find
+ * them in /proc/self/maps to give the kernel read-ahead hints and to report
+ * how much of the database is resident.
+ */
+struct sqlfs_mmap_usage {
+    size_t regions;
+    size_t mapped;
+    size_t resident;
+    int advice;
+};
+
 /**
- * @brief insert an empty file content
- *
- * @param dev linux dev id
- * @param id inserted file id returns here
- * @return int OK if no errors, FUSE negated error otherwise.
+ * @brief call fn for every mapping of the database file in this process
  */
-int sqlfs_insert_empty_file(dev_t dev, uint64_t *id) {
-    return sqlfs_insert_file(NULL, 0, dev, id);
+void sqlfs_mmap_regions(void (*fn)(char *addr, size_t len, void *arg),
+                        void *arg) {
+    struct stat db_stat;
+    if (stat(sqlfs_opts.db_path, &db_stat) != 0) {
+        return;
+    }
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps == NULL) {
+        return;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), maps) != NULL) {
+        unsigned long start, end, inode;
+        unsigned int dev_major, dev_minor;
+        if (sscanf(line, "%lx-%lx %*s %*s %x:%x %lu", &start, &end, &dev_major,
+                   &dev_minor, &inode) != 5) {
+            continue;
+        }
+        if (inode == db_stat.st_ino && dev_major == major(db_stat.st_dev) &&
+            dev_minor == minor(db_stat.st_dev)) {
+            fn((char *)start, end - start, arg);
+        }
+    }
+    fclose(maps);
 }
 
-int sqlfs_mkdir(const char *path, mode_t mode) {
-    return sqlfs_insert_path(path, mode, S_IFDIR, 0);
+static void sqlfs_mmap_advise_region(char *addr, size_t len, void *arg) {
+    struct sqlfs_mmap_usage *usage = arg;
+    if (madvise(addr, len, usage->advice) != 0) {
+        printf("sqlfs_mmap_advise(): %s\n", strerror(errno));
+    }
+    usage->regions++;
+    usage->mapped += len;
 }
 
-int sqlfs_mknod(const char *path, mode_t mode, dev_t dev) {
-    if (is_root_dir(path)) {
-        return -EEXIST;
+/**
+ * @brief set the read-ahead hint of the database mappings. Index lookups jump
+ * around the file, so the default is MADV_RANDOM, which stops the kernel from
+ * reading unrelated pages around every fault. --mmap-sequential suits mounts
+ * that mostly stream large file content. SQLite remaps when the database
+ * grows, so this is repeated from the stats dump.
+ */
+void sqlfs_mmap_advise() {
+    struct sqlfs_mmap_usage usage = {0};
+    if (sqlfs_opts.mmap_size == 0) {
+        return;
     }
-    uint64_t path_id;
-    int ret = sqlfs_find_path_id(path, &path_id);
-    if (ret == SQLITE_OK) {
-        printf("sqlfs_mknod(): file exists '%s'\n", path);
-        return -EEXIST;
-    } else if (ret == SQLITE_DONE) {
-        // do nothing
-    } else {
-        printf("sqlfs_mknod(): io error '%s'\n", path);
-        return -EIO;
+    usage.advice =
+        sqlfs_opts.mmap_sequential ? MADV_SEQUENTIAL : MADV_RANDOM;
+    sqlfs_mmap_regions(sqlfs_mmap_advise_region, &usage);
+}
+
+static void sqlfs_mmap_count_region(char *addr, size_t len, void *arg) {
+    struct sqlfs_mmap_usage *usage = arg;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t pages = (len + page_size - 1) / page_size;
+    unsigned char vec[4096];
+    usage->regions++;
+    usage->mapped += len;
+    for (size_t i = 0; i < pages; i += sizeof(vec)) {
+        size_t n = MIN(pages - i, sizeof(vec));
+        if (mincore(addr + i * page_size, n * page_size, vec) != 0) {
+            return;
+        }
+        for (size_t j = 0; j < n; j++) {
+            usage->resident += (vec[j] & 1) * page_size;
+        }
     }
-    uint64_t file_id;
-    ret = sqlfs_insert_empty_file(dev, &file_id);
-    if (ret != OK) {
+}
+
+void sqlfs_print_mmap_stats(FILE *out) {
+    struct sqlfs_mmap_usage usage = {0};
+    if (sqlfs_opts.mmap_size == 0) {
+        return;
+    }
+    sqlfs_mmap_advise();
+    sqlfs_mmap_regions(sqlfs_mmap_count_region, &usage);
+    fprintf(out, "mmap: limit %lu regions %lu mapped %lu resident %lu (%s)\n",
+            sqlfs_opts.mmap_size, usage.regions, usage.mapped, usage.resident,
+            sqlfs_opts.mmap_sequential ? "sequential" : "random");
+}
+
+/*
+ * O_DIRECT database file.
+ *
+ * --direct-io and --io-uring make "sqlfs" the default VFS. It wraps the
+ * default unix VFS and only takes over data I/O of main database files:
+ * those are read and written through a second descriptor, with --direct-io
+ * opened with O_DIRECT, so database pages are cached once, by SQLite,
+ * instead of again in the kernel page cache. Locking, shared memory and the
+ * WAL and journal files stay with the unix VFS.
+ *
+ * Writes are staged in a per-file batch of DIRECT_BATCH_SEGS segments that
+ * is written out when it is full, before reads that overlap it and on sync,
+ * unlock, truncate and close; a checkpoint writes pages in ascending order,
+ * so most of them merge into a few large writes. The file is preallocated
+ * in --prealloc sized extents with fallocate(FALLOC_FL_KEEP_SIZE), which
+ * keeps the logical size SQLite sees.
+ *
+ * All connections of the process share one such descriptor per database
+ * file: closing a descriptor drops every POSIX lock the process holds on the
+ * file, so it is only closed with the last connection.
+ */
+#define DIRECT_ALIGN 4096
+#define DIRECT_BATCH_SIZE (1024 * 1024)
+#define DIRECT_BATCH_SEGS 64
+
+/*
+ * io_uring for the database file (--io-uring), used through raw system
+ * calls. The staged batch goes out as one submission, and on sync the
+ * fdatasync is linked after the writes, so a checkpoint costs one
+ * io_uring_enter() instead of a pwrite() per run plus an fsync. Sequential
+ * page reads are served from a DIRECT_READAHEAD window per connection.
+ */
+#define URING_ENTRIES 128
+#define DIRECT_READAHEAD (256 * 1024)
+
+struct sqlfs_uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned pending;
+};
+
+/**
+ * @brief set up a ring
+ *
+ * @return 0 on success, -errno otherwise
+ */
+static int sqlfs_uring_init(struct sqlfs_uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(struct sqlfs_uring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -errno;
+    }
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = ring->cq_ring_size =
+            MAX(ring->sq_ring_size, ring->cq_ring_size);
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->sq_ring != MAP_FAILED &&
+        !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+        ring->sqes == MAP_FAILED) {
+        int ret = -errno;
+        close(ring->fd);
         return ret;
     }
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
 
-    return sqlfs_insert_path(path, mode, S_IFREG, file_id);
+static void sqlfs_uring_free(struct sqlfs_uring *ring) {
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    munmap(ring->sqes, ring->sqes_size);
+    close(ring->fd);
 }
 
-int sqlfs_unlink(const char *path) {
+/**
+ * @brief queue an operation, submitted by sqlfs_uring_submit()
+ */
+static struct io_uring_sqe *sqlfs_uring_prep(struct sqlfs_uring *ring,
+                                             int opcode, int fd,
+                                             const void *buf, unsigned len,
+                                             uint64_t offset, uint64_t data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return sqe;
+}
 
-    struct sqlfs_path_info path_info;
-    int ret = sqlfs_find_path_info(path, &path_info);
-    if (ret == OK) {
-        // do nothing
-    } else if (ret == SQLITE_DONE) {
-        printf("sqlfs_unlink(): error no such file '%s'\n", path);
-        return -ENOENT;
-    } else {
-        printf("sqlfs_unlink(): '%s' error %s\n", path, sqlite3_errmsg(db));
-        return -EIO;
+/**
+ * @brief submit everything queued and wait for all of it. res[user_data]
+ * receives the result of each operation.
+ *
+ * @return 0 on success, -errno if io_uring_enter() failed
+ */
+static int sqlfs_uring_submit(struct sqlfs_uring *ring, int *res) {
+    unsigned submitted = 0;
+    unsigned completed = 0;
+    unsigned pending = ring->pending;
+    while (completed < pending) {
+        int n = syscall(__NR_io_uring_enter, ring->fd, pending - submitted,
+                        pending - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0 && errno != EINTR) {
+            return -errno;
+        }
+        submitted += MAX(n, 0);
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            res[cqe->user_data] = cqe->res;
+            completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
     }
-    if (S_ISDIR(path_info.mode)) {
-        printf("sqlfs_unlink(): '%s' is dir\n", path);
-        return -EISDIR;
+    ring->pending = 0;
+    return 0;
+}
+
+struct sqlfs_direct_seg {
+    sqlite3_int64 offset;
+    int len;
+    int data; // offset in the batch buffer, DIRECT_ALIGN aligned
+};
+
+struct sqlfs_direct_inode {
+    dev_t dev;
+    ino_t ino;
+    int fd;
+    int refs;
+    pthread_mutex_t lock;
+    sqlite3_int64 allocated;
+    uint64_t write_gen;
+    bool use_uring;
+    struct sqlfs_uring ring;
+    char *batch;
+    int batch_used;
+    int seg_count;
+    struct sqlfs_direct_seg segs[DIRECT_BATCH_SEGS];
+    struct sqlfs_direct_inode *next;
+};
+
+struct sqlfs_direct_file {
+    sqlite3_file base;
+    struct sqlfs_direct_inode *inode;
+    // read-ahead window of this connection, only valid for the inode
+    // write_gen it was read at
+    char *ra;
+    sqlite3_int64 ra_offset;
+    int ra_len;
+    uint64_t ra_gen;
+    sqlite3_int64 last_end;
+    sqlite3_file *real; // unix VFS file, follows this struct
+};
+
+struct sqlfs_direct {
+    sqlite3_vfs vfs;
+    sqlite3_vfs *real;
+    pthread_mutex_t lock;
+    struct sqlfs_direct_inode *inodes;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t batched_pages;
+    uint64_t preallocs;
+    uint64_t read_modify_writes;
+    uint64_t uring_enters;
+    uint64_t uring_ops;
+    uint64_t linked_syncs;
+    uint64_t ra_hits;
+} direct = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+#define DIRECT_ROUND_DOWN(x) ((x) & ~(sqlite3_int64)(DIRECT_ALIGN - 1))
+#define DIRECT_ROUND_UP(x) DIRECT_ROUND_DOWN((x) + DIRECT_ALIGN - 1)
+
+static char *sqlfs_direct_align(char *buf) {
+    return (char *)DIRECT_ROUND_UP((uintptr_t)buf);
+}
+
+/**
+ * @brief read through the O_DIRECT descriptor, bouncing through an aligned
+ * buffer. Bytes past the end of the file are zeroed.
+ *
+ * @return number of bytes read before the end of the file, -1 on error
+ */
+static ssize_t sqlfs_direct_pread(struct sqlfs_direct_inode *inode, char *buf,
+                                  size_t len, sqlite3_int64 offset) {
+    sqlite3_int64 start = DIRECT_ROUND_DOWN(offset);
+    size_t span = DIRECT_ROUND_UP(offset + (sqlite3_int64)len) - start;
+    char *raw = NULL;
+    char *aligned = buf;
+    if (start != offset || span != len || sqlfs_direct_align(buf) != buf) {
+        raw = sqlfs_buf_get(span + DIRECT_ALIGN);
+        if (raw == NULL) {
+            return -1;
+        }
+        aligned = sqlfs_direct_align(raw);
     }
-    sqlite3_bind_int64(delete_path_by_id_stmt, 1, path_info.id);
-    ret = sqlite3_step(delete_path_by_id_stmt);
-    sqlite3_reset(delete_path_by_id_stmt);
-    if (ret != SQLITE_DONE) {
-        printf("sqlfs_unlink(): '%s' delete path error %s\n", path,
-               sqlite3_errmsg(db));
-        return -EIO;
+    size_t done = 0;
+    bool failed = false;
+    while (done < span) {
+        ssize_t n = pread(inode->fd, aligned + done, span - done, start + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            failed = n < 0;
+            break;
+        }
+        done += n;
     }
+    __atomic_add_fetch(&direct.reads, 1, __ATOMIC_RELAXED);
+    ssize_t got = -1;
+    if (!failed) {
+        got = MAX(MIN((ssize_t)done - (offset - start), (ssize_t)len), 0);
+        if (aligned != buf) {
+            memcpy(buf, aligned + (offset - start), got);
+        }
+        memset(buf + got, 0, len - got);
+    }
+    sqlfs_buf_put(raw);
+    return got;
+}
 
-    sqlite3_bind_int64(decrease_file_nlink_by_id_stmt, 1, path_info.file_id);
-    ret = sqlite3_step(decrease_file_nlink_by_id_stmt);
-    sqlite3_reset(decrease_file_nlink_by_id_stmt);
-    if (ret != SQLITE_DONE) {
-        printf("sqlfs_unlink(): '%s' decrease nlink error %s file_id: %ld, "
-               "ret: %d \n",
-               path, sqlite3_errmsg(db), path_info.file_id, ret);
-        return -EIO;
+/**
+ * @brief make sure the file is allocated up to end, in --prealloc extents
+ */
+static void sqlfs_direct_prealloc(struct sqlfs_direct_inode *inode,
+                                  sqlite3_int64 end, sqlite3_int64 size) {
+    if (end <= inode->allocated || sqlfs_opts.prealloc == 0) {
+        return;
+    }
+    sqlite3_int64 extent = MAX(inode->allocated, size);
+    extent = MAX(extent + (sqlite3_int64)sqlfs_opts.prealloc, end);
+    if (fallocate(inode->fd, FALLOC_FL_KEEP_SIZE, 0, extent) == 0) {
+        inode->allocated = extent;
+        __atomic_add_fetch(&direct.preallocs, 1, __ATOMIC_RELAXED);
     }
+}
 
-    sqlite3_bind_int64(select_file_nlink_by_id_stmt, 1, path_info.file_id);
-    ret = sqlite3_step(select_file_nlink_by_id_stmt);
-    if (ret != SQLITE_ROW) {
-        printf("sqlfs_unlink(): '%s' file_id: %ld select nlink error %s\n",
-               path, path_info.file_id, sqlite3_errmsg(db));
-        return -EIO;
+/**
+ * @brief write through the O_DIRECT descriptor. data has to be aligned;
+ * unaligned edges are completed from disk first, and a padded tail is cut
+ * off again so the file keeps its logical size.
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_direct_pwrite(struct sqlfs_direct_inode *inode,
+                               const char *data, size_t len,
+                               sqlite3_int64 offset) {
+    sqlite3_int64 start = DIRECT_ROUND_DOWN(offset);
+    sqlite3_int64 end = offset + (sqlite3_int64)len;
+    size_t span = DIRECT_ROUND_UP(end) - start;
+    char *raw = NULL;
+    const char *out = data;
+    struct stat st;
+    if (fstat(inode->fd, &st) != 0) {
+        return SQLITE_IOERR_FSTAT;
     }
-    nlink_t nlink = sqlite3_column_int64(select_file_nlink_by_id_stmt, 0);
-    sqlite3_reset(select_file_nlink_by_id_stmt);
-    if (nlink == 0) {
-        sqlite3_bind_int64(delete_file_by_id_stmt, 1, path_info.file_id);
-        ret = sqlite3_step(delete_file_by_id_stmt);
-        sqlite3_reset(delete_file_by_id_stmt);
-        if (ret != SQLITE_DONE) {
-            printf("sqlfs_unlink('%s'): delete file error %s\n", path,
-                   sqlite3_errmsg(db));
-            return -EIO;
+    if (start != offset || span != len ||
+        ((uintptr_t)data & (DIRECT_ALIGN - 1)) != 0) {
+        raw = sqlfs_buf_get(span + DIRECT_ALIGN);
+        if (raw == NULL) {
+            return SQLITE_IOERR_NOMEM;
+        }
+        char *aligned = sqlfs_direct_align(raw);
+        if (start != offset) {
+            sqlfs_direct_pread(inode, aligned, DIRECT_ALIGN, start);
+        }
+        if (DIRECT_ROUND_UP(end) != end &&
+            (span > DIRECT_ALIGN || start == offset)) {
+            sqlfs_direct_pread(inode, aligned + span - DIRECT_ALIGN,
+                               DIRECT_ALIGN, start + span - DIRECT_ALIGN);
         }
+        memcpy(aligned + (offset - start), data, len);
+        out = aligned;
+        __atomic_add_fetch(&direct.read_modify_writes, 1, __ATOMIC_RELAXED);
     }
-    return OK;
+    sqlfs_direct_prealloc(inode, start + span, st.st_size);
+    size_t done = 0;
+    int ret = SQLITE_OK;
+    while (done < span) {
+        ssize_t n = pwrite(inode->fd, out + done, span - done, start + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ret = errno == ENOSPC ? SQLITE_FULL : SQLITE_IOERR_WRITE;
+            break;
+        }
+        done += n;
+    }
+    __atomic_add_fetch(&direct.writes, 1, __ATOMIC_RELAXED);
+    sqlite3_int64 size = MAX(st.st_size, end);
+    if (ret == SQLITE_OK && start + (sqlite3_int64)span > size &&
+        ftruncate(inode->fd, size) != 0) {
+        ret = SQLITE_IOERR_TRUNCATE;
+    }
+    sqlfs_buf_put(raw);
+    return ret;
 }
 
-int sqlfs_rmdir(const char *path) {
-    struct sqlfs_path_info path_info;
-    int ret = sqlfs_find_path_info(path, &path_info);
-    if (ret == OK) {
-        // do nothing
-    } else if (ret == SQLITE_DONE) {
-        return -ENOENT;
-    } else {
-        return -EIO;
+/**
+ * @brief write out the staged batch in one io_uring submission, followed by
+ * a linked fdatasync if sync is set. Segments that O_DIRECT cannot write as
+ * they are go through sqlfs_direct_pwrite() first.
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_direct_flush_uring(struct sqlfs_direct_inode *inode,
+                                    bool sync) {
+    int res[DIRECT_BATCH_SEGS + 1];
+    bool queued[DIRECT_BATCH_SEGS];
+    sqlite3_int64 end = 0;
+    int ret = SQLITE_OK;
+    for (int i = 0; i < inode->seg_count && ret == SQLITE_OK; i++) {
+        struct sqlfs_direct_seg *seg = &inode->segs[i];
+        queued[i] = !sqlfs_opts.direct_io ||
+                    (DIRECT_ROUND_DOWN(seg->offset) == seg->offset &&
+                     DIRECT_ROUND_DOWN(seg->len) == seg->len);
+        if (queued[i]) {
+            end = MAX(end, seg->offset + seg->len);
+        } else {
+            ret = sqlfs_direct_pwrite(inode, inode->batch + seg->data,
+                                      seg->len, seg->offset);
+        }
     }
-    if (S_ISREG(path_info.mode)) {
-        return -ENOTDIR;
+    if (ret != SQLITE_OK) {
+        return ret;
     }
-    sqlite3_bind_int64(count_dir_items_by_id_stmt, 1, path_info.id);
-    ret = sqlite3_step(count_dir_items_by_id_stmt);
-    sqlite3_reset(count_dir_items_by_id_stmt);
-    if (ret == SQLITE_ROW) {
-        int count = sqlite3_column_int64(count_dir_items_by_id_stmt, 0);
-        if (count != 0) {
-            return -EPERM;
+    struct stat st;
+    if (end > 0 && fstat(inode->fd, &st) == 0) {
+        sqlfs_direct_prealloc(inode, end, st.st_size);
+    }
+    for (int i = 0; i < inode->seg_count; i++) {
+        struct sqlfs_direct_seg *seg = &inode->segs[i];
+        if (queued[i]) {
+            struct io_uring_sqe *sqe =
+                sqlfs_uring_prep(&inode->ring, IORING_OP_WRITE, inode->fd,
+                                 inode->batch + seg->data, seg->len,
+                                 seg->offset, i);
+            if (sync) {
+                sqe->flags |= IOSQE_IO_LINK;
+            }
+        }
+    }
+    if (sync) {
+        struct io_uring_sqe *sqe =
+            sqlfs_uring_prep(&inode->ring, IORING_OP_FSYNC, inode->fd, NULL, 0,
+                             0, DIRECT_BATCH_SEGS);
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        __atomic_add_fetch(&direct.linked_syncs, 1, __ATOMIC_RELAXED);
+    }
+    unsigned ops = inode->ring.pending;
+    if (ops == 0) {
+        return SQLITE_OK;
+    }
+    if (sqlfs_uring_submit(&inode->ring, res) != 0) {
+        return SQLITE_IOERR_WRITE;
+    }
+    __atomic_add_fetch(&direct.uring_enters, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&direct.uring_ops, ops, __ATOMIC_RELAXED);
+    bool resync = false;
+    for (int i = 0; i < inode->seg_count && ret == SQLITE_OK; i++) {
+        struct sqlfs_direct_seg *seg = &inode->segs[i];
+        if (!queued[i] || res[i] == seg->len) {
+            continue;
+        }
+        if (res[i] < 0) {
+            ret = res[i] == -ENOSPC ? SQLITE_FULL : SQLITE_IOERR_WRITE;
+        } else {
+            // short write, finish it synchronously
+            ret = sqlfs_direct_pwrite(inode, inode->batch + seg->data + res[i],
+                                      seg->len - res[i], seg->offset + res[i]);
+            resync = sync;
         }
-    } else {
-        printf("sqlfs_rmdir(): '%s' count child error %s ret: %d \n", path,
-               sqlite3_errmsg(db), ret);
-        return -EIO;
     }
+    if (ret == SQLITE_OK && sync &&
+        (res[DIRECT_BATCH_SEGS] < 0 || resync) && fdatasync(inode->fd) != 0) {
+        ret = SQLITE_IOERR_FSYNC;
+    }
+    return ret;
+}
 
-    sqlite3_bind_int64(delete_path_by_id_stmt, 1, path_info.id);
-    ret = sqlite3_step(delete_path_by_id_stmt);
-    sqlite3_reset(delete_path_by_id_stmt);
-    if (ret == SQLITE_DONE) {
-        ret = OK;
+/**
+ * @brief write out the staged batch, and sync the file if sync is set. The
+ * inode lock has to be held.
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_direct_flush(struct sqlfs_direct_inode *inode, bool sync) {
+    int ret = SQLITE_OK;
+    if (inode->seg_count > 0) {
+        inode->write_gen++;
+    }
+    if (inode->use_uring) {
+        ret = sqlfs_direct_flush_uring(inode, sync);
     } else {
-        printf("sqlfs_rmdir(): '%s' delete path error %s ret: %d \n", path,
-               sqlite3_errmsg(db), ret);
-        ret = -EIO;
+        for (int i = 0; i < inode->seg_count && ret == SQLITE_OK; i++) {
+            struct sqlfs_direct_seg *seg = &inode->segs[i];
+            ret = sqlfs_direct_pwrite(inode, inode->batch + seg->data,
+                                      seg->len, seg->offset);
+        }
+        if (ret == SQLITE_OK && sync && fdatasync(inode->fd) != 0) {
+            ret = SQLITE_IOERR_FSYNC;
+        }
     }
+    inode->seg_count = 0;
+    inode->batch_used = 0;
     return ret;
 }
 
-int sqlfs_utimens(const char *path, const struct timespec tv[2],
-                  struct fuse_file_info *file_info) {
-    struct sqlfs_path_info path_info;
-    int ret = sqlfs_find_path_info(path, &path_info);
-    if (ret == SQLITE_OK) {
-        // do nothing
-    } else if (ret == SQLITE_DONE) {
-        printf("sqlfs_utimens() '%s' error: no such file\n", path);
-        return -ENOENT;
-    } else {
-        printf("sqlfs_utimens() '%s' error: %s\n", path, sqlite3_errmsg(db));
-        return -EIO;
+static bool sqlfs_direct_pending(struct sqlfs_direct_inode *inode,
+                                 sqlite3_int64 offset, int len) {
+    for (int i = 0; i < inode->seg_count; i++) {
+        struct sqlfs_direct_seg *seg = &inode->segs[i];
+        if (offset < seg->offset + seg->len && seg->offset < offset + len) {
+            return true;
+        }
     }
-    // TODO fix time
-    sqlite3_bind_int64(update_path_times_by_id_stmt, 1, tv[0].tv_nsec * 1000);
-    sqlite3_bind_int64(update_path_times_by_id_stmt, 2, tv[1].tv_nsec * 1000);
-    sqlite3_bind_int64(update_path_times_by_id_stmt, 3, path_info.id);
-    ret = sqlite3_step(update_path_times_by_id_stmt);
-    sqlite3_reset(update_path_times_by_id_stmt);
-    if (ret == SQLITE_DONE) {
-        ret = OK;
-    } else {
-        printf("sqlfs_utimens('%s') error: %s", path, sqlite3_errmsg(db));
-        ret = -EIO;
+    return false;
+}
+
+static int sqlfs_direct_close(sqlite3_file *file) {
+    struct sqlfs_direct_file *p = (struct sqlfs_direct_file *)file;
+    struct sqlfs_direct_inode *inode = p->inode;
+    pthread_mutex_lock(&inode->lock);
+    int ret = sqlfs_direct_flush(inode, false);
+    pthread_mutex_unlock(&inode->lock);
+    free(p->ra);
+    int close_ret = p->real->pMethods->xClose(p->real);
+    pthread_mutex_lock(&direct.lock);
+    if (--inode->refs == 0) {
+        struct sqlfs_direct_inode **link = &direct.inodes;
+        while (*link != inode) {
+            link = &(*link)->next;
+        }
+        *link = inode->next;
+        if (inode->use_uring) {
+            sqlfs_uring_free(&inode->ring);
+        }
+        close(inode->fd);
+        free(inode->batch);
+        pthread_mutex_destroy(&inode->lock);
+        free(inode);
+    }
+    pthread_mutex_unlock(&direct.lock);
+    return ret != SQLITE_OK ? ret : close_ret;
+}
+
+/**
+ * @brief serve a sequential read from the read-ahead window of the
+ * connection, refilling it when the reader has moved past it
+ *
+ * @return true if buf was filled
+ */
+static bool sqlfs_direct_read_ahead(struct sqlfs_direct_file *p, void *buf,
+                                    int len, sqlite3_int64 offset,
+                                    uint64_t gen) {
+    bool sequential = offset == p->last_end;
+    p->last_end = offset + len;
+    if (p->ra_len > 0 && p->ra_gen == gen && offset >= p->ra_offset &&
+        offset + len <= p->ra_offset + p->ra_len) {
+        memcpy(buf, p->ra + (offset - p->ra_offset), len);
+        __atomic_add_fetch(&direct.ra_hits, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    if (!sequential || len > DIRECT_READAHEAD / 2) {
+        return false;
+    }
+    if (p->ra == NULL &&
+        posix_memalign((void **)&p->ra, DIRECT_ALIGN, DIRECT_READAHEAD) != 0) {
+        p->ra = NULL;
+        return false;
+    }
+    ssize_t n = sqlfs_direct_pread(p->inode, p->ra, DIRECT_READAHEAD, offset);
+    p->ra_offset = offset;
+    p->ra_len = MAX(n, 0);
+    p->ra_gen = gen;
+    if (p->ra_len < len) {
+        return false;
+    }
+    memcpy(buf, p->ra, len);
+    return true;
+}
+
+static int sqlfs_direct_read(sqlite3_file *file, void *buf, int len,
+                             sqlite3_int64 offset) {
+    struct sqlfs_direct_file *p = (struct sqlfs_direct_file *)file;
+    struct sqlfs_direct_inode *inode = p->inode;
+    pthread_mutex_lock(&inode->lock);
+    int ret = SQLITE_OK;
+    if (sqlfs_direct_pending(inode, offset, len)) {
+        ret = sqlfs_direct_flush(inode, false);
+    }
+    uint64_t gen = inode->write_gen;
+    pthread_mutex_unlock(&inode->lock);
+    if (ret != SQLITE_OK) {
+        return ret;
+    }
+    if (inode->use_uring && sqlfs_direct_read_ahead(p, buf, len, offset, gen)) {
+        return SQLITE_OK;
+    }
+    ssize_t n = sqlfs_direct_pread(inode, buf, len, offset);
+    if (n < 0) {
+        return SQLITE_IOERR_READ;
+    }
+    return n < len ? SQLITE_IOERR_SHORT_READ : SQLITE_OK;
+}
+
+static int sqlfs_direct_write(sqlite3_file *file, const void *buf, int len,
+                              sqlite3_int64 offset) {
+    struct sqlfs_direct_file *p = (struct sqlfs_direct_file *)file;
+    struct sqlfs_direct_inode *inode = p->inode;
+    int ret = SQLITE_OK;
+    p->ra_len = 0;
+    pthread_mutex_lock(&inode->lock);
+    struct sqlfs_direct_seg *last =
+        inode->seg_count > 0 ? &inode->segs[inode->seg_count - 1] : NULL;
+    if (sqlfs_direct_pending(inode, offset, len)) {
+        ret = sqlfs_direct_flush(inode, false);
+        last = NULL;
+    }
+    if (ret == SQLITE_OK && last != NULL &&
+        last->offset + last->len == offset &&
+        last->data + last->len == inode->batch_used &&
+        inode->batch_used + len <= DIRECT_BATCH_SIZE) {
+        // continues the last segment
+        memcpy(inode->batch + inode->batch_used, buf, len);
+        inode->batch_used += len;
+        last->len += len;
+        __atomic_add_fetch(&direct.batched_pages, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&inode->lock);
+        return SQLITE_OK;
+    }
+    int data = DIRECT_ROUND_UP(inode->batch_used);
+    if (ret == SQLITE_OK && (inode->seg_count == DIRECT_BATCH_SEGS ||
+                             data + len > DIRECT_BATCH_SIZE)) {
+        ret = sqlfs_direct_flush(inode, false);
+        data = 0;
+    }
+    if (ret == SQLITE_OK && len > DIRECT_BATCH_SIZE) {
+        ret = sqlfs_direct_pwrite(inode, buf, len, offset);
+    } else if (ret == SQLITE_OK) {
+        struct sqlfs_direct_seg *seg = &inode->segs[inode->seg_count++];
+        seg->offset = offset;
+        seg->len = len;
+        seg->data = data;
+        memcpy(inode->batch + data, buf, len);
+        inode->batch_used = data + len;
+        __atomic_add_fetch(&direct.batched_pages, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&inode->lock);
+    return ret;
+}
+
+static int sqlfs_direct_truncate(sqlite3_file *file, sqlite3_int64 size) {
+    struct sqlfs_direct_inode *inode = ((struct sqlfs_direct_file *)file)->inode;
+    ((struct sqlfs_direct_file *)file)->ra_len = 0;
+    pthread_mutex_lock(&inode->lock);
+    int ret = sqlfs_direct_flush(inode, false);
+    if (ret == SQLITE_OK && ftruncate(inode->fd, size) != 0) {
+        ret = SQLITE_IOERR_TRUNCATE;
+    }
+    // blocks past the new end, preallocated ones included, are freed
+    inode->allocated = size;
+    pthread_mutex_unlock(&inode->lock);
+    return ret;
+}
+
+static int sqlfs_direct_sync(sqlite3_file *file, int flags) {
+    struct sqlfs_direct_inode *inode = ((struct sqlfs_direct_file *)file)->inode;
+    pthread_mutex_lock(&inode->lock);
+    int ret = sqlfs_direct_flush(inode, true);
+    pthread_mutex_unlock(&inode->lock);
+    return ret;
+}
+
+static int sqlfs_direct_file_size(sqlite3_file *file, sqlite3_int64 *size) {
+    struct sqlfs_direct_inode *inode = ((struct sqlfs_direct_file *)file)->inode;
+    struct stat st;
+    if (fstat(inode->fd, &st) != 0) {
+        return SQLITE_IOERR_FSTAT;
+    }
+    *size = st.st_size;
+    pthread_mutex_lock(&inode->lock);
+    for (int i = 0; i < inode->seg_count; i++) {
+        *size = MAX(*size, inode->segs[i].offset + inode->segs[i].len);
+    }
+    pthread_mutex_unlock(&inode->lock);
+    return SQLITE_OK;
+}
+
+static int sqlfs_direct_lock(sqlite3_file *file, int lock) {
+    struct sqlfs_direct_file *p = (struct sqlfs_direct_file *)file;
+    p->ra_len = 0;
+    return p->real->pMethods->xLock(p->real, lock);
+}
+
+static int sqlfs_direct_unlock(sqlite3_file *file, int lock) {
+    struct sqlfs_direct_file *p = (struct sqlfs_direct_file *)file;
+    p->ra_len = 0;
+    // other processes may read the file as soon as the lock is gone
+    pthread_mutex_lock(&p->inode->lock);
+    int ret = sqlfs_direct_flush(p->inode, false);
+    pthread_mutex_unlock(&p->inode->lock);
+    int unlock_ret = p->real->pMethods->xUnlock(p->real, lock);
+    return ret != SQLITE_OK ? ret : unlock_ret;
+}
+
+static int sqlfs_direct_check_reserved_lock(sqlite3_file *file, int *out) {
+    sqlite3_file *real = ((struct sqlfs_direct_file *)file)->real;
+    return real->pMethods->xCheckReservedLock(real, out);
+}
+
+static int sqlfs_direct_file_control(sqlite3_file *file, int op, void *arg) {
+    sqlite3_file *real = ((struct sqlfs_direct_file *)file)->real;
+    switch (op) {
+    case SQLITE_FCNTL_SIZE_HINT:
+    case SQLITE_FCNTL_CHUNK_SIZE:
+        // growth is handled by the --prealloc extents
+        return SQLITE_OK;
+    case SQLITE_FCNTL_MMAP_SIZE:
+        // pages are never mapped
+        *(sqlite3_int64 *)arg = 0;
+        return SQLITE_OK;
+    default:
+        return real->pMethods->xFileControl(real, op, arg);
+    }
+}
+
+static int sqlfs_direct_sector_size(sqlite3_file *file) {
+    return DIRECT_ALIGN;
+}
+
+static int sqlfs_direct_device_characteristics(sqlite3_file *file) {
+    sqlite3_file *real = ((struct sqlfs_direct_file *)file)->real;
+    return real->pMethods->xDeviceCharacteristics(real);
+}
+
+static int sqlfs_direct_shm_map(sqlite3_file *file, int page, int page_size,
+                                int extend, void volatile **out) {
+    sqlite3_file *real = ((struct sqlfs_direct_file *)file)->real;
+    return real->pMethods->xShmMap(real, page, page_size, extend, out);
+}
+
+static int sqlfs_direct_shm_lock(sqlite3_file *file, int offset, int n,
+                                 int flags) {
+    struct sqlfs_direct_file *p = (struct sqlfs_direct_file *)file;
+    // in WAL mode every read transaction starts here; another process may
+    // have checkpointed into the file since the window was read
+    p->ra_len = 0;
+    return p->real->pMethods->xShmLock(p->real, offset, n, flags);
+}
+
+static void sqlfs_direct_shm_barrier(sqlite3_file *file) {
+    sqlite3_file *real = ((struct sqlfs_direct_file *)file)->real;
+    real->pMethods->xShmBarrier(real);
+}
+
+static int sqlfs_direct_shm_unmap(sqlite3_file *file, int delete_flag) {
+    sqlite3_file *real = ((struct sqlfs_direct_file *)file)->real;
+    return real->pMethods->xShmUnmap(real, delete_flag);
+}
+
+static int sqlfs_direct_fetch(sqlite3_file *file, sqlite3_int64 offset,
+                              int len, void **out) {
+    *out = NULL;
+    return SQLITE_OK;
+}
+
+static int sqlfs_direct_unfetch(sqlite3_file *file, sqlite3_int64 offset,
+                                void *p) {
+    return SQLITE_OK;
+}
+
+const sqlite3_io_methods direct_io_methods = {
+    .iVersion = 3,
+    .xClose = sqlfs_direct_close,
+    .xRead = sqlfs_direct_read,
+    .xWrite = sqlfs_direct_write,
+    .xTruncate = sqlfs_direct_truncate,
+    .xSync = sqlfs_direct_sync,
+    .xFileSize = sqlfs_direct_file_size,
+    .xLock = sqlfs_direct_lock,
+    .xUnlock = sqlfs_direct_unlock,
+    .xCheckReservedLock = sqlfs_direct_check_reserved_lock,
+    .xFileControl = sqlfs_direct_file_control,
+    .xSectorSize = sqlfs_direct_sector_size,
+    .xDeviceCharacteristics = sqlfs_direct_device_characteristics,
+    .xShmMap = sqlfs_direct_shm_map,
+    .xShmLock = sqlfs_direct_shm_lock,
+    .xShmBarrier = sqlfs_direct_shm_barrier,
+    .xShmUnmap = sqlfs_direct_shm_unmap,
+    .xFetch = sqlfs_direct_fetch,
+    .xUnfetch = sqlfs_direct_unfetch,
+};
+
+/**
+ * @brief find or open the shared O_DIRECT descriptor of a database file
+ *
+ * @return NULL if the file system does not support O_DIRECT
+ */
+static struct sqlfs_direct_inode *sqlfs_direct_inode_get(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&direct.lock);
+    struct sqlfs_direct_inode *inode = direct.inodes;
+    while (inode != NULL &&
+           (inode->dev != st.st_dev || inode->ino != st.st_ino)) {
+        inode = inode->next;
+    }
+    if (inode == NULL) {
+        // a second descriptor is only opened while no connection of this
+        // process has the file open through it, see above
+        int flags = O_CLOEXEC | (sqlfs_opts.direct_io ? O_DIRECT : 0);
+        int fd = open(path, O_RDWR | flags);
+        if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+            fd = open(path, O_RDONLY | flags);
+        }
+        if (fd >= 0) {
+            inode = calloc(1, sizeof(struct sqlfs_direct_inode));
+        }
+        if (inode != NULL &&
+            posix_memalign((void **)&inode->batch, DIRECT_ALIGN,
+                           DIRECT_BATCH_SIZE) != 0) {
+            free(inode);
+            inode = NULL;
+        }
+        if (inode == NULL) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            pthread_mutex_unlock(&direct.lock);
+            return NULL;
+        }
+        inode->dev = st.st_dev;
+        inode->ino = st.st_ino;
+        inode->fd = fd;
+        inode->allocated = st.st_size;
+        if (sqlfs_opts.io_uring) {
+            int err = sqlfs_uring_init(&inode->ring, URING_ENTRIES);
+            inode->use_uring = err == 0;
+            if (err != 0) {
+                printf("sqlfs_direct_inode_get(): no io_uring, %s\n",
+                       strerror(-err));
+            }
+        }
+        pthread_mutex_init(&inode->lock, NULL);
+        inode->next = direct.inodes;
+        direct.inodes = inode;
+    }
+    inode->refs++;
+    pthread_mutex_unlock(&direct.lock);
+    return inode;
+}
+
+static int sqlfs_direct_open(sqlite3_vfs *vfs, const char *name,
+                             sqlite3_file *file, int flags, int *out_flags) {
+    struct sqlfs_direct_file *p = (struct sqlfs_direct_file *)file;
+    if (!(flags & SQLITE_OPEN_MAIN_DB) || name == NULL) {
+        // everything but the database itself is a plain unix VFS file
+        return direct.real->xOpen(direct.real, name, file, flags, out_flags);
+    }
+    memset(p, 0, sizeof(struct sqlfs_direct_file));
+    p->last_end = -1;
+    p->real = (sqlite3_file *)(p + 1);
+    int ret = direct.real->xOpen(direct.real, name, p->real, flags, out_flags);
+    if (ret != SQLITE_OK) {
+        return ret;
+    }
+    p->inode = sqlfs_direct_inode_get(name);
+    if (p->inode == NULL) {
+        printf("sqlfs_direct_open(): cannot reopen %s: %s\n", name,
+               strerror(errno));
+        p->real->pMethods->xClose(p->real);
+        return direct.real->xOpen(direct.real, name, file, flags, out_flags);
+    }
+    p->base.pMethods = &direct_io_methods;
+    return SQLITE_OK;
+}
+
+/**
+ * @brief make the sqlfs VFS the default, before any connection is opened
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_direct_register() {
+    direct.real = sqlite3_vfs_find(NULL);
+    if (direct.real == NULL) {
+        return SQLITE_ERROR;
+    }
+    direct.vfs = *direct.real;
+    direct.vfs.zName = "sqlfs";
+    direct.vfs.pNext = NULL;
+    direct.vfs.szOsFile =
+        sizeof(struct sqlfs_direct_file) + direct.real->szOsFile;
+    direct.vfs.xOpen = sqlfs_direct_open;
+    return sqlite3_vfs_register(&direct.vfs, 1);
+}
+
+void sqlfs_print_direct_stats(FILE *out) {
+    if (direct.real == NULL) {
+        return;
+    }
+    fprintf(out,
+            "direct-io: reads %lu writes %lu batched pages %lu preallocations "
+            "%lu read-modify-writes %lu\n",
+            direct.reads, direct.writes, direct.batched_pages, direct.preallocs,
+            direct.read_modify_writes);
+    if (sqlfs_opts.io_uring) {
+        fprintf(out,
+                "io_uring: enters %lu operations %lu linked syncs %lu "
+                "read-ahead hits %lu\n",
+                direct.uring_enters, direct.uring_ops, direct.linked_syncs,
+                direct.ra_hits);
+    }
+}
+
+bool is_root_dir(const char *path) {
+    if (strcmp(path, "/") == 0) {
+        return true;
+    } else {
+        return false;
+    }
+}
+
+/*
+ * In-memory metadata (--mem-meta).
+ *
+ * The whole `paths` table, joined with `files` size and nlink, is loaded at
+ * mount time. Entries live in one growable array and refer to each other by
+ * index. Entry 0 is the root dir. Names are interned once in a string arena, so
+ * a child is found by probing an open addressing table keyed by (parent index,
+ * name offset). Lookups, getattr and readdir are served from here, mutations
+ * go to SQLite first and are then reloaded with sqlfs_mem_reload().
+ */
+#define SQLFS_MEM_NONE UINT32_MAX
+
+struct sqlfs_mem_entry {
+    uint64_t id;
+    uint64_t file_id;
+    uint64_t size;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t nlink;
+    uint32_t parent;
+    uint32_t name; // offset in names, 0 for free entries
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t prev_sibling;
+};
+
+struct sqlfs_mem {
+    struct sqlfs_mem_entry *entries;
+    uint32_t entries_len;
+    uint32_t entries_cap;
+    uint32_t free_entry;
+    uint32_t live_entries;
+    char *names;
+    uint32_t names_len;
+    uint32_t names_cap;
+    uint32_t *name_slots;
+    uint32_t name_slots_cap;
+    uint32_t name_count;
+    uint32_t *child_slots;
+    uint32_t child_slots_cap;
+    uint32_t child_count;
+    pthread_rwlock_t lock;
+} mem = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+uint64_t sqlfs_hash_bytes(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+uint64_t sqlfs_hash_u64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint32_t sqlfs_mem_child_hash(uint32_t parent, uint32_t name) {
+    return sqlfs_hash_u64((uint64_t)parent << 32 | name);
+}
+
+static bool sqlfs_mem_name_eq(uint32_t name, const char *s, size_t len) {
+    const char *n = mem.names + name;
+    return strncmp(n, s, len) == 0 && n[len] == '\0';
+}
+
+static uint32_t sqlfs_mem_find_name(const char *s, size_t len) {
+    if (mem.name_slots_cap == 0) {
+        return 0;
+    }
+    uint32_t mask = mem.name_slots_cap - 1;
+    uint32_t i = sqlfs_hash_bytes(s, len) & mask;
+    while (mem.name_slots[i] != 0) {
+        if (sqlfs_mem_name_eq(mem.name_slots[i], s, len)) {
+            return mem.name_slots[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return 0;
+}
+
+static void sqlfs_mem_put_name_slot(uint32_t name) {
+    uint32_t mask = mem.name_slots_cap - 1;
+    const char *n = mem.names + name;
+    uint32_t i = sqlfs_hash_bytes(n, strlen(n)) & mask;
+    while (mem.name_slots[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    mem.name_slots[i] = name;
+}
+
+/**
+ * @brief intern a name in the string arena
+ *
+ * @return offset of the name, 0 when out of memory
+ */
+static uint32_t sqlfs_mem_intern(const char *s, size_t len) {
+    uint32_t name = sqlfs_mem_find_name(s, len);
+    if (name != 0) {
+        return name;
+    }
+    if ((mem.name_count + 1) * 4 >= mem.name_slots_cap * 3) {
+        uint32_t *old_slots = mem.name_slots;
+        uint32_t old_cap = mem.name_slots_cap;
+        uint32_t cap = old_cap == 0 ? 1024 : old_cap * 2;
+        uint32_t *slots = calloc(cap, sizeof(uint32_t));
+        if (slots == NULL) {
+            return 0;
+        }
+        mem.name_slots = slots;
+        mem.name_slots_cap = cap;
+        for (uint32_t i = 0; i < old_cap; i++) {
+            if (old_slots[i] != 0) {
+                sqlfs_mem_put_name_slot(old_slots[i]);
+            }
+        }
+        free(old_slots);
+    }
+    if (mem.names_len + len + 1 > mem.names_cap) {
+        uint32_t cap = mem.names_cap == 0 ? 64 * 1024 : mem.names_cap;
+        while (mem.names_len + len + 1 > cap) {
+            cap *= 2;
+        }
+        char *names = realloc(mem.names, cap);
+        if (names == NULL) {
+            return 0;
+        }
+        mem.names = names;
+        mem.names_cap = cap;
+    }
+    if (mem.names_len == 0) {
+        // offset 0 is reserved for "no name"
+        mem.names[mem.names_len++] = '\0';
+    }
+    name = mem.names_len;
+    memcpy(mem.names + name, s, len);
+    mem.names[name + len] = '\0';
+    mem.names_len += len + 1;
+    mem.name_count++;
+    sqlfs_mem_put_name_slot(name);
+    return name;
+}
+
+/**
+ * @brief probe the children table
+ *
+ * @return slot holding (parent, name), or the empty slot ending the probe
+ */
+static uint32_t sqlfs_mem_child_slot(uint32_t parent, uint32_t name) {
+    uint32_t mask = mem.child_slots_cap - 1;
+    uint32_t i = sqlfs_mem_child_hash(parent, name) & mask;
+    while (mem.child_slots[i] != SQLFS_MEM_NONE) {
+        struct sqlfs_mem_entry *e = &mem.entries[mem.child_slots[i]];
+        if (e->parent == parent && e->name == name) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static uint32_t sqlfs_mem_find_child(uint32_t parent, uint32_t name) {
+    if (mem.child_slots_cap == 0) {
+        return SQLFS_MEM_NONE;
+    }
+    return mem.child_slots[sqlfs_mem_child_slot(parent, name)];
+}
+
+static int sqlfs_mem_grow_children() {
+    uint32_t cap = mem.child_slots_cap == 0 ? 1024 : mem.child_slots_cap * 2;
+    uint32_t *slots = malloc(cap * sizeof(uint32_t));
+    if (slots == NULL) {
+        return -ENOMEM;
+    }
+    memset(slots, 0xff, cap * sizeof(uint32_t));
+    free(mem.child_slots);
+    mem.child_slots = slots;
+    mem.child_slots_cap = cap;
+    for (uint32_t i = 1; i < mem.entries_len; i++) {
+        struct sqlfs_mem_entry *e = &mem.entries[i];
+        if (e->name != 0) {
+            mem.child_slots[sqlfs_mem_child_slot(e->parent, e->name)] = i;
+        }
+    }
+    return OK;
+}
+
+static int sqlfs_mem_link_child(uint32_t idx) {
+    if ((mem.child_count + 1) * 4 >= mem.child_slots_cap * 3) {
+        if (sqlfs_mem_grow_children() != OK) {
+            return -ENOMEM;
+        }
+    }
+    struct sqlfs_mem_entry *e = &mem.entries[idx];
+    mem.child_slots[sqlfs_mem_child_slot(e->parent, e->name)] = idx;
+    mem.child_count++;
+    struct sqlfs_mem_entry *parent = &mem.entries[e->parent];
+    e->prev_sibling = 0;
+    e->next_sibling = parent->first_child;
+    if (parent->first_child != 0) {
+        mem.entries[parent->first_child].prev_sibling = idx;
+    }
+    parent->first_child = idx;
+    return OK;
+}
+
+static void sqlfs_mem_unlink_child(uint32_t idx) {
+    struct sqlfs_mem_entry *e = &mem.entries[idx];
+    // backward shift deletion keeps probe sequences intact
+    uint32_t mask = mem.child_slots_cap - 1;
+    uint32_t i = sqlfs_mem_child_slot(e->parent, e->name);
+    uint32_t j = i;
+    while (true) {
+        j = (j + 1) & mask;
+        if (mem.child_slots[j] == SQLFS_MEM_NONE) {
+            break;
+        }
+        struct sqlfs_mem_entry *o = &mem.entries[mem.child_slots[j]];
+        uint32_t k = sqlfs_mem_child_hash(o->parent, o->name) & mask;
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            mem.child_slots[i] = mem.child_slots[j];
+            i = j;
+        }
+    }
+    mem.child_slots[i] = SQLFS_MEM_NONE;
+    mem.child_count--;
+
+    if (e->prev_sibling != 0) {
+        mem.entries[e->prev_sibling].next_sibling = e->next_sibling;
+    } else {
+        mem.entries[e->parent].first_child = e->next_sibling;
+    }
+    if (e->next_sibling != 0) {
+        mem.entries[e->next_sibling].prev_sibling = e->prev_sibling;
+    }
+}
+
+static uint32_t sqlfs_mem_new_entry() {
+    uint32_t idx;
+    if (mem.free_entry != 0) {
+        idx = mem.free_entry;
+        mem.free_entry = mem.entries[idx].next_sibling;
+    } else {
+        if (mem.entries_len == mem.entries_cap) {
+            uint32_t cap = mem.entries_cap == 0 ? 1024 : mem.entries_cap * 2;
+            struct sqlfs_mem_entry *entries =
+                realloc(mem.entries, cap * sizeof(struct sqlfs_mem_entry));
+            if (entries == NULL) {
+                return SQLFS_MEM_NONE;
+            }
+            mem.entries = entries;
+            mem.entries_cap = cap;
+        }
+        idx = mem.entries_len++;
+    }
+    memset(&mem.entries[idx], 0, sizeof(struct sqlfs_mem_entry));
+    mem.live_entries++;
+    return idx;
+}
+
+/**
+ * @brief free an entry and everything below it
+ */
+static void sqlfs_mem_free_entry(uint32_t idx) {
+    while (mem.entries[idx].first_child != 0) {
+        sqlfs_mem_free_entry(mem.entries[idx].first_child);
+    }
+    sqlfs_mem_unlink_child(idx);
+    mem.entries[idx].name = 0;
+    mem.entries[idx].next_sibling = mem.free_entry;
+    mem.free_entry = idx;
+    mem.live_entries--;
+}
+
+/**
+ * @brief resolve a path
+ *
+ * @param path absolute path
+ * @param len number of bytes of path to resolve
+ * @return entry index, SQLFS_MEM_NONE on not found
+ */
+static uint32_t sqlfs_mem_lookup_len(const char *path, size_t len) {
+    uint32_t idx = 0;
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && path[i] == '/') {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && path[i] != '/') {
+            i++;
+        }
+        if (i == start) {
+            break;
+        }
+        uint32_t name = sqlfs_mem_find_name(path + start, i - start);
+        if (name == 0) {
+            return SQLFS_MEM_NONE;
+        }
+        idx = sqlfs_mem_find_child(idx, name);
+        if (idx == SQLFS_MEM_NONE) {
+            return SQLFS_MEM_NONE;
+        }
+    }
+    return idx;
+}
+
+static uint32_t sqlfs_mem_lookup(const char *path) {
+    return sqlfs_mem_lookup_len(path, strlen(path));
+}
+
+/**
+ * @brief insert or update an entry from a row shaped like
+ * select_mem_entry_by_path_sql
+ *
+ * @return OK if no errors, FUSE negated error otherwise.
+ */
+static int sqlfs_mem_put_row(sqlite3_stmt *stmt) {
+    const char *path = (const char *)sqlite3_column_text(stmt, 0);
+    uint32_t idx = sqlfs_mem_lookup(path);
+    if (idx == SQLFS_MEM_NONE) {
+        const char *base = strrchr(path, '/');
+        if (base == NULL || base[1] == '\0') {
+            return -EINVAL;
+        }
+        uint32_t parent = sqlfs_mem_lookup_len(path, base - path);
+        if (parent == SQLFS_MEM_NONE) {
+            return -ENOENT;
+        }
+        uint32_t name = sqlfs_mem_intern(base + 1, strlen(base + 1));
+        idx = name == 0 ? SQLFS_MEM_NONE : sqlfs_mem_new_entry();
+        if (idx == SQLFS_MEM_NONE) {
+            return -ENOMEM;
+        }
+        mem.entries[idx].parent = parent;
+        mem.entries[idx].name = name;
+        if (sqlfs_mem_link_child(idx) != OK) {
+            mem.entries[idx].name = 0;
+            mem.entries[idx].next_sibling = mem.free_entry;
+            mem.free_entry = idx;
+            mem.live_entries--;
+            return -ENOMEM;
+        }
+    }
+    struct sqlfs_mem_entry *e = &mem.entries[idx];
+    e->id = sqlite3_column_int64(stmt, 1);
+    e->uid = sqlite3_column_int(stmt, 2);
+    e->gid = sqlite3_column_int(stmt, 3);
+    e->mode = sqlite3_column_int(stmt, 4);
+    e->atime = sqlite3_column_int64(stmt, 5);
+    e->mtime = sqlite3_column_int64(stmt, 6);
+    e->ctime = sqlite3_column_int64(stmt, 7);
+    e->file_id = sqlite3_column_int64(stmt, 8);
+    e->size = sqlite3_column_int64(stmt, 9);
+    e->nlink = sqlite3_column_int(stmt, 10);
+    return OK;
+}
+
+/**
+ * @brief load all metadata into memory. Rows are read in path order so
+ * parents are always loaded before their children.
+ *
+ * @param reset drop what is loaded first, under the same lock, so readers
+ * wait instead of seeing an empty tree
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_mem_load_all(bool reset) {
+    sqlite3_stmt *stmt;
+    int ret = sqlite3_prepare_v2(db, select_mem_entries_sql, -1, &stmt, NULL);
+    if (ret != SQLITE_OK) {
+        return ret;
+    }
+    pthread_rwlock_wrlock(&mem.lock);
+    while (reset && mem.entries_len > 0 && mem.entries[0].first_child != 0) {
+        sqlfs_mem_free_entry(mem.entries[0].first_child);
+    }
+    if (mem.entries_len == 0) {
+        sqlfs_mem_new_entry(); // root
+        mem.entries[0].mode = ROOT_DIR_MODE;
+    }
+    uint64_t orphans = 0;
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int err = sqlfs_mem_put_row(stmt);
+        if (err == -ENOMEM) {
+            ret = SQLITE_NOMEM;
+            break;
+        } else if (err != OK) {
+            orphans++;
+        }
+    }
+    pthread_rwlock_unlock(&mem.lock);
+    sqlite3_finalize(stmt);
+    if (ret != SQLITE_DONE) {
+        return ret;
+    }
+    if (reset) {
+        return SQLITE_OK;
+    }
+    printf("sqlfs_mem_load(): %u entries, %u names, %lu orphans skipped, "
+           "%lu bytes\n",
+           mem.live_entries - 1, mem.name_count, orphans,
+           (uint64_t)mem.entries_cap * sizeof(struct sqlfs_mem_entry) +
+               mem.names_cap + (uint64_t)mem.name_slots_cap * 4 +
+               (uint64_t)mem.child_slots_cap * 4);
+    return SQLITE_OK;
+}
+
+int sqlfs_mem_load() {
+    return sqlfs_mem_load_all(false);
+}
+
+/**
+ * @brief reload all metadata, after another process changed the database
+ * without saying what
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_mem_reset() {
+    return sqlfs_mem_load_all(true);
+}
+
+/**
+ * @brief reload one path from SQLite after it was mutated. Removes the entry,
+ * and everything below it, if the path is gone.
+ *
+ * @return OK if no errors, FUSE negated error otherwise.
+ */
+int sqlfs_mem_reload(const char *path) {
+    if (!sqlfs_opts.mem_meta || is_root_dir(path)) {
+        return OK;
+    }
+    pthread_rwlock_wrlock(&mem.lock);
+    sqlite3_bind_text(select_mem_entry_by_path_stmt, 1, path, -1, NULL);
+    int ret = sqlite3_step(select_mem_entry_by_path_stmt);
+    if (ret == SQLITE_ROW) {
+        ret = sqlfs_mem_put_row(select_mem_entry_by_path_stmt);
+    } else if (ret == SQLITE_DONE) {
+        uint32_t idx = sqlfs_mem_lookup(path);
+        if (idx != SQLFS_MEM_NONE) {
+            sqlfs_mem_free_entry(idx);
+        }
+        ret = OK;
+    } else {
+        printf("sqlfs_mem_reload(): '%s' sql error %s\n", path,
+               sqlite3_errmsg(db));
+        ret = -EIO;
+    }
+    sqlite3_reset(select_mem_entry_by_path_stmt);
+    pthread_rwlock_unlock(&mem.lock);
+    return ret;
+}
+
+/**
+ * @brief move a path, and everything below it, after a rename. Reloads the
+ * new path from SQLite for its attributes.
+ *
+ * @return OK if no errors, FUSE negated error otherwise.
+ */
+int sqlfs_mem_rename(const char *old_path, const char *new_path) {
+    if (!sqlfs_opts.mem_meta) {
+        return OK;
+    }
+    pthread_rwlock_wrlock(&mem.lock);
+    uint32_t idx = sqlfs_mem_lookup(old_path);
+    const char *base = strrchr(new_path, '/');
+    uint32_t parent = sqlfs_mem_lookup_len(new_path, base - new_path);
+    uint32_t name = sqlfs_mem_intern(base + 1, strlen(base + 1));
+    if (idx != SQLFS_MEM_NONE && parent != SQLFS_MEM_NONE && name != 0) {
+        uint32_t replaced = sqlfs_mem_lookup(new_path);
+        if (replaced != SQLFS_MEM_NONE && replaced != idx) {
+            sqlfs_mem_free_entry(replaced);
+        }
+        // cannot grow the table, as one child was just unlinked
+        sqlfs_mem_unlink_child(idx);
+        mem.entries[idx].parent = parent;
+        mem.entries[idx].name = name;
+        sqlfs_mem_link_child(idx);
+    }
+    pthread_rwlock_unlock(&mem.lock);
+    // drops the old subtree if it could not be moved
+    sqlfs_mem_reload(old_path);
+    return sqlfs_mem_reload(new_path);
+}
+
+/**
+ * @brief reload every path linked to a file, after its size or nlink changed
+ *
+ * @return OK if no errors, FUSE negated error otherwise.
+ */
+int sqlfs_mem_reload_file(uint64_t file_id) {
+    if (!sqlfs_opts.mem_meta || file_id == 0) {
+        return OK;
+    }
+    sqlite3_bind_int64(select_paths_by_file_id_stmt, 1, file_id);
+    int ret = sqlite3_step(select_paths_by_file_id_stmt);
+    while (ret == SQLITE_ROW) {
+        const char *path =
+            (const char *)sqlite3_column_text(select_paths_by_file_id_stmt, 0);
+        if (sqlfs_mem_reload(path) != OK) {
+            break;
+        }
+        ret = sqlite3_step(select_paths_by_file_id_stmt);
+    }
+    sqlite3_reset(select_paths_by_file_id_stmt);
+    return ret == SQLITE_DONE ? OK : -EIO;
+}
+
+static void sqlfs_mem_fill_stat(struct sqlfs_mem_entry *e, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_uid = e->uid;
+    st->st_gid = e->gid;
+    st->st_mode = e->mode;
+    st->st_atime = e->atime;
+    st->st_mtime = e->mtime;
+    st->st_ctime = e->ctime;
+    st->st_size = e->size;
+    st->st_nlink = e->nlink;
+}
+
+int sqlfs_mem_getattr(const char *path, struct stat *stat, uint64_t *id) {
+    pthread_rwlock_rdlock(&mem.lock);
+    uint32_t idx = sqlfs_mem_lookup(path);
+    if (idx != SQLFS_MEM_NONE) {
+        sqlfs_mem_fill_stat(&mem.entries[idx], stat);
+        *id = mem.entries[idx].id;
+    }
+    pthread_rwlock_unlock(&mem.lock);
+    return idx == SQLFS_MEM_NONE ? -ENOENT : OK;
+}
+
+/**
+ * @brief in-memory counterpart of sqlfs_find_path_info()
+ *
+ * @return SQLITE_OK on success, SQLITE_DONE on not found
+ */
+int sqlfs_mem_find_path_info(const char *path,
+                             struct sqlfs_path_info *path_info) {
+    pthread_rwlock_rdlock(&mem.lock);
+    uint32_t idx = sqlfs_mem_lookup(path);
+    if (idx != SQLFS_MEM_NONE) {
+        struct sqlfs_mem_entry *e = &mem.entries[idx];
+        path_info->id = e->id;
+        path_info->mode = e->mode;
+        path_info->file_id = e->file_id;
+        path_info->size = e->size;
+    }
+    pthread_rwlock_unlock(&mem.lock);
+    return idx == SQLFS_MEM_NONE ? SQLITE_DONE : SQLITE_OK;
+}
+
+int sqlfs_mem_readdir(const char *path, void *buff, fuse_fill_dir_t filler) {
+    pthread_rwlock_rdlock(&mem.lock);
+    uint32_t idx = sqlfs_mem_lookup(path);
+    if (idx == SQLFS_MEM_NONE) {
+        pthread_rwlock_unlock(&mem.lock);
+        return -ENOENT;
+    }
+    for (uint32_t child = mem.entries[idx].first_child; child != 0;
+         child = mem.entries[child].next_sibling) {
+        struct stat st;
+        sqlfs_mem_fill_stat(&mem.entries[child], &st);
+        filler(buff, mem.names + mem.entries[child].name, &st, 0,
+               FUSE_FILL_DIR_PLUS);
+    }
+    pthread_rwlock_unlock(&mem.lock);
+    return OK;
+}
+
+/*
+ * Content shards (--shards).
+ *
+ * Metadata stays in the primary database while file content moves to the
+ * content table of <db>.shard<i>, picked by a hash of the file id. Every
+ * shard is a database of its own with its own connection, writer lock and
+ * WAL, so content writes to files on different shards do not queue behind
+ * each other or behind metadata updates, and each WAL is checkpointed on
+ * its own. Background readers attach the shards to their connection as
+ * shard<i>. The shard count is fixed when the first sharded mount stores it
+ * in the config table.
+ */
+#define MAX_SHARDS 64
+
+const char *create_shard_tables_sql =
+    "PRAGMA journal_mode=WAL;\n"
+    "create table if not exists content(id integer primary key, data blob);\n";
+const char *upsert_shard_content_sql =
+    "insert or replace into content(id, data) values(?, ?)";
+const char *grow_shard_content_sql =
+    "insert into content(id, data) values(?3, zeroblob(?2)) on conflict(id) "
+    "do update set data = cast(ifnull(substr(data, 1, ?1), x'') || "
+    "zeroblob(?2 - ?1) as blob)";
+const char *delete_shard_content_sql = "delete from content where id = ?";
+// ids of deleted files whose content may still be on a shard, written in the
+// same transaction as the delete and cleared once the shard row is gone
+const char *create_shard_trash_sql =
+    "create table if not exists shard_trash(id integer primary key);\n"
+    "create trigger if not exists shard_trash_files after delete on files "
+    "begin insert or ignore into shard_trash(id) values(old.id); end;\n";
+const char *delete_shard_trash_sql = "delete from shard_trash where id = ?";
+
+struct sqlfs_shard {
+    sqlite3 *db;
+    char schema[16]; // name when attached to a reader connection
+    pthread_mutex_t lock;
+    sqlite3_stmt *upsert_stmt;
+    sqlite3_stmt *grow_stmt;
+    sqlite3_stmt *delete_stmt;
+    uint64_t writes;
+};
+
+struct sqlfs_shards {
+    int count;
+    sqlite3_stmt *trash_stmt;
+    struct sqlfs_shard shard[MAX_SHARDS];
+} shards;
+
+/**
+ * @brief build a file: URI for path
+ *
+ * @return malloc'ed URI, NULL when out of memory
+ */
+char *sqlfs_db_uri(const char *path, const char *params) {
+    static const char hex[] = "0123456789abcdef";
+    char *uri = malloc(3 * strlen(path) + strlen(params) + 8);
+    if (uri == NULL) {
+        return NULL;
+    }
+    char *out = stpcpy(uri, "file:");
+    for (const char *c = path; *c != '\0'; c++) {
+        if (*c == '%' || *c == '?' || *c == '#') {
+            *out++ = '%';
+            *out++ = hex[(unsigned char)*c >> 4];
+            *out++ = hex[*c & 0xf];
+        } else {
+            *out++ = *c;
+        }
+    }
+    sprintf(out, "?%s", params);
+    return uri;
+}
+
+/**
+ * @brief open a database as immutable (--read-only): SQLite takes no locks
+ * and does not look for a WAL, so any number of processes can serve it
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_open_immutable(const char *path, sqlite3 **conn) {
+    char *uri = sqlfs_db_uri(path, "immutable=1");
+    if (uri == NULL) {
+        return SQLITE_NOMEM;
+    }
+    int ret = sqlite3_open_v2(uri, conn, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI,
+                              NULL);
+    free(uri);
+    return ret;
+}
+
+/**
+ * @brief open a database the way the mount options ask for
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_open_conn(const char *path, sqlite3 **conn) {
+    int ret;
+    if (sqlfs_opts.follower) {
+        // not immutable, the replication thread keeps writing it
+        ret = sqlite3_open_v2(path, conn, SQLITE_OPEN_READONLY, NULL);
+    } else if (sqlfs_opts.read_only) {
+        ret = sqlfs_open_immutable(path, conn);
+    } else {
+        ret = sqlite3_open(path, conn);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_config_conn(*conn);
+    }
+    return ret;
+}
+
+static struct sqlfs_shard *sqlfs_shard_of(uint64_t file_id) {
+    if (shards.count == 0) {
+        return NULL;
+    }
+    return &shards.shard[sqlfs_hash_u64(file_id) % shards.count];
+}
+
+/**
+ * @brief connection that holds the content of file_id, for error messages
+ */
+sqlite3 *sqlfs_content_db(uint64_t file_id) {
+    struct sqlfs_shard *shard = sqlfs_shard_of(file_id);
+    return shard != NULL ? shard->db : db;
+}
+
+/**
+ * @brief open the content of file_id. conn is either db, whose content lives
+ * on the shard connections, or a reader connection with the shards attached.
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_content_blob_open(sqlite3 *conn, uint64_t file_id, int flags,
+                            sqlite3_blob **blob) {
+    struct sqlfs_shard *shard = sqlfs_shard_of(file_id);
+    if (shard == NULL) {
+        return sqlite3_blob_open(conn, "main", "files", "content", file_id,
+                                 flags, blob);
+    }
+    if (conn == db) {
+        return sqlite3_blob_open(shard->db, "main", "content", "data", file_id,
+                                 flags, blob);
+    }
+    return sqlite3_blob_open(conn, shard->schema, "content", "data", file_id,
+                             flags, blob);
+}
+
+/**
+ * @brief whether two files are stored in the same table, so a blob handle
+ * can move between them with sqlite3_blob_reopen()
+ */
+bool sqlfs_content_same_table(uint64_t a, uint64_t b) {
+    return sqlfs_shard_of(a) == sqlfs_shard_of(b);
+}
+
+/**
+ * @brief replace the content of file_id on its shard
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_content_put(uint64_t file_id, const void *data, uint64_t size) {
+    struct sqlfs_shard *shard = sqlfs_shard_of(file_id);
+    pthread_mutex_lock(&shard->lock);
+    sqlite3_bind_int64(shard->upsert_stmt, 1, file_id);
+    if (size == 0) {
+        sqlite3_bind_null(shard->upsert_stmt, 2);
+    } else {
+        sqlite3_bind_blob64(shard->upsert_stmt, 2, data, size, SQLITE_STATIC);
+    }
+    int ret = sqlite3_step(shard->upsert_stmt);
+    sqlite3_reset(shard->upsert_stmt);
+    shard->writes++;
+    pthread_mutex_unlock(&shard->lock);
+    return ret == SQLITE_DONE ? SQLITE_OK : ret;
+}
+
+/**
+ * @brief grow the content of file_id on its shard from `size` to `new_size`
+ * bytes, with zeros
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_content_grow(uint64_t file_id, uint64_t size, uint64_t new_size) {
+    struct sqlfs_shard *shard = sqlfs_shard_of(file_id);
+    pthread_mutex_lock(&shard->lock);
+    sqlite3_bind_int64(shard->grow_stmt, 1, size);
+    sqlite3_bind_int64(shard->grow_stmt, 2, new_size);
+    sqlite3_bind_int64(shard->grow_stmt, 3, file_id);
+    int ret = sqlite3_step(shard->grow_stmt);
+    sqlite3_reset(shard->grow_stmt);
+    shard->writes++;
+    pthread_mutex_unlock(&shard->lock);
+    return ret == SQLITE_DONE ? SQLITE_OK : ret;
+}
+
+/**
+ * @brief drop the content of file_id from its shard, after its files row is
+ * gone, and then its shard_trash entry
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_content_delete(uint64_t file_id) {
+    struct sqlfs_shard *shard = sqlfs_shard_of(file_id);
+    pthread_mutex_lock(&shard->lock);
+    sqlite3_bind_int64(shard->delete_stmt, 1, file_id);
+    int ret = sqlite3_step(shard->delete_stmt);
+    sqlite3_reset(shard->delete_stmt);
+    pthread_mutex_unlock(&shard->lock);
+    if (ret != SQLITE_DONE) {
+        return ret;
+    }
+    sqlite3_bind_int64(shards.trash_stmt, 1, file_id);
+    ret = sqlite3_step(shards.trash_stmt);
+    sqlite3_reset(shards.trash_stmt);
+    return ret == SQLITE_DONE ? SQLITE_OK : ret;
+}
+
+/**
+ * @brief drop the content that a crash left behind between deleting a files
+ * row and its shard row
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_shards_empty_trash() {
+    sqlite3_stmt *stmt;
+    int ret = sqlite3_prepare_v2(db, "select id from shard_trash", -1, &stmt,
+                                 NULL);
+    uint64_t count = 0;
+    while (ret == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        ret = sqlfs_content_delete(sqlite3_column_int64(stmt, 0));
+        count++;
+    }
+    sqlite3_finalize(stmt);
+    if (count > 0) {
+        printf("sqlfs_shards_open(): dropped the content of %lu deleted "
+               "files\n",
+               count);
+    }
+    return ret;
+}
+
+/**
+ * @brief read the shard count stored in the primary database
+ *
+ * @return shard count, 0 if the database is not sharded
+ */
+static int sqlfs_shards_stored() {
+    sqlite3_stmt *stmt;
+    int count = 0;
+    if (sqlite3_prepare_v2(db, "select value from config where key = 'shards'",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        // images built before the config table existed
+        return 0;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        count = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return count;
+}
+
+/**
+ * @brief open the content shards of the primary database
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_shards_open() {
+    int stored = sqlfs_shards_stored();
+    int count = sqlfs_opts.shards;
+    // every reader connection attaches all shards
+    int max = MIN(MAX_SHARDS, sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, -1));
+    // checked before it is stored, a bad count would fail every later mount
+    if (count < 0 || count > max) {
+        printf("sqlfs_shards_open(): at most %d shards\n", max);
+        return SQLITE_MISUSE;
+    }
+    if (count == 0) {
+        count = stored;
+    } else if (stored != 0 && stored != count) {
+        printf("sqlfs_shards_open(): database has %d shards, not %d\n", stored,
+               count);
+        return SQLITE_MISUSE;
+    } else if (stored == 0) {
+        sqlite3_stmt *stmt;
+        int ret = sqlite3_prepare_v2(
+            db, "select exists(select 1 from files where content is not null)",
+            -1, &stmt, NULL);
+        bool has_content =
+            ret == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW &&
+            sqlite3_column_int(stmt, 0) != 0;
+        sqlite3_finalize(stmt);
+        if (ret != SQLITE_OK || has_content) {
+            printf("sqlfs_shards_open(): content is already stored unsharded\n");
+            return SQLITE_MISUSE;
+        }
+        char sql[128];
+        snprintf(sql, sizeof(sql),
+                 "insert into config(key, value) values('shards', %d)", count);
+        ret = sqlite3_exec(db, sql, NULL, NULL, &err_msg);
+        if (ret != SQLITE_OK) {
+            return ret;
+        }
+    }
+    if (count < 0 || count > max) {
+        printf("sqlfs_shards_open(): at most %d shards\n", max);
+        return SQLITE_MISUSE;
+    }
+    size_t path_len = strlen(sqlfs_opts.db_path) + 16;
+    char *path = malloc(path_len);
+    if (path == NULL) {
+        return SQLITE_NOMEM;
+    }
+    int ret = SQLITE_OK;
+    for (int i = 0; i < count && ret == SQLITE_OK; i++) {
+        struct sqlfs_shard *shard = &shards.shard[i];
+        snprintf(path, path_len, "%s.shard%d", sqlfs_opts.db_path, i);
+        snprintf(shard->schema, sizeof(shard->schema), "shard%d", i);
+        pthread_mutex_init(&shard->lock, NULL);
+        shards.count = i + 1;
+        ret = sqlfs_open_conn(path, &shard->db);
+        if (ret == SQLITE_OK && !sqlfs_opts.read_only) {
+            ret = sqlite3_exec(shard->db, create_shard_tables_sql, NULL, NULL,
+                               &err_msg);
+        }
+        if (ret == SQLITE_OK) {
+            ret = sqlite3_prepare_v2(shard->db, upsert_shard_content_sql, -1,
+                                     &shard->upsert_stmt, NULL);
+        }
+        if (ret == SQLITE_OK) {
+            ret = sqlite3_prepare_v2(shard->db, grow_shard_content_sql, -1,
+                                     &shard->grow_stmt, NULL);
+        }
+        if (ret == SQLITE_OK) {
+            ret = sqlite3_prepare_v2(shard->db, delete_shard_content_sql, -1,
+                                     &shard->delete_stmt, NULL);
+        }
+        if (ret != SQLITE_OK) {
+            printf("sqlfs_shards_open(): %s: %s\n", path,
+                   sqlite3_errmsg(shard->db));
+        }
+    }
+    free(path);
+    if (ret == SQLITE_OK && count > 0 && !sqlfs_opts.read_only) {
+        ret = sqlite3_exec(db, create_shard_trash_sql, NULL, NULL, &err_msg);
+        if (ret == SQLITE_OK) {
+            ret = sqlite3_prepare_v2(db, delete_shard_trash_sql, -1,
+                                     &shards.trash_stmt, NULL);
+        }
+        if (ret == SQLITE_OK) {
+            ret = sqlfs_shards_empty_trash();
+        }
+        if (ret != SQLITE_OK) {
+            printf("sqlfs_shards_open(): %s\n", sqlite3_errmsg(db));
+        }
+    }
+    return ret;
+}
+
+void sqlfs_shards_close() {
+    sqlite3_finalize(shards.trash_stmt);
+    shards.trash_stmt = NULL;
+    for (int i = 0; i < shards.count; i++) {
+        sqlite3_finalize(shards.shard[i].upsert_stmt);
+        sqlite3_finalize(shards.shard[i].grow_stmt);
+        sqlite3_finalize(shards.shard[i].delete_stmt);
+        sqlite3_close(shards.shard[i].db);
+    }
+    shards.count = 0;
+}
+
+/**
+ * @brief open a read-only connection for a background thread, with the
+ * content shards attached
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_open_reader(sqlite3 **conn) {
+    int ret;
+    if (sqlfs_opts.read_only && !sqlfs_opts.follower) {
+        ret = sqlfs_open_immutable(sqlfs_opts.db_path, conn);
+    } else {
+        ret = sqlite3_open_v2(sqlfs_opts.db_path, conn, SQLITE_OPEN_READONLY,
+                              NULL);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_config_conn(*conn);
+    }
+    for (int i = 0; i < shards.count && ret == SQLITE_OK; i++) {
+        // attached databases are opened with the flags of the connection
+        const char *path = sqlite3_db_filename(shards.shard[i].db, "main");
+        char *uri = sqlfs_opts.read_only ? sqlfs_db_uri(path, "immutable=1")
+                                         : NULL;
+        char *sql = sqlite3_mprintf("attach %Q as %s", uri ? uri : path,
+                                    shards.shard[i].schema);
+        ret = sql != NULL ? sqlite3_exec(*conn, sql, NULL, NULL, NULL)
+                          : SQLITE_NOMEM;
+        sqlite3_free(sql);
+        free(uri);
+    }
+    return ret;
+}
+
+void sqlfs_print_shard_stats(FILE *out) {
+    if (shards.count == 0) {
+        return;
+    }
+    fprintf(out, "shards: %d, content writes", shards.count);
+    for (int i = 0; i < shards.count; i++) {
+        fprintf(out, " %lu", shards.shard[i].writes);
+    }
+    fprintf(out, "\n");
+}
+
+/*
+ * Data version.
+ *
+ * PRAGMA data_version on db moves whenever another connection commits, and
+ * that includes the background connections of this process, the scrubber's
+ * and the content indexer's. Those commit through sqlfs_background_commit(),
+ * which moves the version the coherence poll compares against past their own
+ * commit, so that only commits of other processes make the poll drop what it
+ * caches.
+ */
+struct sqlfs_data_version {
+    pthread_mutex_t lock;
+    // on db, prepared by sqlfs_coherence_open()
+    sqlite3_stmt *stmt;
+    // the version the coherence poll last handled
+    int64_t seen;
+} data_version = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * @brief read PRAGMA data_version of db, with data_version.lock held
+ *
+ * @return the version, -1 on error
+ */
+static int64_t sqlfs_data_version_read() {
+    int64_t version = -1;
+    if (sqlite3_step(data_version.stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int64(data_version.stmt, 0);
+    }
+    sqlite3_reset(data_version.stmt);
+    return version;
+}
+
+/**
+ * @brief commit the write transaction open on background connection `conn`
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_background_commit(sqlite3 *conn) {
+    pthread_mutex_lock(&data_version.lock);
+    if (data_version.stmt == NULL) {
+        pthread_mutex_unlock(&data_version.lock);
+        return sqlite3_exec(conn, "commit", NULL, NULL, NULL);
+    }
+    // the write lock we hold keeps everyone else from committing until ours
+    int64_t before = sqlfs_data_version_read();
+    int ret = sqlite3_exec(conn, "commit", NULL, NULL, NULL);
+    // if other commits are still to be polled, ours is handled with them
+    if (ret == SQLITE_OK && before == data_version.seen) {
+        data_version.seen = sqlfs_data_version_read();
+    }
+    pthread_mutex_unlock(&data_version.lock);
+    return ret;
+}
+
+/*
+ * Content checksums (--checksums).
+ *
+ * Every CRC_CHUNK_SIZE chunk of content has a CRC32C in chunk_crcs. A write
+ * updates the checksums of the chunks it touched in its own savepoint, and
+ * holds crc.lock while it does. Reads verify every chunk they overlap; a
+ * chunk read only in part is read whole for that. A mismatch is checked
+ * again under crc.lock, from the latest content, so a write racing the read
+ * is not taken for corruption. A real mismatch fails the read with EIO.
+ *
+ * With --scrub-rate, --scrub-threads threads verify all content in rowid
+ * order, which is the order mkimage and VACUUM lay content out on disk.
+ * Each batch of chunks is read in one read transaction together with its
+ * checksums. Missing checksums are then filled in a short write transaction
+ * of their own, under crc.lock so that a write in between keeps its own
+ * checksums, and the rate limit sleeps outside of both. Like --merkle, the
+ * flag is kept in the config table.
+ */
+#define CRC_CHUNK_SIZE (64 * 1024)
+#define CRC_VERIFY_BATCH 64
+#define SCRUB_BATCH 16
+#define SCRUB_PASS_PAUSE 60
+#define MAX_SCRUB_THREADS 64
+
+uint32_t crc32c_table[256];
+bool crc32c_hw;
+
+static void sqlfs_crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? crc >> 1 ^ 0x82f63b78 : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+#if defined(__x86_64__)
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+sqlfs_crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = __builtin_ia32_crc32di(c, w);
+    }
+    crc = c;
+    for (; len > 0; p++, len--) {
+        crc = __builtin_ia32_crc32qi(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+/**
+ * @brief CRC32C (Castagnoli) of `len` bytes, with the SSE4.2 instruction
+ * when the CPU has it
+ */
+uint32_t sqlfs_crc32c(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint32_t crc = 0xffffffff;
+#if defined(__x86_64__)
+    if (crc32c_hw) {
+        return ~sqlfs_crc32c_sse42(crc, p, len);
+    }
+#endif
+    for (size_t i = 0; i < len; i++) {
+        crc = crc32c_table[(crc ^ p[i]) & 0xff] ^ crc >> 8;
+    }
+    return ~crc;
+}
+
+struct sqlfs_crc {
+    bool enabled;
+    // held by writers while content and checksums disagree
+    pthread_mutex_t lock;
+    sqlite3_stmt *select_stmt;
+    sqlite3_stmt *update_stmt;
+    sqlite3_stmt *trim_stmt;
+    uint64_t verified;
+    uint64_t mismatches;
+    uint64_t races;
+    uint64_t updated;
+};
+
+struct sqlfs_crc crc = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+struct sqlfs_scrub {
+    pthread_t threads[MAX_SCRUB_THREADS];
+    int running;
+    bool stop;
+    pthread_mutex_t lock;
+    // last file id handed out in this pass
+    uint64_t cursor;
+    // CLOCK_MONOTONIC seconds before which the next pass does not start
+    time_t resume;
+    uint64_t passes;
+    uint64_t files;
+    uint64_t chunks;
+    uint64_t bytes;
+    uint64_t mismatches;
+    uint64_t filled;
+    uint64_t skipped;
+};
+
+struct sqlfs_scrub scrub = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * @brief enable checksums when --checksums is given or the database already
+ * has them
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_crc_open() {
+    sqlite3_stmt *stmt;
+    int ret = sqlite3_prepare_v2(
+        db, "select value from config where key = 'checksums'", -1, &stmt,
+        NULL);
+    if (ret != SQLITE_OK) {
+        // images built before the config table existed
+        return SQLITE_OK;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0)) {
+        sqlfs_opts.checksums = 1;
+    }
+    sqlite3_finalize(stmt);
+    if (!sqlfs_opts.checksums) {
+        return SQLITE_OK;
+    }
+    if (shards.count > 0) {
+        printf("sqlfs_crc_open(): sharded databases are not supported\n");
+        return SQLITE_MISUSE;
+    }
+    sqlfs_crc32c_init();
+    if (!sqlfs_opts.read_only) {
+        ret = sqlite3_exec(db,
+                           "insert or replace into config(key, value) "
+                           "values('checksums', 1)",
+                           NULL, NULL, &err_msg);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(db,
+                                 "select chunk, length, crc from chunk_crcs "
+                                 "where file_id = ? and chunk between ? and ?",
+                                 -1, &crc.select_stmt, NULL);
+    }
+    if (ret == SQLITE_OK && !sqlfs_opts.read_only) {
+        ret = sqlite3_prepare_v2(
+            db,
+            "insert or replace into chunk_crcs(file_id, chunk, length, crc) "
+            "values(?, ?, ?, ?)",
+            -1, &crc.update_stmt, NULL);
+    }
+    if (ret == SQLITE_OK && !sqlfs_opts.read_only) {
+        ret = sqlite3_prepare_v2(
+            db, "delete from chunk_crcs where file_id = ? and chunk >= ?", -1,
+            &crc.trim_stmt, NULL);
+    }
+    crc.enabled = ret == SQLITE_OK;
+    return ret;
+}
+
+/**
+ * @brief recompute the checksums of the chunks of `file_id` overlapping
+ * [`start`, `end`) from the content just written, the caller holds crc.lock
+ *
+ * @return OK, -EIO on errors
+ */
+int sqlfs_crc_update(uint64_t file_id, uint64_t start, uint64_t end) {
+    sqlite3_blob *blob;
+    int ret = sqlfs_content_blob_open(db, file_id, 0, &blob);
+    char *buff = sqlfs_buf_get(CRC_CHUNK_SIZE);
+    uint64_t blob_size = ret == SQLITE_OK ? sqlite3_blob_bytes(blob) : 0;
+    end = MIN(end, blob_size);
+    for (uint64_t chunk = start / CRC_CHUNK_SIZE;
+         chunk * CRC_CHUNK_SIZE < end && ret == SQLITE_OK && buff != NULL;
+         chunk++) {
+        int len = MIN(CRC_CHUNK_SIZE, blob_size - chunk * CRC_CHUNK_SIZE);
+        ret = sqlite3_blob_read(blob, buff, len, chunk * CRC_CHUNK_SIZE);
+        if (ret == SQLITE_OK) {
+            sqlite3_bind_int64(crc.update_stmt, 1, file_id);
+            sqlite3_bind_int64(crc.update_stmt, 2, chunk);
+            sqlite3_bind_int(crc.update_stmt, 3, len);
+            sqlite3_bind_int64(crc.update_stmt, 4, sqlfs_crc32c(buff, len));
+            ret = sqlite3_step(crc.update_stmt);
+            sqlite3_reset(crc.update_stmt);
+            ret = ret == SQLITE_DONE ? SQLITE_OK : ret;
+            crc.updated++;
+        }
+    }
+    if (ret == SQLITE_OK) {
+        // a rewritten row can be shorter than before
+        sqlite3_bind_int64(crc.trim_stmt, 1, file_id);
+        sqlite3_bind_int64(crc.trim_stmt, 2,
+                           (blob_size + CRC_CHUNK_SIZE - 1) / CRC_CHUNK_SIZE);
+        ret = sqlite3_step(crc.trim_stmt);
+        sqlite3_reset(crc.trim_stmt);
+        ret = ret == SQLITE_DONE ? SQLITE_OK : ret;
+    }
+    sqlite3_blob_close(blob);
+    sqlfs_buf_put(buff);
+    if (ret != SQLITE_OK || buff == NULL) {
+        printf("sqlfs_crc_update(): file %lu error %s\n", file_id,
+               sqlite3_errmsg(db));
+        return -EIO;
+    }
+    return OK;
+}
+
+/**
+ * @brief check chunk `chunk` of `file_id` again from the latest content,
+ * the caller holds crc.lock
+ *
+ * @return true if content and checksum agree
+ */
+static bool sqlfs_crc_recheck(uint64_t file_id, uint64_t chunk) {
+    bool ok = false;
+    sqlite3_blob *blob;
+    char *buff = sqlfs_buf_get(CRC_CHUNK_SIZE);
+    if (buff != NULL &&
+        sqlfs_content_blob_open(db, file_id, 0, &blob) == SQLITE_OK) {
+        uint64_t blob_size = sqlite3_blob_bytes(blob);
+        sqlite3_bind_int64(crc.select_stmt, 1, file_id);
+        sqlite3_bind_int64(crc.select_stmt, 2, chunk);
+        sqlite3_bind_int64(crc.select_stmt, 3, chunk);
+        if (sqlite3_step(crc.select_stmt) != SQLITE_ROW) {
+            // the chunk is gone
+            ok = true;
+        } else {
+            uint64_t len = sqlite3_column_int64(crc.select_stmt, 1);
+            ok = chunk * CRC_CHUNK_SIZE + len <= blob_size &&
+                 sqlite3_blob_read(blob, buff, len, chunk * CRC_CHUNK_SIZE) ==
+                     SQLITE_OK &&
+                 sqlfs_crc32c(buff, len) ==
+                     (uint32_t)sqlite3_column_int64(crc.select_stmt, 2);
+        }
+        sqlite3_reset(crc.select_stmt);
+        sqlite3_blob_close(blob);
+    }
+    sqlfs_buf_put(buff);
+    return ok;
+}
+
+/**
+ * @brief check a chunk that `buff`, read at `offset`, covers only in part:
+ * the whole chunk is read from `blob`, and must match both its checksum and
+ * the part in `buff`
+ *
+ * @return true if they agree
+ */
+static bool sqlfs_crc_verify_part(sqlite3_blob *blob, const char *buff,
+                                  uint64_t offset, uint64_t end,
+                                  uint64_t chunk, uint32_t len, uint32_t sum) {
+    uint64_t start = chunk * CRC_CHUNK_SIZE;
+    char *whole = sqlfs_buf_get(CRC_CHUNK_SIZE);
+    bool ok = whole != NULL &&
+              start + len <= (uint64_t)sqlite3_blob_bytes(blob) &&
+              sqlite3_blob_read(blob, whole, len, start) == SQLITE_OK &&
+              sqlfs_crc32c(whole, len) == sum;
+    if (ok) {
+        uint64_t from = MAX(start, offset);
+        uint64_t to = MIN(start + len, end);
+        ok = from >= to || memcmp(whole + from - start, buff + from - offset,
+                                  to - from) == 0;
+    }
+    sqlfs_buf_put(whole);
+    return ok;
+}
+
+/**
+ * @brief verify the chunks of `file_id` that `buff`, `len` bytes read at
+ * `offset`, overlaps. Chunks it covers only in part are read in full from
+ * `blob`, the content `buff` was read from, or are skipped when `blob` is
+ * NULL.
+ *
+ * @return OK, -EIO on a checksum mismatch
+ */
+int sqlfs_crc_verify(sqlite3_blob *blob, uint64_t file_id, const char *buff,
+                     uint64_t offset, uint64_t len) {
+    if (!crc.enabled || len == 0) {
+        return OK;
+    }
+    uint64_t end = offset + len;
+    uint64_t first = offset / CRC_CHUNK_SIZE;
+    uint64_t last = (end + CRC_CHUNK_SIZE - 1) / CRC_CHUNK_SIZE;
+    while (first < last) {
+        uint64_t chunks[CRC_VERIFY_BATCH];
+        uint32_t lengths[CRC_VERIFY_BATCH];
+        uint32_t crcs[CRC_VERIFY_BATCH];
+        int count = 0;
+        pthread_mutex_lock(&crc.lock);
+        sqlite3_bind_int64(crc.select_stmt, 1, file_id);
+        sqlite3_bind_int64(crc.select_stmt, 2, first);
+        sqlite3_bind_int64(crc.select_stmt, 3,
+                           MIN(last, first + CRC_VERIFY_BATCH) - 1);
+        while (count < CRC_VERIFY_BATCH &&
+               sqlite3_step(crc.select_stmt) == SQLITE_ROW) {
+            chunks[count] = sqlite3_column_int64(crc.select_stmt, 0);
+            lengths[count] = sqlite3_column_int(crc.select_stmt, 1);
+            crcs[count] = sqlite3_column_int64(crc.select_stmt, 2);
+            count++;
+        }
+        sqlite3_reset(crc.select_stmt);
+        pthread_mutex_unlock(&crc.lock);
+        for (int i = 0; i < count; i++) {
+            uint64_t start = chunks[i] * CRC_CHUNK_SIZE;
+            bool ok;
+            if (start >= offset && start + lengths[i] <= end) {
+                ok = sqlfs_crc32c(buff + start - offset, lengths[i]) == crcs[i];
+            } else if (blob != NULL) {
+                ok = sqlfs_crc_verify_part(blob, buff, offset, end, chunks[i],
+                                           lengths[i], crcs[i]);
+            } else {
+                continue;
+            }
+            __atomic_add_fetch(&crc.verified, 1, __ATOMIC_RELAXED);
+            if (ok) {
+                continue;
+            }
+            pthread_mutex_lock(&crc.lock);
+            ok = sqlfs_crc_recheck(file_id, chunks[i]);
+            pthread_mutex_unlock(&crc.lock);
+            if (ok) {
+                __atomic_add_fetch(&crc.races, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            printf("sqlfs_crc_verify(): file %lu chunk %lu checksum "
+                   "mismatch\n",
+                   file_id, chunks[i]);
+            __atomic_add_fetch(&crc.mismatches, 1, __ATOMIC_RELAXED);
+            return -EIO;
+        }
+        first += CRC_VERIFY_BATCH;
+    }
+    return OK;
+}
+
+/**
+ * @brief store the checksums the scrubber computed for chunks that had none,
+ * in a short transaction of their own on `conn`
+ *
+ * @return true if they were stored
+ */
+static bool sqlfs_scrub_fill(sqlite3 *conn, sqlite3_stmt *fill_stmt,
+                             uint64_t file_id, const uint64_t *chunks,
+                             const uint32_t *lengths, const uint32_t *sums,
+                             int count) {
+    if (sqlite3_exec(conn, "begin immediate", NULL, NULL, NULL) != SQLITE_OK) {
+        return false;
+    }
+    // a write since the chunks were read updates their checksums under
+    // crc.lock, and those win over ours with "or ignore". Not waiting for
+    // the lock here keeps a writer that holds it from waiting on us.
+    if (pthread_mutex_trylock(&crc.lock) != 0) {
+        sqlite3_exec(conn, "rollback", NULL, NULL, NULL);
+        return false;
+    }
+    int ret = SQLITE_OK;
+    for (int i = 0; i < count && ret == SQLITE_OK; i++) {
+        sqlite3_bind_int64(fill_stmt, 1, file_id);
+        sqlite3_bind_int64(fill_stmt, 2, chunks[i]);
+        sqlite3_bind_int(fill_stmt, 3, lengths[i]);
+        sqlite3_bind_int64(fill_stmt, 4, sums[i]);
+        ret = sqlite3_step(fill_stmt);
+        sqlite3_reset(fill_stmt);
+        ret = ret == SQLITE_DONE ? SQLITE_OK : ret;
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_background_commit(conn);
+    }
+    if (ret != SQLITE_OK) {
+        sqlite3_exec(conn, "rollback", NULL, NULL, NULL);
+    }
+    pthread_mutex_unlock(&crc.lock);
+    return ret == SQLITE_OK;
+}
+
+/**
+ * @brief scrub chunks [`chunk`, `chunk` + SCRUB_BATCH) of `file_id` on
+ * `conn`, then sleep to keep to `rate`
+ *
+ * @return next chunk, 0 when the file is done
+ */
+static uint64_t sqlfs_scrub_batch(sqlite3 *conn, sqlite3_stmt **stmts,
+                                  char *buff, uint64_t file_id,
+                                  uint64_t chunk, uint64_t rate) {
+    sqlite3_stmt *select_stmt = stmts[0];
+    sqlite3_stmt *fill_stmt = stmts[1];
+    uint64_t next = 0;
+    uint64_t fills[SCRUB_BATCH];
+    uint32_t fill_lengths[SCRUB_BATCH];
+    uint32_t fill_sums[SCRUB_BATCH];
+    int count = 0;
+    uint64_t bytes = 0;
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    // a read transaction, so the chunks and their checksums agree; in WAL
+    // mode it does not hold off writers
+    sqlite3_exec(conn, "begin", NULL, NULL, NULL);
+    sqlite3_blob *blob;
+    int ret = sqlfs_content_blob_open(conn, file_id, 0, &blob);
+    uint64_t blob_size = ret == SQLITE_OK ? sqlite3_blob_bytes(blob) : 0;
+    sqlite3_bind_int64(select_stmt, 1, file_id);
+    sqlite3_bind_int64(select_stmt, 2, chunk);
+    sqlite3_bind_int64(select_stmt, 3, chunk + SCRUB_BATCH - 1);
+    int row = sqlite3_step(select_stmt);
+    uint64_t end = MIN(chunk + SCRUB_BATCH,
+                       (blob_size + CRC_CHUNK_SIZE - 1) / CRC_CHUNK_SIZE);
+    for (; ret == SQLITE_OK && chunk < end &&
+           !__atomic_load_n(&scrub.stop, __ATOMIC_RELAXED);
+         chunk++) {
+        int len = MIN(CRC_CHUNK_SIZE, blob_size - chunk * CRC_CHUNK_SIZE);
+        ret = sqlite3_blob_read(blob, buff, len, chunk * CRC_CHUNK_SIZE);
+        if (ret != SQLITE_OK) {
+            break;
+        }
+        uint32_t sum = sqlfs_crc32c(buff, len);
+        while (row == SQLITE_ROW &&
+               (uint64_t)sqlite3_column_int64(select_stmt, 0) < chunk) {
+            row = sqlite3_step(select_stmt);
+        }
+        if (row == SQLITE_ROW &&
+            (uint64_t)sqlite3_column_int64(select_stmt, 0) == chunk &&
+            sqlite3_column_int(select_stmt, 1) == len) {
+            if ((uint32_t)sqlite3_column_int64(select_stmt, 2) != sum) {
+                printf("sqlfs_scrub(): file %lu chunk %lu checksum mismatch\n",
+                       file_id, chunk);
+                __atomic_add_fetch(&scrub.mismatches, 1, __ATOMIC_RELAXED);
+            }
+        } else if (!sqlfs_opts.read_only) {
+            // nothing to verify against yet
+            fills[count] = chunk;
+            fill_lengths[count] = len;
+            fill_sums[count] = sum;
+            count++;
+        }
+        __atomic_add_fetch(&scrub.chunks, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&scrub.bytes, len, __ATOMIC_RELAXED);
+        bytes += len;
+        next = chunk + 1;
+    }
+    sqlite3_reset(select_stmt);
+    sqlite3_blob_close(blob);
+    sqlite3_exec(conn, "commit", NULL, NULL, NULL);
+    if (next * CRC_CHUNK_SIZE >= blob_size) {
+        next = 0;
+    }
+    if (count > 0) {
+        bool filled = ret == SQLITE_OK &&
+                      sqlfs_scrub_fill(conn, fill_stmt, file_id, fills,
+                                       fill_lengths, fill_sums, count);
+        // when skipped, the next pass fills them
+        __atomic_add_fetch(filled ? &scrub.filled : &scrub.skipped, count,
+                           __ATOMIC_RELAXED);
+    }
+    if (rate > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t spent = (now.tv_sec - begin.tv_sec) * 1000000 +
+                        (now.tv_nsec - begin.tv_nsec) / 1000;
+        int64_t budget = (int64_t)bytes * 1000000 / rate;
+        // in steps, so that stopping does not wait for a slow rate
+        while (budget > spent &&
+               !__atomic_load_n(&scrub.stop, __ATOMIC_RELAXED)) {
+            int64_t step = MIN(budget - spent, 100 * 1000);
+            usleep(step);
+            spent += step;
+        }
+    }
+    return next;
+}
+
+void *sqlfs_scrub_thread(void *arg) {
+    uint64_t rate = sqlfs_opts.scrub_rate / sqlfs_opts.scrub_threads;
+    sqlite3 *conn;
+    sqlite3_stmt *stmts[4] = {NULL};
+    const char *sql[4] = {
+        "select chunk, length, crc from chunk_crcs where file_id = ? and "
+        "chunk between ? and ? order by chunk",
+        "insert or ignore into chunk_crcs(file_id, chunk, length, crc) "
+        "values(?, ?, ?, ?)",
+        "select id from files where id > ? and content is not null order by "
+        "id limit 1",
+        "delete from chunk_crcs where file_id not in (select id from files)",
+    };
+    char *buff = malloc(CRC_CHUNK_SIZE);
+    int ret = buff != NULL ? sqlfs_open_conn(sqlfs_opts.db_path, &conn)
+                           : SQLITE_NOMEM;
+    for (int i = 0; i < 4 && ret == SQLITE_OK; i++) {
+        ret = sqlite3_prepare_v2(conn, sql[i], -1, &stmts[i], NULL);
+    }
+    if (ret != SQLITE_OK) {
+        printf("sqlfs_scrub_thread(): %s\n", sqlite3_errstr(ret));
+    }
+    while (ret == SQLITE_OK &&
+           !__atomic_load_n(&scrub.stop, __ATOMIC_RELAXED)) {
+        uint64_t file_id = 0;
+        bool wrapped = false;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&scrub.lock);
+        if (now.tv_sec >= scrub.resume) {
+            sqlite3_bind_int64(stmts[2], 1, scrub.cursor);
+            if (sqlite3_step(stmts[2]) == SQLITE_ROW) {
+                file_id = sqlite3_column_int64(stmts[2], 0);
+                scrub.cursor = file_id;
+            } else {
+                // whoever finishes the pass holds the others off until the
+                // next one is due
+                wrapped = true;
+                scrub.cursor = 0;
+                scrub.passes++;
+                scrub.resume = now.tv_sec + SCRUB_PASS_PAUSE;
+            }
+            sqlite3_reset(stmts[2]);
+        }
+        pthread_mutex_unlock(&scrub.lock);
+        if (wrapped && !sqlfs_opts.read_only) {
+            sqlite3_exec(conn, "begin immediate", NULL, NULL, NULL);
+            sqlite3_step(stmts[3]);
+            sqlite3_reset(stmts[3]);
+            sqlfs_background_commit(conn);
+        }
+        if (file_id == 0) {
+            usleep(100 * 1000);
+            continue;
+        }
+        uint64_t chunk = 0;
+        do {
+            chunk = sqlfs_scrub_batch(conn, stmts, buff, file_id, chunk, rate);
+        } while (chunk != 0 && !__atomic_load_n(&scrub.stop, __ATOMIC_RELAXED));
+        __atomic_add_fetch(&scrub.files, 1, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < 4; i++) {
+        sqlite3_finalize(stmts[i]);
+    }
+    if (ret == SQLITE_OK) {
+        sqlite3_close(conn);
+    }
+    free(buff);
+    return NULL;
+}
+
+void sqlfs_scrub_start() {
+    if (!sqlfs_opts.read_only) {
+        sqlfs_share_writes();
+    }
+    scrub.stop = false;
+    scrub.resume = 0;
+    int threads = MIN(MAX(sqlfs_opts.scrub_threads, 1), MAX_SCRUB_THREADS);
+    sqlfs_opts.scrub_threads = threads;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&scrub.threads[scrub.running], NULL,
+                           sqlfs_scrub_thread, NULL) == 0) {
+            scrub.running++;
+        }
+    }
+}
+
+void sqlfs_scrub_stop() {
+    __atomic_store_n(&scrub.stop, true, __ATOMIC_RELAXED);
+    for (int i = 0; i < scrub.running; i++) {
+        pthread_join(scrub.threads[i], NULL);
+    }
+    scrub.running = 0;
+}
+
+void sqlfs_print_crc_stats(FILE *out) {
+    if (!crc.enabled) {
+        return;
+    }
+    fprintf(out,
+            "checksums: %s verified %lu mismatches %lu races %lu updated "
+            "%lu\n",
+            crc32c_hw ? "sse4.2" : "table", crc.verified, crc.mismatches,
+            crc.races, crc.updated);
+    if (sqlfs_opts.scrub_rate > 0) {
+        fprintf(out,
+                "scrub: threads %d passes %lu files %lu chunks %lu bytes %lu "
+                "mismatches %lu filled %lu skipped %lu\n",
+                sqlfs_opts.scrub_threads, scrub.passes, scrub.files,
+                scrub.chunks, scrub.bytes, scrub.mismatches, scrub.filled,
+                scrub.skipped);
+    }
+}
+
+/*
+ * Full-text content index (--fts).
+ *
+ * The text of files is indexed in the FTS5 table content_fts, whose rowid is
+ * the file id. It is contentless where SQLite can delete from contentless
+ * tables, so the text is not stored twice. A handle that wrote queues its
+ * file when it is released, truncates and last unlinks queue right away. A
+ * background thread with its own connection reindexes the queued files in
+ * batches of FTS_BATCH per transaction. Files with a NUL byte in their first
+ * FTS_SNIFF_SIZE bytes count as binary and, like files over
+ * FTS_MAX_FILE_SIZE, are left out. The config value 'fts' is 2 while
+ * mounted and 1 after a clean unmount; the queue is lost in a crash, so a
+ * mount that finds 2, or turns the index on, reindexes every file first.
+ */
+#define FTS_BATCH 64
+#define FTS_SNIFF_SIZE 8192
+#define FTS_MAX_FILE_SIZE (16 * 1024 * 1024)
+
+struct sqlfs_fts {
+    bool enabled;
+    // reindex every file before the queue
+    bool rebuild;
+    bool running;
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // file ids to reindex, duplicates are dropped per batch
+    uint64_t *queue;
+    uint64_t len;
+    uint64_t cap;
+    uint64_t indexed;
+    uint64_t skipped;
+    uint64_t removed;
+    uint64_t errors;
+};
+
+struct sqlfs_fts fts = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                        .cond = PTHREAD_COND_INITIALIZER};
+
+/**
+ * @brief enable the content index when --fts is given or the database
+ * already has it. Only writable mounts maintain it.
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_fts_open() {
+    sqlite3_stmt *stmt;
+    int state = 0;
+    int ret = sqlite3_prepare_v2(
+        db, "select value from config where key = 'fts'", -1, &stmt, NULL);
+    if (ret != SQLITE_OK) {
+        // images built before the config table existed
+        return SQLITE_OK;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        state = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    if (state != 0) {
+        sqlfs_opts.fts = 1;
+    }
+    if (!sqlfs_opts.fts || sqlfs_opts.read_only) {
+        return SQLITE_OK;
+    }
+    if (shards.count > 0) {
+        printf("sqlfs_fts_open(): sharded databases are not supported\n");
+        return SQLITE_MISUSE;
+    }
+    ret = sqlite3_exec(db,
+                       "create virtual table if not exists content_fts using "
+                       "fts5(body, content='', contentless_delete=1)",
+                       NULL, NULL, &err_msg);
+    if (ret != SQLITE_OK) {
+        // before SQLite 3.43 only an index with its own copy of the text can
+        // delete rows by rowid
+        ret = sqlite3_exec(db,
+                           "create virtual table if not exists content_fts "
+                           "using fts5(body)",
+                           NULL, NULL, &err_msg);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_exec(db,
+                           "insert or replace into config(key, value) "
+                           "values('fts', 2)",
+                           NULL, NULL, &err_msg);
+    }
+    if (ret != SQLITE_OK) {
+        printf("sqlfs_fts_open(): %s\n", sqlite3_errmsg(db));
+        return ret;
+    }
+    fts.rebuild = state != 1;
+    fts.enabled = true;
+    return SQLITE_OK;
+}
+
+/**
+ * @brief queue `file_id` for reindexing
+ */
+void sqlfs_fts_queue(uint64_t file_id) {
+    if (!fts.enabled) {
+        return;
+    }
+    pthread_mutex_lock(&fts.lock);
+    if (fts.len == fts.cap) {
+        uint64_t cap = MAX(fts.cap * 2, 1024);
+        uint64_t *queue = realloc(fts.queue, cap * sizeof(uint64_t));
+        if (queue == NULL) {
+            // the next unmount is unclean, the next mount reindexes it all
+            pthread_mutex_unlock(&fts.lock);
+            __atomic_add_fetch(&fts.errors, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        fts.queue = queue;
+        fts.cap = cap;
+    }
+    fts.queue[fts.len++] = file_id;
+    pthread_cond_signal(&fts.cond);
+    pthread_mutex_unlock(&fts.lock);
+}
+
+static int sqlfs_fts_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief reindex `count` files in one transaction on `conn`, stopping early
+ * after FTS_MAX_FILE_SIZE bytes so other writers do not wait long
+ *
+ * @param done write the number of sorted `ids` handled here
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_fts_index(sqlite3 *conn, sqlite3_stmt **stmts,
+                           uint64_t *ids, int count, char *buff, int *done) {
+    sqlite3_stmt *size_stmt = stmts[0];
+    sqlite3_stmt *delete_stmt = stmts[1];
+    sqlite3_stmt *insert_stmt = stmts[2];
+    uint64_t indexed = 0;
+    uint64_t skipped = 0;
+    uint64_t removed = 0;
+    uint64_t bytes = 0;
+    qsort(ids, count, sizeof(uint64_t), sqlfs_fts_compare);
+    int ret = sqlite3_exec(conn, "begin immediate", NULL, NULL, NULL);
+    int i = 0;
+    for (; i < count && ret == SQLITE_OK && bytes < FTS_MAX_FILE_SIZE; i++) {
+        if (i > 0 && ids[i] == ids[i - 1]) {
+            continue;
+        }
+        sqlite3_bind_int64(delete_stmt, 1, ids[i]);
+        ret = sqlite3_step(delete_stmt);
+        sqlite3_reset(delete_stmt);
+        if (ret != SQLITE_DONE) {
+            break;
+        }
+        ret = SQLITE_OK;
+        sqlite3_bind_int64(size_stmt, 1, ids[i]);
+        if (sqlite3_step(size_stmt) != SQLITE_ROW) {
+            sqlite3_reset(size_stmt);
+            removed++;
+            continue;
+        }
+        uint64_t size = sqlite3_column_int64(size_stmt, 0);
+        sqlite3_reset(size_stmt);
+        sqlite3_blob *blob;
+        if (sqlfs_content_blob_open(conn, ids[i], 0, &blob) != SQLITE_OK) {
+            // no content yet
+            sqlite3_blob_close(blob);
+            skipped++;
+            continue;
+        }
+        size = MIN(size, (uint64_t)sqlite3_blob_bytes(blob));
+        bool text = size <= FTS_MAX_FILE_SIZE;
+        if (text) {
+            ret = sqlite3_blob_read(blob, buff, size, 0);
+            text = ret == SQLITE_OK &&
+                   memchr(buff, 0, MIN(size, FTS_SNIFF_SIZE)) == NULL;
+        }
+        sqlite3_blob_close(blob);
+        if (ret != SQLITE_OK || !text) {
+            skipped += ret == SQLITE_OK;
+            continue;
+        }
+        sqlite3_bind_int64(insert_stmt, 1, ids[i]);
+        sqlite3_bind_text(insert_stmt, 2, buff, size, NULL);
+        ret = sqlite3_step(insert_stmt);
+        sqlite3_reset(insert_stmt);
+        ret = ret == SQLITE_DONE ? SQLITE_OK : ret;
+        indexed++;
+        bytes += size;
+    }
+    *done = i;
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_background_commit(conn);
+    }
+    if (ret != SQLITE_OK) {
+        printf("sqlfs_fts_index(): %s\n", sqlite3_errmsg(conn));
+        sqlite3_exec(conn, "rollback", NULL, NULL, NULL);
+        return ret;
+    }
+    __atomic_add_fetch(&fts.indexed, indexed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&fts.skipped, skipped, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&fts.removed, removed, __ATOMIC_RELAXED);
+    return SQLITE_OK;
+}
+
+void *sqlfs_fts_thread(void *arg) {
+    sqlite3 *conn;
+    sqlite3_stmt *stmts[5] = {NULL};
+    const char *sql[5] = {
+        "select size from files where id = ?",
+        "delete from content_fts where rowid = ?",
+        "insert into content_fts(rowid, body) values(?, ?)",
+        "select id from files where id > ? order by id limit ?",
+        "delete from content_fts where rowid not in (select id from files)",
+    };
+    char *buff = malloc(FTS_MAX_FILE_SIZE);
+    int ret = buff != NULL ? sqlfs_open_conn(sqlfs_opts.db_path, &conn)
+                           : SQLITE_NOMEM;
+    for (int i = 0; i < 5 && ret == SQLITE_OK; i++) {
+        ret = sqlite3_prepare_v2(conn, sql[i], -1, &stmts[i], NULL);
+    }
+    uint64_t cursor = 0;
+    uint64_t ids[FTS_BATCH];
+    while (ret == SQLITE_OK) {
+        int count = 0;
+        pthread_mutex_lock(&fts.lock);
+        while (!fts.rebuild && fts.len == 0 && !fts.stop) {
+            pthread_cond_wait(&fts.cond, &fts.lock);
+        }
+        // the queue is drained before stopping, a rebuild is not
+        for (; count < FTS_BATCH && fts.len > 0; count++) {
+            ids[count] = fts.queue[--fts.len];
+        }
+        bool rebuild = count == 0 && fts.rebuild && !fts.stop;
+        pthread_mutex_unlock(&fts.lock);
+        if (count == 0 && !rebuild) {
+            break;
+        }
+        if (rebuild) {
+            sqlite3_bind_int64(stmts[3], 1, cursor);
+            sqlite3_bind_int(stmts[3], 2, FTS_BATCH);
+            while (sqlite3_step(stmts[3]) == SQLITE_ROW) {
+                ids[count++] = sqlite3_column_int64(stmts[3], 0);
+            }
+            sqlite3_reset(stmts[3]);
+            if (count == 0) {
+                // files deleted while nothing was watching
+                if (sqlite3_step(stmts[4]) != SQLITE_DONE) {
+                    __atomic_add_fetch(&fts.errors, 1, __ATOMIC_RELAXED);
+                }
+                sqlite3_reset(stmts[4]);
+                pthread_mutex_lock(&fts.lock);
+                fts.rebuild = false;
+                pthread_mutex_unlock(&fts.lock);
+                continue;
+            }
+        }
+        int done = count;
+        if (sqlfs_fts_index(conn, stmts, ids, count, buff, &done) !=
+            SQLITE_OK) {
+            // lost, the unmount is not clean and the next mount rebuilds
+            __atomic_add_fetch(&fts.errors, 1, __ATOMIC_RELAXED);
+            done = count;
+        }
+        if (rebuild) {
+            cursor = ids[done - 1];
+            continue;
+        }
+        for (int i = done; i < count; i++) {
+            sqlfs_fts_queue(ids[i]);
+        }
+    }
+    if (ret != SQLITE_OK) {
+        printf("sqlfs_fts_thread(): %s\n", sqlite3_errstr(ret));
+        __atomic_add_fetch(&fts.errors, 1, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < 5; i++) {
+        sqlite3_finalize(stmts[i]);
+    }
+    if (buff != NULL) {
+        sqlite3_close(conn);
+    }
+    free(buff);
+    return NULL;
+}
+
+void sqlfs_fts_start() {
+    sqlfs_share_writes();
+    fts.stop = false;
+    fts.running =
+        pthread_create(&fts.thread, NULL, sqlfs_fts_thread, NULL) == 0;
+}
+
+/**
+ * @brief index what is queued, then mark the index clean unless something
+ * was lost
+ */
+void sqlfs_fts_stop() {
+    if (!fts.running) {
+        return;
+    }
+    pthread_mutex_lock(&fts.lock);
+    fts.stop = true;
+    pthread_cond_signal(&fts.cond);
+    pthread_mutex_unlock(&fts.lock);
+    pthread_join(fts.thread, NULL);
+    fts.running = false;
+    if (!fts.rebuild && fts.len == 0 && fts.errors == 0 &&
+        sqlite3_exec(db, "update config set value = 1 where key = 'fts'",
+                     NULL, NULL, &err_msg) != SQLITE_OK) {
+        printf("sqlfs_fts_stop(): %s\n", sqlite3_errmsg(db));
+    }
+}
+
+void sqlfs_print_fts_stats(FILE *out) {
+    if (!fts.enabled) {
+        return;
+    }
+    pthread_mutex_lock(&fts.lock);
+    uint64_t queued = fts.len;
+    bool rebuild = fts.rebuild;
+    pthread_mutex_unlock(&fts.lock);
+    fprintf(out,
+            "fts: queued %lu%s indexed %lu skipped %lu removed %lu errors "
+            "%lu\n",
+            queued, rebuild ? " rebuilding" : "", fts.indexed, fts.skipped,
+            fts.removed, fts.errors);
+}
+
+/*
+ * Deferred counter updates.
+ *
+ * A mutation that runs in a change savepoint (see sqlfs_change_begin()) can
+ * still be rolled back after it returned, when its journal record or Merkle
+ * hashes cannot be written. The in-memory counters it updated, capacity and
+ * directory usage, are not part of the savepoint, so while one is open the
+ * updates of the thread are queued here and only applied once the savepoint
+ * is released, or dropped when it is rolled back.
+ */
+enum {
+    DEFER_CAPACITY,
+    DEFER_USAGE_ADD,
+    DEFER_USAGE_REMOVE,
+    DEFER_USAGE_RENAME,
+    DEFER_USAGE_RESIZE,
+};
+
+struct sqlfs_deferred {
+    int op;
+    char *path;
+    char *target;
+    mode_t mode;
+    uint64_t file_id;
+    int64_t bytes;
+    int64_t inodes;
+};
+
+struct sqlfs_deferred_list {
+    // a savepoint of this thread is open
+    bool active;
+    int count;
+    int cap;
+    struct sqlfs_deferred *items;
+};
+
+__thread struct sqlfs_deferred_list deferred;
+
+/**
+ * @brief queue a counter update while a savepoint is open
+ *
+ * @return false when there is none and the caller applies it now
+ */
+static bool sqlfs_defer(int op, const char *path, const char *target,
+                        mode_t mode, uint64_t file_id, int64_t bytes,
+                        int64_t inodes) {
+    if (!deferred.active) {
+        return false;
+    }
+    if (deferred.count == deferred.cap) {
+        int cap = deferred.cap == 0 ? 8 : deferred.cap * 2;
+        struct sqlfs_deferred *items =
+            realloc(deferred.items, cap * sizeof(struct sqlfs_deferred));
+        if (items == NULL) {
+            // applied right away, as without a savepoint
+            return false;
+        }
+        deferred.items = items;
+        deferred.cap = cap;
+    }
+    struct sqlfs_deferred *item = &deferred.items[deferred.count];
+    item->path = path != NULL ? strdup(path) : NULL;
+    item->target = target != NULL ? strdup(target) : NULL;
+    if ((path != NULL && item->path == NULL) ||
+        (target != NULL && item->target == NULL)) {
+        free(item->path);
+        free(item->target);
+        return false;
+    }
+    item->op = op;
+    item->mode = mode;
+    item->file_id = file_id;
+    item->bytes = bytes;
+    item->inodes = inodes;
+    deferred.count++;
+    return true;
+}
+
+/*
+ * Capacity (statfs).
+ *
+ * The bytes of all files and the number of entries are counted once at mount
+ * and then kept up to date by the mutations, so statfs, which some tools call
+ * for every file they write, never scans `paths`. Only after --coherence has
+ * seen a commit of another process are they counted again, at the next
+ * refresh. The block counts come from the database itself: its size and
+ * free-list pages, with those of the shards, and the free space of the host
+ * filesystem it can grow into. These are read at most every
+ * STATFS_REFRESH_MS and reused in between. Used blocks are the bytes of all
+ * files plus the page overhead, the pages in use beyond those bytes at the
+ * last refresh, so writes show up in between refreshes too.
+ */
+#define STATFS_REFRESH_MS 1000
+#define STATFS_NAME_MAX 255
+
+struct sqlfs_capacity {
+    int64_t bytes;
+    int64_t inodes;
+    // another process committed, count again at the next refresh
+    bool recount;
+    pthread_mutex_t lock;
+    sqlite3_stmt *count_stmt;
+    sqlite3_stmt *size_stmt;
+    // pages of the database and shards, in bytes
+    uint64_t db_bytes;
+    uint64_t free_bytes;
+    // pages in use that do not hold file bytes: btree, metadata, indexes
+    uint64_t overhead;
+    uint64_t page_size;
+    // host filesystem of the database
+    uint64_t host_free;
+    uint64_t host_avail;
+    uint64_t host_ffree;
+    struct timespec refreshed;
+    uint64_t calls;
+    uint64_t refreshes;
+};
+
+struct sqlfs_capacity capacity = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * @brief count the files and entries of the whole tree
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_capacity_count() {
+    sqlite3_stmt *stmt = capacity.count_stmt;
+    int ret = sqlite3_step(stmt) == SQLITE_ROW ? SQLITE_OK : SQLITE_ERROR;
+    if (ret == SQLITE_OK) {
+        __atomic_store_n(&capacity.inodes, sqlite3_column_int64(stmt, 0),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&capacity.bytes, sqlite3_column_int64(stmt, 1),
+                         __ATOMIC_RELAXED);
+    }
+    sqlite3_reset(stmt);
+    return ret;
+}
+
+/**
+ * @brief count the files and entries once
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_capacity_open() {
+    int ret = sqlite3_prepare_v2(db,
+                                 "select (select count(*) from paths), "
+                                 "(select ifnull(sum(size), 0) from files)",
+                                 -1, &capacity.count_stmt, NULL);
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_capacity_count();
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(db, "select size from files where id = ?",
+                                 -1, &capacity.size_stmt, NULL);
+    }
+    if (ret != SQLITE_OK) {
+        printf("sqlfs_capacity_open(): %s\n", sqlite3_errmsg(db));
+    }
+    return ret;
+}
+
+/**
+ * @brief another process committed changes the counts do not include
+ */
+void sqlfs_capacity_outside_commit() {
+    __atomic_store_n(&capacity.recount, true, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief add to the bytes of all files and the number of entries
+ */
+void sqlfs_capacity_charge(int64_t bytes, int64_t inodes) {
+    if (sqlfs_defer(DEFER_CAPACITY, NULL, NULL, 0, 0, bytes, inodes)) {
+        return;
+    }
+    __atomic_add_fetch(&capacity.bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&capacity.inodes, inodes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief size of `file_id`, 0 when it does not exist
+ */
+int64_t sqlfs_file_size(uint64_t file_id) {
+    pthread_mutex_lock(&capacity.lock);
+    sqlite3_bind_int64(capacity.size_stmt, 1, file_id);
+    int64_t size = sqlite3_step(capacity.size_stmt) == SQLITE_ROW
+                       ? sqlite3_column_int64(capacity.size_stmt, 0)
+                       : 0;
+    sqlite3_reset(capacity.size_stmt);
+    pthread_mutex_unlock(&capacity.lock);
+    return size;
+}
+
+/**
+ * @brief read the database and host sizes again. The caller holds
+ * capacity.lock.
+ */
+static void sqlfs_capacity_refresh() {
+    uint64_t page_size = sqlfs_pragma_int(db, "page_size");
+    uint64_t db_bytes = sqlfs_pragma_int(db, "page_count") * page_size;
+    uint64_t free_bytes = sqlfs_pragma_int(db, "freelist_count") * page_size;
+    for (int i = 0; i < shards.count; i++) {
+        sqlite3 *conn = shards.shard[i].db;
+        uint64_t size = sqlfs_pragma_int(conn, "page_size");
+        db_bytes += sqlfs_pragma_int(conn, "page_count") * size;
+        free_bytes += sqlfs_pragma_int(conn, "freelist_count") * size;
+    }
+    if (__atomic_exchange_n(&capacity.recount, false, __ATOMIC_RELAXED) &&
+        sqlfs_capacity_count() != SQLITE_OK) {
+        __atomic_store_n(&capacity.recount, true, __ATOMIC_RELAXED);
+    }
+    capacity.page_size = page_size > 0 ? page_size : 4096;
+    capacity.db_bytes = db_bytes;
+    capacity.free_bytes = MIN(free_bytes, db_bytes);
+    int64_t bytes = __atomic_load_n(&capacity.bytes, __ATOMIC_RELAXED);
+    uint64_t used = capacity.db_bytes - capacity.free_bytes;
+    capacity.overhead = (int64_t)used > bytes ? used - MAX(bytes, 0) : 0;
+    struct statvfs host;
+    if (statvfs(sqlfs_opts.db_path, &host) == 0) {
+        capacity.host_free = (uint64_t)host.f_bfree * host.f_frsize;
+        capacity.host_avail = (uint64_t)host.f_bavail * host.f_frsize;
+        capacity.host_ffree = host.f_ffree;
+    }
+    capacity.refreshes++;
+}
+
+int sqlfs_statfs(const char *path, struct statvfs *st) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&capacity.lock);
+    int64_t age = (now.tv_sec - capacity.refreshed.tv_sec) * 1000 +
+                  (now.tv_nsec - capacity.refreshed.tv_nsec) / 1000000;
+    if (capacity.refreshes == 0 || age >= STATFS_REFRESH_MS) {
+        sqlfs_capacity_refresh();
+        capacity.refreshed = now;
+    }
+    capacity.calls++;
+    uint64_t size = capacity.page_size;
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = size;
+    st->f_frsize = size;
+    // the database can grow into what is free on the host
+    uint64_t total = capacity.db_bytes + capacity.host_free;
+    uint64_t used =
+        MAX(__atomic_load_n(&capacity.bytes, __ATOMIC_RELAXED), 0) +
+        capacity.overhead;
+    uint64_t free = total > used ? total - used : 0;
+    // space the host keeps for root only
+    uint64_t reserved = capacity.host_free - MIN(capacity.host_avail,
+                                                 capacity.host_free);
+    st->f_blocks = total / size;
+    st->f_bfree = free / size;
+    st->f_bavail = (free > reserved ? free - reserved : 0) / size;
+    // an entry is a row, not a host inode: at most one per free page
+    st->f_ffree = st->f_bavail;
+    st->f_favail = st->f_bavail;
+    pthread_mutex_unlock(&capacity.lock);
+    st->f_files = st->f_ffree +
+                  MAX(__atomic_load_n(&capacity.inodes, __ATOMIC_RELAXED), 0) +
+                  1;
+    st->f_namemax = STATFS_NAME_MAX;
+    st->f_flag = sqlfs_opts.read_only ? ST_RDONLY : 0;
+    return OK;
+}
+
+void sqlfs_print_capacity_stats(FILE *out) {
+    pthread_mutex_lock(&capacity.lock);
+    fprintf(out,
+            "statfs: calls %lu refreshes %lu bytes %ld inodes %ld db %lu free "
+            "%lu overhead %lu host free %lu\n",
+            capacity.calls, capacity.refreshes,
+            __atomic_load_n(&capacity.bytes, __ATOMIC_RELAXED),
+            __atomic_load_n(&capacity.inodes, __ATOMIC_RELAXED),
+            capacity.db_bytes, capacity.free_bytes, capacity.overhead,
+            capacity.host_free);
+    pthread_mutex_unlock(&capacity.lock);
+}
+
+/*
+ * Recursive directory usage (--dir-usage).
+ *
+ * Every directory has the bytes (rbytes), non-directories (rfiles) and
+ * entries (rinodes) below it, kept in memory and updated along the chain of
+ * ancestors by each mutation, so that reading them is one hash lookup. A
+ * hard link counts once per name. Only the directories touched since the
+ * mount are written to dir_usage, in one transaction at a clean unmount.
+ * Like 'fts', the config value 'usage' is 2 while mounted and 1 after a
+ * clean unmount; a mount that finds 2, or turns the counters on, counts the
+ * whole tree once instead of loading dir_usage. The counters miss what other
+ * processes commit, so once --coherence sees such a commit the value is left
+ * at 2. Read with getxattr as
+ * user.sqlfs.rbytes, user.sqlfs.rfiles and user.sqlfs.rinodes.
+ */
+#define USAGE_XATTR_PREFIX "user.sqlfs."
+
+struct sqlfs_usage_node {
+    struct sqlfs_usage_node *next;
+    int64_t rbytes;
+    int64_t rfiles;
+    int64_t rinodes;
+    // changed since dir_usage was loaded
+    bool dirty;
+    char path[];
+};
+
+struct sqlfs_usage {
+    bool enabled;
+    pthread_mutex_t lock;
+    struct sqlfs_usage_node **buckets;
+    uint64_t bucket_count;
+    uint64_t count;
+    // paths of a file, whose ancestors a size change is charged to
+    sqlite3_stmt *paths_stmt;
+    sqlite3_stmt *forget_stmt;
+    uint64_t updates;
+    // another process committed, see sqlfs_usage_outside_commit()
+    bool stale;
+};
+
+struct sqlfs_usage usage = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static struct sqlfs_usage_node **sqlfs_usage_slot(const char *path,
+                                                  size_t len) {
+    struct sqlfs_usage_node **slot =
+        &usage.buckets[sqlfs_hash_bytes(path, len) % usage.bucket_count];
+    while (*slot != NULL &&
+           (strncmp((*slot)->path, path, len) != 0 ||
+            (*slot)->path[len] != '\0')) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+/**
+ * @brief the node of directory `path`, created with zero counts when
+ * missing. The caller holds usage.lock.
+ *
+ * @return NULL when out of memory
+ */
+static struct sqlfs_usage_node *sqlfs_usage_node(const char *path) {
+    size_t len = strlen(path);
+    struct sqlfs_usage_node **slot = sqlfs_usage_slot(path, len);
+    if (*slot != NULL) {
+        return *slot;
+    }
+    if (usage.count >= usage.bucket_count) {
+        uint64_t count = usage.bucket_count * 2;
+        struct sqlfs_usage_node **buckets =
+            calloc(count, sizeof(struct sqlfs_usage_node *));
+        if (buckets != NULL) {
+            for (uint64_t i = 0; i < usage.bucket_count; i++) {
+                while (usage.buckets[i] != NULL) {
+                    struct sqlfs_usage_node *node = usage.buckets[i];
+                    usage.buckets[i] = node->next;
+                    uint64_t b =
+                        sqlfs_hash_bytes(node->path, strlen(node->path)) %
+                        count;
+                    node->next = buckets[b];
+                    buckets[b] = node;
+                }
+            }
+            free(usage.buckets);
+            usage.buckets = buckets;
+            usage.bucket_count = count;
+            slot = sqlfs_usage_slot(path, len);
+        }
+    }
+    struct sqlfs_usage_node *node =
+        calloc(1, sizeof(struct sqlfs_usage_node) + len + 1);
+    if (node != NULL) {
+        memcpy(node->path, path, len + 1);
+        *slot = node;
+        usage.count++;
+    }
+    return node;
+}
+
+/**
+ * @brief add to the counts of every ancestor of `path`. The caller holds
+ * usage.lock.
+ */
+static void sqlfs_usage_charge(const char *path, int64_t bytes, int64_t files,
+                               int64_t inodes) {
+    size_t len = strlen(path);
+    while (len > 1) {
+        while (len > 0 && path[len - 1] != '/') {
+            len--;
+        }
+        // the parent, without its trailing slash unless it is the root
+        len = len > 1 ? len - 1 : 1;
+        struct sqlfs_usage_node *node = *sqlfs_usage_slot(path, len);
+        if (node != NULL) {
+            node->rbytes += bytes;
+            node->rfiles += files;
+            node->rinodes += inodes;
+            node->dirty = true;
+        }
+    }
+    usage.updates++;
+}
+
+/**
+ * @brief count a new entry `path` of `bytes`
+ */
+void sqlfs_usage_add(const char *path, mode_t mode, int64_t bytes) {
+    if (!usage.enabled ||
+        sqlfs_defer(DEFER_USAGE_ADD, path, NULL, mode, 0, bytes, 0)) {
+        return;
+    }
+    pthread_mutex_lock(&usage.lock);
+    if (S_ISDIR(mode)) {
+        struct sqlfs_usage_node *node = sqlfs_usage_node(path);
+        if (node != NULL) {
+            node->dirty = true;
+        }
+    }
+    sqlfs_usage_charge(path, bytes, !S_ISDIR(mode), 1);
+    pthread_mutex_unlock(&usage.lock);
+}
+
+/**
+ * @brief uncount entry `path` of `bytes`, an empty directory drops its row
+ */
+void sqlfs_usage_remove(const char *path, mode_t mode, int64_t bytes) {
+    if (!usage.enabled ||
+        sqlfs_defer(DEFER_USAGE_REMOVE, path, NULL, mode, 0, bytes, 0)) {
+        return;
+    }
+    pthread_mutex_lock(&usage.lock);
+    if (S_ISDIR(mode)) {
+        struct sqlfs_usage_node **slot = sqlfs_usage_slot(path, strlen(path));
+        struct sqlfs_usage_node *node = *slot;
+        if (node != NULL) {
+            *slot = node->next;
+            usage.count--;
+            free(node);
+        }
+        if (!sqlfs_opts.read_only) {
+            sqlite3_bind_text(usage.forget_stmt, 1, path, -1, NULL);
+            sqlite3_step(usage.forget_stmt);
+            sqlite3_reset(usage.forget_stmt);
+        }
+    }
+    sqlfs_usage_charge(path, -bytes, -!S_ISDIR(mode), -1);
+    pthread_mutex_unlock(&usage.lock);
+}
+
+/**
+ * @brief move entry `old_path` of `bytes` to `new_path`, with the subtree of
+ * a directory
+ */
+void sqlfs_usage_rename(const char *old_path, const char *new_path,
+                        mode_t mode, int64_t bytes) {
+    if (!usage.enabled || sqlfs_defer(DEFER_USAGE_RENAME, old_path, new_path,
+                                      mode, 0, bytes, 0)) {
+        return;
+    }
+    pthread_mutex_lock(&usage.lock);
+    int64_t files = !S_ISDIR(mode);
+    int64_t inodes = 1;
+    size_t old_len = strlen(old_path);
+    size_t new_len = strlen(new_path);
+    if (S_ISDIR(mode)) {
+        struct sqlfs_usage_node *moved = NULL;
+        for (uint64_t i = 0; i < usage.bucket_count; i++) {
+            struct sqlfs_usage_node **slot = &usage.buckets[i];
+            while (*slot != NULL) {
+                struct sqlfs_usage_node *node = *slot;
+                if (strncmp(node->path, old_path, old_len) != 0 ||
+                    (node->path[old_len] != '\0' &&
+                     node->path[old_len] != '/')) {
+                    slot = &node->next;
+                    continue;
+                }
+                *slot = node->next;
+                node->next = moved;
+                moved = node;
+                usage.count--;
+            }
+        }
+        while (moved != NULL) {
+            struct sqlfs_usage_node *node = moved;
+            moved = node->next;
+            char *path = malloc(new_len + strlen(node->path + old_len) + 1);
+            struct sqlfs_usage_node *copy = NULL;
+            if (path != NULL) {
+                strcat(strcpy(path, new_path), node->path + old_len);
+                copy = sqlfs_usage_node(path);
+                free(path);
+            }
+            if (copy != NULL) {
+                copy->rbytes = node->rbytes;
+                copy->rfiles = node->rfiles;
+                copy->rinodes = node->rinodes;
+                copy->dirty = true;
+            }
+            if (strcmp(node->path, old_path) == 0) {
+                bytes = node->rbytes;
+                files = node->rfiles;
+                inodes = node->rinodes + 1;
+            }
+            if (!sqlfs_opts.read_only) {
+                sqlite3_bind_text(usage.forget_stmt, 1, node->path, -1, NULL);
+                sqlite3_step(usage.forget_stmt);
+                sqlite3_reset(usage.forget_stmt);
+            }
+            free(node);
+        }
+    }
+    sqlfs_usage_charge(old_path, -bytes, -files, -inodes);
+    sqlfs_usage_charge(new_path, bytes, files, inodes);
+    pthread_mutex_unlock(&usage.lock);
+}
+
+/**
+ * @brief charge a size change of `file_id` to the ancestors of all its names
+ */
+void sqlfs_usage_resize(uint64_t file_id, int64_t bytes) {
+    if (!usage.enabled || bytes == 0 ||
+        sqlfs_defer(DEFER_USAGE_RESIZE, NULL, NULL, 0, file_id, bytes, 0)) {
+        return;
+    }
+    pthread_mutex_lock(&usage.lock);
+    sqlite3_bind_int64(usage.paths_stmt, 1, file_id);
+    while (sqlite3_step(usage.paths_stmt) == SQLITE_ROW) {
+        sqlfs_usage_charge(
+            (const char *)sqlite3_column_text(usage.paths_stmt, 0), bytes, 0,
+            0);
+    }
+    sqlite3_reset(usage.paths_stmt);
+    pthread_mutex_unlock(&usage.lock);
+}
+
+/**
+ * @brief fill the counters from dir_usage after a clean unmount, otherwise
+ * count the whole tree in path order, which puts parents before children
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_usage_load(bool clean) {
+    sqlite3_stmt *stmt;
+    int ret = sqlite3_prepare_v2(
+        db,
+        clean ? "select path, rbytes, rfiles, rinodes from dir_usage"
+              : "select p.path, p.mode, ifnull(f.size, 0) from paths p left "
+                "join files f on p.file_id = f.id order by p.path",
+        -1, &stmt, NULL);
+    if (ret != SQLITE_OK) {
+        return ret;
+    }
+    pthread_mutex_lock(&usage.lock);
+    struct sqlfs_usage_node *root = sqlfs_usage_node("/");
+    if (root != NULL) {
+        root->dirty = !clean;
+    }
+    while (root != NULL && (ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *path = (const char *)sqlite3_column_text(stmt, 0);
+        if (clean) {
+            struct sqlfs_usage_node *node = sqlfs_usage_node(path);
+            if (node == NULL) {
+                break;
+            }
+            node->rbytes = sqlite3_column_int64(stmt, 1);
+            node->rfiles = sqlite3_column_int64(stmt, 2);
+            node->rinodes = sqlite3_column_int64(stmt, 3);
+            continue;
+        }
+        mode_t mode = sqlite3_column_int(stmt, 1);
+        if (S_ISDIR(mode)) {
+            struct sqlfs_usage_node *node = sqlfs_usage_node(path);
+            if (node == NULL) {
+                break;
+            }
+            node->dirty = true;
+        }
+        sqlfs_usage_charge(path,
+                           S_ISDIR(mode) ? 0 : sqlite3_column_int64(stmt, 2),
+                           !S_ISDIR(mode), 1);
+    }
+    usage.updates = 0;
+    pthread_mutex_unlock(&usage.lock);
+    sqlite3_finalize(stmt);
+    return ret == SQLITE_DONE ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+/**
+ * @brief enable the counters when --dir-usage is given or the database
+ * already keeps them
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_usage_open() {
+    sqlite3_stmt *stmt;
+    int state = 0;
+    int ret = sqlite3_prepare_v2(
+        db, "select value from config where key = 'usage'", -1, &stmt, NULL);
+    if (ret != SQLITE_OK) {
+        // images built before the config table existed
+        return SQLITE_OK;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        state = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    if (state != 0) {
+        sqlfs_opts.dir_usage = 1;
+    }
+    if (!sqlfs_opts.dir_usage) {
+        return SQLITE_OK;
+    }
+    usage.bucket_count = 1024;
+    usage.buckets = calloc(usage.bucket_count,
+                           sizeof(struct sqlfs_usage_node *));
+    ret = usage.buckets != NULL ? SQLITE_OK : SQLITE_NOMEM;
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_usage_load(state == 1);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(db, "select path from paths where file_id = ?",
+                                 -1, &usage.paths_stmt, NULL);
+    }
+    if (ret == SQLITE_OK && !sqlfs_opts.read_only) {
+        ret = sqlite3_prepare_v2(db, "delete from dir_usage where path = ?",
+                                 -1, &usage.forget_stmt, NULL);
+    }
+    if (ret == SQLITE_OK && !sqlfs_opts.read_only) {
+        ret = sqlite3_exec(db,
+                           "insert or replace into config(key, value) "
+                           "values('usage', 2)",
+                           NULL, NULL, &err_msg);
+    }
+    if (ret != SQLITE_OK) {
+        printf("sqlfs_usage_open(): %s\n", sqlite3_errstr(ret));
+    }
+    usage.enabled = ret == SQLITE_OK;
+    return ret;
+}
+
+/**
+ * @brief another process committed changes the counters do not include, so
+ * the next mount has to count again
+ */
+void sqlfs_usage_outside_commit() {
+    __atomic_store_n(&usage.stale, true, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief write the changed counters and mark them clean
+ */
+void sqlfs_usage_close() {
+    if (!usage.enabled || sqlfs_opts.read_only) {
+        return;
+    }
+    if (__atomic_load_n(&usage.stale, __ATOMIC_RELAXED)) {
+        // left at 2, the next mount counts again
+        return;
+    }
+    sqlite3_stmt *stmt = NULL;
+    int ret = sqlite3_exec(db, "begin immediate", NULL, NULL, NULL);
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(db,
+                                 "insert or replace into dir_usage(path, "
+                                 "rbytes, rfiles, rinodes) values(?, ?, ?, ?)",
+                                 -1, &stmt, NULL);
+    }
+    for (uint64_t i = 0; i < usage.bucket_count && ret == SQLITE_OK; i++) {
+        for (struct sqlfs_usage_node *node = usage.buckets[i];
+             node != NULL && ret == SQLITE_OK; node = node->next) {
+            if (!node->dirty) {
+                continue;
+            }
+            sqlite3_bind_text(stmt, 1, node->path, -1, NULL);
+            sqlite3_bind_int64(stmt, 2, node->rbytes);
+            sqlite3_bind_int64(stmt, 3, node->rfiles);
+            sqlite3_bind_int64(stmt, 4, node->rinodes);
+            ret = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+            sqlite3_reset(stmt);
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_exec(db,
+                           "update config set value = 1 where key = 'usage'; "
+                           "commit",
+                           NULL, NULL, NULL);
+    }
+    if (ret != SQLITE_OK) {
+        // left at 2, the next mount counts again
+        printf("sqlfs_usage_close(): %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "rollback", NULL, NULL, NULL);
+    }
+}
+
+/**
+ * @brief user.sqlfs.rbytes, rfiles and rinodes of a directory
+ */
+int sqlfs_getxattr(const char *path, const char *name, char *value,
+                   size_t size) {
+    if (!usage.enabled ||
+        strncmp(name, USAGE_XATTR_PREFIX, strlen(USAGE_XATTR_PREFIX)) != 0) {
+        return -ENODATA;
+    }
+    name += strlen(USAGE_XATTR_PREFIX);
+    int64_t count = -1;
+    pthread_mutex_lock(&usage.lock);
+    struct sqlfs_usage_node *node = *sqlfs_usage_slot(path, strlen(path));
+    if (node != NULL) {
+        count = strcmp(name, "rbytes") == 0    ? node->rbytes
+                : strcmp(name, "rfiles") == 0  ? node->rfiles
+                : strcmp(name, "rinodes") == 0 ? node->rinodes
+                                               : -1;
+    }
+    pthread_mutex_unlock(&usage.lock);
+    if (node == NULL || count < 0) {
+        return -ENODATA;
+    }
+    char text[32];
+    int len = snprintf(text, sizeof(text), "%ld", count);
+    if (size == 0) {
+        return len;
+    }
+    if (size < (size_t)len) {
+        return -ERANGE;
+    }
+    memcpy(value, text, len);
+    return len;
+}
+
+int sqlfs_listxattr(const char *path, char *list, size_t size) {
+    static const char names[] = USAGE_XATTR_PREFIX
+        "rbytes\0" USAGE_XATTR_PREFIX "rfiles\0" USAGE_XATTR_PREFIX "rinodes";
+    if (!usage.enabled) {
+        return 0;
+    }
+    pthread_mutex_lock(&usage.lock);
+    bool dir = *sqlfs_usage_slot(path, strlen(path)) != NULL;
+    pthread_mutex_unlock(&usage.lock);
+    if (!dir) {
+        return 0;
+    }
+    if (size == 0) {
+        return sizeof(names);
+    }
+    if (size < sizeof(names)) {
+        return -ERANGE;
+    }
+    memcpy(list, names, sizeof(names));
+    return sizeof(names);
+}
+
+void sqlfs_print_usage_stats(FILE *out) {
+    if (!usage.enabled) {
+        return;
+    }
+    pthread_mutex_lock(&usage.lock);
+    struct sqlfs_usage_node *root = *sqlfs_usage_slot("/", 1);
+    fprintf(out,
+            "dir-usage: directories %lu updates %lu rbytes %ld rfiles %ld "
+            "rinodes %ld\n",
+            usage.count, usage.updates, root != NULL ? root->rbytes : 0,
+            root != NULL ? root->rfiles : 0, root != NULL ? root->rinodes : 0);
+    pthread_mutex_unlock(&usage.lock);
+}
+
+/*
+ * Access heatmap (--warmup).
+ *
+ * Path lookups and content chunk reads are counted in a fixed size table while
+ * running. The table is saved to `heatmap` on unmount and loaded again, with
+ * halved hits, on the next mount. A background thread then walks the saved
+ * heatmap in (kind, id, chunk) order, which follows the rowid order of the
+ * tables and so roughly the on-disk order, and reads those pages through its
+ * own connection to bring them into the OS page cache. Chunk indices depend on
+ * --chunk-size, which is saved with them; after a change only the path entries
+ * are loaded.
+ */
+#define HEAT_PATH 1
+#define HEAT_CHUNK 2
+#define HEAT_SLOTS (1 << 20)
+
+struct sqlfs_heat_slot {
+    uint64_t id;
+    uint32_t chunk;
+    uint32_t kind;
+    uint64_t hits;
+};
+
+struct sqlfs_heat {
+    struct sqlfs_heat_slot *slots;
+    uint32_t count;
+    pthread_mutex_t lock;
+    pthread_t warmup_thread;
+    bool warmup_running;
+    volatile bool stop;
+} heat = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+void sqlfs_heat_add(uint32_t kind, uint64_t id, uint32_t chunk,
+                    uint64_t hits) {
+    if (!sqlfs_opts.warmup || heat.slots == NULL) {
+        return;
+    }
+    uint32_t mask = HEAT_SLOTS - 1;
+    uint32_t i = sqlfs_hash_u64(id * 31 + chunk * 7 + kind) & mask;
+    pthread_mutex_lock(&heat.lock);
+    while (heat.slots[i].kind != 0) {
+        struct sqlfs_heat_slot *s = &heat.slots[i];
+        if (s->kind == kind && s->id == id && s->chunk == chunk) {
+            s->hits += hits;
+            pthread_mutex_unlock(&heat.lock);
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    // once full, only the entries already tracked keep counting
+    if (heat.count * 4 < HEAT_SLOTS * 3) {
+        heat.slots[i].kind = kind;
+        heat.slots[i].id = id;
+        heat.slots[i].chunk = chunk;
+        heat.slots[i].hits = hits;
+        heat.count++;
+    }
+    pthread_mutex_unlock(&heat.lock);
+}
+
+void sqlfs_heat_add_range(uint64_t file_id, off_t offset, size_t size) {
+    if (!sqlfs_opts.warmup || size == 0) {
+        return;
+    }
+    for (uint64_t chunk = offset / sqlfs_opts.chunk_size;
+         chunk <= (offset + size - 1) / sqlfs_opts.chunk_size; chunk++) {
+        sqlfs_heat_add(HEAT_CHUNK, file_id, chunk, 1);
+    }
+}
+
+/**
+ * @brief load the heatmap saved by the previous mount, with halved hits so
+ * entries that are no longer accessed fade out
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_heat_load() {
+    heat.slots = calloc(HEAT_SLOTS, sizeof(struct sqlfs_heat_slot));
+    if (heat.slots == NULL) {
+        return SQLITE_NOMEM;
+    }
+    sqlite3_stmt *stmt;
+    int ret = sqlite3_prepare_v2(
+        db,
+        "select kind, id, chunk, hits / 2 from heatmap where hits > 1 and "
+        "(kind = ? or ? = (select value from config "
+        "where key = 'heatmap_chunk_size'))",
+        -1, &stmt, NULL);
+    if (ret != SQLITE_OK) {
+        return ret;
+    }
+    sqlite3_bind_int(stmt, 1, HEAT_PATH);
+    sqlite3_bind_int(stmt, 2, sqlfs_opts.chunk_size);
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+        sqlfs_heat_add(sqlite3_column_int(stmt, 0),
+                       sqlite3_column_int64(stmt, 1),
+                       sqlite3_column_int(stmt, 2),
+                       sqlite3_column_int64(stmt, 3));
+    }
+    sqlite3_finalize(stmt);
+    return ret == SQLITE_DONE ? SQLITE_OK : ret;
+}
+
+/**
+ * @brief replace the saved heatmap with the current one
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_heat_save() {
+    sqlite3_stmt *stmt;
+    char sql[128];
+    snprintf(sql, sizeof(sql),
+             "begin; delete from heatmap; insert or replace into "
+             "config(key, value) values('heatmap_chunk_size', %u);",
+             sqlfs_opts.chunk_size);
+    int ret = sqlite3_exec(db, sql, NULL, NULL, &err_msg);
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(
+            db, "insert into heatmap(kind, id, chunk, hits) values(?, ?, ?, ?)",
+            -1, &stmt, NULL);
+    }
+    if (ret != SQLITE_OK) {
+        sqlite3_exec(db, "rollback", NULL, NULL, NULL);
+        return ret;
+    }
+    pthread_mutex_lock(&heat.lock);
+    for (uint32_t i = 0; i < HEAT_SLOTS && ret == SQLITE_OK; i++) {
+        struct sqlfs_heat_slot *s = &heat.slots[i];
+        if (s->kind == 0) {
+            continue;
+        }
+        sqlite3_bind_int(stmt, 1, s->kind);
+        sqlite3_bind_int64(stmt, 2, s->id);
+        sqlite3_bind_int(stmt, 3, s->chunk);
+        sqlite3_bind_int64(stmt, 4, s->hits);
+        ret = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+        sqlite3_reset(stmt);
+    }
+    pthread_mutex_unlock(&heat.lock);
+    sqlite3_finalize(stmt);
+    return sqlite3_exec(db, ret == SQLITE_OK ? "commit" : "rollback", NULL,
+                        NULL, &err_msg);
+}
+
+void *sqlfs_heat_warmup(void *arg) {
+    sqlite3 *conn;
+    sqlite3_stmt *heat_stmt = NULL;
+    sqlite3_stmt *path_stmt = NULL;
+    sqlite3_stmt *lookup_stmt = NULL;
+    sqlite3_blob *blob = NULL;
+    uint64_t blob_id = 0;
+    uint64_t paths = 0;
+    uint64_t chunks = 0;
+    time_t start = time(NULL);
+    char *buff = malloc(sqlfs_opts.chunk_size);
+
+    int ret = sqlfs_open_reader(&conn);
+    if (ret == SQLITE_OK)
+        ret = sqlite3_prepare_v2(conn,
+                                 "select kind, id, chunk from heatmap order by "
+                                 "kind, id, chunk",
+                                 -1, &heat_stmt, NULL);
+    if (ret == SQLITE_OK)
+        ret = sqlite3_prepare_v2(conn,
+                                 "select p.path, f.size from paths p left join "
+                                 "files f on p.file_id = f.id where p.id = ?",
+                                 -1, &path_stmt, NULL);
+    if (ret == SQLITE_OK)
+        ret = sqlite3_prepare_v2(conn, select_path_id_by_path_sql, -1,
+                                 &lookup_stmt, NULL);
+    while (ret == SQLITE_OK && buff != NULL && !heat.stop &&
+           sqlite3_step(heat_stmt) == SQLITE_ROW) {
+        int kind = sqlite3_column_int(heat_stmt, 0);
+        uint64_t id = sqlite3_column_int64(heat_stmt, 1);
+        uint64_t chunk = sqlite3_column_int(heat_stmt, 2);
+        if (kind == HEAT_PATH) {
+            // touch the row and the path index entry
+            sqlite3_bind_int64(path_stmt, 1, id);
+            if (sqlite3_step(path_stmt) == SQLITE_ROW) {
+                sqlite3_bind_text(lookup_stmt, 1,
+                                  (const char *)sqlite3_column_text(path_stmt, 0),
+                                  -1, NULL);
+                sqlite3_step(lookup_stmt);
+                sqlite3_reset(lookup_stmt);
+                paths++;
+            }
+            sqlite3_reset(path_stmt);
+        } else if (kind == HEAT_CHUNK) {
+            if (blob != NULL && !sqlfs_content_same_table(blob_id, id)) {
+                sqlite3_blob_close(blob);
+                blob = NULL;
+            }
+            if (blob == NULL || blob_id != id) {
+                int r = blob == NULL
+                            ? sqlfs_content_blob_open(conn, id, 0, &blob)
+                            : sqlite3_blob_reopen(blob, id);
+                if (r != SQLITE_OK) {
+                    continue;
+                }
+                blob_id = id;
+            }
+            uint64_t blob_size = sqlite3_blob_bytes(blob);
+            uint64_t offset = chunk * sqlfs_opts.chunk_size;
+            if (offset < blob_size) {
+                sqlite3_blob_read(
+                    blob, buff, MIN(sqlfs_opts.chunk_size, blob_size - offset),
+                    offset);
+                chunks++;
+            }
+        }
+    }
+    if (ret != SQLITE_OK) {
+        printf("sqlfs_heat_warmup(): error %s\n", sqlite3_errmsg(conn));
+    } else {
+        printf("sqlfs_heat_warmup(): %lu paths, %lu chunks in %lds\n", paths,
+               chunks, time(NULL) - start);
+    }
+    sqlite3_blob_close(blob);
+    sqlite3_finalize(heat_stmt);
+    sqlite3_finalize(path_stmt);
+    sqlite3_finalize(lookup_stmt);
+    sqlite3_close(conn);
+    free(buff);
+    return NULL;
+}
+
+void sqlfs_heat_start() {
+    heat.stop = false;
+    if (pthread_create(&heat.warmup_thread, NULL, sqlfs_heat_warmup, NULL) ==
+        0) {
+        heat.warmup_running = true;
+    }
+}
+
+void sqlfs_heat_stop() {
+    heat.stop = true;
+    if (heat.warmup_running) {
+        pthread_join(heat.warmup_thread, NULL);
+        heat.warmup_running = false;
+    }
+    if (heat.slots != NULL && !sqlfs_opts.read_only &&
+        sqlfs_heat_save() != SQLITE_OK) {
+        printf("sqlfs_heat_save(): error %s\n", sqlite3_errmsg(db));
+    }
+}
+
+/*
+ * Content chunk cache (--cache-size).
+ *
+ * Chunks of --chunk-size bytes are cached by (file id, chunk index) under an
+ * Adaptive Replacement Cache policy, accounted in bytes. Chunks seen once live
+ * in T1 and chunks seen again move to T2, so a single scan over many files
+ * only cycles through T1 and leaves the working set in T2 alone. B1 and B2
+ * remember the keys recently evicted from T1 and T2 and steer the target size
+ * p of T1. Writes invalidate the chunks they touch, and a generation counter
+ * keeps a reader from inserting a chunk it read before a concurrent write.
+ */
+#define CACHE_T1 0
+#define CACHE_T2 1
+#define CACHE_B1 2
+#define CACHE_B2 3
+
+struct sqlfs_cache_node {
+    uint64_t file_id;
+    uint64_t chunk;
+    uint32_t size;
+    uint16_t list;
+    uint16_t prefetched; // not requested by a reader yet
+    char *data;          // NULL for ghosts in B1 and B2
+    struct sqlfs_cache_node *prev;
+    struct sqlfs_cache_node *next;
+    struct sqlfs_cache_node *hash_next;
+};
+
+struct sqlfs_cache_list {
+    struct sqlfs_cache_node *head; // most recently used
+    struct sqlfs_cache_node *tail; // least recently used
+    uint64_t bytes;
+};
+
+struct sqlfs_cache {
+    struct sqlfs_cache_list lists[4];
+    struct sqlfs_cache_node **buckets;
+    uint64_t bucket_count;
+    uint64_t node_count;
+    uint64_t capacity;
+    uint64_t p;
+    uint64_t gen;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+    pthread_mutex_t lock;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static struct sqlfs_cache_node **sqlfs_cache_bucket(uint64_t file_id,
+                                                    uint64_t chunk) {
+    uint64_t h = sqlfs_hash_u64(file_id * 0x9e3779b97f4a7c15ULL + chunk);
+    return &cache.buckets[h & (cache.bucket_count - 1)];
+}
+
+static struct sqlfs_cache_node *sqlfs_cache_find(uint64_t file_id,
+                                                 uint64_t chunk) {
+    struct sqlfs_cache_node *node = *sqlfs_cache_bucket(file_id, chunk);
+    while (node != NULL && (node->file_id != file_id || node->chunk != chunk)) {
+        node = node->hash_next;
+    }
+    return node;
+}
+
+static void sqlfs_cache_list_remove(struct sqlfs_cache_node *node) {
+    struct sqlfs_cache_list *list = &cache.lists[node->list];
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        list->head = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    } else {
+        list->tail = node->prev;
+    }
+    list->bytes -= node->size;
+}
+
+static void sqlfs_cache_list_push(struct sqlfs_cache_node *node, int list_id) {
+    struct sqlfs_cache_list *list = &cache.lists[list_id];
+    node->list = list_id;
+    node->prev = NULL;
+    node->next = list->head;
+    if (list->head != NULL) {
+        list->head->prev = node;
+    } else {
+        list->tail = node;
+    }
+    list->head = node;
+    list->bytes += node->size;
+}
+
+static void sqlfs_cache_grow_buckets() {
+    uint64_t count = cache.bucket_count * 2;
+    struct sqlfs_cache_node **buckets =
+        calloc(count, sizeof(struct sqlfs_cache_node *));
+    if (buckets == NULL) {
+        return;
+    }
+    struct sqlfs_cache_node **old = cache.buckets;
+    uint64_t old_count = cache.bucket_count;
+    cache.buckets = buckets;
+    cache.bucket_count = count;
+    for (uint64_t i = 0; i < old_count; i++) {
+        while (old[i] != NULL) {
+            struct sqlfs_cache_node *node = old[i];
+            old[i] = node->hash_next;
+            struct sqlfs_cache_node **b =
+                sqlfs_cache_bucket(node->file_id, node->chunk);
+            node->hash_next = *b;
+            *b = node;
+        }
+    }
+    free(old);
+}
+
+static void sqlfs_cache_delete(struct sqlfs_cache_node *node) {
+    struct sqlfs_cache_node **b = sqlfs_cache_bucket(node->file_id, node->chunk);
+    while (*b != node) {
+        b = &(*b)->hash_next;
+    }
+    *b = node->hash_next;
+    sqlfs_cache_list_remove(node);
+    sqlfs_buf_put(node->data);
+    sqlfs_buf_put(node);
+    cache.node_count--;
+}
+
+static void sqlfs_cache_delete_lru(int list_id) {
+    sqlfs_cache_delete(cache.lists[list_id].tail);
+}
+
+/**
+ * @brief move the LRU chunk of T1 or T2 to the matching ghost list
+ */
+static void sqlfs_cache_demote(int list_id) {
+    struct sqlfs_cache_node *node = cache.lists[list_id].tail;
+    sqlfs_cache_list_remove(node);
+    sqlfs_buf_put(node->data);
+    node->data = NULL;
+    sqlfs_cache_list_push(node, list_id == CACHE_T1 ? CACHE_B1 : CACHE_B2);
+    cache.evictions++;
+}
+
+/**
+ * @brief ARC REPLACE, make room for size bytes in T1 + T2
+ */
+static void sqlfs_cache_replace(bool in_b2, uint64_t size) {
+    struct sqlfs_cache_list *t1 = &cache.lists[CACHE_T1];
+    struct sqlfs_cache_list *t2 = &cache.lists[CACHE_T2];
+    while (t1->bytes + t2->bytes + size > cache.capacity &&
+           (t1->tail != NULL || t2->tail != NULL)) {
+        if (t1->tail != NULL &&
+            (t1->bytes > cache.p || (in_b2 && t1->bytes == cache.p) ||
+             t2->tail == NULL)) {
+            sqlfs_cache_demote(CACHE_T1);
+        } else {
+            sqlfs_cache_demote(CACHE_T2);
+        }
+    }
+}
+
+/**
+ * @brief copy part of a cached chunk
+ *
+ * @param chunk_size size of the whole chunk returns here on hit
+ * @param gen generation to pass to sqlfs_cache_put() returns here
+ * @return true on hit
+ */
+bool sqlfs_cache_get(uint64_t file_id, uint64_t chunk, char *buff,
+                     uint32_t offset, uint32_t size, uint32_t *chunk_size,
+                     uint64_t *gen) {
+    pthread_mutex_lock(&cache.lock);
+    *gen = cache.gen;
+    struct sqlfs_cache_node *node = sqlfs_cache_find(file_id, chunk);
+    bool hit = node != NULL && node->data != NULL;
+    if (hit) {
+        if (offset < node->size) {
+            memcpy(buff, node->data + offset, MIN(size, node->size - offset));
+        }
+        *chunk_size = node->size;
+        sqlfs_cache_list_remove(node);
+        // the first read of a prefetched chunk is its first real use
+        sqlfs_cache_list_push(node, node->prefetched ? CACHE_T1 : CACHE_T2);
+        node->prefetched = false;
+        cache.hits++;
+    } else {
+        cache.misses++;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return hit;
+}
+
+/**
+ * @brief insert a chunk read from SQLite after a miss
+ *
+ * @param gen value of cache.gen before the chunk was read, the chunk is
+ * dropped if anything was invalidated since
+ * @param prefetched true when read ahead of any reader
+ */
+void sqlfs_cache_put(uint64_t file_id, uint64_t chunk, const char *data,
+                     uint32_t size, uint64_t gen, bool prefetched) {
+    if (size == 0 || size > cache.capacity) {
+        return;
+    }
+    char *copy = sqlfs_buf_get(size);
+    if (copy == NULL) {
+        return;
+    }
+    memcpy(copy, data, size);
+    pthread_mutex_lock(&cache.lock);
+    if (gen != cache.gen) {
+        pthread_mutex_unlock(&cache.lock);
+        sqlfs_buf_put(copy);
+        return;
+    }
+    struct sqlfs_cache_list *t1 = &cache.lists[CACHE_T1];
+    struct sqlfs_cache_list *t2 = &cache.lists[CACHE_T2];
+    struct sqlfs_cache_list *b1 = &cache.lists[CACHE_B1];
+    struct sqlfs_cache_list *b2 = &cache.lists[CACHE_B2];
+    struct sqlfs_cache_node *node = sqlfs_cache_find(file_id, chunk);
+    if (node != NULL && node->data != NULL) {
+        // inserted by a concurrent reader
+        pthread_mutex_unlock(&cache.lock);
+        sqlfs_buf_put(copy);
+        return;
+    }
+    int target = CACHE_T2;
+    if (node != NULL && node->list == CACHE_B1) {
+        uint64_t delta =
+            b1->bytes >= b2->bytes ? size : size * b2->bytes / b1->bytes;
+        cache.p = MIN(cache.capacity, cache.p + delta);
+        sqlfs_cache_list_remove(node);
+        sqlfs_cache_replace(false, size);
+    } else if (node != NULL && node->list == CACHE_B2) {
+        uint64_t delta =
+            b2->bytes >= b1->bytes ? size : size * b1->bytes / b2->bytes;
+        cache.p = cache.p > delta ? cache.p - delta : 0;
+        sqlfs_cache_list_remove(node);
+        sqlfs_cache_replace(true, size);
+    } else {
+        while (t1->bytes + b1->bytes + size > cache.capacity &&
+               b1->tail != NULL) {
+            sqlfs_cache_delete_lru(CACHE_B1);
+        }
+        while (t1->bytes + size > cache.capacity) {
+            sqlfs_cache_delete_lru(CACHE_T1);
+            cache.evictions++;
+        }
+        while (t1->bytes + t2->bytes + b1->bytes + b2->bytes + size >
+                   2 * cache.capacity &&
+               b2->tail != NULL) {
+            sqlfs_cache_delete_lru(CACHE_B2);
+        }
+        sqlfs_cache_replace(false, size);
+        node = sqlfs_buf_get(sizeof(struct sqlfs_cache_node));
+        if (node != NULL) {
+            memset(node, 0, sizeof(struct sqlfs_cache_node));
+        } else {
+            pthread_mutex_unlock(&cache.lock);
+            sqlfs_buf_put(copy);
+            return;
+        }
+        node->file_id = file_id;
+        node->chunk = chunk;
+        struct sqlfs_cache_node **b = sqlfs_cache_bucket(file_id, chunk);
+        node->hash_next = *b;
+        *b = node;
+        if (++cache.node_count > cache.bucket_count) {
+            sqlfs_cache_grow_buckets();
+        }
+        target = CACHE_T1;
+    }
+    node->size = size;
+    node->data = copy;
+    node->prefetched = prefetched;
+    sqlfs_cache_list_push(node, prefetched ? CACHE_T1 : target);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * @brief check for a resident chunk without counting an access
+ */
+bool sqlfs_cache_contains(uint64_t file_id, uint64_t chunk) {
+    pthread_mutex_lock(&cache.lock);
+    struct sqlfs_cache_node *node = sqlfs_cache_find(file_id, chunk);
+    bool resident = node != NULL && node->data != NULL;
+    pthread_mutex_unlock(&cache.lock);
+    return resident;
+}
+
+/**
+ * @brief current generation, to be taken before SQLite is read and passed to
+ * sqlfs_cache_put()
+ */
+uint64_t sqlfs_cache_gen() {
+    pthread_mutex_lock(&cache.lock);
+    uint64_t gen = cache.gen;
+    pthread_mutex_unlock(&cache.lock);
+    return gen;
+}
+
+/**
+ * @brief drop cached chunks first..last of a file
+ */
+void sqlfs_cache_invalidate(uint64_t file_id, uint64_t first, uint64_t last) {
+    if (cache.capacity == 0) {
+        return;
+    }
+    pthread_mutex_lock(&cache.lock);
+    cache.gen++;
+    for (uint64_t chunk = first; chunk <= last; chunk++) {
+        struct sqlfs_cache_node *node = sqlfs_cache_find(file_id, chunk);
+        if (node != NULL) {
+            if (node->data != NULL) {
+                cache.invalidations++;
+            }
+            sqlfs_cache_delete(node);
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * @brief drop the cached chunks covering a byte range of a file
+ */
+void sqlfs_cache_invalidate_range(uint64_t file_id, off_t offset,
+                                  uint64_t size) {
+    if (size > 0) {
+        sqlfs_cache_invalidate(file_id, offset / sqlfs_opts.chunk_size,
+                               (offset + size - 1) / sqlfs_opts.chunk_size);
+    }
+}
+
+/**
+ * @brief drop every cached chunk of a file, when its size is not known
+ */
+void sqlfs_cache_invalidate_file(uint64_t file_id) {
+    if (cache.capacity == 0) {
+        return;
+    }
+    pthread_mutex_lock(&cache.lock);
+    cache.gen++;
+    for (int list_id = CACHE_T1; list_id <= CACHE_B2; list_id++) {
+        struct sqlfs_cache_node *node = cache.lists[list_id].head;
+        while (node != NULL) {
+            struct sqlfs_cache_node *next = node->next;
+            if (node->file_id == file_id) {
+                if (node->data != NULL) {
+                    cache.invalidations++;
+                }
+                sqlfs_cache_delete(node);
+            }
+            node = next;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * @brief drop the whole cache
+ */
+void sqlfs_cache_invalidate_all() {
+    if (cache.capacity == 0) {
+        return;
+    }
+    pthread_mutex_lock(&cache.lock);
+    cache.gen++;
+    for (int list_id = CACHE_T1; list_id <= CACHE_B2; list_id++) {
+        while (cache.lists[list_id].head != NULL) {
+            if (cache.lists[list_id].head->data != NULL) {
+                cache.invalidations++;
+            }
+            sqlfs_cache_delete(cache.lists[list_id].head);
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+int sqlfs_cache_init() {
+    cache.capacity = sqlfs_opts.cache_size;
+    cache.bucket_count = 1024;
+    cache.buckets = calloc(cache.bucket_count, sizeof(struct sqlfs_cache_node *));
+    return cache.buckets == NULL ? SQLITE_NOMEM : SQLITE_OK;
+}
+
+/**
+ * @brief read file content through the chunk cache
+ *
+ * @return bytes read, FUSE negated error on errors
+ */
+int sqlfs_cache_read(uint64_t file_id, char *buff, size_t size, off_t offset) {
+    sqlite3_blob *blob = NULL;
+    uint64_t blob_size = 0;
+    uint64_t blob_gen = 0;
+    char *chunk_buff = NULL;
+    size_t done = 0;
+    int ret = OK;
+    while (done < size) {
+        uint64_t chunk = (offset + done) / sqlfs_opts.chunk_size;
+        uint32_t chunk_offset = (offset + done) % sqlfs_opts.chunk_size;
+        uint32_t want = MIN(size - done, sqlfs_opts.chunk_size - chunk_offset);
+        uint32_t chunk_size;
+        uint64_t gen;
+        if (!sqlfs_cache_get(file_id, chunk, buff + done, chunk_offset, want,
+                             &chunk_size, &gen)) {
+            if (blob == NULL) {
+                ret = sqlfs_content_blob_open(db, file_id, 0, &blob);
+                chunk_buff = sqlfs_buf_get(sqlfs_opts.chunk_size);
+                if (ret != SQLITE_OK || chunk_buff == NULL) {
+                    printf("sqlfs_cache_read() blob open error: %s\n",
+                           sqlite3_errmsg(sqlfs_content_db(file_id)));
+                    ret = -EIO;
+                    break;
+                }
+                blob_size = sqlite3_blob_bytes(blob);
+                // the blob reads one snapshot, taken after this generation
+                blob_gen = gen;
+            }
+            uint64_t start = chunk * sqlfs_opts.chunk_size;
+            if (start >= blob_size) {
+                break;
+            }
+            chunk_size = MIN(sqlfs_opts.chunk_size, blob_size - start);
+            ret = sqlite3_blob_read(blob, chunk_buff, chunk_size, start);
+            if (ret != SQLITE_OK) {
+                printf("sqlfs_cache_read() blob read error: %s\n",
+                       sqlite3_errmsg(db));
+                ret = -EIO;
+                break;
+            }
+            ret = sqlfs_crc_verify(blob, file_id, chunk_buff, start,
+                                   chunk_size);
+            if (ret != OK) {
+                break;
+            }
+            sqlfs_cache_put(file_id, chunk, chunk_buff, chunk_size, blob_gen,
+                            false);
+            if (chunk_offset < chunk_size) {
+                memcpy(buff + done, chunk_buff + chunk_offset,
+                       MIN(want, chunk_size - chunk_offset));
+            }
+        }
+        if (chunk_offset >= chunk_size) {
+            break;
+        }
+        done += MIN(want, chunk_size - chunk_offset);
+        if (chunk_size < sqlfs_opts.chunk_size) {
+            break;
+        }
+    }
+    sqlite3_blob_close(blob);
+    sqlfs_buf_put(chunk_buff);
+    return ret < 0 ? ret : (int)done;
+}
+
+/*
+ * Sequential read-ahead (--readahead).
+ *
+ * Every open file has a handle tracking where a sequential reader would
+ * continue. While reads keep arriving at that offset, the window ahead of the
+ * reader doubles up to the --readahead limit, and the part of it not yet
+ * requested is queued for the prefetch thread. That thread reads through its
+ * own connection into the chunk cache, so the next FUSE reads are cache hits.
+ * A read anywhere else shrinks the window back to its initial size.
+ */
+#define READAHEAD_MIN_CHUNKS 2
+#define READAHEAD_QUEUE_LEN 64
+
+struct sqlfs_file_handle {
+    uint64_t file_id;
+    off_t next_offset;  // where a sequential read would continue
+    off_t ahead;        // prefetch was queued up to here
+    uint64_t window;
+    char *content;      // whole content of a small file, see sqlfs_open()
+    uint64_t content_size;
+    uint64_t content_gen;
+    bool written;       // reindex on release, see --fts
+    pthread_mutex_t lock;
+};
+
+struct sqlfs_readahead_req {
+    uint64_t file_id;
+    off_t offset;
+    uint64_t size;
+};
+
+struct sqlfs_readahead {
+    struct sqlfs_readahead_req queue[READAHEAD_QUEUE_LEN];
+    uint32_t head;
+    uint32_t len;
+    uint64_t queued;
+    uint64_t dropped;
+    uint64_t chunks;
+    bool stop;
+    bool running;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ra_queue = {.lock = PTHREAD_MUTEX_INITIALIZER,
+              .cond = PTHREAD_COND_INITIALIZER};
+
+/*
+ * Content write generations. Writers bump the global generation and then the
+ * slot of the file after their update is committed, so a reader that saw the
+ * same global generation before and after reading content knows the slot
+ * generation it read in between is not newer than that content.
+ */
+#define WRITE_GEN_SLOTS 256
+
+uint64_t write_gen;
+uint64_t write_gens[WRITE_GEN_SLOTS];
+
+uint64_t *sqlfs_write_gen_slot(uint64_t file_id) {
+    return &write_gens[sqlfs_hash_u64(file_id) % WRITE_GEN_SLOTS];
+}
+
+void sqlfs_content_changed(uint64_t file_id) {
+    __atomic_add_fetch(&write_gen, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(sqlfs_write_gen_slot(file_id), 1, __ATOMIC_SEQ_CST);
+}
+
+struct sqlfs_small_files {
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t reads;
+    uint64_t stale;
+} small_files;
+
+struct sqlfs_file_handle *sqlfs_handle(struct fuse_file_info *file_info) {
+    return (struct sqlfs_file_handle *)(uintptr_t)file_info->fh;
+}
+
+static void sqlfs_readahead_queue(uint64_t file_id, off_t offset,
+                                  uint64_t size) {
+    pthread_mutex_lock(&ra_queue.lock);
+    if (ra_queue.len < READAHEAD_QUEUE_LEN) {
+        struct sqlfs_readahead_req *req =
+            &ra_queue.queue[(ra_queue.head + ra_queue.len) %
+                             READAHEAD_QUEUE_LEN];
+        req->file_id = file_id;
+        req->offset = offset;
+        req->size = size;
+        ra_queue.len++;
+        ra_queue.queued++;
+        pthread_cond_signal(&ra_queue.cond);
+    } else {
+        ra_queue.dropped++;
+    }
+    pthread_mutex_unlock(&ra_queue.lock);
+}
+
+/**
+ * @brief update the sequential state of a handle after a read and queue the
+ * next part of the window
+ */
+void sqlfs_readahead_update(struct sqlfs_file_handle *handle, off_t offset,
+                            size_t size) {
+    if (sqlfs_opts.readahead == 0) {
+        return;
+    }
+    pthread_mutex_lock(&handle->lock);
+    off_t end = offset + size;
+    if (offset != handle->next_offset) {
+        handle->window =
+            MAX(READAHEAD_MIN_CHUNKS * sqlfs_opts.chunk_size, 2 * size);
+        handle->ahead = end;
+        handle->next_offset = end;
+        pthread_mutex_unlock(&handle->lock);
+        return;
+    }
+    handle->next_offset = end;
+    // grow once the reader got into the second half of the window
+    if (handle->ahead - end < (off_t)handle->window / 2) {
+        handle->window = MIN(handle->window * 2, sqlfs_opts.readahead);
+    }
+    off_t from = MAX(handle->ahead, end);
+    off_t to = end + handle->window;
+    if (to > from) {
+        handle->ahead = to;
+        pthread_mutex_unlock(&handle->lock);
+        sqlfs_readahead_queue(handle->file_id, from, to - from);
+        return;
+    }
+    pthread_mutex_unlock(&handle->lock);
+}
+
+void *sqlfs_readahead_thread(void *arg) {
+    sqlite3 *conn;
+    char *buff = malloc(sqlfs_opts.chunk_size);
+    int ret = sqlfs_open_reader(&conn);
+    if (ret != SQLITE_OK || buff == NULL) {
+        printf("sqlfs_readahead_thread(): open error %s\n",
+               sqlite3_errmsg(conn));
+    }
+    pthread_mutex_lock(&ra_queue.lock);
+    while (ret == SQLITE_OK && buff != NULL) {
+        while (ra_queue.len == 0 && !ra_queue.stop) {
+            pthread_cond_wait(&ra_queue.cond, &ra_queue.lock);
+        }
+        if (ra_queue.stop) {
+            break;
+        }
+        struct sqlfs_readahead_req req = ra_queue.queue[ra_queue.head];
+        ra_queue.head = (ra_queue.head + 1) % READAHEAD_QUEUE_LEN;
+        ra_queue.len--;
+        pthread_mutex_unlock(&ra_queue.lock);
+
+        // an open blob pins its read transaction, so it is not kept across
+        // requests. The generation is taken before the transaction starts.
+        uint64_t gen = sqlfs_cache_gen();
+        sqlite3_blob *blob = NULL;
+        uint64_t blob_size = 0;
+        if (sqlfs_content_blob_open(conn, req.file_id, 0, &blob) ==
+            SQLITE_OK) {
+            blob_size = sqlite3_blob_bytes(blob);
+        }
+        uint64_t chunks = 0;
+        for (uint64_t chunk = req.offset / sqlfs_opts.chunk_size;
+             chunk <= (req.offset + req.size - 1) / sqlfs_opts.chunk_size &&
+             chunk * sqlfs_opts.chunk_size < blob_size;
+             chunk++) {
+            if (sqlfs_cache_contains(req.file_id, chunk)) {
+                continue;
+            }
+            uint64_t start = chunk * sqlfs_opts.chunk_size;
+            uint32_t chunk_size = MIN(sqlfs_opts.chunk_size, blob_size - start);
+            if (sqlite3_blob_read(blob, buff, chunk_size, start) != SQLITE_OK ||
+                sqlfs_crc_verify(blob, req.file_id, buff, start, chunk_size) !=
+                    OK) {
+                break;
+            }
+            sqlfs_cache_put(req.file_id, chunk, buff, chunk_size, gen, true);
+            chunks++;
+        }
+        sqlite3_blob_close(blob);
+
+        pthread_mutex_lock(&ra_queue.lock);
+        ra_queue.chunks += chunks;
+    }
+    pthread_mutex_unlock(&ra_queue.lock);
+    sqlite3_close(conn);
+    free(buff);
+    return NULL;
+}
+
+void sqlfs_readahead_start() {
+    ra_queue.stop = false;
+    if (pthread_create(&ra_queue.thread, NULL, sqlfs_readahead_thread,
+                       NULL) == 0) {
+        ra_queue.running = true;
+    }
+}
+
+void sqlfs_readahead_stop() {
+    pthread_mutex_lock(&ra_queue.lock);
+    ra_queue.stop = true;
+    pthread_cond_broadcast(&ra_queue.cond);
+    pthread_mutex_unlock(&ra_queue.lock);
+    if (ra_queue.running) {
+        pthread_join(ra_queue.thread, NULL);
+        ra_queue.running = false;
+    }
+}
+
+int sqlfs_getattr(const char *path, struct stat *stat,
+                  struct fuse_file_info *fi) {
+    if (is_root_dir(path)) {
+        stat->st_mode = ROOT_DIR_MODE;
+        stat->st_nlink = 1;
+        stat->st_uid = getuid();
+        stat->st_gid = getgid();
+        stat->st_atime = time(NULL);
+        stat->st_mtime = time(NULL);
+        return 0;
+    }
+    if (sqlfs_opts.mem_meta) {
+        uint64_t id;
+        int ret = sqlfs_mem_getattr(path, stat, &id);
+        if (ret == OK) {
+            sqlfs_heat_add(HEAT_PATH, id, 0, 1);
+        }
+        return ret;
+    }
+    sqlite3_bind_text(select_path_by_name_stmt, 1, path, -1, NULL);
+    int ret = sqlite3_step(select_path_by_name_stmt);
+    if (ret == SQLITE_ROW) {
+        stat->st_uid = sqlite3_column_int(select_path_by_name_stmt, 0);
+        stat->st_gid = sqlite3_column_int(select_path_by_name_stmt, 1);
+        stat->st_mode = sqlite3_column_int(select_path_by_name_stmt, 2);
+        stat->st_atime = sqlite3_column_int(select_path_by_name_stmt, 3);
+        stat->st_mtime = sqlite3_column_int(select_path_by_name_stmt, 4);
+        stat->st_ctime = sqlite3_column_int(select_path_by_name_stmt, 5);
+        stat->st_size = sqlite3_column_int64(select_path_by_name_stmt, 6);
+        stat->st_nlink = sqlite3_column_int(select_path_by_name_stmt, 7);
+        sqlfs_heat_add(HEAT_PATH,
+                       sqlite3_column_int64(select_path_by_name_stmt, 8), 0, 1);
+        ret = OK;
+    } else if (ret == SQLITE_DONE) {
+        ret = -ENOENT;
+    } else {
+        printf("sqlfs_getattr(): '%s' sql error %s\n", path,
+               sqlite3_errmsg(db));
+        ret = -EIO;
+    }
+    sqlite3_reset(select_path_by_name_stmt);
+    return ret;
+}
+/**
+ * @brief find file id by path
+ *
+ * @param path path to query
+ * @param file_id write file id here
+ * @return SQLITE_OK on success, SQLITE_DONE on not found
+ */
+int sqlfs_find_file_id(const char *path, uint64_t *file_id) {
+    if (is_root_dir(path)) {
+        return SQLITE_DONE;
+    }
+    if (sqlfs_opts.mem_meta) {
+        struct sqlfs_path_info path_info;
+        int ret = sqlfs_mem_find_path_info(path, &path_info);
+        if (ret == SQLITE_OK) {
+            *file_id = path_info.file_id;
+        }
+        return ret;
+    }
+    sqlite3_bind_text(select_file_id_by_path_stmt, 1, path, -1, NULL);
+    int ret = sqlite3_step(select_file_id_by_path_stmt);
+    if (ret == SQLITE_ROW) {
+        *file_id = sqlite3_column_int64(select_file_id_by_path_stmt, 0);
+        ret = SQLITE_OK;
+    }
+    sqlite3_reset(select_file_id_by_path_stmt);
+    return ret;
+}
+
+/**
+ * @brief find file content by id
+ *
+ * @param id
+ * @param buff
+ * @param buff_size
+ * @return OK if find a row
+ */
+int sqlfs_find_file_content_by_id(u_int64_t id, char *buff, size_t buff_size) {
+    sqlite3_blob *blob;
+    int ret = sqlfs_content_blob_open(db, id, 0, &blob);
+    if (ret != SQLITE_OK) {
+        printf("sqlfs_find_file_content_by_id() blob open error: %s\n",
+               sqlite3_errmsg(sqlfs_content_db(id)));
+        sqlite3_blob_close(blob);
+        return -EIO;
+    }
+    uint64_t blob_size = sqlite3_blob_bytes(blob);
+    uint64_t max_size = buff_size > blob_size ? blob_size : buff_size;
+    ret = sqlite3_blob_read(blob, buff, max_size, 0);
+    if (ret != SQLITE_OK) {
+        printf("sqlfs_find_file_content_by_id() blob read error: %s\n",
+               sqlite3_errmsg(sqlfs_content_db(id)));
+        sqlite3_blob_close(blob);
+        return -EIO;
+    }
+    sqlite3_blob_close(blob);
+    return OK;
+}
+
+/**
+ * @brief find file id by path and, for files up to --prefetch-small bytes,
+ * load the whole content with the same statement, or from its shard
+ *
+ * @param handle file_id, content, content_size and content_gen are set here
+ * @return SQLITE_OK on success, SQLITE_DONE on not found
+ */
+int sqlfs_find_small_file(const char *path,
+                          struct sqlfs_file_handle *handle) {
+    if (is_root_dir(path)) {
+        return SQLITE_DONE;
+    }
+    uint64_t gen = __atomic_load_n(&write_gen, __ATOMIC_SEQ_CST);
+    sqlite3_bind_int64(select_small_file_by_path_stmt, 1,
+                       sqlfs_opts.prefetch_small);
+    sqlite3_bind_text(select_small_file_by_path_stmt, 2, path, -1, NULL);
+    int ret = sqlite3_step(select_small_file_by_path_stmt);
+    if (ret == SQLITE_ROW) {
+        handle->file_id =
+            sqlite3_column_int64(select_small_file_by_path_stmt, 0);
+        const void *content =
+            sqlite3_column_blob(select_small_file_by_path_stmt, 1);
+        uint64_t size = sqlite3_column_bytes(select_small_file_by_path_stmt, 1);
+        if (shards.count > 0) {
+            size = sqlite3_column_int64(select_small_file_by_path_stmt, 2);
+        }
+        handle->content_gen = __atomic_load_n(
+            sqlfs_write_gen_slot(handle->file_id), __ATOMIC_SEQ_CST);
+        if (shards.count > 0 && size > 0 && size <= sqlfs_opts.prefetch_small) {
+            // sharded content is not in the row, read it from its shard
+            handle->content = sqlfs_buf_get(size);
+            if (handle->content != NULL &&
+                sqlfs_find_file_content_by_id(handle->file_id, handle->content,
+                                              size) != OK) {
+                sqlfs_buf_put(handle->content);
+                handle->content = NULL;
+            }
+        } else if (content != NULL) {
+            handle->content = sqlfs_buf_get(size);
+            if (handle->content != NULL) {
+                memcpy(handle->content, content, size);
+            }
+        }
+        // a mismatch fails the reads, on the path that reads the blob
+        if (handle->content != NULL &&
+            sqlfs_crc_verify(NULL, handle->file_id, handle->content, 0,
+                             size) != OK) {
+            sqlfs_buf_put(handle->content);
+            handle->content = NULL;
+        }
+        // skip it if any write finished while the content was read
+        if (handle->content != NULL &&
+            gen != __atomic_load_n(&write_gen, __ATOMIC_SEQ_CST)) {
+            sqlfs_buf_put(handle->content);
+            handle->content = NULL;
+        }
+        if (handle->content != NULL) {
+            handle->content_size = size;
+            __atomic_add_fetch(&small_files.files, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&small_files.bytes, size, __ATOMIC_RELAXED);
+        }
+        ret = SQLITE_OK;
+    }
+    sqlite3_reset(select_small_file_by_path_stmt);
+    return ret;
+}
+
+int sqlfs_open(const char *path, struct fuse_file_info *file_info) {
+    if (sqlfs_opts.read_only &&
+        ((file_info->flags & O_ACCMODE) != O_RDONLY ||
+         (file_info->flags & O_TRUNC))) {
+        return -EROFS;
+    }
+    struct sqlfs_file_handle *handle =
+        sqlfs_buf_get(sizeof(struct sqlfs_file_handle));
+    if (handle == NULL) {
+        return -ENOMEM;
+    }
+    memset(handle, 0, sizeof(struct sqlfs_file_handle));
+    int ret;
+    if (sqlfs_opts.prefetch_small > 0 &&
+        (file_info->flags & O_ACCMODE) == O_RDONLY) {
+        ret = sqlfs_find_small_file(path, handle);
+    } else {
+        ret = sqlfs_find_file_id(path, &handle->file_id);
+    }
+    if (ret == SQLITE_OK) {
+        handle->window = READAHEAD_MIN_CHUNKS * sqlfs_opts.chunk_size;
+        pthread_mutex_init(&handle->lock, NULL);
+        file_info->fh = (uintptr_t)handle;
+        return OK;
+    } else if (ret == SQLITE_DONE) {
+        printf("sqlfs_open(): not found '%s'\n", path);
+        ret = -ENOENT;
+    } else {
+        printf("sqlfs_open(): error %s\n", sqlite3_errmsg(db));
+        ret = -EIO;
+    }
+    sqlfs_buf_put(handle);
+    return ret;
+}
+
+/**
+ * @brief get path id by path name. Root dir '/' id is 0
+ *
+ * @param path Path to query
+ * @param id write path id here
+ * @return SQLITE_OK on success, SQLITE_DONE on not found
+ */
+int sqlfs_find_path_id(const char *path, uint64_t *id) {
+    if (is_root_dir(path)) {
+        *id = 0;
+        return SQLITE_OK;
+    }
+    if (sqlfs_opts.mem_meta) {
+        struct sqlfs_path_info path_info;
+        int ret = sqlfs_mem_find_path_info(path, &path_info);
+        if (ret == SQLITE_OK) {
+            *id = path_info.id;
+        }
+        return ret;
+    }
+    sqlite3_bind_text(select_path_id_by_path_stmt, 1, path, -1, NULL);
+    int ret = sqlite3_step(select_path_id_by_path_stmt);
+    if (ret == SQLITE_ROW) {
+        *id = sqlite3_column_int64(select_path_id_by_path_stmt, 0);
+        ret = SQLITE_OK;
+    }
+    sqlite3_reset(select_path_id_by_path_stmt);
+    return ret;
+}
+
+/**
+ * @brief get `path info` by path name.
+ *
+ * @param path Path to query
+ * @param path_info write `path info` here
+ * @return SQLITE_OK on success, SQLITE_DONE on not found
+ */
+int sqlfs_find_path_info(const char *path, struct sqlfs_path_info *path_info) {
+    if (is_root_dir(path)) {
+        path_info->id = 0;
+        path_info->mode = 0;
+        path_info->file_id = 0;
+        path_info->size = 0;
+        return SQLITE_OK;
+    }
+    if (sqlfs_opts.mem_meta) {
+        return sqlfs_mem_find_path_info(path, path_info);
+    }
+    sqlite3_bind_text(select_path_info_by_path_stmt, 1, path, -1, NULL);
+    int ret = sqlite3_step(select_path_info_by_path_stmt);
+    if (ret == SQLITE_ROW) {
+        path_info->id = sqlite3_column_int64(select_path_info_by_path_stmt, 0);
+        path_info->mode = sqlite3_column_int(select_path_info_by_path_stmt, 1);
+        path_info->file_id =
+            sqlite3_column_int64(select_path_info_by_path_stmt, 2);
+        path_info->size =
+            sqlite3_column_int64(select_path_info_by_path_stmt, 3);
+        ret = SQLITE_OK;
+    }
+    sqlite3_reset(select_path_info_by_path_stmt);
+    return ret;
+}
+
+int sqlfs_opendir(const char *path, struct fuse_file_info *file_info) {
+    uint64_t id;
+    int ret = sqlfs_find_path_id(path, &id);
+    if (ret == SQLITE_OK) {
+        file_info->fh = id;
+        return 0;
+    } else if (ret == SQLITE_DONE) {
+        return -ENOENT;
+    } else {
+        return -EIO;
+    }
+}
+
+int sqlfs_readdir(const char *path, void *buff, fuse_fill_dir_t filler,
+                  off_t offset, struct fuse_file_info *file_info,
+                  enum fuse_readdir_flags flags) {
+    if (offset == 0) {
+        filler(buff, ".", NULL, 0, FUSE_FILL_DIR_PLUS);
+        filler(buff, "..", NULL, 0, FUSE_FILL_DIR_PLUS);
+    }
+    if (sqlfs_opts.mem_meta) {
+        return sqlfs_mem_readdir(path, buff, filler);
+    }
+    sqlite3_bind_int64(select_stats_by_parent_id_stmt, 1, file_info->fh);
+    sqlite3_bind_int64(select_stats_by_parent_id_stmt, 2, 0);
+    int ret = sqlite3_step(select_stats_by_parent_id_stmt);
+    while (ret == SQLITE_ROW) {
+        struct stat st;
+        const char *p = (const char *)sqlite3_column_text(
+            select_stats_by_parent_id_stmt, 0);
+        st.st_uid = sqlite3_column_int(select_stats_by_parent_id_stmt, 1);
+        st.st_gid = sqlite3_column_int(select_stats_by_parent_id_stmt, 2);
+        st.st_mode = sqlite3_column_int(select_stats_by_parent_id_stmt, 3);
+        st.st_atime = sqlite3_column_int64(select_stats_by_parent_id_stmt, 4);
+        st.st_mtime = sqlite3_column_int64(select_stats_by_parent_id_stmt, 5);
+        st.st_ctime = sqlite3_column_int64(select_stats_by_parent_id_stmt, 6);
+        st.st_size = sqlite3_column_int64(select_stats_by_parent_id_stmt, 7);
+        st.st_nlink = sqlite3_column_int(select_stats_by_parent_id_stmt, 8);
+        filler(buff, strrchr(p, '/') + 1, &st, 0, FUSE_FILL_DIR_PLUS);
+        ret = sqlite3_step(select_stats_by_parent_id_stmt);
+    }
+    if (ret != SQLITE_DONE) {
+        printf("sqlfs_readdir(): '%s' path_id: %ld error %s\n", path,
+               file_info->fh, sqlite3_errmsg(db));
+        ret = -EIO;
+    }
+    ret = 0;
+    sqlite3_reset(select_stats_by_parent_id_stmt);
+    return ret;
+}
+/**
+ * @brief Insert a path.
+ *
+ * @param path path name
+ * @param mode
+ * @param type, such as S_IFREG, S_IFDIR
+ * @param file_id 0 for no file content
+ * @return OK if no errors, FUSE negated error otherwise.
+ */
+int sqlfs_insert_path(const char *path, mode_t mode, int type,
+                      uint64_t file_id) {
+    if (is_root_dir(path)) {
+        return OK;
+    }
+    uint64_t parent_id;
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *path_copy = sqlfs_arena_strndup(path, strlen(path));
+    if (path_copy == NULL) {
+        return -ENOMEM;
+    }
+    int ret = sqlfs_find_path_id(dirname(path_copy), &parent_id);
+    sqlfs_arena_release(mark);
+    if (ret == SQLITE_OK) {
+        // do nothing
+    } else if (ret == SQLITE_DONE) {
+        return -ENOENT;
+    } else {
+        return -EIO;
+    }
+    sqlite3_bind_text(insert_path_stmt, 1, path, -1, NULL);
+    sqlite3_bind_int64(insert_path_stmt, 2, parent_id);
+    sqlite3_bind_int64(insert_path_stmt, 3, getuid());
+    sqlite3_bind_int64(insert_path_stmt, 4, getgid());
+    sqlite3_bind_int(insert_path_stmt, 5, mode | type);
+    sqlite3_bind_int64(insert_path_stmt, 6, time(NULL));
+    sqlite3_bind_int64(insert_path_stmt, 7, time(NULL));
+    sqlite3_bind_int64(insert_path_stmt, 8, time(NULL));
+    sqlite3_bind_int64(insert_path_stmt, 9, file_id);
+    ret = sqlite3_step(insert_path_stmt);
+    if (ret == SQLITE_DONE) {
+        ret = OK;
+    } else {
+        printf("sql error in sqlfs_insert_path(): \"%s\" %s\n", path,
+               sqlite3_errmsg(db));
+        ret = -EIO;
+    }
+    sqlite3_reset(insert_path_stmt);
+    if (ret == OK) {
+        sqlfs_capacity_charge(0, 1);
+        ret = sqlfs_mem_reload(path);
+    }
+    return ret;
+}
+
+/**
+ * @brief insert an file with content
+ *
+ * @param content file content
+ * @param content_len content length in bytes
+ * @param id inserted file id returns here
+ * @return int OK if no errors, FUSE negated error otherwise.
+ */
+int sqlfs_insert_file(const void *content, uint64_t content_len, dev_t dev,
+                      uint64_t *id) {
+    if (content_len == 0 || shards.count > 0) {
+        sqlite3_bind_null(insert_file_stmt, 1);
+    } else {
+        sqlite3_bind_blob64(insert_file_stmt, 1, content, content_len,
+                            SQLITE_STATIC);
+    }
+
+    // sharded content is stored before the size that refers to it, so a
+    // crash in between leaves an empty file, not one with missing content
+    bool sharded = content_len > 0 && shards.count > 0;
+    sqlite3_bind_int64(insert_file_stmt, 2, dev);
+    sqlite3_bind_int64(insert_file_stmt, 3, sharded ? 0 : content_len);
+    int ret = sqlite3_step(insert_file_stmt);
+    if (ret == SQLITE_DONE) {
+        ret = OK;
+    } else {
+        printf("sql error in sqlfs_insert_file(): %s\n", sqlite3_errmsg(db));
+        ret = -EIO;
+    }
+    *id = sqlite3_last_insert_rowid(db);
+    sqlite3_reset(insert_file_stmt);
+    if (ret == OK && sharded &&
+        sqlfs_content_put(*id, content, content_len) != SQLITE_OK) {
+        printf("sql error in sqlfs_insert_file(): %s\n",
+               sqlite3_errmsg(sqlfs_content_db(*id)));
+        ret = -EIO;
+    }
+    if (ret == OK && sharded) {
+        sqlite3_bind_null(update_file_content_by_id_stmt, 1);
+        sqlite3_bind_int64(update_file_content_by_id_stmt, 2, content_len);
+        sqlite3_bind_int64(update_file_content_by_id_stmt, 3, *id);
+        if (sqlite3_step(update_file_content_by_id_stmt) != SQLITE_DONE) {
+            printf("sql error in sqlfs_insert_file(): %s\n",
+                   sqlite3_errmsg(db));
+            ret = -EIO;
+        }
+        sqlite3_reset(update_file_content_by_id_stmt);
+    }
+    if (ret == OK) {
+        sqlfs_capacity_charge(content_len, 0);
+    }
+    return ret;
+}
+
+/**
+ * @brief insert an empty file content
+ *
+ * @param dev linux dev id
+ * @param id inserted file id returns here
+ * @return int OK if no errors, FUSE negated error otherwise.
+ */
+int sqlfs_insert_empty_file(dev_t dev, uint64_t *id) {
+    return sqlfs_insert_file(NULL, 0, dev, id);
+}
+
+int sqlfs_do_mkdir(const char *path, mode_t mode) {
+    if (sqlfs_opts.read_only) {
+        return -EROFS;
+    }
+    int ret = sqlfs_insert_path(path, mode, S_IFDIR, 0);
+    if (ret == OK) {
+        sqlfs_usage_add(path, S_IFDIR, 0);
+    }
+    return ret;
+}
+
+int sqlfs_do_mknod(const char *path, mode_t mode, dev_t dev) {
+    if (sqlfs_opts.read_only) {
+        return -EROFS;
+    }
+    if (is_root_dir(path)) {
+        return -EEXIST;
+    }
+    uint64_t path_id;
+    int ret = sqlfs_find_path_id(path, &path_id);
+    if (ret == SQLITE_OK) {
+        printf("sqlfs_mknod(): file exists '%s'\n", path);
+        return -EEXIST;
+    } else if (ret == SQLITE_DONE) {
+        // do nothing
+    } else {
+        printf("sqlfs_mknod(): io error '%s'\n", path);
+        return -EIO;
+    }
+    uint64_t file_id;
+    ret = sqlfs_insert_empty_file(dev, &file_id);
+    if (ret != OK) {
+        return ret;
+    }
+
+    ret = sqlfs_insert_path(path, mode, S_IFREG, file_id);
+    if (ret == OK) {
+        sqlfs_usage_add(path, S_IFREG, 0);
+    }
+    return ret;
+}
+
+int sqlfs_do_unlink(const char *path) {
+    if (sqlfs_opts.read_only) {
+        return -EROFS;
+    }
+    struct sqlfs_path_info path_info;
+    int ret = sqlfs_find_path_info(path, &path_info);
+    if (ret == OK) {
+        // do nothing
+    } else if (ret == SQLITE_DONE) {
+        printf("sqlfs_unlink(): error no such file '%s'\n", path);
+        return -ENOENT;
+    } else {
+        printf("sqlfs_unlink(): '%s' error %s\n", path, sqlite3_errmsg(db));
+        return -EIO;
+    }
+    if (S_ISDIR(path_info.mode)) {
+        printf("sqlfs_unlink(): '%s' is dir\n", path);
+        return -EISDIR;
+    }
+    sqlite3_bind_int64(delete_path_by_id_stmt, 1, path_info.id);
+    ret = sqlite3_step(delete_path_by_id_stmt);
+    sqlite3_reset(delete_path_by_id_stmt);
+    if (ret != SQLITE_DONE) {
+        printf("sqlfs_unlink(): '%s' delete path error %s\n", path,
+               sqlite3_errmsg(db));
+        return -EIO;
+    }
+    sqlfs_mem_reload(path);
+    sqlfs_capacity_charge(0, -1);
+    sqlfs_usage_remove(path, path_info.mode, path_info.size);
+
+    sqlite3_bind_int64(decrease_file_nlink_by_id_stmt, 1, path_info.file_id);
+    ret = sqlite3_step(decrease_file_nlink_by_id_stmt);
+    sqlite3_reset(decrease_file_nlink_by_id_stmt);
+    if (ret != SQLITE_DONE) {
+        printf("sqlfs_unlink(): '%s' decrease nlink error %s file_id: %ld, "
+               "ret: %d \n",
+               path, sqlite3_errmsg(db), path_info.file_id, ret);
+        return -EIO;
+    }
+
+    sqlite3_bind_int64(select_file_nlink_by_id_stmt, 1, path_info.file_id);
+    ret = sqlite3_step(select_file_nlink_by_id_stmt);
+    if (ret != SQLITE_ROW) {
+        printf("sqlfs_unlink(): '%s' file_id: %ld select nlink error %s\n",
+               path, path_info.file_id, sqlite3_errmsg(db));
+        return -EIO;
+    }
+    nlink_t nlink = sqlite3_column_int64(select_file_nlink_by_id_stmt, 0);
+    sqlite3_reset(select_file_nlink_by_id_stmt);
+    if (nlink == 0) {
+        sqlite3_bind_int64(delete_file_by_id_stmt, 1, path_info.file_id);
+        ret = sqlite3_step(delete_file_by_id_stmt);
+        sqlite3_reset(delete_file_by_id_stmt);
+        if (ret != SQLITE_DONE) {
+            printf("sqlfs_unlink('%s'): delete file error %s\n", path,
+                   sqlite3_errmsg(db));
+            return -EIO;
+        }
+        sqlfs_capacity_charge(-(int64_t)path_info.size, 0);
+        if (shards.count > 0 &&
+            sqlfs_content_delete(path_info.file_id) != SQLITE_OK) {
+            printf("sqlfs_unlink('%s'): delete content error %s\n", path,
+                   sqlite3_errmsg(sqlfs_content_db(path_info.file_id)));
+            return -EIO;
+        }
+        sqlfs_fts_queue(path_info.file_id);
+        return OK;
+    }
+    return sqlfs_mem_reload_file(path_info.file_id);
+}
+
+int sqlfs_do_rmdir(const char *path) {
+    if (sqlfs_opts.read_only) {
+        return -EROFS;
+    }
+    struct sqlfs_path_info path_info;
+    int ret = sqlfs_find_path_info(path, &path_info);
+    if (ret == OK) {
+        // do nothing
+    } else if (ret == SQLITE_DONE) {
+        return -ENOENT;
+    } else {
+        return -EIO;
+    }
+    if (S_ISREG(path_info.mode)) {
+        return -ENOTDIR;
+    }
+    sqlite3_bind_int64(count_dir_items_by_id_stmt, 1, path_info.id);
+    ret = sqlite3_step(count_dir_items_by_id_stmt);
+    sqlite3_reset(count_dir_items_by_id_stmt);
+    if (ret == SQLITE_ROW) {
+        int count = sqlite3_column_int64(count_dir_items_by_id_stmt, 0);
+        if (count != 0) {
+            return -EPERM;
+        }
+    } else {
+        printf("sqlfs_rmdir(): '%s' count child error %s ret: %d \n", path,
+               sqlite3_errmsg(db), ret);
+        return -EIO;
+    }
+
+    sqlite3_bind_int64(delete_path_by_id_stmt, 1, path_info.id);
+    ret = sqlite3_step(delete_path_by_id_stmt);
+    sqlite3_reset(delete_path_by_id_stmt);
+    if (ret == SQLITE_DONE) {
+        sqlfs_capacity_charge(0, -1);
+        sqlfs_usage_remove(path, S_IFDIR, 0);
+        ret = sqlfs_mem_reload(path);
+    } else {
+        printf("sqlfs_rmdir(): '%s' delete path error %s ret: %d \n", path,
+               sqlite3_errmsg(db), ret);
+        ret = -EIO;
+    }
+    return ret;
+}
+
+int sqlfs_do_utimens(const char *path, const struct timespec tv[2],
+                     struct fuse_file_info *file_info) {
+    if (sqlfs_opts.read_only) {
+        return -EROFS;
+    }
+    struct sqlfs_path_info path_info;
+    int ret = sqlfs_find_path_info(path, &path_info);
+    if (ret == SQLITE_OK) {
+        // do nothing
+    } else if (ret == SQLITE_DONE) {
+        printf("sqlfs_utimens() '%s' error: no such file\n", path);
+        return -ENOENT;
+    } else {
+        printf("sqlfs_utimens() '%s' error: %s\n", path, sqlite3_errmsg(db));
+        return -EIO;
+    }
+    // TODO fix time
+    sqlite3_bind_int64(update_path_times_by_id_stmt, 1, tv[0].tv_nsec * 1000);
+    sqlite3_bind_int64(update_path_times_by_id_stmt, 2, tv[1].tv_nsec * 1000);
+    sqlite3_bind_int64(update_path_times_by_id_stmt, 3, path_info.id);
+    ret = sqlite3_step(update_path_times_by_id_stmt);
+    sqlite3_reset(update_path_times_by_id_stmt);
+    if (ret == SQLITE_DONE) {
+        ret = sqlfs_mem_reload(path);
+    } else {
+        printf("sqlfs_utimens('%s') error: %s", path, sqlite3_errmsg(db));
+        ret = -EIO;
+    }
+    return ret;
+}
+
+int sqlfs_do_symlink(const char *old_path, const char *new_path) {
+    if (sqlfs_opts.read_only) {
+        return -EROFS;
+    }
+    struct sqlfs_path_info path_info;
+    int ret = sqlfs_find_path_info(new_path, &path_info);
+    if (ret == SQLITE_OK) {
+        return -EEXIST;
+    } else if (ret == SQLITE_DONE) {
+        // do nothing
+    } else {
+        printf("sqlfs_symlink() '%s' error: %s\n", new_path,
+               sqlite3_errmsg(db));
+        return -EIO;
+    }
+
+    uint64_t file_id;
+    ret = sqlfs_insert_file(old_path, strlen(old_path) + 1, 0, &file_id);
+    if (ret != OK) {
+        printf("sqlfs_symlink() '%s' insert file error: %s\n", new_path,
+               sqlite3_errmsg(db));
+        return ret;
+    }
+    ret = sqlfs_insert_path(new_path, 0755, S_IFLNK, file_id);
+    if (ret == OK) {
+        sqlfs_usage_add(new_path, S_IFLNK, strlen(old_path) + 1);
+    }
+    return ret;
+}
+
+int sqlfs_readlink(const char *path, char *buff, size_t size) {
+    struct sqlfs_path_info path_info;
+    int ret = sqlfs_find_path_info(path, &path_info);
+    if (ret == SQLITE_OK) {
+        // do nothing
+    } else if (ret == SQLITE_DONE) {
+        return -ENOENT;
+    } else {
+        printf("sqlfs_readlink() '%s' error: %s\n", path, sqlite3_errmsg(db));
+        return -EIO;
+    }
+    return sqlfs_find_file_content_by_id(path_info.file_id, buff, size);
+}
+
+int sqlfs_do_rename(const char *old_path, const char *new_path,
+                    unsigned int flags) {
+    if (sqlfs_opts.read_only) {
+        return -EROFS;
+    }
+    struct sqlfs_path_info path_info;
+    int ret = sqlfs_find_path_info(old_path, &path_info);
+    if (ret == SQLITE_OK) {
+        // do nothing
+    } else if (ret == SQLITE_DONE) {
+        printf("sqlfs_rename(): '%s' not found\n", old_path);
+        return -ENOENT;
+    } else {
+        printf("sqlfs_rename(): '%s' to '%s' error: %s\n", old_path, new_path,
+               sqlite3_errmsg(db));
+        return -EIO;
+    }
+    struct sqlfs_path_info new_path_info;
+    ret = sqlfs_find_path_info(new_path, &new_path_info);
+    if (ret == SQLITE_OK) {
+        if (S_ISDIR(new_path_info.mode)) {
+            printf("sqlfs_rename(): '%s' is dir\n", new_path);
+            return -EISDIR;
+        }
+        ret = sqlfs_do_unlink(new_path);
+        if (ret != OK) {
+            printf("sqlfs_rename(): '%s' unlink error\n", new_path);
+            return ret;
+        }
+    } else if (ret == SQLITE_DONE) {
+        // do nothings
+    } else {
+        printf("sqlfs_rename(): '%s' new path error %s\n", new_path,
+               sqlite3_errmsg(db));
+    }
+
+    uint64_t parent_id;
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *path_copy = sqlfs_arena_strndup(new_path, strlen(new_path));
+    if (path_copy == NULL) {
+        return -ENOMEM;
+    }
+    ret = sqlfs_find_path_id(dirname(path_copy), &parent_id);
+    sqlfs_arena_release(mark);
+    if (ret == SQLITE_DONE) {
+        printf("sqlfs_rename(): '%s' parent not found\n", new_path);
+        return -ENOENT;
+    } else if (ret != SQLITE_OK) {
+        printf("sqlfs_rename(): '%s' parent error %s\n", new_path,
+               sqlite3_errmsg(db));
+        return -EIO;
+    }
+    sqlite3_bind_text(update_path_name_by_id_stmt, 1, new_path, -1, NULL);
+    sqlite3_bind_int64(update_path_name_by_id_stmt, 2, parent_id);
+    sqlite3_bind_int64(update_path_name_by_id_stmt, 3, path_info.id);
+    ret = sqlite3_step(update_path_name_by_id_stmt);
+    sqlite3_reset(update_path_name_by_id_stmt);
+    if (ret == SQLITE_DONE && S_ISDIR(path_info.mode)) {
+        // children keep their parent_id, only the prefix of their paths moves
+        sqlite3_bind_text(update_path_prefix_stmt, 1, new_path, -1, NULL);
+        sqlite3_bind_text(update_path_prefix_stmt, 2, old_path, -1, NULL);
+        ret = sqlite3_step(update_path_prefix_stmt);
+        sqlite3_reset(update_path_prefix_stmt);
+    }
+    if (ret == SQLITE_DONE) {
+        ret = OK;
+    } else {
+        printf("sqlfs_rename() '%s' to '%s' error: %s\n", old_path, new_path,
+               sqlite3_errmsg(db));
+        ret = -EIO;
+    }
+    if (ret == OK) {
+        sqlfs_usage_rename(old_path, new_path, path_info.mode, path_info.size);
+        ret = sqlfs_mem_rename(old_path, new_path);
+    }
+    return ret;
+}
+
+int sqlfs_do_link(const char *old_path, const char *new_path) {
+    if (sqlfs_opts.read_only) {
+        return -EROFS;
+    }
+    struct sqlfs_path_info path_info;
+    int ret = sqlfs_find_path_info(new_path, &path_info);
+    if (ret == SQLITE_OK) {
+        printf("sqlfs_rename() '%s' exists\n", new_path);
+        return -EEXIST;
+    } else if (ret == SQLITE_DONE) {
+        // do nothing
+    } else {
+        printf("sqlfs_rename() '%s' error: %s\n", new_path, sqlite3_errmsg(db));
+        return -EIO;
+    }
+    ret = sqlfs_find_path_info(old_path, &path_info);
+    if (ret == SQLITE_OK) {
+        // do nothing
+    } else if (ret == SQLITE_DONE) {
+        printf("sqlfs_rename() '%s' not found\n", old_path);
+        return -ENOENT;
+    } else {
+        printf("sqlfs_rename() '%s' error: %s\n", old_path, sqlite3_errmsg(db));
+        return -EIO;
+    }
+    ret = sqlfs_insert_path(new_path, path_info.mode, path_info.mode & S_IFMT,
+                            path_info.file_id);
+    if (ret != OK) {
+        return ret;
+    }
+    sqlfs_usage_add(new_path, path_info.mode, path_info.size);
+
+    sqlite3_bind_int64(increase_file_nlink_by_id_stmt, 1, path_info.file_id);
+
+    ret = sqlite3_step(increase_file_nlink_by_id_stmt);
+    sqlite3_reset(increase_file_nlink_by_id_stmt);
+    if (ret != SQLITE_DONE) {
+        printf("sqlfs_rename(): '%s' sql error %s\n", old_path,
+               sqlite3_errmsg(db));
+        return -EIO;
+    } else {
+        return sqlfs_mem_reload_file(path_info.file_id);
+    }
+}
+
+int sqlfs_do_chmod(const char *path, mode_t mode,
+                   struct fuse_file_info *file_info) {
+    if (sqlfs_opts.read_only) {
+        return -EROFS;
+    }
+    struct sqlfs_path_info path_info;
+    int ret = sqlfs_find_path_info(path, &path_info);
+    if (ret == SQLITE_OK) {
+        // do nothing
+    } else if (ret == SQLITE_DONE) {
+        printf("sqlfs_chmod() '%s' not found", path);
+        return -ENOENT;
+    } else {
+        printf("sqlfs_chmod() '%s' error: %s\n", path, sqlite3_errmsg(db));
+        return -EIO;
+    }
+
+    sqlite3_bind_int(update_path_mode_by_id_stmt, 1, path_info.mode | mode);
+    sqlite3_bind_int64(update_path_mode_by_id_stmt, 2, path_info.id);
+    ret = sqlite3_step(update_path_mode_by_id_stmt);
+    sqlite3_reset(update_path_mode_by_id_stmt);
+    if (ret != SQLITE_DONE) {
+        printf("sqlfs_chmod(): '%s' sql error %s\n", path, sqlite3_errmsg(db));
+        return -EIO;
+    } else {
+        return sqlfs_mem_reload(path);
+    }
+}
+
+int sqlfs_do_chown(const char *path, uid_t uid, gid_t gid,
+                   struct fuse_file_info *file_info) {
+    if (sqlfs_opts.read_only) {
+        return -EROFS;
+    }
+    struct sqlfs_path_info path_info;
+    int ret = sqlfs_find_path_info(path, &path_info);
+    if (ret == SQLITE_OK) {
+        // do nothing
+    } else if (ret == SQLITE_DONE) {
+        printf("sqlfs_chown() '%s' not found", path);
+        return -ENOENT;
+    } else {
+        printf("sqlfs_chown() '%s' error: %s\n", path, sqlite3_errmsg(db));
+        return -EIO;
+    }
+
+    sqlite3_bind_int(update_path_owner_by_id_stmt, 1, gid);
+    sqlite3_bind_int(update_path_owner_by_id_stmt, 2, uid);
+    sqlite3_bind_int64(update_path_owner_by_id_stmt, 3, path_info.file_id);
+    ret = sqlite3_step(update_path_owner_by_id_stmt);
+    sqlite3_reset(update_path_owner_by_id_stmt);
+    if (ret != SQLITE_DONE) {
+        printf("sqlfs_chown(): '%s' sql error %s\n", path, sqlite3_errmsg(db));
+        return -EIO;
+    } else {
+        return sqlfs_mem_reload(path);
+    }
+}
+
+// serializes writes past the end and truncates, which read and charge the
+// stored size; crc.lock does with --checksums
+pthread_mutex_t extend_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// what the last write or truncate of this thread changed the stored size by,
+// as read under that lock, for the tenant wrappers to settle their quota with
+__thread int64_t resized;
+
+int sqlfs_truncate_file_by_id(u_int64_t file_id, off_t new_size) {
+    pthread_mutex_t *lock = crc.enabled ? &crc.lock : &extend_lock;
+    pthread_mutex_lock(lock);
+    int64_t old_size = sqlfs_file_size(file_id);
+    sqlite3_bind_int(update_file_size_by_id_stmt, 1, new_size);
+    sqlite3_bind_int(update_file_size_by_id_stmt, 2, file_id);
+    sqlite3_bind_int(update_file_size_by_id_stmt, 3, new_size);
+    int ret = sqlite3_step(update_file_size_by_id_stmt);
+    sqlite3_reset(update_file_size_by_id_stmt);
+    if (ret != SQLITE_DONE) {
+        pthread_mutex_unlock(lock);
+        printf("sqlfs_truncate_file_by_id(): file_id: %ld sql error %s\n",
+               file_id, sqlite3_errmsg(db));
+        return -EIO;
+    } else {
+        // only shrinking changes the size
+        resized = MIN(new_size - old_size, 0);
+        sqlfs_capacity_charge(resized, 0);
+        sqlfs_usage_resize(file_id, resized);
+        pthread_mutex_unlock(lock);
+        // everything between the old and the new end, including the
+        // partial last chunk on either side
+        sqlfs_cache_invalidate_range(file_id, MIN(new_size, old_size),
+                                     llabs(new_size - old_size));
+        // content snapshots taken at open must not outlive it either
+        sqlfs_content_changed(file_id);
+        return sqlfs_mem_reload_file(file_id);
+    }
+}
+
+int sqlfs_do_truncate(const char *path, off_t new_size,
+                      struct fuse_file_info *file_info) {
+    if (sqlfs_opts.read_only) {
+        return -EROFS;
+    }
+    struct sqlfs_path_info path_info;
+    int ret = sqlfs_find_path_info(path, &path_info);
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_truncate_file_by_id(path_info.file_id, new_size);
+        if (ret == OK) {
+            sqlfs_fts_queue(path_info.file_id);
+        }
+        return ret;
+    } else if (ret == SQLITE_DONE) {
+        printf("sqlfs_truncate() '%s' not found", path);
+        return -ENOENT;
+    } else {
+        printf("sqlfs_truncate() '%s' error: %s\n", path, sqlite3_errmsg(db));
+        return -EIO;
+    }
+}
+
+int sqlfs_ftruncate(const char *path, off_t new_size,
+                    struct fuse_file_info *file_info) {
+    struct sqlfs_file_handle *handle = sqlfs_handle(file_info);
+    int ret = sqlfs_truncate_file_by_id(handle->file_id, new_size);
+    if (ret == OK) {
+        handle->written = true;
+    }
+    return ret;
+}
+
+int sqlfs_write_blob(uint64_t file_id, const char *buff, size_t size,
+                     off_t offset) {
+    sqlite3_blob *blob;
+    int ret = sqlfs_content_blob_open(db, file_id, 1, &blob);
+    if (ret != SQLITE_OK) {
+        printf("write_blob() open blob error: %s",
+               sqlite3_errmsg(sqlfs_content_db(file_id)));
+        sqlite3_blob_close(blob);
+        return -EIO;
+    }
+
+    ret = sqlite3_blob_write(blob, buff, size, offset);
+    if (ret != SQLITE_OK) {
+        printf("write_blob() write blob error: %s",
+               sqlite3_errmsg(sqlfs_content_db(file_id)));
+        sqlite3_blob_close(blob);
+        return -EIO;
+    }
+
+    sqlite3_blob_close(blob);
+    return OK;
+}
+
+/**
+ * @brief write past the end of a file: grow its row with zeros, which also
+ * fill the hole up to `offset`, and then write only the given range in place
+ *
+ * @return OK if no errors, FUSE negated error otherwise.
+ */
+int sqlfs_write_row(struct sqlfs_path_info path_info, const char *buff,
+                    size_t size, off_t offset) {
+    uint64_t new_size = offset + size;
+    sqlite3_stmt *stmt = grow_file_content_by_id_stmt;
+    if (shards.count > 0) {
+        int ret = sqlfs_content_grow(path_info.file_id, path_info.size,
+                                     new_size);
+        if (ret != SQLITE_OK) {
+            printf("sqlfs_write_row(): shard error %s\n",
+                   sqlite3_errmsg(sqlfs_content_db(path_info.file_id)));
+            return -EIO;
+        }
+        // the metadata row keeps a NULL content
+        stmt = update_file_content_by_id_stmt;
+        sqlite3_bind_null(stmt, 1);
+    } else {
+        sqlite3_bind_int64(stmt, 1, path_info.size);
+    }
+    sqlite3_bind_int64(stmt, 2, new_size);
+    sqlite3_bind_int64(stmt, 3, path_info.file_id);
+    int ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (ret != SQLITE_DONE) {
+        printf("sqlfs_write_row(): error %s\n", sqlite3_errmsg(db));
+        return -EIO;
+    }
+    return size > 0 ? sqlfs_write_blob(path_info.file_id, buff, size, offset)
+                    : OK;
+}
+
+int sqlfs_do_write(const char *path, const char *buff, size_t size,
+                   off_t offset, struct fuse_file_info *file_info) {
+    if (sqlfs_opts.read_only) {
+        return -EROFS;
+    }
+    struct sqlfs_path_info path_info;
+    int ret = sqlfs_find_path_info(path, &path_info);
+    if (ret == SQLITE_OK) {
+        // do nothing
+    } else if (ret == SQLITE_DONE) {
+        printf("sqlfs_write() '%s' not found", path);
+        return -ENOENT;
+    } else {
+        printf("sqlfs_write() '%s' error: %s\n", path, sqlite3_errmsg(db));
+        return -EIO;
+    }
+    // the size looked up above may be stale, a concurrent write past the end
+    // may have grown the file since
+    bool extend = offset + size > path_info.size;
+    if (crc.enabled) {
+        pthread_mutex_lock(&crc.lock);
+    } else if (extend) {
+        pthread_mutex_lock(&extend_lock);
+    }
+    if (extend) {
+        path_info.size = sqlfs_file_size(path_info.file_id);
+    }
+    if (offset + size <= path_info.size) {
+        ret = sqlfs_write_blob(path_info.file_id, buff, size, offset);
+    } else {
+        ret = sqlfs_write_row(path_info, buff, size, offset);
+        if (ret == OK) {
+            ret = sqlfs_mem_reload_file(path_info.file_id);
+        }
+    }
+    if (crc.enabled && ret == OK) {
+        // a write past the end also changes the old last chunk
+        ret = sqlfs_crc_update(path_info.file_id,
+                               MIN((uint64_t)offset, path_info.size),
+                               offset + size);
+    }
+    if (ret == OK && file_info != NULL) {
+        sqlfs_handle(file_info)->written = true;
+    }
+    if (ret == OK && offset + size > path_info.size) {
+        resized = offset + size - path_info.size;
+        sqlfs_capacity_charge(resized, 0);
+        sqlfs_usage_resize(path_info.file_id, resized);
+    }
+    if (crc.enabled) {
+        pthread_mutex_unlock(&crc.lock);
+    } else if (extend) {
+        pthread_mutex_unlock(&extend_lock);
+    }
+    sqlfs_content_changed(path_info.file_id);
+    // a write past the end also changes the old last chunk and the hole
+    uint64_t first = MIN((uint64_t)offset, path_info.size);
+    sqlfs_cache_invalidate_range(path_info.file_id, first,
+                                 offset + size - first);
+    if (ret == OK) {
+        return size;
+    } else {
+        printf("sqlfs_write() error");
+        return ret;
+    }
+}
+
+int sqlfs_read(const char *path, char *buff, size_t size, off_t offset,
+               struct fuse_file_info *file_info) {
+    struct sqlfs_file_handle *handle = sqlfs_handle(file_info);
+    // another thread drops the content once it is stale
+    pthread_mutex_lock(&handle->lock);
+    if (handle->content != NULL &&
+        handle->content_gen ==
+            __atomic_load_n(sqlfs_write_gen_slot(handle->file_id),
+                            __ATOMIC_SEQ_CST)) {
+        size_t n = (uint64_t)offset < handle->content_size
+                       ? MIN(size, handle->content_size - offset)
+                       : 0;
+        if (n > 0) {
+            memcpy(buff, handle->content + offset, n);
+        }
+        pthread_mutex_unlock(&handle->lock);
+        __atomic_add_fetch(&small_files.reads, 1, __ATOMIC_RELAXED);
+        sqlfs_heat_add_range(handle->file_id, offset, n);
+        return n;
+    }
+    if (handle->content != NULL) {
+        // written or truncated since open, fall back to SQLite
+        sqlfs_buf_put(handle->content);
+        handle->content = NULL;
+        __atomic_add_fetch(&small_files.stale, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&handle->lock);
+    if (cache.capacity > 0) {
+        int ret = sqlfs_cache_read(handle->file_id, buff, size, offset);
+        if (ret > 0) {
+            sqlfs_heat_add_range(handle->file_id, offset, ret);
+            sqlfs_readahead_update(handle, offset, ret);
+        }
+        return ret;
+    }
+    sqlite3_blob *blob;
+    int ret = sqlfs_content_blob_open(db, handle->file_id, 0, &blob);
+    if (ret != SQLITE_OK) {
+        printf("sqlfs_read() blob open error: %s\n",
+               sqlite3_errmsg(sqlfs_content_db(handle->file_id)));
+        sqlite3_blob_close(blob);
+        return -EIO;
+    }
+    uint64_t blob_size = sqlite3_blob_bytes(blob);
+    uint64_t max_size = offset + size > blob_size ? blob_size - offset : size;
+    ret = sqlite3_blob_read(blob, buff, max_size, offset);
+    if (ret != SQLITE_OK) {
+        printf("sqlfs_read() blob read error: %s\n",
+               sqlite3_errmsg(sqlfs_content_db(handle->file_id)));
+        sqlite3_blob_close(blob);
+        return -EIO;
+    }
+    ret = sqlfs_crc_verify(blob, handle->file_id, buff, offset, max_size);
+    sqlite3_blob_close(blob);
+    if (ret != OK) {
+        return ret;
+    }
+    sqlfs_heat_add_range(handle->file_id, offset, max_size);
+    return max_size;
+}
+
+int sqlfs_release(const char *path, struct fuse_file_info *file_info) {
+    struct sqlfs_file_handle *handle = sqlfs_handle(file_info);
+    if (handle->written) {
+        sqlfs_fts_queue(handle->file_id);
+    }
+    pthread_mutex_destroy(&handle->lock);
+    sqlfs_buf_put(handle->content);
+    sqlfs_buf_put(handle);
+    return OK;
+}
+
+/*
+ * Merkle hashes.
+ *
+ * With --merkle, a file's content hash is a hash over its MERKLE_CHUNK_SIZE
+ * chunk hashes, and a directory's hash rolls up the names and hashes of its
+ * children. A node hash covers mode, owner and content, but not times.
+ * Hashes are computed lazily by `sqlfs hash` and `sqlfs diff` and stored in
+ * chunk_hashes and tree_hashes. Every mutation deletes the stored hash of the
+ * path and of its ancestors, and a write deletes the hashes of the chunks it
+ * touched, in the same savepoint as the mutation. After a change only the
+ * path up to the root is rehashed, and a diff only descends into subtrees
+ * whose hashes differ. A chunk hash also records the chunk length, so when a
+ * file grows, the hash of its old last chunk no longer matches. The flag is
+ * kept in the config table, so the hashes are never left stale by a later
+ * mount without --merkle.
+ */
+#define MERKLE_CHUNK_SIZE (64 * 1024)
+
+/**
+ * @brief 64 bit hash of `len` bytes, a different `seed` gives an unrelated
+ * hash. Not cryptographic: it finds changes, it does not stop an attacker.
+ */
+uint64_t sqlfs_hash64(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = data;
+    uint64_t h = sqlfs_hash_u64(seed ^ (len * 0x9e3779b97f4a7c15ULL));
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ sqlfs_hash_u64(w)) * 0x9e3779b97f4a7c15ULL;
+        h = h << 31 | h >> 33;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p, len);
+    return sqlfs_hash_u64(h ^ sqlfs_hash_u64(tail ^ len));
+}
+
+// statements that drop stored hashes, on the connection that mutates
+struct sqlfs_merkle_forget {
+    sqlite3_stmt *path_stmt;
+    sqlite3_stmt *subtree_stmt;
+    sqlite3_stmt *chunks_stmt;
+    sqlite3_stmt *names_stmt;
+};
+
+int sqlfs_merkle_forget_prepare(sqlite3 *conn, const char *schema,
+                                struct sqlfs_merkle_forget *forget) {
+    char *sql[4] = {
+        sqlite3_mprintf("delete from %s.tree_hashes where path = ?", schema),
+        sqlite3_mprintf("delete from %s.tree_hashes where path > ?1 || '/' "
+                        "and path < ?1 || '0'",
+                        schema),
+        sqlite3_mprintf("delete from %s.chunk_hashes where file_id = ? and "
+                        "chunk between ? and ?",
+                        schema),
+        sqlite3_mprintf("select path from %s.paths where file_id = ?",
+                        schema),
+    };
+    sqlite3_stmt **stmts[4] = {&forget->path_stmt, &forget->subtree_stmt,
+                               &forget->chunks_stmt, &forget->names_stmt};
+    int ret = SQLITE_OK;
+    for (int i = 0; i < 4; i++) {
+        if (ret == SQLITE_OK) {
+            ret = sql[i] != NULL ? sqlite3_prepare_v2(conn, sql[i], -1,
+                                                      stmts[i], NULL)
+                                 : SQLITE_NOMEM;
+        }
+        sqlite3_free(sql[i]);
+    }
+    return ret;
+}
+
+void sqlfs_merkle_forget_finalize(struct sqlfs_merkle_forget *forget) {
+    sqlite3_finalize(forget->path_stmt);
+    sqlite3_finalize(forget->subtree_stmt);
+    sqlite3_finalize(forget->chunks_stmt);
+    sqlite3_finalize(forget->names_stmt);
+}
+
+static int sqlfs_merkle_step(sqlite3_stmt *stmt) {
+    int ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return ret == SQLITE_DONE ? SQLITE_OK : ret;
+}
+
+/**
+ * @brief drop the stored hashes of `path`, its ancestors and, with
+ * `subtree`, everything below it
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_merkle_forget_path(struct sqlfs_merkle_forget *forget,
+                             const char *path, bool subtree) {
+    int ret = SQLITE_OK;
+    if (subtree) {
+        sqlite3_bind_text(forget->subtree_stmt, 1, path, -1, NULL);
+        ret = sqlfs_merkle_step(forget->subtree_stmt);
+    }
+    size_t len = strlen(path);
+    while (ret == SQLITE_OK) {
+        sqlite3_bind_text(forget->path_stmt, 1, len > 0 ? path : "/",
+                          len > 0 ? len : 1, NULL);
+        ret = sqlfs_merkle_step(forget->path_stmt);
+        if (len <= 1) {
+            break;
+        }
+        while (len > 0 && path[--len] != '/') {
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief drop the stored hashes of the chunks of `file_id` overlapping
+ * [`start`, `end`)
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_merkle_forget_chunks(struct sqlfs_merkle_forget *forget,
+                               uint64_t file_id, uint64_t start,
+                               uint64_t end) {
+    if (end <= start) {
+        return SQLITE_OK;
+    }
+    sqlite3_bind_int64(forget->chunks_stmt, 1, file_id);
+    sqlite3_bind_int64(forget->chunks_stmt, 2, start / MERKLE_CHUNK_SIZE);
+    sqlite3_bind_int64(forget->chunks_stmt, 3,
+                       MIN((end - 1) / MERKLE_CHUNK_SIZE, INT64_MAX));
+    return sqlfs_merkle_step(forget->chunks_stmt);
+}
+
+/**
+ * @brief drop the stored hashes of file `file_id` in [`start`, `end`) and of
+ * every name it has
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_merkle_forget_file(struct sqlfs_merkle_forget *forget,
+                             uint64_t file_id, uint64_t start, uint64_t end) {
+    int ret = sqlfs_merkle_forget_chunks(forget, file_id, start, end);
+    sqlite3_bind_int64(forget->names_stmt, 1, file_id);
+    while (ret == SQLITE_OK &&
+           sqlite3_step(forget->names_stmt) == SQLITE_ROW) {
+        ret = sqlfs_merkle_forget_path(
+            forget, (const char *)sqlite3_column_text(forget->names_stmt, 0),
+            false);
+    }
+    sqlite3_reset(forget->names_stmt);
+    return ret;
+}
+
+struct sqlfs_merkle {
+    bool enabled;
+    struct sqlfs_merkle_forget forget;
+    uint64_t forgotten;
+};
+
+struct sqlfs_merkle merkle;
+
+/**
+ * @brief enable hash maintenance when --merkle is given or the database
+ * already has it
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_merkle_open() {
+    sqlite3_stmt *stmt;
+    int ret = sqlite3_prepare_v2(
+        db, "select value from config where key = 'merkle'", -1, &stmt, NULL);
+    if (ret != SQLITE_OK) {
+        return ret;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0)) {
+        sqlfs_opts.merkle = 1;
+    }
+    sqlite3_finalize(stmt);
+    if (!sqlfs_opts.merkle) {
+        return SQLITE_OK;
+    }
+    if (shards.count > 0) {
+        // content commits on other connections, outside the savepoint
+        printf("sqlfs_merkle_open(): sharded databases are not supported\n");
+        return SQLITE_MISUSE;
+    }
+    ret = sqlite3_exec(db,
+                       "insert or replace into config(key, value) "
+                       "values('merkle', 1)",
+                       NULL, NULL, &err_msg);
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_merkle_forget_prepare(db, "main", &merkle.forget);
+    }
+    merkle.enabled = ret == SQLITE_OK;
+    return ret;
+}
+
+/**
+ * @brief drop the stored hashes a mutation of `path` invalidates
+ *
+ * @param subtree the path moved, along with everything below it
+ * @return SQLITE_OK on success
+ */
+int sqlfs_merkle_forget_mutation(const char *path, bool subtree) {
+    merkle.forgotten++;
+    return sqlfs_merkle_forget_path(&merkle.forget, path, subtree);
+}
+
+/**
+ * @brief drop the stored hashes a content change of the file behind `path`
+ * in [`start`, `end`) invalidates, under every name of the file
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_merkle_forget_content(const char *path, uint64_t start,
+                                uint64_t end) {
+    merkle.forgotten++;
+    struct sqlfs_path_info path_info;
+    int ret = sqlfs_find_path_info(path, &path_info);
+    if (ret != SQLITE_OK) {
+        return ret;
+    }
+    return sqlfs_merkle_forget_file(&merkle.forget, path_info.file_id, start,
+                                    end);
+}
+
+void sqlfs_print_merkle_stats(FILE *out) {
+    if (!merkle.enabled) {
+        return;
+    }
+    fprintf(out, "merkle: invalidations %lu\n", merkle.forgotten);
+}
+
+/*
+ * Change journal.
+ *
+ * With --changelog every mutation appends one row to `changelog`, inside a
+ * savepoint that also covers the mutation, so a change is journaled if and
+ * only if it is committed. The savepoint belongs to the connection, so
+ * journaled mutations are serialized by changelog.lock. Content of a sharded
+ * database lives on other connections and is not covered by the savepoint.
+ * `sqlfs changes` tails the journal from a sequence number.
+ */
+enum sqlfs_change_op {
+    CHANGE_CREATE = 1,
+    CHANGE_MKDIR,
+    CHANGE_SYMLINK,
+    CHANGE_LINK,
+    CHANGE_UNLINK,
+    CHANGE_RMDIR,
+    CHANGE_RENAME,
+    CHANGE_WRITE,
+    CHANGE_TRUNCATE,
+    CHANGE_CHMOD,
+    CHANGE_CHOWN,
+    CHANGE_UTIMENS,
+    CHANGE_OP_COUNT,
+};
+
+const char *sqlfs_change_names[CHANGE_OP_COUNT] = {
+    [CHANGE_CREATE] = "create",     [CHANGE_MKDIR] = "mkdir",
+    [CHANGE_SYMLINK] = "symlink",   [CHANGE_LINK] = "link",
+    [CHANGE_UNLINK] = "unlink",     [CHANGE_RMDIR] = "rmdir",
+    [CHANGE_RENAME] = "rename",     [CHANGE_WRITE] = "write",
+    [CHANGE_TRUNCATE] = "truncate", [CHANGE_CHMOD] = "chmod",
+    [CHANGE_CHOWN] = "chown",       [CHANGE_UTIMENS] = "utimens",
+};
+
+struct sqlfs_changelog {
+    // recursive, rename may unlink its target
+    pthread_mutex_t lock;
+    int depth;
+    // seq of our last journaled change, for sqlfs_coherence_poll()
+    int64_t last_seq;
+    uint64_t records;
+    uint64_t errors;
+};
+
+struct sqlfs_changelog changelog;
+
+int sqlfs_changelog_open() {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&changelog.lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    int ret = sqlite3_prepare_v2(db, insert_change_sql, -1,
+                                 &insert_change_stmt, NULL);
+    if (ret == SQLITE_OK)
+        ret = sqlite3_prepare_v2(db, begin_change_sql, -1, &begin_change_stmt,
+                                 NULL);
+    if (ret == SQLITE_OK)
+        ret = sqlite3_prepare_v2(db, commit_change_sql, -1,
+                                 &commit_change_stmt, NULL);
+    if (ret == SQLITE_OK)
+        ret = sqlite3_prepare_v2(db, savepoint_change_sql, -1,
+                                 &savepoint_change_stmt, NULL);
+    if (ret == SQLITE_OK)
+        ret = sqlite3_prepare_v2(db, release_change_sql, -1,
+                                 &release_change_stmt, NULL);
+    if (ret == SQLITE_OK)
+        ret = sqlite3_prepare_v2(db, rollback_change_sql, -1,
+                                 &rollback_change_stmt, NULL);
+    return ret;
+}
+
+int sqlfs_change_step(sqlite3_stmt *stmt) {
+    int ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return ret == SQLITE_DONE ? SQLITE_OK : ret;
+}
+
+/**
+ * @brief whether mutations run in a savepoint, because something has to
+ * commit together with them
+ */
+static bool sqlfs_change_savepoint() {
+    return sqlfs_opts.changelog || merkle.enabled ||
+           (crc.enabled && !sqlfs_opts.read_only);
+}
+
+/**
+ * @brief apply the counter updates queued in the savepoint that was released,
+ * or drop them when it was rolled back
+ */
+static void sqlfs_deferred_end(bool apply) {
+    deferred.active = false;
+    for (int i = 0; i < deferred.count; i++) {
+        struct sqlfs_deferred *item = &deferred.items[i];
+        switch (apply ? item->op : -1) {
+        case DEFER_CAPACITY:
+            sqlfs_capacity_charge(item->bytes, item->inodes);
+            break;
+        case DEFER_USAGE_ADD:
+            sqlfs_usage_add(item->path, item->mode, item->bytes);
+            break;
+        case DEFER_USAGE_REMOVE:
+            sqlfs_usage_remove(item->path, item->mode, item->bytes);
+            break;
+        case DEFER_USAGE_RENAME:
+            sqlfs_usage_rename(item->path, item->target, item->mode,
+                               item->bytes);
+            break;
+        case DEFER_USAGE_RESIZE:
+            sqlfs_usage_resize(item->file_id, item->bytes);
+            break;
+        }
+        free(item->path);
+        free(item->target);
+    }
+    deferred.count = 0;
+}
+
+/**
+ * @brief run `sql` on every shard, whose content writes are not part of the
+ * savepoint on the main database
+ */
+static void sqlfs_change_shards(const char *sql) {
+    for (int i = 0; i < shards.count; i++) {
+        struct sqlfs_shard *shard = &shards.shard[i];
+        pthread_mutex_lock(&shard->lock);
+        if (sqlite3_exec(shard->db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+            printf("sqlfs_change_shards(): '%s' %s\n", sql,
+                   sqlite3_errmsg(shard->db));
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/**
+ * @brief open the savepoint a mutation runs in, and journal it with
+ * sqlfs_change_end() unless this fails
+ *
+ * @return OK, or -EBUSY or -EIO when the savepoint cannot be opened and the
+ * mutation must not run
+ */
+int sqlfs_change_begin() {
+    if (!sqlfs_change_savepoint()) {
+        return OK;
+    }
+    pthread_mutex_lock(&changelog.lock);
+    if (changelog.depth == 0) {
+        int ret = sqlfs_change_step(begin_change_stmt);
+        if (ret == SQLITE_OK) {
+            ret = sqlfs_change_step(savepoint_change_stmt);
+        }
+        if (ret != SQLITE_OK) {
+            printf("sqlfs_change_begin(): %s\n", sqlite3_errmsg(db));
+            // nothing was written in the transaction yet
+            if (!sqlite3_get_autocommit(db)) {
+                sqlfs_change_step(commit_change_stmt);
+            }
+            pthread_mutex_unlock(&changelog.lock);
+            return ret == SQLITE_BUSY ? -EBUSY : -EIO;
+        }
+        sqlfs_change_shards(savepoint_change_sql);
+        deferred.active = true;
+    }
+    changelog.depth++;
+    return OK;
+}
+
+/**
+ * @brief drop the stored Merkle hashes a successful mutation invalidates
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_merkle_forget_change(int op, const char *path, const char *target,
+                               int64_t offset, int64_t length) {
+    switch (op) {
+    case CHANGE_UTIMENS:
+        // times are not hashed
+        return SQLITE_OK;
+    case CHANGE_RENAME: {
+        int ret = sqlfs_merkle_forget_mutation(path, true);
+        return ret == SQLITE_OK ? sqlfs_merkle_forget_mutation(target, true)
+                                : ret;
+    }
+    case CHANGE_WRITE:
+        return sqlfs_merkle_forget_content(path, offset, offset + length);
+    case CHANGE_TRUNCATE:
+        return sqlfs_merkle_forget_content(path, offset, UINT64_MAX);
+    default:
+        return sqlfs_merkle_forget_mutation(path, false);
+    }
+}
+
+/**
+ * @brief journal a mutation that returned `ret` and end its savepoint
+ *
+ * @param op one of CHANGE_*
+ * @param path path the mutation applied to
+ * @param target second path of rename, link and symlink, or NULL
+ * @param offset,length range of a write, new size of a truncate
+ * @return `ret`, or -EIO when the journal or the Merkle hashes cannot be
+ * written and the mutation was rolled back
+ */
+int sqlfs_change_end(int ret, int op, const char *path, const char *target,
+                     int64_t offset, int64_t length) {
+    if (!sqlfs_change_savepoint()) {
+        return ret;
+    }
+    int err = SQLITE_OK;
+    if (ret >= 0 && merkle.enabled) {
+        err = sqlfs_merkle_forget_change(op, path, target, offset, length);
+    }
+    if (ret >= 0 && err == SQLITE_OK && sqlfs_opts.changelog) {
+        sqlite3_bind_int64(insert_change_stmt, 1, time(NULL));
+        sqlite3_bind_int(insert_change_stmt, 2, op);
+        sqlite3_bind_text(insert_change_stmt, 3, path, -1, NULL);
+        if (target != NULL) {
+            sqlite3_bind_text(insert_change_stmt, 4, target, -1, NULL);
+        } else {
+            sqlite3_bind_null(insert_change_stmt, 4);
+        }
+        sqlite3_bind_int64(insert_change_stmt, 5, offset);
+        sqlite3_bind_int64(insert_change_stmt, 6, length);
+        err = sqlfs_change_step(insert_change_stmt);
+        if (err == SQLITE_OK) {
+            changelog.records++;
+            __atomic_store_n(&changelog.last_seq, sqlite3_last_insert_rowid(db),
+                             __ATOMIC_SEQ_CST);
+        }
+    }
+    if (ret >= 0 && err != SQLITE_OK) {
+        printf("sqlfs_change_end(): '%s' error %s\n", path,
+               sqlite3_errmsg(db));
+        changelog.errors++;
+        sqlfs_change_step(rollback_change_stmt);
+        sqlfs_change_shards(rollback_change_sql);
+        // the whole savepoint is undone, with what it queued so far
+        sqlfs_deferred_end(false);
+        deferred.active = changelog.depth > 1;
+        sqlfs_mem_reload(path);
+        if (target != NULL && op != CHANGE_SYMLINK) {
+            sqlfs_mem_reload(target);
+        }
+        ret = -EIO;
+    }
+    if (--changelog.depth == 0) {
+        if (sqlfs_change_step(release_change_stmt) != SQLITE_OK ||
+            (!sqlite3_get_autocommit(db) &&
+             sqlfs_change_step(commit_change_stmt) != SQLITE_OK)) {
+            printf("sqlfs_change_end(): %s\n", sqlite3_errmsg(db));
+        }
+        sqlfs_change_shards(release_change_sql);
+        sqlfs_deferred_end(true);
+    }
+    pthread_mutex_unlock(&changelog.lock);
+    return ret;
+}
+
+int sqlfs_mkdir(const char *path, mode_t mode) {
+    int ret = sqlfs_change_begin();
+    if (ret != OK) {
+        return ret;
+    }
+    return sqlfs_change_end(sqlfs_do_mkdir(path, mode), CHANGE_MKDIR, path,
+                            NULL, 0, 0);
+}
+
+int sqlfs_mknod(const char *path, mode_t mode, dev_t dev) {
+    int ret = sqlfs_change_begin();
+    if (ret != OK) {
+        return ret;
+    }
+    return sqlfs_change_end(sqlfs_do_mknod(path, mode, dev), CHANGE_CREATE,
+                            path, NULL, 0, 0);
+}
+
+int sqlfs_unlink(const char *path) {
+    int ret = sqlfs_change_begin();
+    if (ret != OK) {
+        return ret;
+    }
+    return sqlfs_change_end(sqlfs_do_unlink(path), CHANGE_UNLINK, path, NULL,
+                            0, 0);
+}
+
+int sqlfs_rmdir(const char *path) {
+    int ret = sqlfs_change_begin();
+    if (ret != OK) {
+        return ret;
+    }
+    return sqlfs_change_end(sqlfs_do_rmdir(path), CHANGE_RMDIR, path, NULL, 0,
+                            0);
+}
+
+int sqlfs_utimens(const char *path, const struct timespec tv[2],
+                  struct fuse_file_info *file_info) {
+    int ret = sqlfs_change_begin();
+    if (ret != OK) {
+        return ret;
+    }
+    return sqlfs_change_end(sqlfs_do_utimens(path, tv, file_info),
+                            CHANGE_UTIMENS, path, NULL, 0, 0);
+}
+
+int sqlfs_symlink(const char *old_path, const char *new_path) {
+    int ret = sqlfs_change_begin();
+    if (ret != OK) {
+        return ret;
+    }
+    return sqlfs_change_end(sqlfs_do_symlink(old_path, new_path),
+                            CHANGE_SYMLINK, new_path, old_path, 0, 0);
+}
+
+int sqlfs_rename(const char *old_path, const char *new_path,
+                 unsigned int flags) {
+    int ret = sqlfs_change_begin();
+    if (ret != OK) {
+        return ret;
+    }
+    return sqlfs_change_end(sqlfs_do_rename(old_path, new_path, flags),
+                            CHANGE_RENAME, old_path, new_path, 0, 0);
+}
+
+int sqlfs_link(const char *old_path, const char *new_path) {
+    int ret = sqlfs_change_begin();
+    if (ret != OK) {
+        return ret;
+    }
+    return sqlfs_change_end(sqlfs_do_link(old_path, new_path), CHANGE_LINK,
+                            new_path, old_path, 0, 0);
+}
+
+int sqlfs_chmod(const char *path, mode_t mode,
+                struct fuse_file_info *file_info) {
+    int ret = sqlfs_change_begin();
+    if (ret != OK) {
+        return ret;
+    }
+    return sqlfs_change_end(sqlfs_do_chmod(path, mode, file_info),
+                            CHANGE_CHMOD, path, NULL, 0, mode);
+}
+
+int sqlfs_chown(const char *path, uid_t uid, gid_t gid,
+                struct fuse_file_info *file_info) {
+    int ret = sqlfs_change_begin();
+    if (ret != OK) {
+        return ret;
+    }
+    return sqlfs_change_end(sqlfs_do_chown(path, uid, gid, file_info),
+                            CHANGE_CHOWN, path, NULL, uid, gid);
+}
+
+int sqlfs_truncate(const char *path, off_t new_size,
+                   struct fuse_file_info *file_info) {
+    int ret = sqlfs_change_begin();
+    if (ret != OK) {
+        return ret;
+    }
+    return sqlfs_change_end(sqlfs_do_truncate(path, new_size, file_info),
+                            CHANGE_TRUNCATE, path, NULL, new_size, 0);
+}
+
+int sqlfs_write(const char *path, const char *buff, size_t size, off_t offset,
+                struct fuse_file_info *file_info) {
+    int ret = sqlfs_change_begin();
+    if (ret != OK) {
+        return ret;
+    }
+    return sqlfs_change_end(sqlfs_do_write(path, buff, size, offset, file_info),
+                            CHANGE_WRITE, path, NULL, offset, size);
+}
+
+void sqlfs_print_changelog_stats(FILE *out) {
+    if (!sqlfs_opts.changelog) {
+        return;
+    }
+    fprintf(out, "changelog: records %lu errors %lu\n", changelog.records,
+            changelog.errors);
+}
+
+/*
+ * Replication.
+ *
+ * With --replica=<path> a background thread keeps a follower database in
+ * sync by replaying the changelog. The follower is seeded with the backup
+ * API. After that, every batch of changes is applied in one follower
+ * transaction. The primary is attached read-only, so the batch sees one
+ * snapshot of it. Each path named in the batch is copied over, together with
+ * the files rows it used and uses, and the changelog rows go along too. When
+ * only writes, truncates and attribute changes touched a file whose content
+ * blob has the same length on both sides, only the written byte range of the
+ * blob is copied, otherwise the whole row.
+ * The thread has its own connections and only ever reads the primary, so it
+ * never holds up a FUSE request. The follower can be mounted with
+ * --follower meanwhile.
+ */
+#define REPLICA_BATCH 4096
+#define REPLICA_INTERVAL_MS 100
+#define REPLICA_COPY_SIZE (64 * 1024)
+
+// a path named in a batch, with the content range its writes changed
+struct sqlfs_replica_path {
+    char *path;
+    // the files rows are copied over whole
+    bool whole;
+    uint64_t lo;
+    uint64_t hi;
+};
+
+struct sqlfs_replica {
+    sqlite3 *conn;
+    pthread_t thread;
+    bool running;
+    bool stop;
+    // last change applied to the follower and last one seen on the primary
+    int64_t applied_seq;
+    int64_t primary_seq;
+    // time of the oldest change not applied yet, 0 when caught up
+    int64_t pending_since;
+    uint64_t batches;
+    uint64_t paths;
+    // files rows patched with a byte range instead of copied whole
+    uint64_t patched;
+    uint64_t errors;
+    sqlite3_stmt *head_stmt;
+    sqlite3_stmt *changes_stmt;
+    sqlite3_stmt *old_file_stmt;
+    sqlite3_stmt *delete_path_stmt;
+    sqlite3_stmt *copy_path_stmt;
+    sqlite3_stmt *delete_file_stmt;
+    sqlite3_stmt *copy_file_stmt;
+    sqlite3_stmt *same_length_stmt;
+    sqlite3_stmt *update_file_stmt;
+    sqlite3_stmt *copy_changes_stmt;
+    sqlite3_stmt *rename_prefix_stmt;
+    sqlite3_stmt *delete_crcs_stmt;
+    sqlite3_stmt *copy_crcs_stmt;
+    struct sqlfs_merkle_forget forget;
+};
+
+struct sqlfs_replica replica;
+
+/**
+ * @brief seed an empty follower with a consistent copy of the primary
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_replica_seed() {
+    sqlite3 *src;
+    int ret = sqlite3_open_v2(sqlfs_opts.db_path, &src, SQLITE_OPEN_READONLY,
+                              NULL);
+    if (ret == SQLITE_OK) {
+        sqlite3_backup *backup =
+            sqlite3_backup_init(replica.conn, "main", src, "main");
+        if (backup == NULL) {
+            ret = sqlite3_errcode(replica.conn);
+        } else {
+            // one step is one read transaction, a consistent snapshot
+            ret = sqlite3_backup_step(backup, -1);
+            sqlite3_backup_finish(backup);
+            ret = ret == SQLITE_DONE ? SQLITE_OK : ret;
+        }
+    }
+    sqlite3_close(src);
+    return ret;
+}
+
+int sqlfs_replica_open() {
+    int ret = sqlite3_open(sqlfs_opts.replica, &replica.conn);
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_config_conn(replica.conn);
+    }
+    sqlite3_stmt *stmt = NULL;
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(
+            replica.conn,
+            "select count(*) from sqlite_schema where name = 'changelog'", -1,
+            &stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        bool seeded =
+            sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+        if (!seeded) {
+            ret = sqlfs_replica_seed();
+        }
+    }
+    if (ret == SQLITE_OK) {
+        // a follower seeded by an older version lacks the newer tables
+        ret = sqlite3_exec(replica.conn, create_tables_sql, NULL, NULL, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        // the content index and the directory usage are not replicated, a
+        // writable mount rebuilds them
+        ret = sqlite3_exec(replica.conn,
+                           "update config set value = 2 where key in ('fts', "
+                           "'usage')",
+                           NULL, NULL, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        char *uri = sqlfs_db_uri(sqlfs_opts.db_path, "mode=ro");
+        char *sql = sqlite3_mprintf("attach %Q as src", uri);
+        ret = uri != NULL && sql != NULL
+                  ? sqlite3_exec(replica.conn, sql, NULL, NULL, NULL)
+                  : SQLITE_NOMEM;
+        sqlite3_free(sql);
+        free(uri);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(
+            replica.conn,
+            "select (select ifnull(max(seq), 0) from main.changelog), "
+            "(select ifnull(max(seq), 0) from src.changelog)",
+            -1, &replica.head_stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(
+            replica.conn,
+            "select seq, time, op, path, target, offset, length from "
+            "src.changelog where seq > ? order by seq limit ?",
+            -1, &replica.changes_stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(
+            replica.conn,
+            "select file_id from main.paths where path = ?1 union select "
+            "file_id from src.paths where path = ?1",
+            -1, &replica.old_file_stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(replica.conn,
+                                 "delete from main.paths where path = ?", -1,
+                                 &replica.delete_path_stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        // ids are kept, a renamed row replaces its old self
+        ret = sqlite3_prepare_v2(replica.conn,
+                                 "insert or replace into main.paths select * "
+                                 "from src.paths where path = ?",
+                                 -1, &replica.copy_path_stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(replica.conn,
+                                 "delete from main.files where id = ?", -1,
+                                 &replica.delete_file_stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(replica.conn,
+                                 "insert into main.files select * from "
+                                 "src.files where id = ?",
+                                 -1, &replica.copy_file_stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        // length() of a blob reads its header, not its pages
+        ret = sqlite3_prepare_v2(
+            replica.conn,
+            "select length(m.content) from main.files m join src.files s on "
+            "s.id = m.id where m.id = ? and length(m.content) is "
+            "length(s.content)",
+            -1, &replica.same_length_stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(
+            replica.conn,
+            "update main.files set (nlink, dev, size) = (select nlink, dev, "
+            "size from src.files where id = ?1) where id = ?1",
+            -1, &replica.update_file_stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(replica.conn,
+                                 "insert into main.changelog select * from "
+                                 "src.changelog where seq > ? and seq <= ?",
+                                 -1, &replica.copy_changes_stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        // main comes first in name resolution, this moves follower rows
+        ret = sqlite3_prepare_v2(replica.conn, update_path_prefix_sql, -1,
+                                 &replica.rename_prefix_stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(
+            replica.conn, "delete from main.chunk_crcs where file_id = ?", -1,
+            &replica.delete_crcs_stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(replica.conn,
+                                 "insert into main.chunk_crcs select * from "
+                                 "src.chunk_crcs where file_id = ?",
+                                 -1, &replica.copy_crcs_stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        // the follower's Merkle hashes of what the batch copies
+        ret = sqlfs_merkle_forget_prepare(replica.conn, "main",
+                                          &replica.forget);
+    }
+    return ret;
+}
+
+int sqlfs_replica_exec(sqlite3_stmt *stmt) {
+    int ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return ret == SQLITE_DONE ? SQLITE_OK : ret;
+}
+
+/**
+ * @brief bring files row `file_id` up to date by copying the columns other
+ * than content and bytes [lo, hi) of the content blob
+ *
+ * @return SQLITE_OK on success, SQLITE_DONE when the blobs differ in length
+ * and the row has to be copied whole
+ */
+static int sqlfs_replica_patch_file(uint64_t file_id, uint64_t lo,
+                                    uint64_t hi) {
+    sqlite3_bind_int64(replica.same_length_stmt, 1, file_id);
+    int ret = sqlite3_step(replica.same_length_stmt);
+    uint64_t length = sqlite3_column_int64(replica.same_length_stmt, 0);
+    sqlite3_reset(replica.same_length_stmt);
+    if (ret != SQLITE_ROW) {
+        return ret == SQLITE_DONE ? SQLITE_DONE : ret;
+    }
+    sqlite3_bind_int64(replica.update_file_stmt, 1, file_id);
+    ret = sqlfs_replica_exec(replica.update_file_stmt);
+    hi = MIN(hi, length);
+    if (ret != SQLITE_OK || lo >= hi) {
+        return ret;
+    }
+    sqlite3_blob *src = NULL;
+    sqlite3_blob *dst = NULL;
+    char *buff = sqlfs_buf_get(REPLICA_COPY_SIZE);
+    ret = buff != NULL ? SQLITE_OK : SQLITE_NOMEM;
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_blob_open(replica.conn, "src", "files", "content",
+                                file_id, 0, &src);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_blob_open(replica.conn, "main", "files", "content",
+                                file_id, 1, &dst);
+    }
+    for (uint64_t offset = lo; offset < hi && ret == SQLITE_OK;
+         offset += REPLICA_COPY_SIZE) {
+        int len = MIN(REPLICA_COPY_SIZE, hi - offset);
+        ret = sqlite3_blob_read(src, buff, len, offset);
+        if (ret == SQLITE_OK) {
+            ret = sqlite3_blob_write(dst, buff, len, offset);
+        }
+    }
+    sqlite3_blob_close(src);
+    sqlite3_blob_close(dst);
+    sqlfs_buf_put(buff);
+    return ret;
+}
+
+/**
+ * @brief copy `path` and every files row it references on either side, or
+ * only content bytes [lo, hi) of them unless `whole`
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_replica_copy_path(const char *path, bool whole, uint64_t lo,
+                            uint64_t hi) {
+    uint64_t file_ids[2];
+    int count = 0;
+    sqlite3_bind_text(replica.old_file_stmt, 1, path, -1, NULL);
+    while (sqlite3_step(replica.old_file_stmt) == SQLITE_ROW && count < 2) {
+        if (sqlite3_column_type(replica.old_file_stmt, 0) != SQLITE_NULL) {
+            file_ids[count++] = sqlite3_column_int64(replica.old_file_stmt, 0);
+        }
+    }
+    int ret = sqlite3_reset(replica.old_file_stmt);
+    sqlite3_bind_text(replica.delete_path_stmt, 1, path, -1, NULL);
+    sqlite3_bind_text(replica.copy_path_stmt, 1, path, -1, NULL);
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_replica_exec(replica.delete_path_stmt);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_replica_exec(replica.copy_path_stmt);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_merkle_forget_path(&replica.forget, path, true);
+    }
+    for (int i = 0; i < count && ret == SQLITE_OK; i++) {
+        bool patched = false;
+        if (!whole) {
+            ret = sqlfs_replica_patch_file(file_ids[i], lo, hi);
+            patched = ret == SQLITE_OK;
+            ret = ret == SQLITE_DONE ? SQLITE_OK : ret;
+        }
+        if (patched) {
+            replica.patched++;
+        } else if (ret == SQLITE_OK) {
+            sqlite3_bind_int64(replica.delete_file_stmt, 1, file_ids[i]);
+            sqlite3_bind_int64(replica.copy_file_stmt, 1, file_ids[i]);
+            ret = sqlfs_replica_exec(replica.delete_file_stmt);
+            if (ret == SQLITE_OK) {
+                ret = sqlfs_replica_exec(replica.copy_file_stmt);
+            }
+        }
+        sqlite3_bind_int64(replica.delete_crcs_stmt, 1, file_ids[i]);
+        sqlite3_bind_int64(replica.copy_crcs_stmt, 1, file_ids[i]);
+        if (ret == SQLITE_OK) {
+            ret = sqlfs_replica_exec(replica.delete_crcs_stmt);
+        }
+        if (ret == SQLITE_OK) {
+            ret = sqlfs_replica_exec(replica.copy_crcs_stmt);
+        }
+        if (ret == SQLITE_OK && (!patched || lo < hi)) {
+            ret = sqlfs_merkle_forget_file(&replica.forget, file_ids[i],
+                                           patched ? lo : 0,
+                                           patched ? hi : UINT64_MAX);
+        }
+    }
+    replica.paths++;
+    return ret;
+}
+
+/**
+ * @brief replay the rename of a directory onto the rows below it, which have
+ * no changelog records of their own, and onto the paths of the batch so far
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_replica_rename(const char *old_path, const char *new_path,
+                                struct sqlfs_replica_path *paths,
+                                int path_count) {
+    sqlite3_bind_text(replica.rename_prefix_stmt, 1, new_path, -1, NULL);
+    sqlite3_bind_text(replica.rename_prefix_stmt, 2, old_path, -1, NULL);
+    int ret = sqlfs_replica_exec(replica.rename_prefix_stmt);
+    size_t old_len = strlen(old_path);
+    for (int i = 0; i < path_count && ret == SQLITE_OK; i++) {
+        const char *path = paths[i].path;
+        if (strncmp(path, old_path, old_len) != 0 || path[old_len] != '/') {
+            continue;
+        }
+        char *moved = malloc(strlen(new_path) + strlen(path + old_len) + 1);
+        if (moved == NULL) {
+            ret = SQLITE_NOMEM;
+            break;
+        }
+        strcat(strcpy(moved, new_path), path + old_len);
+        free(paths[i].path);
+        paths[i].path = moved;
+    }
+    return ret;
+}
+
+/**
+ * @brief apply the next batch of changes to the follower
+ *
+ * @return number of changes applied, -1 on error
+ */
+int sqlfs_replica_apply() {
+    int ret = sqlite3_exec(replica.conn, "begin immediate", NULL, NULL, NULL);
+    if (ret != SQLITE_OK) {
+        // the follower is busy, try again next round
+        return ret == SQLITE_BUSY ? 0 : -1;
+    }
+    int64_t applied = 0;
+    if (sqlite3_step(replica.head_stmt) == SQLITE_ROW) {
+        applied = sqlite3_column_int64(replica.head_stmt, 0);
+        __atomic_store_n(&replica.primary_seq,
+                         sqlite3_column_int64(replica.head_stmt, 1),
+                         __ATOMIC_RELAXED);
+    }
+    ret = sqlite3_reset(replica.head_stmt);
+    __atomic_store_n(&replica.applied_seq, applied, __ATOMIC_RELAXED);
+
+    // the paths of a batch, each copied once however often it changed
+    struct sqlfs_replica_path *paths = NULL;
+    int path_count = 0;
+    int64_t last = applied;
+    sqlite3_bind_int64(replica.changes_stmt, 1, applied);
+    sqlite3_bind_int(replica.changes_stmt, 2, REPLICA_BATCH);
+    while (ret == SQLITE_OK &&
+           sqlite3_step(replica.changes_stmt) == SQLITE_ROW) {
+        if (last == applied) {
+            __atomic_store_n(&replica.pending_since,
+                             sqlite3_column_int64(replica.changes_stmt, 1),
+                             __ATOMIC_RELAXED);
+        }
+        last = sqlite3_column_int64(replica.changes_stmt, 0);
+        int op = sqlite3_column_int(replica.changes_stmt, 2);
+        // these keep the content blob, except for the bytes written
+        bool whole = op != CHANGE_WRITE && op != CHANGE_TRUNCATE &&
+                     op != CHANGE_CHMOD && op != CHANGE_CHOWN &&
+                     op != CHANGE_UTIMENS && op != CHANGE_RENAME;
+        uint64_t lo = 0;
+        uint64_t hi = 0;
+        if (op == CHANGE_WRITE) {
+            lo = sqlite3_column_int64(replica.changes_stmt, 5);
+            hi = lo + sqlite3_column_int64(replica.changes_stmt, 6);
+        }
+        if (op == CHANGE_RENAME) {
+            ret = sqlfs_replica_rename(
+                (const char *)sqlite3_column_text(replica.changes_stmt, 3),
+                (const char *)sqlite3_column_text(replica.changes_stmt, 4),
+                paths, path_count);
+        }
+        for (int col = 3; col <= 4; col++) {
+            const char *path =
+                (const char *)sqlite3_column_text(replica.changes_stmt, col);
+            // a symlink's target is its content, not a path of ours
+            if (path == NULL || (col == 4 && op == CHANGE_SYMLINK)) {
+                continue;
+            }
+            struct sqlfs_replica_path *seen = NULL;
+            for (int i = 0; i < path_count && seen == NULL; i++) {
+                seen = strcmp(paths[i].path, path) == 0 ? &paths[i] : NULL;
+            }
+            if (seen == NULL) {
+                struct sqlfs_replica_path *grown =
+                    realloc(paths, (path_count + 1) * sizeof(*paths));
+                char *copy = grown != NULL ? strdup(path) : NULL;
+                if (copy == NULL) {
+                    paths = grown != NULL ? grown : paths;
+                    ret = SQLITE_NOMEM;
+                    break;
+                }
+                paths = grown;
+                seen = &paths[path_count++];
+                seen->path = copy;
+                seen->whole = false;
+                seen->lo = lo;
+                seen->hi = hi;
+            }
+            seen->whole = seen->whole || whole;
+            if (lo < hi) {
+                seen->lo = seen->lo < seen->hi ? MIN(seen->lo, lo) : lo;
+                seen->hi = MAX(seen->hi, hi);
+            }
+        }
+    }
+    sqlite3_reset(replica.changes_stmt);
+    for (int i = 0; i < path_count && ret == SQLITE_OK; i++) {
+        ret = sqlfs_replica_copy_path(paths[i].path, paths[i].whole,
+                                      paths[i].lo, paths[i].hi);
+    }
+    for (int i = 0; i < path_count; i++) {
+        free(paths[i].path);
+    }
+    free(paths);
+    if (ret == SQLITE_OK && last > applied) {
+        sqlite3_bind_int64(replica.copy_changes_stmt, 1, applied);
+        sqlite3_bind_int64(replica.copy_changes_stmt, 2, last);
+        ret = sqlfs_replica_exec(replica.copy_changes_stmt);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_exec(replica.conn, "commit", NULL, NULL, NULL);
+    }
+    if (ret != SQLITE_OK) {
+        printf("sqlfs_replica_apply(): %s\n", sqlite3_errmsg(replica.conn));
+        sqlite3_exec(replica.conn, "rollback", NULL, NULL, NULL);
+        replica.errors++;
+        return -1;
+    }
+    __atomic_store_n(&replica.applied_seq, last, __ATOMIC_RELAXED);
+    if (last == __atomic_load_n(&replica.primary_seq, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&replica.pending_since, 0, __ATOMIC_RELAXED);
+    }
+    if (last > applied) {
+        replica.batches++;
+    }
+    return last - applied;
+}
+
+void *sqlfs_replica_thread(void *arg) {
+    int ret = sqlfs_replica_open();
+    if (ret != SQLITE_OK) {
+        printf("sqlfs_replica_open(): %s: %s\n", sqlfs_opts.replica,
+               sqlite3_errmsg(replica.conn));
+        replica.errors++;
+        return NULL;
+    }
+    while (!__atomic_load_n(&replica.stop, __ATOMIC_RELAXED)) {
+        // a full batch means there is more, go on at once
+        if (sqlfs_replica_apply() < REPLICA_BATCH) {
+            usleep(REPLICA_INTERVAL_MS * 1000);
+        }
+    }
+    return NULL;
+}
+
+void sqlfs_replica_start() {
+    replica.stop = false;
+    if (pthread_create(&replica.thread, NULL, sqlfs_replica_thread, NULL) ==
+        0) {
+        replica.running = true;
+    }
+}
+
+void sqlfs_replica_stop() {
+    __atomic_store_n(&replica.stop, true, __ATOMIC_RELAXED);
+    if (replica.running) {
+        pthread_join(replica.thread, NULL);
+        replica.running = false;
+    }
+    sqlite3_finalize(replica.head_stmt);
+    sqlite3_finalize(replica.changes_stmt);
+    sqlite3_finalize(replica.old_file_stmt);
+    sqlite3_finalize(replica.delete_path_stmt);
+    sqlite3_finalize(replica.copy_path_stmt);
+    sqlite3_finalize(replica.delete_file_stmt);
+    sqlite3_finalize(replica.copy_file_stmt);
+    sqlite3_finalize(replica.same_length_stmt);
+    sqlite3_finalize(replica.update_file_stmt);
+    sqlite3_finalize(replica.copy_changes_stmt);
+    sqlite3_finalize(replica.rename_prefix_stmt);
+    sqlite3_finalize(replica.delete_crcs_stmt);
+    sqlite3_finalize(replica.copy_crcs_stmt);
+    sqlfs_merkle_forget_finalize(&replica.forget);
+    sqlite3_close(replica.conn);
+    replica.conn = NULL;
+}
+
+void sqlfs_print_replica_stats(FILE *out) {
+    if (sqlfs_opts.replica == NULL) {
+        return;
+    }
+    int64_t applied = __atomic_load_n(&replica.applied_seq, __ATOMIC_RELAXED);
+    int64_t primary = __atomic_load_n(&replica.primary_seq, __ATOMIC_RELAXED);
+    int64_t since = __atomic_load_n(&replica.pending_since, __ATOMIC_RELAXED);
+    fprintf(out,
+            "replica: %s applied %ld of %ld lag %ld changes %ld s batches %lu "
+            "paths %lu patched %lu errors %lu\n",
+            sqlfs_opts.replica, applied, primary, primary - applied,
+            since > 0 ? MAX(time(NULL) - since, 0) : 0, replica.batches,
+            replica.paths, replica.patched, replica.errors);
+}
+
+/*
+ * Tenants.
+ *
+ * With --tenants one daemon serves several filesystems out of one database.
+ * Tenant <name> owns the subtree /<name>; its mount sees that directory as
+ * its root. All tenants share the connection, the caches and the background
+ * threads, so the page cache, the writer and the checkpointer are shared too.
+ * Usage is counted per tenant at mount and kept up to date by the wrappers
+ * below. They reserve what a mutation may add before running it, so
+ * concurrent writers cannot together overshoot the quota, fail with EDQUOT
+ * when it does not fit and give the reservation back when the mutation
+ * fails.
+ */
+#define MAX_TENANTS 256
+
+struct sqlfs_tenant {
+    char *name;
+    char *mountpoint;
+    // "/<name>", prepended to every path of the tenant
+    char *prefix;
+    size_t prefix_len;
+    // 0 for no limit, given on the command line or stored in `tenants`
+    uint64_t quota_bytes;
+    uint64_t quota_inodes;
+    bool has_quota;
+    int64_t used_bytes;
+    int64_t used_inodes;
+    uint64_t ops;
+    uint64_t quota_errors;
+    struct fuse *fuse;
+    pthread_t thread;
+};
+
+struct sqlfs_tenants {
+    int count;
+    struct sqlfs_tenant tenant[MAX_TENANTS];
+    int running;
+};
+
+struct sqlfs_tenants tenants;
+
+/**
+ * @brief parse --tenants=<name>:<mountpoint>[:<bytes>[:<inodes>]][,...]
+ *
+ * @return 0 on success, -1 on a malformed list
+ */
+int sqlfs_tenants_parse(const char *list) {
+    char *copy = strdup(list);
+    if (copy == NULL) {
+        return -1;
+    }
+    char *save;
+    for (char *spec = strtok_r(copy, ",", &save); spec != NULL;
+         spec = strtok_r(NULL, ",", &save)) {
+        if (tenants.count == MAX_TENANTS) {
+            printf("--tenants: at most %d tenants\n", MAX_TENANTS);
+            return -1;
+        }
+        struct sqlfs_tenant *t = &tenants.tenant[tenants.count];
+        char *field_save;
+        char *name = strtok_r(spec, ":", &field_save);
+        char *mountpoint = strtok_r(NULL, ":", &field_save);
+        char *bytes = strtok_r(NULL, ":", &field_save);
+        char *inodes = strtok_r(NULL, ":", &field_save);
+        if (name == NULL || mountpoint == NULL || strchr(name, '/') != NULL ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            printf("--tenants: bad tenant '%s'\n", spec);
+            return -1;
+        }
+        for (int i = 0; i < tenants.count; i++) {
+            if (strcmp(tenants.tenant[i].name, name) == 0) {
+                printf("--tenants: tenant '%s' given twice\n", name);
+                return -1;
+            }
+        }
+        t->name = name;
+        t->mountpoint = mountpoint;
+        t->prefix_len = strlen(name) + 1;
+        t->prefix = malloc(t->prefix_len + 1);
+        if (t->prefix == NULL) {
+            return -1;
+        }
+        snprintf(t->prefix, t->prefix_len + 1, "/%s", name);
+        if (bytes != NULL) {
+            t->quota_bytes = strtoull(bytes, NULL, 0);
+            t->quota_inodes = inodes != NULL ? strtoull(inodes, NULL, 0) : 0;
+            t->has_quota = true;
+        }
+        tenants.count++;
+    }
+    // names and mountpoints point into the copy, it lives as long as we do
+    return 0;
+}
+
+/**
+ * @brief create or load tenant `t`: its root directory, its quotas and the
+ * usage of its subtree
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_tenant_open(struct sqlfs_tenant *t) {
+    sqlite3_stmt *stmt;
+    int ret;
+    if (!sqlfs_opts.read_only) {
+        uint64_t id;
+        ret = sqlfs_find_path_id(t->prefix, &id);
+        if (ret == SQLITE_DONE) {
+            // runs after sqlfs_mem_load(): sqlfs_insert_path() also adds the
+            // root to the in-memory copy of --mem-meta
+            ret = sqlfs_insert_path(t->prefix, 0755, S_IFDIR, 0) == OK
+                      ? SQLITE_OK
+                      : SQLITE_ERROR;
+            if (ret == SQLITE_OK) {
+                sqlfs_usage_add(t->prefix, S_IFDIR, 0);
+            }
+        }
+        if (ret != SQLITE_OK) {
+            printf("sqlfs_tenant_open(): cannot create '%s'\n", t->prefix);
+            return ret;
+        }
+        if (t->has_quota) {
+            ret = sqlite3_prepare_v2(
+                db,
+                "insert into tenants(name, quota_bytes, quota_inodes) "
+                "values(?, ?, ?) on conflict(name) do update set quota_bytes "
+                "= excluded.quota_bytes, quota_inodes = excluded.quota_inodes",
+                -1, &stmt, NULL);
+            if (ret == SQLITE_OK) {
+                sqlite3_bind_text(stmt, 1, t->name, -1, NULL);
+                sqlite3_bind_int64(stmt, 2, t->quota_bytes);
+                sqlite3_bind_int64(stmt, 3, t->quota_inodes);
+                ret = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK
+                                                        : SQLITE_ERROR;
+            }
+            sqlite3_finalize(stmt);
+            if (ret != SQLITE_OK) {
+                return ret;
+            }
+        }
+    }
+    if (!t->has_quota) {
+        ret = sqlite3_prepare_v2(
+            db, "select quota_bytes, quota_inodes from tenants where name = ?",
+            -1, &stmt, NULL);
+        if (ret != SQLITE_OK) {
+            return ret;
+        }
+        sqlite3_bind_text(stmt, 1, t->name, -1, NULL);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            t->quota_bytes = sqlite3_column_int64(stmt, 0);
+            t->quota_inodes = sqlite3_column_int64(stmt, 1);
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    // everything below /<name>/ sorts between "/<name>/" and "/<name>0"
+    ret = sqlite3_prepare_v2(
+        db,
+        "select count(*), ifnull(sum(f.size), 0) from paths p left join "
+        "files f on p.file_id = f.id where p.path > ?1 || '/' and p.path < "
+        "?1 || '0'",
+        -1, &stmt, NULL);
+    if (ret != SQLITE_OK) {
+        return ret;
+    }
+    sqlite3_bind_text(stmt, 1, t->prefix, -1, NULL);
+    ret = sqlite3_step(stmt);
+    if (ret == SQLITE_ROW) {
+        t->used_inodes = sqlite3_column_int64(stmt, 0);
+        t->used_bytes = sqlite3_column_int64(stmt, 1);
+        ret = SQLITE_OK;
+    }
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+int sqlfs_tenants_open() {
+    int ret = SQLITE_OK;
+    for (int i = 0; i < tenants.count && ret == SQLITE_OK; i++) {
+        ret = sqlfs_tenant_open(&tenants.tenant[i]);
+    }
+    return ret;
+}
+
+struct sqlfs_tenant *sqlfs_tenant() {
+    struct sqlfs_tenant *t = fuse_get_context()->private_data;
+    __atomic_add_fetch(&t->ops, 1, __ATOMIC_RELAXED);
+    return t;
+}
+
+/**
+ * @brief map a path of tenant `t` into the shared tree, allocated from the
+ * request arena
+ */
+char *sqlfs_tenant_path(struct sqlfs_tenant *t, const char *path) {
+    size_t len = is_root_dir(path) ? 0 : strlen(path);
+    char *full = sqlfs_arena_alloc(t->prefix_len + len + 1);
+    if (full != NULL) {
+        memcpy(full, t->prefix, t->prefix_len);
+        memcpy(full + t->prefix_len, path, len);
+        full[t->prefix_len + len] = '\0';
+    }
+    return full;
+}
+
+void sqlfs_tenant_charge(struct sqlfs_tenant *t, int64_t bytes,
+                         int64_t inodes) {
+    __atomic_add_fetch(&t->used_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->used_inodes, inodes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief add `amount` to `*used` unless that exceeds `quota`, 0 for none
+ */
+static bool sqlfs_tenant_take(int64_t *used, int64_t amount, uint64_t quota) {
+    if (amount <= 0 || quota == 0) {
+        __atomic_add_fetch(used, amount, __ATOMIC_RELAXED);
+        return true;
+    }
+    int64_t old = __atomic_load_n(used, __ATOMIC_RELAXED);
+    do {
+        if (old + amount > (int64_t)quota) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(used, &old, old + amount, false,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
+
+/**
+ * @brief charge tenant `t` for `bytes` and `inodes` before a mutation. The
+ * caller charges them back when the mutation fails.
+ *
+ * @return OK or -EDQUOT, with nothing charged
+ */
+int sqlfs_tenant_reserve(struct sqlfs_tenant *t, int64_t bytes,
+                         int64_t inodes) {
+    if (sqlfs_tenant_take(&t->used_bytes, bytes, t->quota_bytes)) {
+        if (sqlfs_tenant_take(&t->used_inodes, inodes, t->quota_inodes)) {
+            return OK;
+        }
+        sqlfs_tenant_charge(t, -bytes, 0);
+    }
+    __atomic_add_fetch(&t->quota_errors, 1, __ATOMIC_RELAXED);
+    return -EDQUOT;
+}
+
+int sqlfs_tenant_getattr(const char *path, struct stat *stat,
+                         struct fuse_file_info *fi) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    int ret = full != NULL ? sqlfs_getattr(full, stat, fi) : -ENOMEM;
+    sqlfs_arena_release(mark);
+    return ret;
+}
+
+int sqlfs_tenant_open_file(const char *path, struct fuse_file_info *file_info) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    int ret = full != NULL ? sqlfs_open(full, file_info) : -ENOMEM;
+    sqlfs_arena_release(mark);
+    return ret;
+}
+
+int sqlfs_tenant_opendir(const char *path, struct fuse_file_info *file_info) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    int ret = full != NULL ? sqlfs_opendir(full, file_info) : -ENOMEM;
+    sqlfs_arena_release(mark);
+    return ret;
+}
+
+int sqlfs_tenant_readdir(const char *path, void *buff, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *file_info,
+                         enum fuse_readdir_flags flags) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    int ret = full != NULL ? sqlfs_readdir(full, buff, filler, offset,
+                                           file_info, flags)
+                           : -ENOMEM;
+    sqlfs_arena_release(mark);
+    return ret;
+}
+
+int sqlfs_tenant_mkdir(const char *path, mode_t mode) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    int ret = sqlfs_tenant_reserve(t, 0, 1);
+    if (ret != OK) {
+        return ret;
+    }
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    ret = full != NULL ? sqlfs_mkdir(full, mode) : -ENOMEM;
+    sqlfs_arena_release(mark);
+    if (ret != OK) {
+        sqlfs_tenant_charge(t, 0, -1);
+    }
+    return ret;
+}
+
+int sqlfs_tenant_mknod(const char *path, mode_t mode, dev_t dev) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    int ret = sqlfs_tenant_reserve(t, 0, 1);
+    if (ret != OK) {
+        return ret;
+    }
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    ret = full != NULL ? sqlfs_mknod(full, mode, dev) : -ENOMEM;
+    sqlfs_arena_release(mark);
+    if (ret != OK) {
+        sqlfs_tenant_charge(t, 0, -1);
+    }
+    return ret;
+}
+
+int sqlfs_tenant_unlink(const char *path) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    struct sqlfs_path_info path_info = {0};
+    int ret = -ENOMEM;
+    if (full != NULL) {
+        sqlfs_find_path_info(full, &path_info);
+        ret = sqlfs_unlink(full);
+    }
+    sqlfs_arena_release(mark);
+    if (ret == OK) {
+        sqlfs_tenant_charge(t, -(int64_t)path_info.size, -1);
+    }
+    return ret;
+}
+
+int sqlfs_tenant_rmdir(const char *path) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    int ret = full != NULL ? sqlfs_rmdir(full) : -ENOMEM;
+    sqlfs_arena_release(mark);
+    if (ret == OK) {
+        sqlfs_tenant_charge(t, 0, -1);
+    }
+    return ret;
+}
+
+int sqlfs_tenant_utimens(const char *path, const struct timespec tv[2],
+                         struct fuse_file_info *fi) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    int ret = full != NULL ? sqlfs_utimens(full, tv, fi) : -ENOMEM;
+    sqlfs_arena_release(mark);
+    return ret;
+}
+
+int sqlfs_tenant_symlink(const char *old_path, const char *new_path) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    // the target is stored as it is, only the link lives in the tenant
+    int64_t size = strlen(old_path) + 1;
+    int ret = sqlfs_tenant_reserve(t, size, 1);
+    if (ret != OK) {
+        return ret;
+    }
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, new_path);
+    ret = full != NULL ? sqlfs_symlink(old_path, full) : -ENOMEM;
+    sqlfs_arena_release(mark);
+    if (ret != OK) {
+        sqlfs_tenant_charge(t, -size, -1);
+    }
+    return ret;
+}
+
+int sqlfs_tenant_readlink(const char *path, char *buff, size_t size) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    int ret = full != NULL ? sqlfs_readlink(full, buff, size) : -ENOMEM;
+    sqlfs_arena_release(mark);
+    return ret;
+}
+
+int sqlfs_tenant_rename(const char *old_path, const char *new_path,
+                        unsigned int flags) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full_old = sqlfs_tenant_path(t, old_path);
+    char *full_new = sqlfs_tenant_path(t, new_path);
+    struct sqlfs_path_info replaced;
+    int ret = -ENOMEM;
+    int found = SQLITE_DONE;
+    if (full_old != NULL && full_new != NULL) {
+        found = sqlfs_find_path_info(full_new, &replaced);
+        ret = sqlfs_rename(full_old, full_new, flags);
+    }
+    sqlfs_arena_release(mark);
+    if (ret == OK && found == SQLITE_OK) {
+        sqlfs_tenant_charge(t, -(int64_t)replaced.size, -1);
+    }
+    return ret;
+}
+
+int sqlfs_tenant_link(const char *old_path, const char *new_path) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full_old = sqlfs_tenant_path(t, old_path);
+    char *full_new = sqlfs_tenant_path(t, new_path);
+    struct sqlfs_path_info path_info = {0};
+    int ret = -ENOMEM;
+    if (full_old != NULL && full_new != NULL) {
+        sqlfs_find_path_info(full_old, &path_info);
+        // every name of a file is charged its size, as at mount
+        ret = sqlfs_tenant_reserve(t, path_info.size, 1);
+        if (ret == OK) {
+            ret = sqlfs_link(full_old, full_new);
+            if (ret != OK) {
+                sqlfs_tenant_charge(t, -(int64_t)path_info.size, -1);
+            }
+        }
+    }
+    sqlfs_arena_release(mark);
+    return ret;
+}
+
+int sqlfs_tenant_chmod(const char *path, mode_t mode,
+                       struct fuse_file_info *fi) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    int ret = full != NULL ? sqlfs_chmod(full, mode, fi) : -ENOMEM;
+    sqlfs_arena_release(mark);
+    return ret;
+}
+
+int sqlfs_tenant_chown(const char *path, uid_t uid, gid_t gid,
+                       struct fuse_file_info *fi) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    int ret = full != NULL ? sqlfs_chown(full, uid, gid, fi) : -ENOMEM;
+    sqlfs_arena_release(mark);
+    return ret;
+}
+
+int sqlfs_tenant_truncate(const char *path, off_t new_size,
+                          struct fuse_file_info *file_info) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    resized = 0;
+    int ret = full != NULL ? sqlfs_truncate(full, new_size, file_info)
+                           : -ENOMEM;
+    sqlfs_arena_release(mark);
+    if (ret == OK) {
+        sqlfs_tenant_charge(t, resized, 0);
+    }
+    return ret;
+}
+
+int sqlfs_tenant_write(const char *path, const char *buff, size_t size,
+                       off_t offset, struct fuse_file_info *file_info) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    struct sqlfs_path_info path_info = {0};
+    int64_t growth = 0;
+    int ret = -ENOMEM;
+    if (full != NULL) {
+        sqlfs_find_path_info(full, &path_info);
+        // checked against the quota before the write, from a size that
+        // may be stale; settled with what the write grew the file by
+        growth = MAX((int64_t)(offset + size) - (int64_t)path_info.size, 0);
+        ret = sqlfs_tenant_reserve(t, growth, 0);
+        if (ret == OK) {
+            resized = 0;
+            ret = sqlfs_write(full, buff, size, offset, file_info);
+            sqlfs_tenant_charge(t, (ret < 0 ? 0 : resized) - growth, 0);
+        }
+    }
+    sqlfs_arena_release(mark);
+    return ret;
+}
+
+int sqlfs_tenant_getxattr(const char *path, const char *name, char *value,
+                          size_t size) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    int ret = full != NULL ? sqlfs_getxattr(full, name, value, size) : -ENOMEM;
+    sqlfs_arena_release(mark);
+    return ret;
+}
+
+int sqlfs_tenant_listxattr(const char *path, char *list, size_t size) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    struct sqlfs_arena_mark mark = sqlfs_arena_mark();
+    char *full = sqlfs_tenant_path(t, path);
+    int ret = full != NULL ? sqlfs_listxattr(full, list, size) : -ENOMEM;
+    sqlfs_arena_release(mark);
+    return ret;
+}
+
+/**
+ * @brief the shared capacity, narrowed to the quotas of the tenant
+ */
+int sqlfs_tenant_statfs(const char *path, struct statvfs *st) {
+    struct sqlfs_tenant *t = sqlfs_tenant();
+    int ret = sqlfs_statfs(path, st);
+    if (ret != OK) {
+        return ret;
+    }
+    if (t->quota_bytes > 0) {
+        uint64_t used = MAX(__atomic_load_n(&t->used_bytes, __ATOMIC_RELAXED),
+                            0);
+        uint64_t left = t->quota_bytes > used ? t->quota_bytes - used : 0;
+        st->f_blocks = t->quota_bytes / st->f_frsize;
+        st->f_bfree = MIN(st->f_bfree, left / st->f_frsize);
+        st->f_bavail = MIN(st->f_bavail, left / st->f_frsize);
+    }
+    if (t->quota_inodes > 0) {
+        uint64_t used = MAX(
+            __atomic_load_n(&t->used_inodes, __ATOMIC_RELAXED), 0);
+        uint64_t left = t->quota_inodes > used ? t->quota_inodes - used : 0;
+        st->f_files = t->quota_inodes;
+        st->f_ffree = MIN(st->f_ffree, left);
+        st->f_favail = MIN(st->f_favail, left);
+    }
+    return OK;
+}
+
+void sqlfs_print_tenant_stats(FILE *out) {
+    for (int i = 0; i < tenants.count; i++) {
+        struct sqlfs_tenant *t = &tenants.tenant[i];
+        fprintf(out,
+                "tenant %s: mountpoint %s bytes %ld of %lu inodes %ld of %lu "
+                "ops %lu quota errors %lu\n",
+                t->name, t->mountpoint,
+                __atomic_load_n(&t->used_bytes, __ATOMIC_RELAXED),
+                t->quota_bytes,
+                __atomic_load_n(&t->used_inodes, __ATOMIC_RELAXED),
+                t->quota_inodes, __atomic_load_n(&t->ops, __ATOMIC_RELAXED),
+                __atomic_load_n(&t->quota_errors, __ATOMIC_RELAXED));
+    }
+}
+
+/*
+ * Coherence.
+ *
+ * Other processes may write the database too: a second mount, the
+ * replication of a follower, an indexer. With --coherence=<ms> a background
+ * thread polls PRAGMA data_version, which only moves when another connection
+ * commits. The changelog rows since the last poll name what changed: those
+ * paths are reloaded into the in-memory metadata, their cached chunks are
+ * dropped and the kernel is told to forget them. A commit that journaled
+ * nothing came from a writer without --changelog, and everything is dropped.
+ * The kernel is notified from this thread only; from a request it could
+ * deadlock on the inode being served.
+ */
+struct sqlfs_coherence {
+    pthread_t thread;
+    bool running;
+    bool stop;
+    // the mount without --tenants
+    struct fuse *fuse;
+    sqlite3 *conn;
+    sqlite3_stmt *changes_stmt;
+    sqlite3_stmt *names_stmt;
+    sqlite3_stmt *subtree_stmt;
+    int64_t seen_seq;
+    uint64_t polls;
+    uint64_t commits;
+    uint64_t changes;
+    uint64_t resets;
+    uint64_t notifications;
+};
+
+struct sqlfs_coherence coherence;
+
+/**
+ * @brief tell the kernel to forget `path`, on whichever mount shows it
+ */
+void sqlfs_coherence_notify(const char *path) {
+    if (tenants.count == 0) {
+        if (coherence.fuse != NULL) {
+            fuse_invalidate_path(coherence.fuse, path);
+            coherence.notifications++;
+        }
+        return;
+    }
+    for (int i = 0; i < tenants.count; i++) {
+        struct sqlfs_tenant *t = &tenants.tenant[i];
+        if (t->fuse != NULL && strncmp(path, t->prefix, t->prefix_len) == 0 &&
+            (path[t->prefix_len] == '\0' || path[t->prefix_len] == '/')) {
+            fuse_invalidate_path(t->fuse, path[t->prefix_len] != '\0'
+                                              ? path + t->prefix_len
+                                              : "/");
+            coherence.notifications++;
+        }
+    }
+}
+
+/**
+ * @brief forget what is cached about one journaled change of `path`
+ */
+void sqlfs_coherence_apply(int op, const char *path, int64_t offset,
+                           int64_t length) {
+    sqlfs_mem_reload(path);
+    sqlfs_coherence_notify(path);
+    // the other names of the file show its new size too
+    sqlite3_bind_text(coherence.names_stmt, 1, path, -1, NULL);
+    while (sqlite3_step(coherence.names_stmt) == SQLITE_ROW) {
+        const char *name =
+            (const char *)sqlite3_column_text(coherence.names_stmt, 0);
+        uint64_t file_id = sqlite3_column_int64(coherence.names_stmt, 1);
+        if (strcmp(name, path) != 0) {
+            sqlfs_mem_reload(name);
+            sqlfs_coherence_notify(name);
+            continue;
+        }
+        if (op == CHANGE_WRITE) {
+            sqlfs_cache_invalidate_range(file_id, offset, length);
+        } else {
+            sqlfs_cache_invalidate_file(file_id);
+        }
+        sqlfs_content_changed(file_id);
+    }
+    sqlite3_reset(coherence.names_stmt);
+}
+
+/**
+ * @brief move what is cached about `path` and everything below it to
+ * `target`, after another connection renamed it
+ */
+void sqlfs_coherence_rename(const char *path, const char *target) {
+    sqlfs_mem_rename(path, target);
+    // the kernel knows the descendants by their old and their new names
+    size_t target_len = strlen(target);
+    sqlite3_bind_text(coherence.subtree_stmt, 1, target, -1, NULL);
+    while (sqlite3_step(coherence.subtree_stmt) == SQLITE_ROW) {
+        const char *name =
+            (const char *)sqlite3_column_text(coherence.subtree_stmt, 0);
+        const char *rest = name + target_len;
+        char *old = malloc(strlen(path) + strlen(rest) + 1);
+        if (old != NULL) {
+            sqlfs_coherence_notify(strcat(strcpy(old, path), rest));
+            free(old);
+        }
+        sqlfs_coherence_notify(name);
+    }
+    sqlite3_reset(coherence.subtree_stmt);
+}
+
+/**
+ * @brief forget everything, nobody said what changed
+ */
+void sqlfs_coherence_reset() {
+    if (sqlfs_opts.mem_meta && sqlfs_mem_reset() != SQLITE_OK) {
+        printf("sqlfs_coherence_reset(): %s\n", sqlite3_errmsg(db));
+    }
+    sqlfs_cache_invalidate_all();
+    // every handle rereads what it prefetched
+    sqlfs_content_changed(0);
+    sqlfs_coherence_notify("/");
+    for (int i = 0; i < tenants.count; i++) {
+        sqlfs_coherence_notify(tenants.tenant[i].prefix);
+    }
+    coherence.resets++;
+}
+
+int sqlfs_coherence_open() {
+    // data_version has to be read on the connection that does our writes
+    pthread_mutex_lock(&data_version.lock);
+    int ret = sqlite3_prepare_v2(db, "PRAGMA data_version", -1,
+                                 &data_version.stmt, NULL);
+    if (ret == SQLITE_OK) {
+        data_version.seen = sqlfs_data_version_read();
+    }
+    pthread_mutex_unlock(&data_version.lock);
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_open_reader(&coherence.conn);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(
+            coherence.conn,
+            "select p2.path, p2.file_id from paths p1 join paths p2 on "
+            "p2.file_id = p1.file_id where p1.path = ?",
+            -1, &coherence.names_stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(coherence.conn,
+                                 "select path from paths where path > ?1 || "
+                                 "'/' and path < ?1 || '0'",
+                                 -1, &coherence.subtree_stmt, NULL);
+    }
+    // without a changelog every outside commit resets everything
+    if (ret == SQLITE_OK &&
+        sqlite3_prepare_v2(coherence.conn,
+                           "select seq, op, path, target, offset, length from "
+                           "changelog where seq > ? order by seq",
+                           -1, &coherence.changes_stmt, NULL) == SQLITE_OK) {
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(coherence.conn,
+                               "select ifnull(max(seq), 0) from changelog", -1,
+                               &stmt, NULL) == SQLITE_OK &&
+            sqlite3_step(stmt) == SQLITE_ROW) {
+            coherence.seen_seq = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return ret;
+}
+
+/**
+ * @brief one poll: handle the changes committed by other connections
+ */
+void sqlfs_coherence_poll() {
+    // our own changes up to here are known, see below
+    int64_t own_seq = __atomic_load_n(&changelog.last_seq, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&data_version.lock);
+    int64_t version = sqlfs_data_version_read();
+    bool outside = version != -1 && version != data_version.seen;
+    if (outside) {
+        data_version.seen = version;
+    }
+    pthread_mutex_unlock(&data_version.lock);
+    coherence.polls++;
+    if (!outside) {
+        // nobody else committed, so no foreign row sorts before own_seq
+        coherence.seen_seq = MAX(coherence.seen_seq, own_seq);
+        return;
+    }
+    coherence.commits++;
+    // the counters only follow our own mutations
+    sqlfs_usage_outside_commit();
+    sqlfs_capacity_outside_commit();
+    int rows = 0;
+    if (coherence.changes_stmt != NULL) {
+        sqlite3_bind_int64(coherence.changes_stmt, 1, coherence.seen_seq);
+        while (sqlite3_step(coherence.changes_stmt) == SQLITE_ROW) {
+            sqlite3_stmt *stmt = coherence.changes_stmt;
+            int op = sqlite3_column_int(stmt, 1);
+            const char *path = (const char *)sqlite3_column_text(stmt, 2);
+            const char *target = (const char *)sqlite3_column_text(stmt, 3);
+            int64_t offset = sqlite3_column_int64(stmt, 4);
+            int64_t length = sqlite3_column_int64(stmt, 5);
+            coherence.seen_seq = sqlite3_column_int64(stmt, 0);
+            if (op == CHANGE_RENAME && target != NULL) {
+                sqlfs_coherence_rename(path, target);
+            }
+            sqlfs_coherence_apply(op, path, offset, length);
+            if (target != NULL && op != CHANGE_SYMLINK) {
+                sqlfs_coherence_apply(op, target, offset, length);
+            }
+            rows++;
+        }
+        sqlite3_reset(coherence.changes_stmt);
+    }
+    coherence.changes += rows;
+    if (rows == 0) {
+        sqlfs_coherence_reset();
+    }
+}
+
+void *sqlfs_coherence_thread(void *arg) {
+    while (!__atomic_load_n(&coherence.stop, __ATOMIC_RELAXED)) {
+        usleep(sqlfs_opts.coherence * 1000);
+        sqlfs_coherence_poll();
+    }
+    return NULL;
+}
+
+void sqlfs_coherence_start(struct fuse *fuse) {
+    coherence.fuse = fuse;
+    if (sqlfs_coherence_open() != SQLITE_OK) {
+        printf("sqlfs_coherence_open(): %s\n", sqlite3_errmsg(db));
+        return;
+    }
+    coherence.stop = false;
+    if (pthread_create(&coherence.thread, NULL, sqlfs_coherence_thread,
+                       NULL) == 0) {
+        coherence.running = true;
+    }
+}
+
+void sqlfs_coherence_stop() {
+    __atomic_store_n(&coherence.stop, true, __ATOMIC_RELAXED);
+    if (coherence.running) {
+        pthread_join(coherence.thread, NULL);
+        coherence.running = false;
+    }
+    pthread_mutex_lock(&data_version.lock);
+    sqlite3_finalize(data_version.stmt);
+    data_version.stmt = NULL;
+    pthread_mutex_unlock(&data_version.lock);
+    sqlite3_finalize(coherence.changes_stmt);
+    sqlite3_finalize(coherence.names_stmt);
+    sqlite3_finalize(coherence.subtree_stmt);
+    sqlite3_close(coherence.conn);
+}
+
+void sqlfs_print_coherence_stats(FILE *out) {
+    if (sqlfs_opts.coherence == 0) {
+        return;
+    }
+    fprintf(out,
+            "coherence: polls %lu outside commits %lu changes %lu resets %lu "
+            "kernel notifications %lu seen seq %ld\n",
+            coherence.polls, coherence.commits, coherence.changes,
+            coherence.resets, coherence.notifications, coherence.seen_seq);
+}
+
+void sqlfs_print_stats(FILE *out) {
+    fprintf(out,
+            "tuning: page_size %d cache_size %d temp_store %d "
+            "wal_autocheckpoint %d busy_timeout %d chunk_size %u\n",
+            sqlfs_pragma_int(db, "page_size"),
+            sqlfs_pragma_int(db, "cache_size"),
+            sqlfs_pragma_int(db, "temp_store"),
+            sqlfs_pragma_int(db, "wal_autocheckpoint"),
+            sqlfs_pragma_int(db, "busy_timeout"), sqlfs_opts.chunk_size);
+    sqlfs_print_memory_stats(out);
+    sqlfs_print_mmap_stats(out);
+    sqlfs_print_direct_stats(out);
+    sqlfs_print_shard_stats(out);
+    sqlfs_print_tenant_stats(out);
+    sqlfs_print_changelog_stats(out);
+    sqlfs_print_merkle_stats(out);
+    sqlfs_print_crc_stats(out);
+    sqlfs_print_fts_stats(out);
+    sqlfs_print_usage_stats(out);
+    sqlfs_print_capacity_stats(out);
+    sqlfs_print_replica_stats(out);
+    sqlfs_print_coherence_stats(out);
+    fprintf(out, "alloc: heap %lu pool hits %lu kept %lu\n",
+            __atomic_load_n(&alloc_stats.heap_allocs, __ATOMIC_RELAXED),
+            __atomic_load_n(&alloc_stats.pool_hits, __ATOMIC_RELAXED),
+            __atomic_load_n(&alloc_stats.kept, __ATOMIC_RELAXED));
+    if (sqlfs_opts.mem_meta) {
+        pthread_rwlock_rdlock(&mem.lock);
+        fprintf(out, "mem-meta: entries %u names %u\n", mem.live_entries - 1,
+                mem.name_count);
+        pthread_rwlock_unlock(&mem.lock);
+    }
+    if (sqlfs_opts.warmup) {
+        fprintf(out, "heatmap: tracked %u of %u\n", heat.count, HEAT_SLOTS);
+    }
+    if (cache.capacity > 0) {
+        pthread_mutex_lock(&cache.lock);
+        fprintf(out,
+                "cache: capacity %lu used %lu (t1 %lu t2 %lu p %lu) ghosts "
+                "%lu hits %lu misses %lu evictions %lu invalidations %lu\n",
+                cache.capacity,
+                cache.lists[CACHE_T1].bytes + cache.lists[CACHE_T2].bytes,
+                cache.lists[CACHE_T1].bytes, cache.lists[CACHE_T2].bytes,
+                cache.p,
+                cache.lists[CACHE_B1].bytes + cache.lists[CACHE_B2].bytes,
+                cache.hits, cache.misses, cache.evictions, cache.invalidations);
+        pthread_mutex_unlock(&cache.lock);
+    }
+    if (sqlfs_opts.prefetch_small > 0) {
+        fprintf(out,
+                "prefetch-small: threshold %lu files %lu bytes %lu reads %lu "
+                "stale %lu\n",
+                sqlfs_opts.prefetch_small, small_files.files, small_files.bytes,
+                small_files.reads, small_files.stale);
+    }
+    if (sqlfs_opts.readahead > 0) {
+        pthread_mutex_lock(&ra_queue.lock);
+        fprintf(out, "readahead: max window %lu queued %lu dropped %lu chunks %lu\n",
+                sqlfs_opts.readahead, ra_queue.queued, ra_queue.dropped,
+                ra_queue.chunks);
+        pthread_mutex_unlock(&ra_queue.lock);
+    }
+    fflush(out);
+}
+
+/**
+ * @brief print stats to --stats-file, or to stdout without it
+ */
+void sqlfs_write_stats() {
+    if (sqlfs_opts.stats_file == NULL) {
+        sqlfs_print_stats(stdout);
+        return;
+    }
+    FILE *out = fopen(sqlfs_opts.stats_file, "a");
+    if (out == NULL) {
+        syslog(LOG_ERR, "sqlfs: cannot open --stats-file %s: %m",
+               sqlfs_opts.stats_file);
+        return;
+    }
+    sqlfs_print_stats(out);
+    fclose(out);
+}
+
+/**
+ * @brief print stats on every SIGUSR1. main() blocks the signal before any
+ * thread is started, so only this thread receives it.
+ */
+void *sqlfs_stats_thread(void *arg) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    int sig;
+    while (sigwait(&set, &sig) == 0) {
+        sqlfs_write_stats();
+    }
+    return NULL;
+}
+
+// mounts served by this process, more than one with --tenants
+int sqlfs_mounts;
+
+void *sqlfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    // the tenant given to fuse_new() stays the private data of its mount
+    void *private_data = fuse_get_context()->private_data;
+    if (__atomic_fetch_add(&sqlfs_mounts, 1, __ATOMIC_SEQ_CST) > 0) {
+        return private_data;
+    }
+    // threads have to be started here, after fuse_main() daemonized
+    pthread_t stats_thread;
+    if (pthread_create(&stats_thread, NULL, sqlfs_stats_thread, NULL) == 0) {
+        pthread_detach(stats_thread);
+    }
+    sqlfs_mmap_advise();
+    if (sqlfs_opts.warmup) {
+        sqlfs_heat_start();
+    }
+    if (sqlfs_opts.readahead > 0) {
+        sqlfs_readahead_start();
+    }
+    if (sqlfs_opts.replica != NULL) {
+        sqlfs_replica_start();
+    }
+    if (sqlfs_opts.coherence > 0) {
+        sqlfs_coherence_start(fuse_get_context()->fuse);
+    }
+    if (crc.enabled && sqlfs_opts.scrub_rate > 0) {
+        sqlfs_scrub_start();
+    }
+    if (fts.enabled) {
+        sqlfs_fts_start();
+    }
+    return private_data;
+}
+
+void sqlfs_destroy(void *private_data) {
+    if (__atomic_sub_fetch(&sqlfs_mounts, 1, __ATOMIC_SEQ_CST) > 0) {
+        return;
+    }
+    sqlfs_scrub_stop();
+    sqlfs_fts_stop();
+    sqlfs_usage_close();
+    if (sqlfs_opts.coherence > 0) {
+        sqlfs_coherence_stop();
+    }
+    if (sqlfs_opts.replica != NULL) {
+        sqlfs_replica_stop();
+    }
+    sqlfs_readahead_stop();
+    if (sqlfs_opts.warmup) {
+        sqlfs_heat_stop();
+    }
+    sqlfs_write_stats();
+    sqlfs_shards_close();
+    sqlite3_close(db);
+}
+
+struct fuse_operations operations = {.getattr = sqlfs_getattr,
+                                     .init = sqlfs_init,
+                                     .destroy = sqlfs_destroy,
+                                     .open = sqlfs_open,
+                                     .opendir = sqlfs_opendir,
+                                     .readdir = sqlfs_readdir,
+                                     .mkdir = sqlfs_mkdir,
+                                     .mknod = sqlfs_mknod,
+                                     .unlink = sqlfs_unlink,
+                                     .rmdir = sqlfs_rmdir,
+                                     .utimens = sqlfs_utimens,
+                                     .symlink = sqlfs_symlink,
+                                     .readlink = sqlfs_readlink,
+                                     .rename = sqlfs_rename,
+                                     .link = sqlfs_link,
+                                     .chmod = sqlfs_chmod,
+                                     .chown = sqlfs_chown,
+                                     .truncate = sqlfs_truncate,
+                                     .write = sqlfs_write,
+                                     .read = sqlfs_read,
+                                     .release = sqlfs_release,
+                                     .getxattr = sqlfs_getxattr,
+                                     .listxattr = sqlfs_listxattr,
+                                     .statfs = sqlfs_statfs};
+
+// read and release only use the file handle
+struct fuse_operations tenant_operations = {
+    .getattr = sqlfs_tenant_getattr,
+    .init = sqlfs_init,
+    .destroy = sqlfs_destroy,
+    .open = sqlfs_tenant_open_file,
+    .opendir = sqlfs_tenant_opendir,
+    .readdir = sqlfs_tenant_readdir,
+    .mkdir = sqlfs_tenant_mkdir,
+    .mknod = sqlfs_tenant_mknod,
+    .unlink = sqlfs_tenant_unlink,
+    .rmdir = sqlfs_tenant_rmdir,
+    .utimens = sqlfs_tenant_utimens,
+    .symlink = sqlfs_tenant_symlink,
+    .readlink = sqlfs_tenant_readlink,
+    .rename = sqlfs_tenant_rename,
+    .link = sqlfs_tenant_link,
+    .chmod = sqlfs_tenant_chmod,
+    .chown = sqlfs_tenant_chown,
+    .truncate = sqlfs_tenant_truncate,
+    .write = sqlfs_tenant_write,
+    .read = sqlfs_read,
+    .release = sqlfs_release,
+    .getxattr = sqlfs_tenant_getxattr,
+    .listxattr = sqlfs_tenant_listxattr,
+    .statfs = sqlfs_tenant_statfs};
+
+struct sqlfs_tenant_loop_args {
+    struct sqlfs_tenant *tenant;
+    struct fuse_cmdline_opts *cmdline;
+};
+
+void *sqlfs_tenant_loop(void *arg) {
+    struct sqlfs_tenant_loop_args *loop = arg;
+    struct fuse_loop_config config = {
+        .clone_fd = loop->cmdline->clone_fd,
+        .max_idle_threads = loop->cmdline->max_idle_threads};
+    if (loop->cmdline->singlethread) {
+        fuse_loop(loop->tenant->fuse);
+    } else {
+        fuse_loop_mt(loop->tenant->fuse, &config);
+    }
+    // a tenant unmounted from outside keeps the others running
+    if (__atomic_sub_fetch(&tenants.running, 1, __ATOMIC_SEQ_CST) == 0) {
+        kill(getpid(), SIGTERM);
+    }
+    return NULL;
+}
+
+/**
+ * @brief mount every tenant and serve them until SIGINT, SIGTERM or SIGHUP,
+ * or until all of them are unmounted
+ *
+ * @return exit status
+ */
+int sqlfs_tenants_main(struct fuse_args *args) {
+    struct fuse_cmdline_opts cmdline;
+    if (fuse_parse_cmdline(args, &cmdline) != 0) {
+        return 1;
+    }
+    if (cmdline.mountpoint != NULL) {
+        printf("--tenants: mountpoints are given per tenant, not '%s'\n",
+               cmdline.mountpoint);
+        free(cmdline.mountpoint);
+        return 1;
+    }
+    struct sqlfs_tenant_loop_args loops[MAX_TENANTS];
+    int ret = 0;
+    int mounted = 0;
+    for (int i = 0; i < tenants.count; i++) {
+        struct sqlfs_tenant *t = &tenants.tenant[i];
+        // fuse_new() consumes the options it knows, every mount gets a copy
+        struct fuse_args tenant_args = FUSE_ARGS_INIT(0, NULL);
+        for (int j = 0; j < args->argc; j++) {
+            assert(fuse_opt_add_arg(&tenant_args, args->argv[j]) == 0);
+        }
+        t->fuse = fuse_new(&tenant_args, &tenant_operations,
+                           sizeof(tenant_operations), t);
+        fuse_opt_free_args(&tenant_args);
+        if (t->fuse == NULL) {
+            ret = 1;
+            break;
+        }
+        if (fuse_mount(t->fuse, t->mountpoint) != 0) {
+            printf("sqlfs_tenants_main(): cannot mount '%s' on '%s'\n",
+                   t->name, t->mountpoint);
+            fuse_destroy(t->fuse);
+            ret = 1;
+            break;
+        }
+        mounted = i + 1;
+    }
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (ret == 0) {
+        fuse_daemonize(cmdline.foreground);
+        for (int i = 0; i < mounted; i++) {
+            loops[i].tenant = &tenants.tenant[i];
+            loops[i].cmdline = &cmdline;
+            __atomic_add_fetch(&tenants.running, 1, __ATOMIC_SEQ_CST);
+            if (pthread_create(&tenants.tenant[i].thread, NULL,
+                               sqlfs_tenant_loop, &loops[i]) != 0) {
+                __atomic_sub_fetch(&tenants.running, 1, __ATOMIC_SEQ_CST);
+                tenants.tenant[i].thread = 0;
+                ret = 1;
+                break;
+            }
+        }
+        int sig;
+        if (ret == 0) {
+            sigwait(&set, &sig);
+        }
+    }
+    for (int i = 0; i < mounted; i++) {
+        fuse_exit(tenants.tenant[i].fuse);
+        // wakes up the loop threads blocked reading the session
+        fuse_unmount(tenants.tenant[i].fuse);
+    }
+    for (int i = 0; i < mounted; i++) {
+        if (tenants.tenant[i].thread != 0) {
+            pthread_join(tenants.tenant[i].thread, NULL);
+        }
+        fuse_destroy(tenants.tenant[i].fuse);
+    }
+    return ret;
+}
+
+int sqlfs_prepare_stmt(const char *sql, sqlite3_stmt **stmt) {
+    return sqlite3_prepare_v2(db, sql, -1, stmt, NULL);
+}
+
+int sqlfs_open_db(const char *db_path) {
+    return sqlfs_open_conn(db_path, &db);
+}
+
+/**
+ * @brief apply --page-size. A new database just takes the pragma; an existing
+ * one is rebuilt by VACUUM, which cannot change the page size in WAL mode.
+ * create_tables_sql switches back to WAL afterwards.
+ *
+ * @return SQLITE_OK on success
+ */
+int sqlfs_apply_page_size() {
+    char sql[128];
+    if (sqlfs_opts.page_size == 0 ||
+        sqlfs_pragma_int(db, "page_size") == sqlfs_opts.page_size) {
+        return SQLITE_OK;
+    }
+    if (sqlfs_pragma_int(db, "page_count") == 0) {
+        snprintf(sql, sizeof(sql), "PRAGMA page_size = %d",
+                 sqlfs_opts.page_size);
+    } else {
+        printf("changing page size to %d, this rewrites the database\n",
+               sqlfs_opts.page_size);
+        snprintf(sql, sizeof(sql),
+                 "PRAGMA journal_mode = DELETE; PRAGMA page_size = %d; VACUUM",
+                 sqlfs_opts.page_size);
+    }
+    return sqlite3_exec(db, sql, NULL, NULL, &err_msg);
+}
+
+int sqlfs_init_db() {
+    int ret = SQLITE_OK;
+
+    // an image mounted --read-only is used as it is
+    if (!sqlfs_opts.read_only)
+        ret = sqlfs_apply_page_size();
+    if (ret == SQLITE_OK && !sqlfs_opts.read_only)
+        ret = sqlite3_exec(db, create_tables_sql, NULL, NULL, &err_msg);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_shards_open();
+    if (ret == SQLITE_OK)
+        ret = sqlfs_crc_open();
+    if (ret == SQLITE_OK)
+        ret = sqlfs_fts_open();
+    if (ret == SQLITE_OK)
+        ret = sqlfs_usage_open();
+    if (ret == SQLITE_OK)
+        ret = sqlfs_capacity_open();
+
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(select_file_by_path_sql,
+                                 &select_file_by_path_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(select_path_by_name_sql,
+                                 &select_path_by_name_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(select_file_id_by_path_sql,
+                                 &select_file_id_by_path_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(select_path_id_by_path_sql,
+                                 &select_path_id_by_path_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(select_stats_by_parent_id_sql,
+                                 &select_stats_by_parent_id_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(insert_path_sql, &insert_path_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(insert_file_sql, &insert_file_stmt);
+
+    if (ret == SQLITE_OK)
+        ret =
+            sqlfs_prepare_stmt(delete_path_by_id_sql, &delete_path_by_id_stmt);
+    if (ret == SQLITE_OK)
+        ret =
+            sqlfs_prepare_stmt(delete_file_by_id_sql, &delete_file_by_id_stmt);
+
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(select_file_nlink_by_id_sql,
+                                 &select_file_nlink_by_id_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(select_path_info_by_path_sql,
+                                 &select_path_info_by_path_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(count_dir_items_by_id_sql,
+                                 &count_dir_items_by_id_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(update_path_times_by_id_sql,
+                                 &update_path_times_by_id_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(increase_file_nlink_by_id_sql,
+                                 &increase_file_nlink_by_id_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(decrease_file_nlink_by_id_sql,
+                                 &decrease_file_nlink_by_id_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(select_file_content_by_id_sql,
+                                 &select_file_content_by_id_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(update_path_name_by_id_sql,
+                                 &update_path_name_by_id_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(update_path_prefix_sql,
+                                 &update_path_prefix_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(update_path_mode_by_id_sql,
+                                 &update_path_mode_by_id_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(update_path_owner_by_id_sql,
+                                 &update_path_owner_by_id_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(update_file_size_by_id_sql,
+                                 &update_file_size_by_id_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(update_file_content_by_id_sql,
+                                 &update_file_content_by_id_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(grow_file_content_by_id_sql,
+                                 &grow_file_content_by_id_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(select_mem_entry_by_path_sql,
+                                 &select_mem_entry_by_path_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(select_paths_by_file_id_sql,
+                                 &select_paths_by_file_id_stmt);
+    if (ret == SQLITE_OK)
+        ret = sqlfs_prepare_stmt(select_small_file_by_path_sql,
+                                 &select_small_file_by_path_stmt);
+    if (ret == SQLITE_OK && !sqlfs_opts.read_only)
+        ret = sqlfs_merkle_open();
+    if (ret == SQLITE_OK && sqlfs_change_savepoint())
+        ret = sqlfs_changelog_open();
+    if (ret == SQLITE_OK && sqlfs_opts.mem_meta)
+        ret = sqlfs_mem_load();
+    if (ret == SQLITE_OK && sqlfs_opts.warmup)
+        ret = sqlfs_heat_load();
+    if (ret == SQLITE_OK && sqlfs_opts.cache_size > 0)
+        ret = sqlfs_cache_init();
+    return ret;
+}
+
+/*
+ * Image builder: sqlfs mkimage <srcdir> <out.db>
+ *
+ * Builds a database meant to be mounted --read-only. Each directory is
+ * written before its subdirectories with its files in name order, so the
+ * content of files that are used together ends up next to each other. The
+ * final VACUUM rewrites every table and index into its own contiguous run
+ * of 64 KiB pages in rowid order and leaves no free pages; ANALYZE runs
+ * before it so the planner statistics ship with the image.
+ */
+#define MKIMAGE_PAGE_SIZE 65536
+#define MKIMAGE_COPY_SIZE (1024 * 1024)
+
+struct sqlfs_mkimage_link {
+    dev_t dev;
+    ino_t ino;
+    uint64_t file_id;
+};
+
+struct sqlfs_mkimage {
+    // open addressing on (dev, ino), file_id 0 marks a free slot
+    struct sqlfs_mkimage_link *links;
+    size_t link_count;
+    size_t link_cap;
+    char *copy_buff;
+    uint64_t dirs;
+    uint64_t files;
+    uint64_t symlinks;
+    uint64_t hardlinks;
+    uint64_t bytes;
+};
+
+static int sqlfs_mkimage_insert_path(const char *path, uint64_t parent_id,
+                                     const struct stat *st, uint64_t file_id,
+                                     uint64_t *id) {
+    sqlite3_bind_text(insert_path_stmt, 1, path, -1, NULL);
+    sqlite3_bind_int64(insert_path_stmt, 2, parent_id);
+    sqlite3_bind_int64(insert_path_stmt, 3, st->st_uid);
+    sqlite3_bind_int64(insert_path_stmt, 4, st->st_gid);
+    sqlite3_bind_int(insert_path_stmt, 5, st->st_mode);
+    sqlite3_bind_int64(insert_path_stmt, 6, st->st_atime);
+    sqlite3_bind_int64(insert_path_stmt, 7, st->st_mtime);
+    sqlite3_bind_int64(insert_path_stmt, 8, st->st_ctime);
+    sqlite3_bind_int64(insert_path_stmt, 9, file_id);
+    int ret = sqlite3_step(insert_path_stmt);
+    sqlite3_reset(insert_path_stmt);
+    if (ret != SQLITE_DONE) {
+        printf("sqlfs_mkimage(): '%s' %s\n", path, sqlite3_errmsg(db));
+        return ret;
+    }
+    *id = sqlite3_last_insert_rowid(db);
+    return SQLITE_OK;
+}
+
+static struct sqlfs_mkimage_link *
+sqlfs_mkimage_link_slot(struct sqlfs_mkimage_link *links, size_t cap,
+                        dev_t dev, ino_t ino) {
+    size_t mask = cap - 1;
+    size_t i = sqlfs_hash_u64(sqlfs_hash_u64(dev) ^ ino) & mask;
+    while (links[i].file_id != 0 &&
+           (links[i].dev != dev || links[i].ino != ino)) {
+        i = (i + 1) & mask;
+    }
+    return &links[i];
+}
+
+/**
+ * @brief remember the file id of a multiply linked inode
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_mkimage_link_add(struct sqlfs_mkimage *image,
+                                  const struct stat *st, uint64_t file_id) {
+    if ((image->link_count + 1) * 4 >= image->link_cap * 3) {
+        size_t cap = MAX(image->link_cap * 2, 64);
+        struct sqlfs_mkimage_link *links =
+            calloc(cap, sizeof(struct sqlfs_mkimage_link));
+        if (links == NULL) {
+            return SQLITE_NOMEM;
+        }
+        for (size_t i = 0; i < image->link_cap; i++) {
+            struct sqlfs_mkimage_link *old = &image->links[i];
+            if (old->file_id != 0) {
+                *sqlfs_mkimage_link_slot(links, cap, old->dev, old->ino) =
+                    *old;
+            }
+        }
+        free(image->links);
+        image->links = links;
+        image->link_cap = cap;
+    }
+    struct sqlfs_mkimage_link *link = sqlfs_mkimage_link_slot(
+        image->links, image->link_cap, st->st_dev, st->st_ino);
+    link->dev = st->st_dev;
+    link->ino = st->st_ino;
+    link->file_id = file_id;
+    image->link_count++;
+    return SQLITE_OK;
+}
+
+/**
+ * @brief copy a regular file into a new files row, in MKIMAGE_COPY_SIZE
+ * pieces through blob I/O so large files are never held in memory
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_mkimage_copy_file(struct sqlfs_mkimage *image,
+                                   const char *src, const struct stat *st,
+                                   uint64_t *file_id) {
+    int fd = open(src, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        printf("sqlfs_mkimage(): cannot open '%s': %s\n", src,
+               strerror(errno));
+        return SQLITE_CANTOPEN;
+    }
+    if (st->st_size == 0) {
+        sqlite3_bind_null(insert_file_stmt, 1);
+    } else {
+        sqlite3_bind_zeroblob64(insert_file_stmt, 1, st->st_size);
+    }
+    sqlite3_bind_int64(insert_file_stmt, 2, 0);
+    sqlite3_bind_int64(insert_file_stmt, 3, st->st_size);
+    int ret = sqlite3_step(insert_file_stmt);
+    sqlite3_reset(insert_file_stmt);
+    ret = ret == SQLITE_DONE ? SQLITE_OK : ret;
+    *file_id = sqlite3_last_insert_rowid(db);
+    sqlite3_blob *blob = NULL;
+    if (ret == SQLITE_OK && st->st_size > 0) {
+        ret = sqlite3_blob_open(db, "main", "files", "content", *file_id, 1,
+                                &blob);
+    }
+    off_t offset = 0;
+    while (ret == SQLITE_OK && offset < st->st_size) {
+        ssize_t n = read(fd, image->copy_buff,
+                         MIN(MKIMAGE_COPY_SIZE, st->st_size - offset));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // an error, or the file shrank while we copied it
+            printf("sqlfs_mkimage(): short read of '%s' at %ld: %s\n", src,
+                   offset, n < 0 ? strerror(errno) : "end of file");
+            ret = SQLITE_IOERR;
+            break;
+        }
+        ret = sqlite3_blob_write(blob, image->copy_buff, n, offset);
+        offset += n;
+    }
+    sqlite3_blob_close(blob);
+    close(fd);
+    image->bytes += st->st_size;
+    return ret;
+}
+
+/**
+ * @brief store one directory entry other than a directory
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_mkimage_add(struct sqlfs_mkimage *image, const char *src,
+                             const char *path, uint64_t parent_id,
+                             const struct stat *st) {
+    uint64_t file_id = 0;
+    uint64_t path_id;
+    int ret = SQLITE_OK;
+    if (S_ISREG(st->st_mode) && st->st_nlink > 1 && image->link_cap > 0) {
+        file_id = sqlfs_mkimage_link_slot(image->links, image->link_cap,
+                                          st->st_dev, st->st_ino)
+                      ->file_id;
+        if (file_id != 0) {
+            image->hardlinks++;
+            sqlite3_bind_int64(increase_file_nlink_by_id_stmt, 1, file_id);
+            ret = sqlite3_step(increase_file_nlink_by_id_stmt);
+            sqlite3_reset(increase_file_nlink_by_id_stmt);
+            if (ret != SQLITE_DONE) {
+                return ret;
+            }
+            return sqlfs_mkimage_insert_path(path, parent_id, st, file_id,
+                                             &path_id);
+        }
+    }
+    if (S_ISREG(st->st_mode)) {
+        ret = sqlfs_mkimage_copy_file(image, src, st, &file_id);
+        image->files++;
+    } else if (S_ISLNK(st->st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlink(src, target, sizeof(target) - 1);
+        if (len < 0) {
+            printf("sqlfs_mkimage(): cannot read link '%s': %s\n", src,
+                   strerror(errno));
+            return SQLITE_IOERR;
+        }
+        target[len] = '\0';
+        // stored with its terminator, like sqlfs_symlink() does
+        ret = sqlfs_insert_file(target, len + 1, 0, &file_id) == OK
+                  ? SQLITE_OK
+                  : SQLITE_ERROR;
+        image->symlinks++;
+    } else {
+        ret = sqlfs_insert_empty_file(st->st_rdev, &file_id) == OK
+                  ? SQLITE_OK
+                  : SQLITE_ERROR;
+    }
+    if (ret != SQLITE_OK) {
+        return ret;
+    }
+    if (S_ISREG(st->st_mode) && st->st_nlink > 1) {
+        ret = sqlfs_mkimage_link_add(image, st, file_id);
+        if (ret != SQLITE_OK) {
+            return ret;
+        }
+    }
+    return sqlfs_mkimage_insert_path(path, parent_id, st, file_id, &path_id);
+}
+
+/**
+ * @brief store the entries of a directory, then recurse into its
+ * subdirectories. src and path are buffers of PATH_MAX bytes holding the
+ * directory on the host and in the image.
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_mkimage_dir(struct sqlfs_mkimage *image, char *src,
+                             char *path, uint64_t dir_id) {
+    struct dirent **entries;
+    int count = scandir(src, &entries, NULL, alphasort);
+    if (count < 0) {
+        printf("sqlfs_mkimage(): cannot read '%s': %s\n", src,
+               strerror(errno));
+        return SQLITE_IOERR;
+    }
+    size_t src_len = strlen(src);
+    size_t path_len = strlen(path);
+    int ret = SQLITE_OK;
+    // files first, so a directory's content is stored together
+    for (int pass = 0; pass < 2 && ret == SQLITE_OK; pass++) {
+        for (int i = 0; i < count && ret == SQLITE_OK; i++) {
+            const char *name = entries[i]->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+            if (src_len + strlen(name) + 2 > PATH_MAX ||
+                path_len + strlen(name) + 2 > PATH_MAX) {
+                printf("sqlfs_mkimage(): path too long '%s/%s'\n", src, name);
+                ret = SQLITE_TOOBIG;
+                break;
+            }
+            snprintf(src + src_len, PATH_MAX - src_len, "/%s", name);
+            snprintf(path + path_len, PATH_MAX - path_len, "%s%s",
+                     path_len == 1 ? "" : "/", name);
+            struct stat st;
+            if (lstat(src, &st) != 0) {
+                printf("sqlfs_mkimage(): cannot stat '%s': %s\n", src,
+                       strerror(errno));
+                ret = SQLITE_IOERR;
+            } else if (pass == 0 && !S_ISDIR(st.st_mode)) {
+                ret = sqlfs_mkimage_add(image, src, path, dir_id, &st);
+            } else if (pass == 1 && S_ISDIR(st.st_mode)) {
+                uint64_t id;
+                ret = sqlfs_mkimage_insert_path(path, dir_id, &st, 0, &id);
+                image->dirs++;
+                if (ret == SQLITE_OK) {
+                    ret = sqlfs_mkimage_dir(image, src, path, id);
+                }
+            }
+            src[src_len] = '\0';
+            path[path_len] = '\0';
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    return ret;
+}
+
+/**
+ * @brief sqlfs mkimage <srcdir> <out.db>
+ *
+ * @return exit status
+ */
+int sqlfs_mkimage(int argc, char **argv) {
+    if (argc != 2) {
+        printf("usage: sqlfs mkimage <srcdir> <out.db>\n");
+        return 1;
+    }
+    struct stat st;
+    if (lstat(argv[1], &st) == 0) {
+        printf("sqlfs_mkimage(): '%s' already exists\n", argv[1]);
+        return 1;
+    }
+    char src[PATH_MAX];
+    char path[PATH_MAX] = "/";
+    if (strlen(argv[0]) >= sizeof(src)) {
+        printf("sqlfs_mkimage(): path too long '%s'\n", argv[0]);
+        return 1;
+    }
+    strcpy(src, argv[0]);
+    while (strlen(src) > 1 && src[strlen(src) - 1] == '/') {
+        src[strlen(src) - 1] = '\0';
+    }
+
+    struct sqlfs_mkimage image;
+    memset(&image, 0, sizeof(image));
+    image.copy_buff = malloc(MKIMAGE_COPY_SIZE);
+    if (image.copy_buff == NULL) {
+        return 1;
+    }
+    sqlfs_opts.db_path = argv[1];
+    if (sqlfs_opts.page_size == 0) {
+        sqlfs_opts.page_size = MKIMAGE_PAGE_SIZE;
+    }
+    int ret = sqlfs_open_db(sqlfs_opts.db_path);
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_init_db();
+    }
+    // nothing to recover if the build fails half way, the image is rebuilt
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_exec(db,
+                           "PRAGMA journal_mode = OFF; PRAGMA synchronous = "
+                           "OFF; BEGIN",
+                           NULL, NULL, &err_msg);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_mkimage_dir(&image, src, path, 0);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_exec(db, "COMMIT; ANALYZE; VACUUM", NULL, NULL,
+                           &err_msg);
+    }
+    if (ret == SQLITE_OK) {
+        printf("%s: %lu directories, %lu files (%lu bytes), %lu symlinks, "
+               "%lu hard links, %d pages of %d bytes\n",
+               sqlfs_opts.db_path, image.dirs, image.files, image.bytes,
+               image.symlinks, image.hardlinks,
+               sqlfs_pragma_int(db, "page_count"),
+               sqlfs_pragma_int(db, "page_size"));
+    } else {
+        printf("sqlfs_mkimage(): error %s\n", sqlite3_errmsg(db));
+    }
+    free(image.copy_buff);
+    free(image.links);
+    sqlite3_close(db);
+    return ret == SQLITE_OK ? 0 : 1;
+}
+
+/**
+ * @brief print `s` with tab, newline and backslash escaped as \t, \n and \\,
+ * so a path cannot break the line format of `sqlfs changes`
+ */
+static void sqlfs_print_escaped(const char *s) {
+    for (; *s != '\0'; s++) {
+        if (*s == '\t') {
+            fputs("\\t", stdout);
+        } else if (*s == '\n') {
+            fputs("\\n", stdout);
+        } else if (*s == '\\') {
+            fputs("\\\\", stdout);
+        } else {
+            putchar(*s);
+        }
+    }
+}
+
+/**
+ * @brief sqlfs changes <db> [<seq>] [--follow]
+ *
+ * Print the changelog after sequence number <seq>, one tab separated line
+ * "seq time op path target offset length" per change, with tab, newline and
+ * backslash in paths escaped as \t, \n and \\. With --follow keep polling
+ * for new changes; a consumer restarts from the last seq it handled.
+ *
+ * @return exit status
+ */
+int sqlfs_changes(int argc, char **argv) {
+    bool follow = argc > 0 && strcmp(argv[argc - 1], "--follow") == 0;
+    if (follow) {
+        argc--;
+    }
+    if (argc < 1 || argc > 2) {
+        printf("usage: sqlfs changes <db> [<seq>] [--follow]\n");
+        return 1;
+    }
+    int64_t seq = argc == 2 ? strtoll(argv[1], NULL, 0) : 0;
+    sqlite3 *conn;
+    sqlite3_stmt *stmt = NULL;
+    int ret = sqlite3_open_v2(argv[0], &conn, SQLITE_OPEN_READONLY, NULL);
+    if (ret == SQLITE_OK) {
+        sqlite3_busy_timeout(conn, 1000);
+        ret = sqlite3_prepare_v2(
+            conn,
+            "select seq, time, op, path, target, offset, length from "
+            "changelog where seq > ? order by seq limit 1024",
+            -1, &stmt, NULL);
+    }
+    while (ret == SQLITE_OK) {
+        int rows = 0;
+        sqlite3_bind_int64(stmt, 1, seq);
+        while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+            int op = sqlite3_column_int(stmt, 2);
+            const char *target = (const char *)sqlite3_column_text(stmt, 4);
+            seq = sqlite3_column_int64(stmt, 0);
+            printf("%ld\t%ld\t%s\t", seq,
+                   (int64_t)sqlite3_column_int64(stmt, 1),
+                   op > 0 && op < CHANGE_OP_COUNT ? sqlfs_change_names[op]
+                                                  : "?");
+            sqlfs_print_escaped((const char *)sqlite3_column_text(stmt, 3));
+            putchar('\t');
+            sqlfs_print_escaped(target != NULL ? target : "");
+            printf("\t%ld\t%ld\n", (int64_t)sqlite3_column_int64(stmt, 5),
+                   (int64_t)sqlite3_column_int64(stmt, 6));
+            rows++;
+        }
+        sqlite3_reset(stmt);
+        if (ret != SQLITE_DONE) {
+            break;
+        }
+        ret = SQLITE_OK;
+        if (rows == 0) {
+            if (!follow) {
+                break;
+            }
+            fflush(stdout);
+            sleep(1);
+        }
+    }
+    if (ret != SQLITE_OK) {
+        printf("sqlfs_changes(): %s\n", sqlite3_errmsg(conn));
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(conn);
+    return ret == SQLITE_OK ? 0 : 1;
+}
+
+/*
+ * Delta sync: sqlfs sync <src.db> <dst.db>
+ *
+ * Makes dst equal to src by comparing the two databases directly, inside one
+ * dst transaction with src attached read-only. Paths are matched by name,
+ * since ids differ between databases. Metadata is compared column by column.
+ * Content is compared chunk by chunk, and only differing chunks are written;
+ * a file whose size changed is copied whole inside SQLite, as the row has to
+ * be rewritten anyway. Where both databases keep Merkle chunk hashes or
+ * checksums, a chunk is compared by those and only read when neither side
+ * has one stored. Gone paths are deleted children first. Files no path
+ * refers to are dropped at the end.
+ */
+// the unit of chunk_hashes and chunk_crcs
+#define SYNC_CHUNK_SIZE (64 * 1024)
+
+struct sqlfs_sync {
+    sqlite3 *conn;
+    sqlite3_stmt *scan_stmt;
+    sqlite3_stmt *gone_stmt;
+    sqlite3_stmt *parent_stmt;
+    sqlite3_stmt *insert_path_stmt;
+    sqlite3_stmt *update_path_stmt;
+    sqlite3_stmt *delete_path_stmt;
+    sqlite3_stmt *copy_file_stmt;
+    sqlite3_stmt *replace_file_stmt;
+    sqlite3_stmt *update_file_stmt;
+    sqlite3_stmt *delete_crcs_stmt;
+    // NULL when src has no checksums
+    sqlite3_stmt *copy_crcs_stmt;
+    // whether a chunk is the same on both sides by what is stored, NULL when
+    // the databases do not both keep hashes or checksums
+    sqlite3_stmt *same_stmt;
+    // drops the dst Merkle hashes of what changed
+    struct sqlfs_merkle_forget forget;
+    // src file id -> dst file id of the hard linked files handled so far
+    uint64_t *file_map;
+    uint64_t file_map_len;
+    uint64_t file_map_cap;
+    char *src_chunk;
+    char *dst_chunk;
+    uint64_t created;
+    uint64_t updated;
+    uint64_t deleted;
+    uint64_t copied;
+    uint64_t compared;
+    uint64_t chunks;
+    uint64_t bytes;
+};
+
+static uint64_t sqlfs_sync_mapped(struct sqlfs_sync *sync, uint64_t src_id) {
+    for (uint64_t i = 0; i < sync->file_map_len; i += 2) {
+        if (sync->file_map[i] == src_id) {
+            return sync->file_map[i + 1];
+        }
+    }
+    return 0;
+}
+
+static bool sqlfs_sync_claimed(struct sqlfs_sync *sync, uint64_t dst_id) {
+    for (uint64_t i = 0; i < sync->file_map_len; i += 2) {
+        if (sync->file_map[i + 1] == dst_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int sqlfs_sync_map(struct sqlfs_sync *sync, uint64_t src_id,
+                          uint64_t dst_id) {
+    if (sync->file_map_len == sync->file_map_cap) {
+        uint64_t cap = sync->file_map_cap == 0 ? 64 : sync->file_map_cap * 2;
+        uint64_t *map = realloc(sync->file_map, cap * sizeof(uint64_t));
+        if (map == NULL) {
+            return SQLITE_NOMEM;
+        }
+        sync->file_map = map;
+        sync->file_map_cap = cap;
+    }
+    sync->file_map[sync->file_map_len++] = src_id;
+    sync->file_map[sync->file_map_len++] = dst_id;
+    return SQLITE_OK;
+}
+
+static int sqlfs_sync_step(sqlite3_stmt *stmt) {
+    int ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return ret == SQLITE_DONE ? SQLITE_OK : ret;
+}
+
+/**
+ * @brief give dst file `dst_id` the checksums of src `src_id`, after its
+ * content became the same
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_sync_crcs(struct sqlfs_sync *sync, uint64_t src_id,
+                           uint64_t dst_id) {
+    sqlite3_bind_int64(sync->delete_crcs_stmt, 1, dst_id);
+    int ret = sqlfs_sync_step(sync->delete_crcs_stmt);
+    if (ret == SQLITE_OK && sync->copy_crcs_stmt != NULL) {
+        sqlite3_bind_int64(sync->copy_crcs_stmt, 1, dst_id);
+        sqlite3_bind_int64(sync->copy_crcs_stmt, 2, src_id);
+        ret = sqlfs_sync_step(sync->copy_crcs_stmt);
+    }
+    return ret;
+}
+
+/**
+ * @brief write the chunks of dst file `dst_id` that differ from src `src_id`,
+ * both `size` bytes long
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_sync_chunks(struct sqlfs_sync *sync, uint64_t src_id,
+                             uint64_t dst_id, uint64_t size) {
+    sqlite3_blob *src_blob;
+    sqlite3_blob *dst_blob;
+    int ret = sqlite3_blob_open(sync->conn, "src", "files", "content", src_id,
+                                0, &src_blob);
+    if (ret != SQLITE_OK) {
+        return ret;
+    }
+    ret = sqlite3_blob_open(sync->conn, "main", "files", "content", dst_id, 1,
+                            &dst_blob);
+    if (ret != SQLITE_OK) {
+        sqlite3_blob_close(src_blob);
+        return ret;
+    }
+    sync->compared++;
+    for (uint64_t offset = 0; offset < size && ret == SQLITE_OK;
+         offset += SYNC_CHUNK_SIZE) {
+        int len = MIN(SYNC_CHUNK_SIZE, size - offset);
+        // 1 same, 0 different, NULL not known
+        int same = -1;
+        if (sync->same_stmt != NULL) {
+            sqlite3_bind_int64(sync->same_stmt, 1, src_id);
+            sqlite3_bind_int64(sync->same_stmt, 2, dst_id);
+            sqlite3_bind_int64(sync->same_stmt, 3, offset / SYNC_CHUNK_SIZE);
+            if (sqlite3_step(sync->same_stmt) == SQLITE_ROW &&
+                sqlite3_column_type(sync->same_stmt, 0) != SQLITE_NULL) {
+                same = sqlite3_column_int(sync->same_stmt, 0);
+            }
+            sqlite3_reset(sync->same_stmt);
+        }
+        if (same == 1) {
+            continue;
+        }
+        ret = sqlite3_blob_read(src_blob, sync->src_chunk, len, offset);
+        if (ret == SQLITE_OK && same == -1) {
+            ret = sqlite3_blob_read(dst_blob, sync->dst_chunk, len, offset);
+            same = ret == SQLITE_OK &&
+                   memcmp(sync->src_chunk, sync->dst_chunk, len) == 0;
+        }
+        if (ret == SQLITE_OK && !same) {
+            ret = sqlite3_blob_write(dst_blob, sync->src_chunk, len, offset);
+            if (ret == SQLITE_OK) {
+                ret = sqlfs_merkle_forget_file(&sync->forget, dst_id,
+                                               offset, offset + len);
+            }
+            sync->chunks++;
+            sync->bytes += len;
+        }
+    }
+    sqlite3_blob_close(src_blob);
+    sqlite3_blob_close(dst_blob);
+    return ret;
+}
+
+/**
+ * @brief bring the file of one dst path in line with src, 0 in `dst_id` when
+ * the path is new. Only hard linked files, with more than one name on either
+ * side, go through the file map: their other names must end up sharing the
+ * same dst file, and no other src file may write into it.
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_sync_file(struct sqlfs_sync *sync, uint64_t src_id,
+                           uint64_t src_size, bool src_linked,
+                           uint64_t *dst_id, uint64_t dst_size,
+                           bool dst_linked) {
+    if (src_linked) {
+        uint64_t mapped = sqlfs_sync_mapped(sync, src_id);
+        if (mapped != 0) {
+            // another name of a file already synced
+            *dst_id = mapped;
+            return SQLITE_OK;
+        }
+    }
+    if (dst_linked && sqlfs_sync_claimed(sync, *dst_id)) {
+        // the dst file went to another src file, this one gets its own
+        *dst_id = 0;
+    }
+    int ret;
+    uint64_t copied = sync->copied;
+    uint64_t chunks = sync->chunks;
+    if (*dst_id == 0) {
+        sqlite3_bind_int64(sync->copy_file_stmt, 1, src_id);
+        ret = sqlfs_sync_step(sync->copy_file_stmt);
+        *dst_id = sqlite3_last_insert_rowid(sync->conn);
+        sync->copied++;
+        sync->bytes += src_size;
+    } else if (src_size != dst_size) {
+        sqlite3_bind_int64(sync->replace_file_stmt, 1, src_id);
+        sqlite3_bind_int64(sync->replace_file_stmt, 2, *dst_id);
+        ret = sqlfs_sync_step(sync->replace_file_stmt);
+        if (ret == SQLITE_OK) {
+            ret = sqlfs_merkle_forget_file(&sync->forget, *dst_id, 0,
+                                           UINT64_MAX);
+        }
+        sync->copied++;
+        sync->bytes += src_size;
+    } else {
+        sqlite3_bind_int64(sync->update_file_stmt, 1, src_id);
+        sqlite3_bind_int64(sync->update_file_stmt, 2, *dst_id);
+        ret = sqlfs_sync_step(sync->update_file_stmt);
+        if (ret == SQLITE_OK && src_size > 0) {
+            ret = sqlfs_sync_chunks(sync, src_id, *dst_id, src_size);
+        }
+    }
+    if (ret == SQLITE_OK &&
+        (sync->copied > copied || sync->chunks > chunks)) {
+        ret = sqlfs_sync_crcs(sync, src_id, *dst_id);
+    }
+    if (ret == SQLITE_OK && (src_linked || dst_linked)) {
+        ret = sqlfs_sync_map(sync, src_id, *dst_id);
+    }
+    return ret;
+}
+
+static int sqlfs_sync_prepare(struct sqlfs_sync *sync) {
+    struct {
+        const char *sql;
+        sqlite3_stmt **stmt;
+    } stmts[] = {
+        {"select s.path, s.uid, s.gid, s.mode, s.atime, s.mtime, s.ctime, "
+         "s.file_id, ifnull(sf.size, 0), d.id, d.uid, d.gid, d.mode, d.atime, "
+         "d.mtime, d.ctime, d.file_id, ifnull(df.size, 0), sf.nlink, "
+         "df.nlink from src.paths s "
+         "left join src.files sf on sf.id = s.file_id left join main.paths d "
+         "on d.path = s.path left join main.files df on df.id = d.file_id "
+         "order by s.path",
+         &sync->scan_stmt},
+        {"select d.path from main.paths d where not exists (select 1 from "
+         "src.paths s where s.path = d.path) order by d.path desc",
+         &sync->gone_stmt},
+        {"select id from main.paths where path = ?", &sync->parent_stmt},
+        {"insert into main.paths(path, parent_id, uid, gid, mode, atime, "
+         "mtime, ctime, file_id) values(?, ?, ?, ?, ?, ?, ?, ?, ?)",
+         &sync->insert_path_stmt},
+        {"update main.paths set uid = ?, gid = ?, mode = ?, atime = ?, mtime "
+         "= ?, ctime = ?, file_id = ? where id = ?",
+         &sync->update_path_stmt},
+        {"delete from main.paths where path = ?", &sync->delete_path_stmt},
+        {"insert into main.files(nlink, content, dev, size) select nlink, "
+         "content, dev, size from src.files where id = ?",
+         &sync->copy_file_stmt},
+        {"update main.files set (nlink, content, dev, size) = (select nlink, "
+         "content, dev, size from src.files where id = ?1) where id = ?2",
+         &sync->replace_file_stmt},
+        {"update main.files set (nlink, dev) = (select nlink, dev from "
+         "src.files where id = ?1) where id = ?2",
+         &sync->update_file_stmt},
+        {"delete from main.chunk_crcs where file_id = ?",
+         &sync->delete_crcs_stmt},
+    };
+    int ret = SQLITE_OK;
+    for (size_t i = 0; i < sizeof(stmts) / sizeof(stmts[0]) && ret == SQLITE_OK;
+         i++) {
+        ret = sqlite3_prepare_v2(sync->conn, stmts[i].sql, -1, stmts[i].stmt,
+                                 NULL);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_merkle_forget_prepare(sync->conn, "main", &sync->forget);
+    }
+    if (ret == SQLITE_OK &&
+        sqlite3_prepare_v2(sync->conn,
+                           "insert into main.chunk_crcs select ?1, chunk, "
+                           "length, crc from src.chunk_crcs where file_id = ?2",
+                           -1, &sync->copy_crcs_stmt, NULL) != SQLITE_OK) {
+        // src predates checksums, the dst scrubber fills them in
+        sync->copy_crcs_stmt = NULL;
+    }
+    // stored hashes and checksums are only up to date where they are kept
+    sqlite3_stmt *stmt;
+    bool hashes = false;
+    bool crcs = false;
+    if (ret == SQLITE_OK &&
+        sqlite3_prepare_v2(
+            sync->conn,
+            "select (select value from src.config where key = 'merkle') and "
+            "(select value from main.config where key = 'merkle'), (select "
+            "value from src.config where key = 'checksums') and (select value "
+            "from main.config where key = 'checksums')",
+            -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            hashes = sqlite3_column_int(stmt, 0) != 0;
+            crcs = sqlite3_column_int(stmt, 1) != 0;
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (ret == SQLITE_OK && (hashes || crcs)) {
+        const char *by_hash =
+            "(select s.length = d.length and s.hash = d.hash from "
+            "src.chunk_hashes s, main.chunk_hashes d where s.file_id = ?1 and "
+            "s.chunk = ?3 and d.file_id = ?2 and d.chunk = ?3)";
+        const char *by_crc =
+            "(select s.length = d.length and s.crc = d.crc from "
+            "src.chunk_crcs s, main.chunk_crcs d where s.file_id = ?1 and "
+            "s.chunk = ?3 and d.file_id = ?2 and d.chunk = ?3)";
+        // the 64 bit hash is the stronger of the two
+        char *sql = sqlite3_mprintf("select coalesce(%s, %s)",
+                                    hashes ? by_hash : "null",
+                                    crcs ? by_crc : "null");
+        ret = sql != NULL ? sqlite3_prepare_v2(sync->conn, sql, -1,
+                                               &sync->same_stmt, NULL)
+                          : SQLITE_NOMEM;
+        sqlite3_free(sql);
+    }
+    return ret;
+}
+
+static void sqlfs_sync_finalize(struct sqlfs_sync *sync) {
+    sqlite3_finalize(sync->scan_stmt);
+    sqlite3_finalize(sync->gone_stmt);
+    sqlite3_finalize(sync->parent_stmt);
+    sqlite3_finalize(sync->insert_path_stmt);
+    sqlite3_finalize(sync->update_path_stmt);
+    sqlite3_finalize(sync->delete_path_stmt);
+    sqlite3_finalize(sync->copy_file_stmt);
+    sqlite3_finalize(sync->replace_file_stmt);
+    sqlite3_finalize(sync->update_file_stmt);
+    sqlite3_finalize(sync->delete_crcs_stmt);
+    sqlite3_finalize(sync->copy_crcs_stmt);
+    sqlite3_finalize(sync->same_stmt);
+    sqlfs_merkle_forget_finalize(&sync->forget);
+}
+
+/**
+ * @brief create or update the dst side of one src path, the current row of
+ * scan_stmt
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_sync_path(struct sqlfs_sync *sync) {
+    sqlite3_stmt *scan = sync->scan_stmt;
+    const char *path = (const char *)sqlite3_column_text(scan, 0);
+    bool exists = sqlite3_column_type(scan, 9) != SQLITE_NULL;
+    uint64_t src_file = sqlite3_column_int64(scan, 7);
+    uint64_t dst_file = sqlite3_column_int64(scan, 16);
+    int ret = SQLITE_OK;
+    if (exists && (src_file == 0) != (dst_file == 0)) {
+        // a directory became a file or the other way round
+        sqlite3_bind_text(sync->delete_path_stmt, 1, path, -1, NULL);
+        ret = sqlfs_sync_step(sync->delete_path_stmt);
+        if (ret == SQLITE_OK) {
+            ret = sqlfs_merkle_forget_path(&sync->forget, path, true);
+        }
+        exists = false;
+        dst_file = 0;
+    }
+    if (ret == SQLITE_OK && src_file != 0) {
+        ret = sqlfs_sync_file(sync, src_file, sqlite3_column_int64(scan, 8),
+                              sqlite3_column_int(scan, 18) > 1, &dst_file,
+                              exists ? sqlite3_column_int64(scan, 17) : 0,
+                              exists && sqlite3_column_int(scan, 19) > 1);
+    }
+    if (ret != SQLITE_OK) {
+        return ret;
+    }
+    if (exists) {
+        bool same = dst_file == (uint64_t)sqlite3_column_int64(scan, 16);
+        for (int col = 1; col <= 6 && same; col++) {
+            same = sqlite3_column_int64(scan, col) ==
+                   sqlite3_column_int64(scan, col + 9);
+        }
+        if (same) {
+            return SQLITE_OK;
+        }
+        sqlite3_stmt *stmt = sync->update_path_stmt;
+        for (int col = 1; col <= 6; col++) {
+            sqlite3_bind_int64(stmt, col, sqlite3_column_int64(scan, col));
+        }
+        if (dst_file != 0) {
+            sqlite3_bind_int64(stmt, 7, dst_file);
+        } else {
+            sqlite3_bind_null(stmt, 7);
+        }
+        sqlite3_bind_int64(stmt, 8, sqlite3_column_int64(scan, 9));
+        sync->updated++;
+        ret = sqlfs_sync_step(stmt);
+        return ret == SQLITE_OK
+                   ? sqlfs_merkle_forget_path(&sync->forget, path, false)
+                   : ret;
+    }
+
+    // paths are scanned in order, the parent is already there
+    uint64_t parent_id = 0;
+    const char *base = strrchr(path, '/');
+    if (base != path) {
+        sqlite3_bind_text(sync->parent_stmt, 1, path, base - path, NULL);
+        if (sqlite3_step(sync->parent_stmt) == SQLITE_ROW) {
+            parent_id = sqlite3_column_int64(sync->parent_stmt, 0);
+        }
+        sqlite3_reset(sync->parent_stmt);
+    }
+    sqlite3_stmt *stmt = sync->insert_path_stmt;
+    sqlite3_bind_text(stmt, 1, path, -1, NULL);
+    sqlite3_bind_int64(stmt, 2, parent_id);
+    for (int col = 1; col <= 6; col++) {
+        sqlite3_bind_int64(stmt, col + 2, sqlite3_column_int64(scan, col));
+    }
+    if (dst_file != 0) {
+        sqlite3_bind_int64(stmt, 9, dst_file);
+    } else {
+        sqlite3_bind_null(stmt, 9);
+    }
+    sync->created++;
+    ret = sqlfs_sync_step(stmt);
+    return ret == SQLITE_OK
+               ? sqlfs_merkle_forget_path(&sync->forget, path, false)
+               : ret;
+}
+
+/**
+ * @brief sqlfs sync <src.db> <dst.db>
+ *
+ * @return exit status
+ */
+int sqlfs_sync(int argc, char **argv) {
+    if (argc != 2) {
+        printf("usage: sqlfs sync <src.db> <dst.db>\n");
+        return 1;
+    }
+    struct sqlfs_sync sync;
+    memset(&sync, 0, sizeof(sync));
+    sync.src_chunk = malloc(SYNC_CHUNK_SIZE);
+    sync.dst_chunk = malloc(SYNC_CHUNK_SIZE);
+    if (sync.src_chunk == NULL || sync.dst_chunk == NULL) {
+        return 1;
+    }
+    int ret = sqlite3_open(argv[1], &sync.conn);
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_exec(sync.conn, create_tables_sql, NULL, NULL, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        char *uri = sqlfs_db_uri(argv[0], "mode=ro");
+        char *sql = sqlite3_mprintf("attach %Q as src", uri);
+        ret = uri != NULL && sql != NULL
+                  ? sqlite3_exec(sync.conn, sql, NULL, NULL, NULL)
+                  : SQLITE_NOMEM;
+        sqlite3_free(sql);
+        free(uri);
+    }
+    if (ret == SQLITE_OK) {
+        sqlite3_stmt *stmt;
+        ret = sqlite3_prepare_v2(
+            sync.conn,
+            "select exists(select 1 from main.config where key = 'shards') or "
+            "exists(select 1 from src.config where key = 'shards')",
+            -1, &stmt, NULL);
+        if (ret == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW &&
+            sqlite3_column_int(stmt, 0)) {
+            printf("sqlfs_sync(): sharded databases are not supported\n");
+            ret = SQLITE_MISUSE;
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlfs_sync_prepare(&sync);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_exec(sync.conn, "begin immediate", NULL, NULL, NULL);
+    }
+    while (ret == SQLITE_OK && sqlite3_step(sync.gone_stmt) == SQLITE_ROW) {
+        const char *path = (const char *)sqlite3_column_text(sync.gone_stmt, 0);
+        sqlite3_bind_text(sync.delete_path_stmt, 1, path, -1,
+                          SQLITE_TRANSIENT);
+        ret = sqlfs_sync_step(sync.delete_path_stmt);
+        if (ret == SQLITE_OK) {
+            ret = sqlfs_merkle_forget_path(&sync.forget, path, false);
+        }
+        sync.deleted++;
+    }
+    sqlite3_reset(sync.gone_stmt);
+    while (ret == SQLITE_OK && sqlite3_step(sync.scan_stmt) == SQLITE_ROW) {
+        ret = sqlfs_sync_path(&sync);
+    }
+    sqlite3_reset(sync.scan_stmt);
+    // content changes show up in copied and chunks only
+    uint64_t changes = sync.created + sync.updated + sync.deleted +
+                       sync.copied + sync.chunks;
+    if (ret == SQLITE_OK && changes > 0) {
+        // the content index and the directory usage are not synced, the
+        // next mount of dst rebuilds them
+        ret = sqlite3_exec(sync.conn,
+                           "update main.config set value = 2 where key in "
+                           "('fts', 'usage')",
+                           NULL, NULL, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_exec(sync.conn,
+                           "delete from main.files where id not in (select "
+                           "file_id from main.paths where file_id is not null); "
+                           "commit",
+                           NULL, NULL, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        printf("%s -> %s: %lu created, %lu updated, %lu deleted, %lu files "
+               "copied, %lu compared, %lu chunks, %lu bytes written\n",
+               argv[0], argv[1], sync.created, sync.updated, sync.deleted,
+               sync.copied, sync.compared, sync.chunks, sync.bytes);
+    } else {
+        printf("sqlfs_sync(): error %s\n", sqlite3_errmsg(sync.conn));
+        sqlite3_exec(sync.conn, "rollback", NULL, NULL, NULL);
+    }
+    sqlfs_sync_finalize(&sync);
+    sqlite3_close(sync.conn);
+    free(sync.file_map);
+    free(sync.src_chunk);
+    free(sync.dst_chunk);
+    return ret == SQLITE_OK ? 0 : 1;
+}
+
+/*
+ * Merkle tree commands: sqlfs hash <db> [<path>] prints the hash of a
+ * subtree, sqlfs diff <a.db> <b.db> [<path>] lists where two databases
+ * differ. Hashes missing from tree_hashes and chunk_hashes are computed and,
+ * when the database keeps them up to date (see --merkle), stored for the
+ * next run.
+ *
+ * The tree is read in one read transaction, which a mounted database's
+ * writers do not wait for. Computed hashes are stored through a second
+ * connection in batches of MERKLE_PUT_BATCH, each in a short write
+ * transaction. Nothing more is stored once another connection has committed
+ * since the read began, as the hashes may then be stale. Without WAL the
+ * read would keep that second connection from committing, so one connection
+ * reads and stores in a single write transaction, as any reader there keeps
+ * writers out anyway.
+ */
+#define MERKLE_PUT_BATCH 4096
+
+struct sqlfs_merkle_put {
+    // NULL for a chunk hash
+    char *path;
+    uint64_t file_id;
+    uint64_t chunk;
+    int len;
+    uint64_t hash;
+};
+
+struct sqlfs_merkle_tree {
+    sqlite3 *conn;
+    // the database has --merkle and is writable
+    bool store;
+    // stores the computed hashes, `conn` itself without WAL
+    sqlite3 *writer;
+    int data_version;
+    struct sqlfs_merkle_put puts[MERKLE_PUT_BATCH];
+    int put_count;
+    bool stale;
+    char *chunk;
+    uint64_t nodes;
+    uint64_t chunks;
+    uint64_t bytes;
+    sqlite3_stmt *get_stmt;
+    sqlite3_stmt *put_stmt;
+    sqlite3_stmt *entry_stmt;
+    sqlite3_stmt *children_stmt;
+    sqlite3_stmt *get_chunk_stmt;
+    sqlite3_stmt *put_chunk_stmt;
+};
+
+struct sqlfs_merkle_entry {
+    uint64_t id;
+    uint64_t mode;
+    uint64_t uid;
+    uint64_t gid;
+    uint64_t file_id;
+    uint64_t size;
+};
+
+static int sqlfs_merkle_tree_open(struct sqlfs_merkle_tree *tree,
+                                  const char *path) {
+    memset(tree, 0, sizeof(*tree));
+    tree->chunk = malloc(MERKLE_CHUNK_SIZE);
+    if (tree->chunk == NULL) {
+        return SQLITE_NOMEM;
+    }
+    int ret = sqlite3_open_v2(path, &tree->conn, SQLITE_OPEN_READWRITE, NULL);
+    if (ret == SQLITE_OK) {
+        sqlite3_busy_timeout(tree->conn, 5000);
+    }
+    bool wal = false;
+    sqlite3_stmt *stmt = NULL;
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(tree->conn, "PRAGMA journal_mode", -1, &stmt,
+                                 NULL);
+    }
+    if (ret == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        wal = strcmp((const char *)sqlite3_column_text(stmt, 0), "wal") == 0;
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+    if (ret == SQLITE_OK) {
+        ret = sqlite3_prepare_v2(
+            tree->conn,
+            "select (select value from config where key = 'merkle'), exists("
+            "select 1 from config where key = 'shards')",
+            -1, &stmt, NULL);
+    }
+    if (ret == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        tree->store = sqlite3_column_int(stmt, 0) != 0 &&
+                      !sqlite3_db_readonly(tree->conn, "main");
+        if (sqlite3_column_int(stmt, 1)) {
+            printf("%s: sharded databases are not supported\n", path);
+            ret = SQLITE_MISUSE;
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (ret == SQLITE_OK && tree->store && !wal) {
+        tree->writer = tree->conn;
+    } else if (ret == SQLITE_OK && tree->store) {
+        ret = sqlite3_open_v2(path, &tree->writer, SQLITE_OPEN_READWRITE,
+                              NULL);
+        sqlite3_busy_timeout(tree->writer, 5000);
+    }
+    struct {
+        const char *sql;
+        sqlite3_stmt **stmt;
+        bool store;
+    } stmts[] = {
+        {"select hash from tree_hashes where path = ?", &tree->get_stmt,
+         true},
+        {"insert or replace into tree_hashes(path, hash) values(?, ?)",
+         &tree->put_stmt, true},
+        {"select p.id, p.mode, p.uid, p.gid, ifnull(p.file_id, 0), "
+         "ifnull(f.size, 0) from paths p left join files f on f.id = "
+         "p.file_id where p.path = ?",
+         &tree->entry_stmt, false},
+        {"select path from paths where parent_id = ? order by path",
+         &tree->children_stmt, false},
+        {"select length, hash from chunk_hashes where file_id = ? and chunk "
+         "= ?",
+         &tree->get_chunk_stmt, true},
+        {"insert or replace into chunk_hashes(file_id, chunk, length, hash) "
+         "values(?, ?, ?, ?)",
+         &tree->put_chunk_stmt, true},
+    };
+    for (size_t i = 0; i < sizeof(stmts) / sizeof(stmts[0]) && ret == SQLITE_OK;
+         i++) {
+        // stored hashes are only trusted where they are kept up to date
+        if (!stmts[i].store || tree->store) {
+            bool put = stmts[i].stmt == &tree->put_stmt ||
+                       stmts[i].stmt == &tree->put_chunk_stmt;
+            ret = sqlite3_prepare_v2(put ? tree->writer : tree->conn,
+                                     stmts[i].sql, -1, stmts[i].stmt, NULL);
+        }
+    }
+    if (ret == SQLITE_OK && tree->store && wal) {
+        // taken before the read begins: a commit in between only makes the
+        // stored hashes look stale
+        tree->data_version = sqlfs_pragma_int(tree->writer, "data_version");
+    }
+    if (ret == SQLITE_OK) {
+        // one snapshot for the whole walk
+        ret = sqlite3_exec(tree->conn,
+                           tree->writer == tree->conn
+                               ? "begin immediate"
+                               : "begin; select 1 from sqlite_schema",
+                           NULL, NULL, NULL);
+    }
+    if (ret != SQLITE_OK && ret != SQLITE_MISUSE) {
+        printf("%s: %s\n", path,
+               tree->conn != NULL ? sqlite3_errmsg(tree->conn)
+                                  : sqlite3_errstr(ret));
+    }
+    return ret;
+}
+
+/**
+ * @brief store the queued hashes in one write transaction, unless another
+ * connection committed since the tree was read
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_merkle_flush(struct sqlfs_merkle_tree *tree) {
+    int ret = SQLITE_OK;
+    // without WAL the puts join the transaction of the walk
+    bool own = tree->writer != tree->conn;
+    bool began = false;
+    if (tree->put_count > 0 && !tree->stale && own) {
+        ret = sqlite3_exec(tree->writer, "begin immediate", NULL, NULL, NULL);
+        began = ret == SQLITE_OK;
+        if (began && sqlfs_pragma_int(tree->writer, "data_version") !=
+                         tree->data_version) {
+            tree->stale = true;
+        }
+    }
+    for (int i = 0; i < tree->put_count && ret == SQLITE_OK && !tree->stale;
+         i++) {
+        struct sqlfs_merkle_put *put = &tree->puts[i];
+        sqlite3_stmt *stmt =
+            put->path != NULL ? tree->put_stmt : tree->put_chunk_stmt;
+        if (put->path != NULL) {
+            sqlite3_bind_text(stmt, 1, put->path, -1, NULL);
+            sqlite3_bind_int64(stmt, 2, put->hash);
+        } else {
+            sqlite3_bind_int64(stmt, 1, put->file_id);
+            sqlite3_bind_int64(stmt, 2, put->chunk);
+            sqlite3_bind_int(stmt, 3, put->len);
+            sqlite3_bind_int64(stmt, 4, put->hash);
+        }
+        ret = sqlfs_merkle_step(stmt);
+    }
+    if (began && ret == SQLITE_OK && !tree->stale) {
+        ret = sqlite3_exec(tree->writer, "commit", NULL, NULL, NULL);
+    } else if (began) {
+        sqlite3_exec(tree->writer, "rollback", NULL, NULL, NULL);
+    }
+    for (int i = 0; i < tree->put_count; i++) {
+        free(tree->puts[i].path);
+    }
+    tree->put_count = 0;
+    return ret;
+}
+
+/**
+ * @brief queue a computed hash, of node `path` or of a chunk when `path` is
+ * NULL
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_merkle_put(struct sqlfs_merkle_tree *tree, const char *path,
+                            uint64_t file_id, uint64_t chunk, int len,
+                            uint64_t hash) {
+    if (tree->stale) {
+        return SQLITE_OK;
     }
-    return ret;
+    struct sqlfs_merkle_put *put = &tree->puts[tree->put_count];
+    put->path = NULL;
+    if (path != NULL && (put->path = strdup(path)) == NULL) {
+        return SQLITE_NOMEM;
+    }
+    put->file_id = file_id;
+    put->chunk = chunk;
+    put->len = len;
+    put->hash = hash;
+    if (++tree->put_count == MERKLE_PUT_BATCH) {
+        return sqlfs_merkle_flush(tree);
+    }
+    return SQLITE_OK;
 }
 
-int sqlfs_symlink(const char *old_path, const char *new_path) {
-    struct sqlfs_path_info path_info;
-    int ret = sqlfs_find_path_info(new_path, &path_info);
+static int sqlfs_merkle_tree_close(struct sqlfs_merkle_tree *tree, int ret) {
     if (ret == SQLITE_OK) {
-        return -EEXIST;
-    } else if (ret == SQLITE_DONE) {
-        // do nothing
+        ret = sqlfs_merkle_flush(tree);
     } else {
-        printf("sqlfs_symlink() '%s' error: %s\n", new_path,
-               sqlite3_errmsg(db));
-        return -EIO;
+        tree->stale = true;
+        sqlfs_merkle_flush(tree);
     }
-
-    uint64_t file_id;
-    ret = sqlfs_insert_file(old_path, strlen(old_path) + 1, 0, &file_id);
-    if (ret != OK) {
-        printf("sqlfs_symlink() '%s' insert file error: %s\n", new_path,
-               sqlite3_errmsg(db));
-        return ret;
+    if (tree->conn != NULL && !sqlite3_get_autocommit(tree->conn)) {
+        int end = sqlite3_exec(tree->conn,
+                               ret == SQLITE_OK ? "commit" : "rollback", NULL,
+                               NULL, NULL);
+        ret = ret == SQLITE_OK ? end : ret;
     }
-    ret = sqlfs_insert_path(new_path, 0755, S_IFLNK, file_id);
+    sqlite3_finalize(tree->get_stmt);
+    sqlite3_finalize(tree->put_stmt);
+    sqlite3_finalize(tree->entry_stmt);
+    sqlite3_finalize(tree->children_stmt);
+    sqlite3_finalize(tree->get_chunk_stmt);
+    sqlite3_finalize(tree->put_chunk_stmt);
+    if (tree->writer != tree->conn) {
+        sqlite3_close(tree->writer);
+    }
+    sqlite3_close(tree->conn);
+    free(tree->chunk);
     return ret;
 }
 
 /**
- * @brief find file content by id
+ * @brief look up `path`, the root directory is not stored
  *
- * @param id
- * @param buff
- * @param buff_size
- * @return OK if find a row
+ * @return SQLITE_OK, SQLITE_DONE when not found
  */
-int sqlfs_find_file_content_by_id(u_int64_t id, char *buff, size_t buff_size) {
-    sqlite3_blob *blob;
-    int ret = sqlite3_blob_open(db, "main", "files", "content", id, 0, &blob);
-    if (ret != SQLITE_OK) {
-        printf("sqlfs_find_file_content_by_id() blob open error: %s\n",
-               sqlite3_errmsg(db));
-        sqlite3_blob_close(blob);
-        return -EIO;
+static int sqlfs_merkle_entry(struct sqlfs_merkle_tree *tree,
+                              const char *path,
+                              struct sqlfs_merkle_entry *entry) {
+    if (strcmp(path, "/") == 0) {
+        memset(entry, 0, sizeof(*entry));
+        entry->mode = ROOT_DIR_MODE;
+        return SQLITE_OK;
     }
-    uint64_t blob_size = sqlite3_blob_bytes(blob);
-    uint64_t max_size = buff_size > blob_size ? blob_size : buff_size;
-    ret = sqlite3_blob_read(blob, buff, max_size, 0);
-    if (ret != SQLITE_OK) {
-        printf("sqlfs_find_file_content_by_id() blob read error: %s\n",
-               sqlite3_errmsg(db));
-        sqlite3_blob_close(blob);
-        return -EIO;
+    sqlite3_stmt *stmt = tree->entry_stmt;
+    sqlite3_bind_text(stmt, 1, path, -1, NULL);
+    int ret = sqlite3_step(stmt);
+    if (ret == SQLITE_ROW) {
+        entry->id = sqlite3_column_int64(stmt, 0);
+        entry->mode = sqlite3_column_int64(stmt, 1);
+        entry->uid = sqlite3_column_int64(stmt, 2);
+        entry->gid = sqlite3_column_int64(stmt, 3);
+        entry->file_id = sqlite3_column_int64(stmt, 4);
+        entry->size = sqlite3_column_int64(stmt, 5);
+        ret = SQLITE_OK;
     }
-    sqlite3_blob_close(blob);
-    return OK;
+    sqlite3_reset(stmt);
+    return ret;
 }
 
-int sqlfs_readlink(const char *path, char *buff, size_t size) {
-    struct sqlfs_path_info path_info;
-    int ret = sqlfs_find_path_info(path, &path_info);
-    if (ret == SQLITE_OK) {
-        // do nothing
-    } else if (ret == SQLITE_DONE) {
-        return -ENOENT;
-    } else {
-        printf("sqlfs_readlink() '%s' error: %s\n", path, sqlite3_errmsg(db));
-        return -EIO;
+/**
+ * @brief the children of directory `id` in name order, free with
+ * sqlfs_merkle_children_free()
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_merkle_children(struct sqlfs_merkle_tree *tree, uint64_t id,
+                                 char ***children, int *count) {
+    *children = NULL;
+    *count = 0;
+    int ret = SQLITE_OK;
+    sqlite3_bind_int64(tree->children_stmt, 1, id);
+    while (ret == SQLITE_OK &&
+           sqlite3_step(tree->children_stmt) == SQLITE_ROW) {
+        char **grown = realloc(*children, (*count + 1) * sizeof(char *));
+        if (grown == NULL) {
+            ret = SQLITE_NOMEM;
+            break;
+        }
+        *children = grown;
+        grown[*count] = strdup(
+            (const char *)sqlite3_column_text(tree->children_stmt, 0));
+        ret = grown[*count] != NULL ? SQLITE_OK : SQLITE_NOMEM;
+        *count += ret == SQLITE_OK;
     }
-    return sqlfs_find_file_content_by_id(path_info.file_id, buff, size);
+    int end = sqlite3_reset(tree->children_stmt);
+    return ret == SQLITE_OK ? end : ret;
 }
 
-int sqlfs_rename(const char *old_path, const char *new_path,
-                 unsigned int flags) {
-    struct sqlfs_path_info path_info;
-    int ret = sqlfs_find_path_info(old_path, &path_info);
-    if (ret == SQLITE_OK) {
-        // do nothing
-    } else if (ret == SQLITE_DONE) {
-        printf("sqlfs_rename(): '%s' not found\n", old_path);
-        return -ENOENT;
-    } else {
-        printf("sqlfs_rename(): '%s' to '%s' error: %s\n", old_path, new_path,
-               sqlite3_errmsg(db));
-        return -EIO;
+static void sqlfs_merkle_children_free(char **children, int count) {
+    for (int i = 0; i < count; i++) {
+        free(children[i]);
     }
-    struct sqlfs_path_info new_path_info;
-    ret = sqlfs_find_path_info(new_path, &new_path_info);
-    if (ret == SQLITE_OK) {
-        if (S_ISDIR(new_path_info.mode)) {
-            printf("sqlfs_rename(): '%s' is dir\n", new_path);
-            return -EISDIR;
+    free(children);
+}
+
+/**
+ * @brief hash over the chunk hashes of a file
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_merkle_file(struct sqlfs_merkle_tree *tree,
+                             const struct sqlfs_merkle_entry *entry,
+                             uint64_t *hash) {
+    uint64_t root = entry->size;
+    sqlite3_blob *blob = NULL;
+    int ret = SQLITE_OK;
+    for (uint64_t chunk = 0;
+         chunk * MERKLE_CHUNK_SIZE < entry->size && ret == SQLITE_OK;
+         chunk++) {
+        int len = MIN(MERKLE_CHUNK_SIZE,
+                      entry->size - chunk * MERKLE_CHUNK_SIZE);
+        uint64_t h = 0;
+        bool stored = false;
+        if (tree->store) {
+            sqlite3_stmt *stmt = tree->get_chunk_stmt;
+            sqlite3_bind_int64(stmt, 1, entry->file_id);
+            sqlite3_bind_int64(stmt, 2, chunk);
+            if (sqlite3_step(stmt) == SQLITE_ROW &&
+                sqlite3_column_int(stmt, 0) == len) {
+                h = sqlite3_column_int64(stmt, 1);
+                stored = true;
+            }
+            sqlite3_reset(stmt);
         }
-        ret = sqlfs_unlink(new_path);
-        if (ret != OK) {
-            printf("sqlfs_rename(): '%s' unlink error\n", new_path);
-            return ret;
+        if (!stored) {
+            if (blob == NULL) {
+                ret = sqlite3_blob_open(tree->conn, "main", "files", "content",
+                                        entry->file_id, 0, &blob);
+            }
+            if (ret == SQLITE_OK) {
+                ret = sqlite3_blob_read(blob, tree->chunk, len,
+                                        chunk * MERKLE_CHUNK_SIZE);
+            }
+            if (ret != SQLITE_OK) {
+                break;
+            }
+            h = sqlfs_hash64(tree->chunk, len, chunk);
+            tree->chunks++;
+            tree->bytes += len;
+            if (tree->store) {
+                ret = sqlfs_merkle_put(tree, NULL, entry->file_id, chunk, len,
+                                       h);
+            }
         }
-    } else if (ret == SQLITE_DONE) {
-        // do nothings
-    } else {
-        printf("sqlfs_rename(): '%s' new path error %s\n", new_path,
-               sqlite3_errmsg(db));
-    }
-
-    sqlite3_bind_text(update_path_name_by_id_stmt, 1, new_path, -1, NULL);
-    sqlite3_bind_int64(update_path_name_by_id_stmt, 2, path_info.id);
-    ret = sqlite3_step(update_path_name_by_id_stmt);
-    if (ret == SQLITE_DONE) {
-        ret = OK;
-    } else {
-        printf("sqlfs_rename() '%s' to '%s' error: %s\n", old_path, new_path,
-               sqlite3_errmsg(db));
-        ret = -EIO;
+        root = sqlfs_hash64(&h, sizeof(h), root);
     }
-    sqlite3_reset(update_path_name_by_id_stmt);
+    sqlite3_blob_close(blob);
+    *hash = root;
     return ret;
 }
 
-int sqlfs_link(const char *old_path, const char *new_path) {
-    struct sqlfs_path_info path_info;
-    int ret = sqlfs_find_path_info(new_path, &path_info);
-    if (ret == SQLITE_OK) {
-        printf("sqlfs_rename() '%s' exists\n", new_path);
-        return -EEXIST;
-    } else if (ret == SQLITE_DONE) {
-        // do nothing
-    } else {
-        printf("sqlfs_rename() '%s' error: %s\n", new_path, sqlite3_errmsg(db));
-        return -EIO;
+/**
+ * @brief hash of the node at `path`, computed from its children and chunks
+ * where it is not stored
+ *
+ * @return SQLITE_OK, SQLITE_DONE when `path` does not exist
+ */
+static int sqlfs_merkle_node(struct sqlfs_merkle_tree *tree, const char *path,
+                             uint64_t *hash) {
+    int ret;
+    if (tree->store) {
+        sqlite3_bind_text(tree->get_stmt, 1, path, -1, NULL);
+        ret = sqlite3_step(tree->get_stmt);
+        *hash = sqlite3_column_int64(tree->get_stmt, 0);
+        sqlite3_reset(tree->get_stmt);
+        if (ret == SQLITE_ROW) {
+            return SQLITE_OK;
+        }
     }
-    ret = sqlfs_find_path_info(old_path, &path_info);
-    if (ret == SQLITE_OK) {
-        // do nothing
-    } else if (ret == SQLITE_DONE) {
-        printf("sqlfs_rename() '%s' not found\n", old_path);
-        return -ENOENT;
+    struct sqlfs_merkle_entry entry;
+    ret = sqlfs_merkle_entry(tree, path, &entry);
+    if (ret != SQLITE_OK) {
+        return ret;
+    }
+    uint64_t node[4] = {entry.mode, entry.uid, entry.gid, 0};
+    if (S_ISDIR(entry.mode)) {
+        char **children;
+        int count;
+        ret = sqlfs_merkle_children(tree, entry.id, &children, &count);
+        for (int i = 0; i < count && ret == SQLITE_OK; i++) {
+            const char *name = strrchr(children[i], '/') + 1;
+            uint64_t child;
+            ret = sqlfs_merkle_node(tree, children[i], &child);
+            node[3] = sqlfs_hash64(name, strlen(name), node[3]);
+            node[3] = sqlfs_hash64(&child, sizeof(child), node[3]);
+        }
+        sqlfs_merkle_children_free(children, count);
     } else {
-        printf("sqlfs_rename() '%s' error: %s\n", old_path, sqlite3_errmsg(db));
-        return -EIO;
+        ret = sqlfs_merkle_file(tree, &entry, &node[3]);
     }
-    ret = sqlfs_insert_path(new_path, path_info.mode, path_info.mode & S_IFMT,
-                            path_info.file_id);
-    if (ret != OK) {
+    if (ret != SQLITE_OK) {
         return ret;
     }
-
-    sqlite3_bind_int64(increase_file_nlink_by_id_stmt, 1, path_info.file_id);
-
-    ret = sqlite3_step(increase_file_nlink_by_id_stmt);
-    sqlite3_reset(increase_file_nlink_by_id_stmt);
-    if (ret != SQLITE_DONE) {
-        printf("sqlfs_rename(): '%s' sql error %s\n", old_path,
-               sqlite3_errmsg(db));
-        return -EIO;
-    } else {
-        return OK;
+    *hash = sqlfs_hash64(node, sizeof(node), 0);
+    tree->nodes++;
+    if (tree->store) {
+        ret = sqlfs_merkle_put(tree, path, 0, 0, 0, *hash);
     }
+    return ret;
 }
 
-int sqlfs_chmod(const char *path, mode_t mode,
-                struct fuse_file_info *file_info) {
-    struct sqlfs_path_info path_info;
-    int ret = sqlfs_find_path_info(path, &path_info);
+/**
+ * @brief sqlfs hash <db> [<path>]
+ *
+ * @return exit status
+ */
+int sqlfs_hash(int argc, char **argv) {
+    if (argc < 1 || argc > 2) {
+        printf("usage: sqlfs hash <db> [<path>]\n");
+        return 1;
+    }
+    const char *path = argc == 2 ? argv[1] : "/";
+    struct sqlfs_merkle_tree tree;
+    uint64_t hash = 0;
+    int ret = sqlfs_merkle_tree_open(&tree, argv[0]);
     if (ret == SQLITE_OK) {
-        // do nothing
-    } else if (ret == SQLITE_DONE) {
-        printf("sqlfs_chmod() '%s' not found", path);
-        return -ENOENT;
-    } else {
-        printf("sqlfs_chmod() '%s' error: %s\n", path, sqlite3_errmsg(db));
-        return -EIO;
+        ret = sqlfs_merkle_node(&tree, path, &hash);
+        if (ret == SQLITE_DONE) {
+            printf("%s: not found\n", path);
+        } else if (ret != SQLITE_OK) {
+            printf("sqlfs_hash(): error %s\n", sqlite3_errmsg(tree.conn));
+        }
     }
-
-    sqlite3_bind_int(update_path_mode_by_id_stmt, 1, path_info.mode | mode);
-    sqlite3_bind_int64(update_path_mode_by_id_stmt, 2, path_info.id);
-    ret = sqlite3_step(update_path_mode_by_id_stmt);
-    sqlite3_reset(update_path_mode_by_id_stmt);
-    if (ret != SQLITE_DONE) {
-        printf("sqlfs_chmod(): '%s' sql error %s\n", path, sqlite3_errmsg(db));
-        return -EIO;
-    } else {
-        return OK;
+    uint64_t nodes = tree.nodes;
+    uint64_t chunks = tree.chunks;
+    uint64_t bytes = tree.bytes;
+    ret = sqlfs_merkle_tree_close(&tree, ret);
+    bool store = tree.store;
+    bool stale = tree.stale;
+    if (ret != SQLITE_OK) {
+        return 1;
     }
+    printf("%016lx %s\n", hash, path);
+    printf("%lu nodes, %lu chunks, %lu bytes hashed%s\n", nodes, chunks, bytes,
+           !store  ? ", not stored: no --merkle or read-only"
+           : stale ? ", not stored: changed while hashing"
+                   : "");
+    return 0;
 }
 
-int sqlfs_chown(const char *path, uid_t uid, gid_t gid,
-                struct fuse_file_info *file_info) {
-    struct sqlfs_path_info path_info;
-    int ret = sqlfs_find_path_info(path, &path_info);
+/**
+ * @brief print where `path` differs between `a` and `b`, descending only into
+ * directories whose hashes differ
+ *
+ * @return SQLITE_OK on success
+ */
+static int sqlfs_merkle_diff(struct sqlfs_merkle_tree *a,
+                             struct sqlfs_merkle_tree *b, const char *path,
+                             uint64_t *differences) {
+    uint64_t hash_a;
+    uint64_t hash_b;
+    int ret_a = sqlfs_merkle_node(a, path, &hash_a);
+    int ret_b = sqlfs_merkle_node(b, path, &hash_b);
+    if (ret_a != SQLITE_OK && ret_a != SQLITE_DONE) {
+        return ret_a;
+    }
+    if (ret_b != SQLITE_OK && ret_b != SQLITE_DONE) {
+        return ret_b;
+    }
+    if (ret_a == SQLITE_DONE || ret_b == SQLITE_DONE) {
+        if (ret_a != ret_b) {
+            printf("%c %s\n", ret_a == SQLITE_DONE ? '+' : '-', path);
+            (*differences)++;
+        }
+        return SQLITE_OK;
+    }
+    if (hash_a == hash_b) {
+        return SQLITE_OK;
+    }
+    struct sqlfs_merkle_entry entry_a;
+    struct sqlfs_merkle_entry entry_b;
+    int ret = sqlfs_merkle_entry(a, path, &entry_a);
     if (ret == SQLITE_OK) {
-        // do nothing
-    } else if (ret == SQLITE_DONE) {
-        printf("sqlfs_chown() '%s' not found", path);
-        return -ENOENT;
-    } else {
-        printf("sqlfs_chown() '%s' error: %s\n", path, sqlite3_errmsg(db));
-        return -EIO;
+        ret = sqlfs_merkle_entry(b, path, &entry_b);
     }
-
-    sqlite3_bind_int(update_path_owner_by_id_stmt, 1, gid);
-    sqlite3_bind_int(update_path_owner_by_id_stmt, 2, uid);
-    sqlite3_bind_int64(update_path_owner_by_id_stmt, 3, path_info.file_id);
-    ret = sqlite3_step(update_path_owner_by_id_stmt);
-    sqlite3_reset(update_path_owner_by_id_stmt);
-    if (ret != SQLITE_DONE) {
-        printf("sqlfs_chown(): '%s' sql error %s\n", path, sqlite3_errmsg(db));
-        return -EIO;
-    } else {
-        return OK;
+    if (ret != SQLITE_OK) {
+        return ret;
     }
-}
-
-int sqlfs_truncate_file_by_id(u_int64_t file_id, off_t new_size) {
-    sqlite3_bind_int(update_file_size_by_id_stmt, 1, new_size);
-    sqlite3_bind_int(update_file_size_by_id_stmt, 2, file_id);
-    sqlite3_bind_int(update_file_size_by_id_stmt, 3, new_size);
-    int ret = sqlite3_step(update_file_size_by_id_stmt);
-    sqlite3_reset(update_file_size_by_id_stmt);
-    if (ret != SQLITE_DONE) {
-        printf("sqlfs_truncate_file_by_id(): file_id: %ld sql error %s\n",
-               file_id, sqlite3_errmsg(db));
-        return -EIO;
-    } else {
-        return OK;
+    if (!S_ISDIR(entry_a.mode) || !S_ISDIR(entry_b.mode) ||
+        entry_a.mode != entry_b.mode || entry_a.uid != entry_b.uid ||
+        entry_a.gid != entry_b.gid) {
+        printf("M %s\n", path);
+        (*differences)++;
+    }
+    if (!S_ISDIR(entry_a.mode) || !S_ISDIR(entry_b.mode)) {
+        return SQLITE_OK;
+    }
+    char **children_a;
+    char **children_b;
+    int count_a;
+    int count_b;
+    ret = sqlfs_merkle_children(a, entry_a.id, &children_a, &count_a);
+    if (ret != SQLITE_OK) {
+        return ret;
     }
+    ret = sqlfs_merkle_children(b, entry_b.id, &children_b, &count_b);
+    if (ret != SQLITE_OK) {
+        sqlfs_merkle_children_free(children_a, count_a);
+        return ret;
+    }
+    // both lists are in path order, merge them
+    int i = 0;
+    int j = 0;
+    while (ret == SQLITE_OK && (i < count_a || j < count_b)) {
+        int cmp = i == count_a   ? 1
+                  : j == count_b ? -1
+                                 : strcmp(children_a[i], children_b[j]);
+        if (cmp == 0) {
+            ret = sqlfs_merkle_diff(a, b, children_a[i], differences);
+            i++;
+            j++;
+        } else {
+            printf("%c %s\n", cmp < 0 ? '-' : '+',
+                   cmp < 0 ? children_a[i++] : children_b[j++]);
+            (*differences)++;
+        }
+    }
+    sqlfs_merkle_children_free(children_a, count_a);
+    sqlfs_merkle_children_free(children_b, count_b);
+    return ret;
 }
 
-int sqlfs_truncate(const char *path, off_t new_size,
-                   struct fuse_file_info *file_info) {
-    struct sqlfs_path_info path_info;
-    int ret = sqlfs_find_path_info(path, &path_info);
+/**
+ * @brief sqlfs diff <a.db> <b.db> [<path>]
+ *
+ * Print one line per difference: "- path" only in a, "+ path" only in b,
+ * "M path" in both but different.
+ *
+ * @return exit status, 0 when equal, 1 when different, 2 on error
+ */
+int sqlfs_diff(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        printf("usage: sqlfs diff <a.db> <b.db> [<path>]\n");
+        return 2;
+    }
+    struct sqlfs_merkle_tree a;
+    struct sqlfs_merkle_tree b;
+    uint64_t differences = 0;
+    int ret = sqlfs_merkle_tree_open(&a, argv[0]);
     if (ret == SQLITE_OK) {
-        return sqlfs_truncate_file_by_id(path_info.file_id, new_size);
-    } else if (ret == SQLITE_DONE) {
-        printf("sqlfs_truncate() '%s' not found", path);
-        return -ENOENT;
-    } else {
-        printf("sqlfs_truncate() '%s' error: %s\n", path, sqlite3_errmsg(db));
-        return -EIO;
+        ret = sqlfs_merkle_tree_open(&b, argv[1]);
+        if (ret == SQLITE_OK) {
+            ret = sqlfs_merkle_diff(&a, &b, argc == 3 ? argv[2] : "/",
+                                    &differences);
+            if (ret != SQLITE_OK) {
+                printf("sqlfs_diff(): error %s / %s\n", sqlite3_errmsg(a.conn),
+                       sqlite3_errmsg(b.conn));
+            }
+        }
+        ret = sqlfs_merkle_tree_close(&b, ret);
+    }
+    ret = sqlfs_merkle_tree_close(&a, ret);
+    if (ret != SQLITE_OK) {
+        return 2;
     }
+    return differences > 0 ? 1 : 0;
 }
 
-int sqlfs_ftruncate(const char *path, off_t new_size,
-                    struct fuse_file_info *file_info) {
-    return sqlfs_truncate_file_by_id(file_info->fh, new_size);
+/*
+ * Metadata queries: sqlfs query <db> [<path>] [<predicate>...]
+ *
+ * Runs find(1) style predicates as one SQL statement over paths and files
+ * instead of walking the tree. The path prefix is a range on path_idx,
+ * -mtime and -mmin are ranges on mtime_idx, -uid uses uid_idx and -size
+ * size_idx; SQLite picks the most selective of them. The output is in the
+ * order of that index, as sorting would keep the planner on path_idx. Numbers
+ * take a "+" for more than, a "-" for less than, and sizes a k, M or G
+ * suffix.
+ */
+#define MAX_QUERY_PREDICATES 32
+
+struct sqlfs_query {
+    char sql[4096];
+    size_t len;
+    int64_t binds[MAX_QUERY_PREDICATES * 2];
+    const char *texts[MAX_QUERY_PREDICATES * 2];
+    int count;
+};
+
+static void sqlfs_query_append(struct sqlfs_query *query, const char *sql) {
+    query->len += snprintf(query->sql + query->len,
+                           sizeof(query->sql) - query->len, "%s", sql);
 }
 
-int sqlfs_write_blob(uint64_t file_id, const char *buff, size_t size,
-                     off_t offset) {
-    sqlite3_blob *blob;
-    int ret =
-        sqlite3_blob_open(db, "main", "files", "content", file_id, 1, &blob);
-    if (ret != SQLITE_OK) {
-        printf("write_blob() open blob error: %s", sqlite3_errmsg(db));
-        sqlite3_blob_close(blob);
-        return -EIO;
-    }
+static void sqlfs_query_bind(struct sqlfs_query *query, const char *text,
+                             int64_t value) {
+    query->texts[query->count] = text;
+    query->binds[query->count] = value;
+    query->count++;
+}
 
-    ret = sqlite3_blob_write(blob, buff, size, offset);
-    if (ret != SQLITE_OK) {
-        printf("write_blob() write blob error: %s", sqlite3_errmsg(db));
-        sqlite3_blob_close(blob);
-        return -EIO;
+/**
+ * @brief parse "[+-]<n>[kMG]" times `unit`
+ *
+ * @return the sign, '=' without one, 0 when `arg` is not a number
+ */
+static char sqlfs_query_number(const char *arg, int64_t unit,
+                               int64_t *value) {
+    char sign = *arg == '+' || *arg == '-' ? *arg++ : '=';
+    char *end;
+    *value = strtoll(arg, &end, 10);
+    if (end == arg) {
+        return 0;
     }
-
-    sqlite3_blob_close(blob);
-    return OK;
+    switch (*end) {
+    case 'G':
+        unit <<= 10;
+        // fallthrough
+    case 'M':
+        unit <<= 10;
+        // fallthrough
+    case 'k':
+        unit <<= 10;
+        end++;
+        break;
+    }
+    *value *= unit;
+    return *end == '\0' ? sign : 0;
 }
 
-int sqlfs_write_row(struct sqlfs_path_info path_info, const char *buff,
-                    size_t size, off_t offset) {
+/**
+ * @brief add "`column` > value", "< value" or "= value" for a number
+ * argument
+ *
+ * @return 0 on success
+ */
+static int sqlfs_query_compare(struct sqlfs_query *query, const char *column,
+                               const char *arg, int64_t unit) {
+    int64_t value;
+    char sign = sqlfs_query_number(arg, unit, &value);
+    if (sign == 0) {
+        return 1;
+    }
+    sqlfs_query_append(query, " and ");
+    sqlfs_query_append(query, column);
+    sqlfs_query_append(query, sign == '+' ? " > ?" : sign == '-' ? " < ?"
+                                                                : " = ?");
+    sqlfs_query_bind(query, NULL, value);
+    return 0;
+}
 
-    uint64_t new_size = offset + size;
-    char *content_buff = malloc(new_size);
-    const char *p = content_buff;
-    if (path_info.size > 0) {
-        // read old content
-        int ret = sqlfs_find_file_content_by_id(path_info.file_id, content_buff,
-                                                path_info.size);
-        if (ret != OK) {
-            printf("sqlfs_write_row() file id not found: %ld\n",
-                   path_info.file_id);
-            return -EIO;
-        }
+/**
+ * @brief add a find -mtime / -mmin style predicate: modified more than
+ * (+n), less than (-n) or exactly n `unit` seconds ago, rounded down
+ *
+ * @return 0 on success
+ */
+static int sqlfs_query_age(struct sqlfs_query *query, const char *arg,
+                           int64_t unit) {
+    int64_t age;
+    char sign = sqlfs_query_number(arg, unit, &age);
+    int64_t now = time(NULL);
+    if (sign == 0) {
+        return 1;
     }
-    memcpy(content_buff + offset, buff, size);
-    sqlite3_bind_blob64(update_file_content_by_id_stmt, 1, p, new_size,
-                        SQLITE_STATIC);
-    sqlite3_bind_int64(update_file_content_by_id_stmt, 2, new_size);
-    sqlite3_bind_int64(update_file_content_by_id_stmt, 3, path_info.file_id);
-    int ret = sqlite3_step(update_file_content_by_id_stmt);
-    if (ret != SQLITE_DONE) {
-        printf("sqlfs_write_row(): error %s\n", sqlite3_errmsg(db));
-        ret = -EIO;
+    if (sign == '+') {
+        sqlfs_query_append(query, " and p.mtime <= ?");
+        sqlfs_query_bind(query, NULL, now - age - unit);
+    } else if (sign == '-') {
+        sqlfs_query_append(query, " and p.mtime > ?");
+        sqlfs_query_bind(query, NULL, now - age);
     } else {
-        ret = OK;
+        sqlfs_query_append(query, " and p.mtime > ? and p.mtime <= ?");
+        sqlfs_query_bind(query, NULL, now - age - unit);
+        sqlfs_query_bind(query, NULL, now - age);
     }
-    sqlite3_reset(update_file_content_by_id_stmt);
-    free(content_buff);
-    return ret;
+    return 0;
 }
 
-int sqlfs_write(const char *path, const char *buff, size_t size, off_t offset,
-                struct fuse_file_info *file_info) {
-    struct sqlfs_path_info path_info;
-    int ret = sqlfs_find_path_info(path, &path_info);
+/**
+ * @brief sqlfs query <db> [<path>] [<predicate>...]
+ *
+ * Print the paths under <path> matching all predicates, one per line,
+ * <path> included.
+ *
+ * @return exit status
+ */
+int sqlfs_query(int argc, char **argv) {
+    const char *usage =
+        "usage: sqlfs query <db> [<path>] [-name <glob>] [-type f|d|l]\n"
+        "                   [-size [+-]<bytes>[kMG]] [-mtime [+-]<days>]\n"
+        "                   [-mmin [+-]<minutes>] [-uid <n>] [-gid <n>]\n"
+        "                   [-perm <octal>]\n";
+    if (argc < 1) {
+        printf("%s", usage);
+        return 1;
+    }
+    struct sqlfs_query query = {.len = 0, .count = 0};
+    int i = 1;
+    const char *path = argc > 1 && argv[1][0] == '/' ? argv[i++] : "/";
+    size_t path_len = strlen(path);
+    while (path_len > 1 && path[path_len - 1] == '/') {
+        path_len--;
+    }
+    char base[MAX_PATH_LEN + 2];
+    char prefix[MAX_PATH_LEN + 2];
+    char prefix_end[MAX_PATH_LEN + 2];
+    snprintf(base, sizeof(base), "%.*s", (int)path_len, path);
+    snprintf(prefix, sizeof(prefix), "%.*s/", (int)path_len, path);
+    snprintf(prefix_end, sizeof(prefix_end), "%.*s0", (int)path_len, path);
+    sqlfs_query_append(&query, "select p.path from paths p left join files f "
+                               "on p.file_id = f.id where 1");
+    if (path_len > 1) {
+        // '0' sorts right after '/'
+        sqlfs_query_append(&query, " and (p.path = ? or "
+                                   "(p.path > ? and p.path < ?))");
+        sqlfs_query_bind(&query, base, 0);
+        sqlfs_query_bind(&query, prefix, 0);
+        sqlfs_query_bind(&query, prefix_end, 0);
+    }
+    int ret = 0;
+    for (; i < argc && ret == 0; i += 2) {
+        const char *arg = i + 1 < argc ? argv[i + 1] : NULL;
+        if (arg == NULL || query.count + 2 > MAX_QUERY_PREDICATES * 2) {
+            ret = 1;
+        } else if (strcmp(argv[i], "-name") == 0) {
+            // the glob's * also matches '/', so match the last component
+            // only: rtrim() drops every character but '/' from the end
+            sqlfs_query_append(&query,
+                               " and substr(p.path, length(rtrim(p.path, "
+                               "replace(p.path, '/', ''))) + 1) glob ?");
+            sqlfs_query_bind(&query, arg, 0);
+        } else if (strcmp(argv[i], "-type") == 0) {
+            mode_t type = strcmp(arg, "f") == 0   ? S_IFREG
+                          : strcmp(arg, "d") == 0 ? S_IFDIR
+                          : strcmp(arg, "l") == 0 ? S_IFLNK
+                                                  : 0;
+            sqlfs_query_append(&query, " and p.mode & ? = ?");
+            sqlfs_query_bind(&query, NULL, S_IFMT);
+            sqlfs_query_bind(&query, NULL, type);
+            ret = type == 0;
+        } else if (strcmp(argv[i], "-size") == 0) {
+            ret = sqlfs_query_compare(&query, "f.size", arg, 1);
+        } else if (strcmp(argv[i], "-mtime") == 0) {
+            ret = sqlfs_query_age(&query, arg, 24 * 60 * 60);
+        } else if (strcmp(argv[i], "-mmin") == 0) {
+            ret = sqlfs_query_age(&query, arg, 60);
+        } else if (strcmp(argv[i], "-uid") == 0) {
+            ret = sqlfs_query_compare(&query, "p.uid", arg, 1);
+        } else if (strcmp(argv[i], "-gid") == 0) {
+            ret = sqlfs_query_compare(&query, "p.gid", arg, 1);
+        } else if (strcmp(argv[i], "-perm") == 0) {
+            char *end;
+            sqlfs_query_append(&query, " and p.mode & 4095 = ?");
+            sqlfs_query_bind(&query, NULL, strtol(arg, &end, 8));
+            ret = end == arg || *end != '\0';
+        } else {
+            ret = 1;
+        }
+    }
+    if (ret != 0) {
+        printf("%s", usage);
+        return 1;
+    }
+    sqlite3 *conn;
+    sqlite3_stmt *stmt = NULL;
+    ret = sqlite3_open_v2(argv[0], &conn, SQLITE_OPEN_READONLY, NULL);
     if (ret == SQLITE_OK) {
-        // do nothing
-    } else if (ret == SQLITE_DONE) {
-        printf("sqlfs_write() '%s' not found", path);
-        return -ENOENT;
-    } else {
-        printf("sqlfs_write() '%s' error: %s\n", path, sqlite3_errmsg(db));
-        return -EIO;
+        sqlite3_busy_timeout(conn, 1000);
+        ret = sqlite3_prepare_v2(conn, query.sql, -1, &stmt, NULL);
     }
-    if (offset + size <= path_info.size) {
-        ret = sqlfs_write_blob(path_info.file_id, buff, size, offset);
-    } else {
-        ret = sqlfs_write_row(path_info, buff, size, offset);
+    for (int b = 0; b < query.count && ret == SQLITE_OK; b++) {
+        if (query.texts[b] != NULL) {
+            sqlite3_bind_text(stmt, b + 1, query.texts[b], -1, NULL);
+        } else {
+            sqlite3_bind_int64(stmt, b + 1, query.binds[b]);
+        }
     }
-    if (ret == OK) {
-        return size;
-    } else {
-        printf("sqlfs_write() error");
-        return ret;
+    while (ret == SQLITE_OK && (ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+        printf("%s\n", (const char *)sqlite3_column_text(stmt, 0));
+        ret = SQLITE_OK;
+    }
+    if (ret != SQLITE_DONE) {
+        printf("sqlfs_query(): %s\n", sqlite3_errmsg(conn));
     }
+    sqlite3_finalize(stmt);
+    sqlite3_close(conn);
+    return ret == SQLITE_DONE ? 0 : 1;
 }
 
-int sqlfs_read(const char *path, char *buff, size_t size, off_t offset,
-               struct fuse_file_info *file_info) {
-    sqlite3_blob *blob;
-    int ret = sqlite3_blob_open(db, "main", "files", "content", file_info->fh,
-                                0, &blob);
-    if (ret != SQLITE_OK) {
-        printf("sqlfs_read() blob open error: %s\n", sqlite3_errmsg(db));
-        sqlite3_blob_close(blob);
-        return -EIO;
+/**
+ * @brief sqlfs search <db> <fts5 query> [<path>]
+ *
+ * Print the paths under <path> of the files whose text matches, best
+ * matches first. The index is kept by mounts with --fts.
+ *
+ * @return exit status, 0 when something matched, 1 when nothing did, 2 on
+ * error
+ */
+int sqlfs_search(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        printf("usage: sqlfs search <db> <fts5 query> [<path>]\n");
+        return 2;
     }
-    uint64_t blob_size = sqlite3_blob_bytes(blob);
-    uint64_t max_size = offset + size > blob_size ? blob_size - offset : size;
-    ret = sqlite3_blob_read(blob, buff, max_size, offset);
+    const char *path = argc == 3 ? argv[2] : "/";
+    size_t path_len = strlen(path);
+    while (path_len > 1 && path[path_len - 1] == '/') {
+        path_len--;
+    }
+    char prefix[MAX_PATH_LEN + 2];
+    char prefix_end[MAX_PATH_LEN + 2];
+    snprintf(prefix, sizeof(prefix), "%.*s/", (int)path_len, path);
+    snprintf(prefix_end, sizeof(prefix_end), "%.*s0", (int)path_len, path);
+    sqlite3 *conn;
+    sqlite3_stmt *stmt = NULL;
+    uint64_t matches = 0;
+    int ret = sqlite3_open_v2(argv[0], &conn, SQLITE_OPEN_READONLY, NULL);
+    if (ret == SQLITE_OK) {
+        sqlite3_busy_timeout(conn, 1000);
+        ret = sqlite3_prepare_v2(
+            conn, "select value from config where key = 'fts'", -1, &stmt,
+            NULL);
+    }
+    if (ret == SQLITE_OK) {
+        int state = sqlite3_step(stmt) == SQLITE_ROW
+                        ? sqlite3_column_int(stmt, 0)
+                        : 0;
+        if (state == 0) {
+            printf("sqlfs_search(): no content index, mount with --fts\n");
+            ret = SQLITE_MISUSE;
+        } else if (state != 1) {
+            printf("sqlfs_search(): the index may be incomplete until the "
+                   "next clean unmount\n");
+        }
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+    }
+    if (ret == SQLITE_OK) {
+        // '0' sorts right after '/'
+        ret = sqlite3_prepare_v2(
+            conn,
+            "select p.path from content_fts join paths p on p.file_id = "
+            "content_fts.rowid where content_fts match ? and (? or "
+            "(p.path > ? and p.path < ?)) order by rank",
+            -1, &stmt, NULL);
+    }
+    if (ret == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, argv[1], -1, NULL);
+        sqlite3_bind_int(stmt, 2, path_len <= 1);
+        sqlite3_bind_text(stmt, 3, prefix, -1, NULL);
+        sqlite3_bind_text(stmt, 4, prefix_end, -1, NULL);
+        while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+            printf("%s\n", (const char *)sqlite3_column_text(stmt, 0));
+            matches++;
+        }
+        ret = ret == SQLITE_DONE ? SQLITE_OK : ret;
+    }
+    if (ret != SQLITE_OK && ret != SQLITE_MISUSE) {
+        printf("sqlfs_search(): %s\n", sqlite3_errmsg(conn));
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(conn);
     if (ret != SQLITE_OK) {
-        printf("sqlfs_read() blob read error: %s\n", sqlite3_errmsg(db));
-        sqlite3_blob_close(blob);
-        return -EIO;
+        return 2;
     }
-    sqlite3_blob_close(blob);
-    return max_size;
-}
-
-struct fuse_operations operations = {.getattr = sqlfs_getattr,
-                                     .destroy = sqlfs_destroy,
-                                     .open = sqlfs_open,
-                                     .opendir = sqlfs_opendir,
-                                     .readdir = sqlfs_readdir,
-                                     .mkdir = sqlfs_mkdir,
-                                     .mknod = sqlfs_mknod,
-                                     .unlink = sqlfs_unlink,
-                                     .rmdir = sqlfs_rmdir,
-                                     .utimens = sqlfs_utimens,
-                                     .symlink = sqlfs_symlink,
-                                     .readlink = sqlfs_readlink,
-                                     .rename = sqlfs_rename,
-                                     .link = sqlfs_link,
-                                     .chmod = sqlfs_chmod,
-                                     .chown = sqlfs_chown,
-                                     .truncate = sqlfs_truncate,
-                                     .write = sqlfs_write,
-                                     .read = sqlfs_read};
-
-int sqlfs_prepare_stmt(const char *sql, sqlite3_stmt **stmt) {
-    return sqlite3_prepare_v2(db, sql, -1, stmt, NULL);
-}
-
-int sqlfs_open_db(const char *db_path) { return sqlite3_open(db_path, &db); }
-
-int sqlfs_init_db() {
-    int ret = sqlite3_exec(db, create_tables_sql, NULL, NULL, &err_msg);
-
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(select_file_by_path_sql,
-                                 &select_file_by_path_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(select_path_by_name_sql,
-                                 &select_path_by_name_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(select_file_id_by_path_sql,
-                                 &select_file_id_by_path_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(select_path_id_by_path_sql,
-                                 &select_path_id_by_path_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(select_stats_by_parent_id_sql,
-                                 &select_stats_by_parent_id_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(insert_path_sql, &insert_path_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(insert_file_sql, &insert_file_stmt);
-
-    if (ret == SQLITE_OK)
-        ret =
-            sqlfs_prepare_stmt(delete_path_by_id_sql, &delete_path_by_id_stmt);
-    if (ret == SQLITE_OK)
-        ret =
-            sqlfs_prepare_stmt(delete_file_by_id_sql, &delete_file_by_id_stmt);
-
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(select_file_nlink_by_id_sql,
-                                 &select_file_nlink_by_id_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(select_path_info_by_path_sql,
-                                 &select_path_info_by_path_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(count_dir_items_by_id_sql,
-                                 &count_dir_items_by_id_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(update_path_times_by_id_sql,
-                                 &update_path_times_by_id_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(increase_file_nlink_by_id_sql,
-                                 &increase_file_nlink_by_id_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(decrease_file_nlink_by_id_sql,
-                                 &decrease_file_nlink_by_id_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(select_file_content_by_id_sql,
-                                 &select_file_content_by_id_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(update_path_name_by_id_sql,
-                                 &update_path_name_by_id_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(update_path_mode_by_id_sql,
-                                 &update_path_mode_by_id_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(update_path_owner_by_id_sql,
-                                 &update_path_owner_by_id_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(update_file_size_by_id_sql,
-                                 &update_file_size_by_id_stmt);
-    if (ret == SQLITE_OK)
-        ret = sqlfs_prepare_stmt(update_file_content_by_id_sql,
-                                 &update_file_content_by_id_stmt);
-    return ret;
+    return matches > 0 ? 0 : 1;
 }
 
-struct sqlfs_opts {
-    const char *db_path;
-    int show_help;
-};
-
 static struct fuse_opt opts[] = {
     {"--db %s", offsetof(struct sqlfs_opts, db_path), 0},
+    {"--mem-meta", offsetof(struct sqlfs_opts, mem_meta), 1},
+    {"--warmup", offsetof(struct sqlfs_opts, warmup), 1},
+    {"--cache-size %lu", offsetof(struct sqlfs_opts, cache_size), 0},
+    {"--readahead %lu", offsetof(struct sqlfs_opts, readahead), 0},
+    {"--prefetch-small %lu", offsetof(struct sqlfs_opts, prefetch_small), 0},
+    {"--pagecache-arena %lu", offsetof(struct sqlfs_opts, pagecache_arena), 0},
+    {"--pagecache-huge-pages", offsetof(struct sqlfs_opts, pagecache_huge_pages),
+     1},
+    {"--db-cache-size %lu", offsetof(struct sqlfs_opts, db_cache_size), 0},
+    {"--mmap-size %lu", offsetof(struct sqlfs_opts, mmap_size), 0},
+    {"--mmap-sequential", offsetof(struct sqlfs_opts, mmap_sequential), 1},
+    {"--heap-limit %lu", offsetof(struct sqlfs_opts, heap_limit), 0},
+    {"--page-size %d", offsetof(struct sqlfs_opts, page_size), 0},
+    {"--temp-store %s", offsetof(struct sqlfs_opts, temp_store), 0},
+    {"--wal-autocheckpoint %d", offsetof(struct sqlfs_opts, wal_autocheckpoint),
+     0},
+    {"--busy-timeout %d", offsetof(struct sqlfs_opts, busy_timeout), 0},
+    {"--chunk-size %u", offsetof(struct sqlfs_opts, chunk_size), 0},
+    {"--direct-io", offsetof(struct sqlfs_opts, direct_io), 1},
+    {"--io-uring", offsetof(struct sqlfs_opts, io_uring), 1},
+    {"--read-only", offsetof(struct sqlfs_opts, read_only), 1},
+    {"--shards %d", offsetof(struct sqlfs_opts, shards), 0},
+    {"--prealloc %lu", offsetof(struct sqlfs_opts, prealloc), 0},
+    {"--tenants %s", offsetof(struct sqlfs_opts, tenants), 0},
+    {"--changelog", offsetof(struct sqlfs_opts, changelog), 1},
+    {"--replica %s", offsetof(struct sqlfs_opts, replica), 0},
+    {"--follower", offsetof(struct sqlfs_opts, follower), 1},
+    {"--coherence %d", offsetof(struct sqlfs_opts, coherence), 0},
+    {"--merkle", offsetof(struct sqlfs_opts, merkle), 1},
+    {"--checksums", offsetof(struct sqlfs_opts, checksums), 1},
+    {"--scrub-rate %lu", offsetof(struct sqlfs_opts, scrub_rate), 0},
+    {"--scrub-threads %d", offsetof(struct sqlfs_opts, scrub_threads), 0},
+    {"--fts", offsetof(struct sqlfs_opts, fts), 1},
+    {"--dir-usage", offsetof(struct sqlfs_opts, dir_usage), 1},
+    {"--stats-file %s", offsetof(struct sqlfs_opts, stats_file), 0},
     {"--help", offsetof(struct sqlfs_opts, show_help), 1},
     {"-h", offsetof(struct sqlfs_opts, show_help), 1},
+    FUSE_OPT_END,
 };
 
 static void sqlfs_print_help(const char *progname) {
-    printf("usage: %s --db=<path> [FUSE options] <mountpoint>\n\n", progname);
+    printf("usage: %s --db=<path> [FUSE options] <mountpoint>\n"
+           "       %s --db=<path> --tenants=<list> [FUSE options]\n"
+           "       %s mkimage <srcdir> <out.db>\n"
+           "       %s changes <db> [<seq>] [--follow]\n"
+           "       %s sync <src.db> <dst.db>\n"
+           "       %s hash <db> [<path>]\n"
+           "       %s diff <a.db> <b.db> [<path>]\n"
+           "       %s query <db> [<path>] [-name <glob>] [-type f|d|l]\n"
+           "             [-size [+-]<bytes>[kMG]] [-mtime [+-]<days>]\n"
+           "             [-mmin [+-]<minutes>] [-uid <n>] [-gid <n>]\n"
+           "             [-perm <octal>]\n"
+           "       %s search <db> <fts5 query> [<path>]\n\n",
+           progname, progname, progname, progname, progname, progname,
+           progname, progname, progname);
     printf("SQLite options:\n"
            "    --db=<path>          path to the SQLite file\n"
-           "\n");
+           "    --mem-meta           serve lookups, getattr and readdir from an\n"
+           "                         in-memory copy of the metadata\n"
+           "    --warmup             record hot paths and content, save them on\n"
+           "                         unmount and prefetch them on next mount\n"
+           "    --cache-size=<bytes> cache up to <bytes> of file content, 0 to\n"
+           "                         disable (default)\n"
+           "    --readahead=<bytes>  prefetch up to <bytes> ahead of sequential\n"
+           "                         readers into the content cache\n"
+           "    --prefetch-small=<bytes>\n"
+           "                         load files up to <bytes> whole when they\n"
+           "                         are opened read-only\n"
+           "    --pagecache-arena=<bytes>\n"
+           "                         preallocate the SQLite page cache of all\n"
+           "                         connections\n"
+           "    --pagecache-huge-pages\n"
+           "                         back the page cache arena by huge pages\n"
+           "    --db-cache-size=<bytes>\n"
+           "                         SQLite page cache size per connection\n"
+           "    --mmap-size=<bytes>  map up to this much of the database into\n"
+           "                         memory instead of reading it\n"
+           "    --mmap-sequential    hint sequential instead of random access\n"
+           "                         on the database mapping\n"
+           "    --heap-limit=<bytes> SQLite heap limit, allocations beyond it\n"
+           "                         fail\n"
+           "    --page-size=<bytes>  SQLite page size, an existing database is\n"
+           "                         rebuilt when it differs\n"
+           "    --temp-store=default|file|memory\n"
+           "                         where SQLite keeps temporary tables\n"
+           "    --wal-autocheckpoint=<pages>\n"
+           "                         WAL size that triggers a checkpoint\n"
+           "    --busy-timeout=<ms>  wait this long for a locked database\n"
+           "    --chunk-size=<bytes> unit of content caching and read-ahead\n"
+           "                         (default: 65536)\n"
+           "    --direct-io          access the database file with O_DIRECT,\n"
+           "                         SQLite's page cache is the only cache\n"
+           "    --read-only          serve an image that never changes: no\n"
+           "                         locking, all metadata in memory, maximum\n"
+           "                         mmap_size, mutations fail with EROFS\n"
+           "    --shards=<n>         spread file content over <n> databases\n"
+           "                         <db>.shard<i> with their own writer lock,\n"
+           "                         fixed once the database has content, at\n"
+           "                         most SQLite's attached database limit\n"
+           "                         (10 by default)\n"
+           "    --io-uring           write the database file in batched\n"
+           "                         io_uring submissions, can be combined with\n"
+           "                         --direct-io\n"
+           "    --prealloc=<bytes>   with --direct-io or --io-uring, grow the\n"
+           "                         database file in extents of this size\n"
+           "                         (default: 64 MiB)\n"
+           "    --tenants=<name>:<mountpoint>[:<bytes>[:<inodes>]][,...]\n"
+           "                         serve one filesystem per tenant from this\n"
+           "                         database, each under /<name> and mounted\n"
+           "                         on its own mountpoint, with optional\n"
+           "                         quotas (0 for none)\n"
+           "    --changelog          journal every mutation in the changelog\n"
+           "                         table, see `%s changes`\n"
+           "    --replica=<path>     replicate to the follower database <path>\n"
+           "                         in the background, implies --changelog\n"
+           "    --follower           serve a follower read-only while it is\n"
+           "                         being replicated to, caches only with\n"
+           "                         --coherence\n"
+           "    --coherence=<ms>     poll for commits of other processes and\n"
+           "                         drop what they changed from the caches\n"
+           "    --merkle             keep the Merkle hashes of `%s hash` up to\n"
+           "                         date, stays on for the database\n"
+           "    --checksums          keep a CRC32C per 64 KiB of content and\n"
+           "                         verify it on read, stays on for the\n"
+           "                         database\n"
+           "    --scrub-rate=<bytes> verify all content in the background at\n"
+           "                         up to <bytes> per second, implies\n"
+           "                         --checksums\n"
+           "    --scrub-threads=<n>  threads sharing the scrub rate\n"
+           "                         (default: 1)\n"
+           "    --fts                index the text of files for `%s search`\n"
+           "                         when they are closed after writing, stays\n"
+           "                         on for the database\n"
+           "    --dir-usage          keep the bytes, files and entries below\n"
+           "                         each directory, read as the xattrs\n"
+           "                         user.sqlfs.rbytes, rfiles and rinodes,\n"
+           "                         stays on for the database\n"
+           "    --stats-file=<path>  append the stats printed on SIGUSR1 and\n"
+           "                         at unmount to <path>, the default is\n"
+           "                         stdout, which is lost once daemonized\n"
+           "\n",
+           progname, progname, progname);
+}
+
+/**
+ * @brief absolute form of `path`, which need not exist yet
+ *
+ * @return malloc'ed path, NULL with errno set on failure
+ */
+char *sqlfs_absolute_path(const char *path) {
+    char *full = realpath(path, NULL);
+    if (full != NULL || errno != ENOENT || path[0] == '/') {
+        return full;
+    }
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        return NULL;
+    }
+    full = malloc(strlen(cwd) + strlen(path) + 2);
+    if (full != NULL) {
+        strcat(strcat(strcpy(full, cwd), "/"), path);
+    }
+    free(cwd);
+    return full;
 }
 
 int main(int argc, char **argv) {
-    struct sqlfs_opts sqlfs_opts = {0};
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
+    sqlfs_opts.wal_autocheckpoint = -1;
+    sqlfs_opts.chunk_size = DEFAULT_CHUNK_SIZE;
+    sqlfs_opts.prealloc = DEFAULT_PREALLOC;
+    if (argc > 1 && strcmp(argv[1], "mkimage") == 0) {
+        return sqlfs_mkimage(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "changes") == 0) {
+        return sqlfs_changes(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "sync") == 0) {
+        return sqlfs_sync(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "hash") == 0) {
+        return sqlfs_hash(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "diff") == 0) {
+        return sqlfs_diff(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "query") == 0) {
+        return sqlfs_query(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "search") == 0) {
+        return sqlfs_search(argc - 2, argv + 2);
+    }
     int ret = fuse_opt_parse(&args, &sqlfs_opts, opts, NULL);
     if (ret != 0 || !sqlfs_opts.db_path || sqlfs_opts.show_help) {
         sqlfs_print_help(argv[0]);
         assert(fuse_opt_add_arg(&args, "--help") == 0);
         args.argv[0][0] = '\0';
     }
+    if (sqlfs_opts.db_path != NULL) {
+        // background connections open it again after fuse_main has changed
+        // the working directory to /
+        char *db_path = sqlfs_absolute_path(sqlfs_opts.db_path);
+        if (db_path == NULL) {
+            printf("cannot resolve --db %s: %s\n", sqlfs_opts.db_path,
+                   strerror(errno));
+            return 1;
+        }
+        sqlfs_opts.db_path = db_path;
+    }
+    if (sqlfs_opts.replica != NULL) {
+        char *replica_path = sqlfs_absolute_path(sqlfs_opts.replica);
+        if (replica_path == NULL) {
+            printf("cannot resolve --replica %s: %s\n", sqlfs_opts.replica,
+                   strerror(errno));
+            return 1;
+        }
+        sqlfs_opts.replica = replica_path;
+    }
+    if (sqlfs_opts.stats_file != NULL) {
+        char *stats_path = sqlfs_absolute_path(sqlfs_opts.stats_file);
+        if (stats_path == NULL) {
+            printf("cannot resolve --stats-file %s: %s\n",
+                   sqlfs_opts.stats_file, strerror(errno));
+            return 1;
+        }
+        sqlfs_opts.stats_file = stats_path;
+    }
+    if (sqlfs_opts.page_size != 0 &&
+        (sqlfs_opts.page_size < 512 || sqlfs_opts.page_size > 65536 ||
+         (sqlfs_opts.page_size & (sqlfs_opts.page_size - 1)) != 0)) {
+        printf("--page-size must be a power of two from 512 to 65536\n");
+        return 1;
+    }
+    if (sqlfs_opts.chunk_size < 4096 || sqlfs_opts.chunk_size > (16 << 20)) {
+        printf("--chunk-size must be from 4096 to 16777216\n");
+        return 1;
+    }
+    if (sqlfs_opts.temp_store != NULL) {
+        // it is spliced into a PRAGMA statement
+        const char *stores[] = {"default", "file", "memory", "0", "1", "2"};
+        size_t i = 0;
+        while (i < sizeof(stores) / sizeof(stores[0]) &&
+               strcasecmp(sqlfs_opts.temp_store, stores[i]) != 0) {
+            i++;
+        }
+        if (i == sizeof(stores) / sizeof(stores[0])) {
+            printf("--temp-store must be default, file, memory, 0, 1 or 2\n");
+            return 1;
+        }
+    }
 
+    if (sqlfs_opts.tenants != NULL &&
+        sqlfs_tenants_parse(sqlfs_opts.tenants) != 0) {
+        return 1;
+    }
+    if (sqlfs_opts.replica != NULL) {
+        if (sqlfs_opts.read_only || sqlfs_opts.follower ||
+            sqlfs_opts.shards > 0) {
+            printf("--replica needs a writable, unsharded database\n");
+            return 1;
+        }
+        sqlfs_opts.changelog = 1;
+    }
+    if (sqlfs_opts.follower && sqlfs_opts.coherence == 0) {
+        // changes arrive underneath us, nothing may be cached
+        sqlfs_opts.mem_meta = 0;
+        sqlfs_opts.warmup = 0;
+        sqlfs_opts.cache_size = 0;
+        sqlfs_opts.readahead = 0;
+        sqlfs_opts.prefetch_small = 0;
+    }
+    if (sqlfs_opts.follower) {
+        sqlfs_opts.read_only = 1;
+    }
+    if (sqlfs_opts.scrub_rate > 0 && !sqlfs_opts.read_only) {
+        // the scrubber fills in missing checksums
+        sqlfs_opts.checksums = 1;
+    }
+    if (sqlfs_opts.read_only) {
+        // nothing to journal
+        sqlfs_opts.changelog = 0;
+    }
+    if (sqlfs_opts.read_only && !sqlfs_opts.follower) {
+        // an immutable image never changes
+        sqlfs_opts.coherence = 0;
+    }
+    if (sqlfs_opts.read_only && !sqlfs_opts.follower) {
+        sqlfs_opts.mem_meta = 1;
+        if (sqlfs_opts.mmap_size == 0) {
+            // SQLite caps this at its compile time SQLITE_MAX_MMAP_SIZE
+            sqlfs_opts.mmap_size = (uint64_t)1 << 40;
+        }
+    }
+    if (sqlfs_opts.read_only) {
+        // the kernel refuses writes before they reach us
+        assert(fuse_opt_add_arg(&args, "-oro") == 0);
+    }
+    if (sqlfs_opts.readahead > 0 && sqlfs_opts.cache_size == 0) {
+        // read-ahead fills the content cache
+        sqlfs_opts.cache_size = 4 * sqlfs_opts.readahead;
+    }
+    // only a mount has a database whose page size sizes the arena
+    ret = sqlfs_opts.db_path != NULL ? sqlfs_config_memory() : SQLITE_OK;
+    if (ret != SQLITE_OK) {
+        printf("error when configure SQLite memory: %s\n",
+               sqlite3_errstr(ret));
+        return ret;
+    }
+    if (sqlfs_opts.direct_io || sqlfs_opts.io_uring) {
+        ret = sqlfs_direct_register();
+        if (ret != SQLITE_OK) {
+            printf("error when register VFS: %s\n",
+                   sqlite3_errstr(ret));
+            return ret;
+        }
+    }
     ret = sqlfs_open_db(sqlfs_opts.db_path);
     if (ret != SQLITE_OK) {
         printf("error when open database %s: %s\n", sqlfs_opts.db_path,
@@ -1024,12 +10984,26 @@ int main(int argc, char **argv) {
                err_msg);
         return ret;
     }
+    ret = sqlfs_tenants_open();
+    if (ret != SQLITE_OK) {
+        printf("error when open tenants: %s\n", sqlite3_errmsg(db));
+        return ret;
+    }
 
     if (ret != SQLITE_OK) {
         printf("error in sqlite3_prepare_v2(): %s\n", sqlite3_errmsg(db));
         return ret;
     }
-    ret = fuse_main(args.argc, args.argv, &operations, NULL);
+    // stats are printed by sqlfs_stats_thread() on SIGUSR1
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (tenants.count > 0 && !sqlfs_opts.show_help) {
+        ret = sqlfs_tenants_main(&args);
+    } else {
+        ret = fuse_main(args.argc, args.argv, &operations, NULL);
+    }
     if (ret != 0) {
         sqlite3_close(db);
     }